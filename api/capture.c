@@ -0,0 +1,339 @@
+/* SPDX-License-Identifier: GPL-2.0
+ *
+ * Copyright (C) 2018-2021 WireGuard LLC. All Rights Reserved.
+ */
+
+#include "capture.h"
+#include "logger.h"
+#include <Windows.h>
+
+/* Staging ring capacity: 100 ms of full-sized packets at about 650 Mbit/s between two writer passes */
+#define CAPTURE_RING_CAPACITY 0x800000 /* 8MiB */
+/* Blocks collected between two file writes. Must fit the largest block and the closing statistics. */
+#define CAPTURE_BUFFER_SIZE 0x100000 /* 1MiB */
+/* Longest time a staged packet waits for the writer, in milliseconds */
+#define CAPTURE_FLUSH_INTERVAL 100
+/* Room for the ".%u" suffix of rotated file names */
+#define CAPTURE_MAX_SUFFIX 11
+/* Blocks every file starts with */
+#define CAPTURE_HEADER_SIZE (TUN_PCAPNG_SECTION_HEADER_SIZE + TUN_PCAPNG_INTERFACE_DESCRIPTION_SIZE)
+/* FILETIME of the Unix epoch */
+#define CAPTURE_UNIX_EPOCH 116444736000000000ULL
+
+C_ASSERT(CAPTURE_BUFFER_SIZE >= CAPTURE_HEADER_SIZE + TUN_PCAPNG_ENHANCED_PACKET_SIZE(TUN_MAX_IP_PACKET_SIZE) +
+                                    TUN_PCAPNG_INTERFACE_STATISTICS_SIZE);
+
+struct _CAPTURE
+{
+    TUN_CAPTURE_QUEUE Queue;
+    volatile LONG Enabled;
+    volatile LONG Stopping;
+    DWORD SnapLength;
+    LONG64 Frequency;
+    HANDLE Wake;  /* Auto-reset, set by producers once the ring fills up halfway and by StopCapture */
+    HANDLE Thread;
+    SRWLOCK Lock; /* Serializes CaptureStart and CaptureStop */
+
+    /* Owned by the writer thread while a capture runs */
+    LONG64 StartCounter;
+    ULONG64 StartTime; /* 100 ns units since the Unix epoch */
+    LONG64 StartDropped;
+    WCHAR Path[MAX_PATH];
+    DWORD64 MaxFileSize;
+    DWORD MaxFiles;
+    HANDLE File;
+    DWORD64 FileSize;
+    ULONG BufferSize;
+    BYTE *Buffer;
+};
+
+_Use_decl_annotations_
+CAPTURE *
+CaptureCreate(VOID)
+{
+    DWORD LastError;
+    CAPTURE *Capture = Zalloc(sizeof(CAPTURE));
+    if (!Capture)
+        return NULL;
+    Capture->Buffer = Alloc(CAPTURE_BUFFER_SIZE);
+    if (!Capture->Buffer)
+    {
+        LastError = GetLastError();
+        goto cleanupCapture;
+    }
+    TUN_RING *Ring =
+        VirtualAlloc(NULL, TUN_CAPTURE_RING_SIZE(CAPTURE_RING_CAPACITY), MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+    if (!Ring)
+    {
+        LastError = LOG_LAST_ERROR(L"Failed to allocate capture ring");
+        goto cleanupBuffer;
+    }
+    Capture->Wake = CreateEventW(NULL, FALSE, FALSE, NULL);
+    if (!Capture->Wake)
+    {
+        LastError = LOG_LAST_ERROR(L"Failed to create capture event");
+        goto cleanupRing;
+    }
+    TunCaptureInit(&Capture->Queue, Ring, CAPTURE_RING_CAPACITY);
+    LARGE_INTEGER Frequency;
+    QueryPerformanceFrequency(&Frequency);
+    Capture->Frequency = Frequency.QuadPart;
+    InitializeSRWLock(&Capture->Lock);
+    return Capture;
+cleanupRing:
+    VirtualFree(Ring, 0, MEM_RELEASE);
+cleanupBuffer:
+    Free(Capture->Buffer);
+cleanupCapture:
+    Free(Capture);
+    SetLastError(LastError);
+    return NULL;
+}
+
+_Use_decl_annotations_
+VOID
+CaptureFree(CAPTURE *Capture)
+{
+    if (!Capture)
+        return;
+    CaptureStop(Capture);
+    CloseHandle(Capture->Wake);
+    VirtualFree(Capture->Queue.Ring, 0, MEM_RELEASE);
+    Free(Capture->Buffer);
+    Free(Capture);
+}
+
+/* Converts a performance counter value to 100 ns units since the Unix epoch. */
+static ULONG64
+CaptureTime(_In_ const CAPTURE *Capture, _In_ LONG64 Counter)
+{
+    LONG64 Delta = Counter - Capture->StartCounter;
+    return Capture->StartTime + Delta / Capture->Frequency * 10000000 +
+           Delta % Capture->Frequency * 10000000 / Capture->Frequency;
+}
+
+_Return_type_success_(return != FALSE)
+static BOOL
+FlushCaptureBuffer(_Inout_ CAPTURE *Capture)
+{
+    DWORD BytesWritten;
+    if (!Capture->BufferSize)
+        return TRUE;
+    if (!WriteFile(Capture->File, Capture->Buffer, Capture->BufferSize, &BytesWritten, NULL))
+    {
+        LOG_LAST_ERROR(L"Failed to write capture file %s", Capture->Path);
+        return FALSE;
+    }
+    Capture->FileSize += Capture->BufferSize;
+    Capture->BufferSize = 0;
+    return TRUE;
+}
+
+_Return_type_success_(return != FALSE)
+static BOOL
+OpenCaptureFile(_Inout_ CAPTURE *Capture)
+{
+    Capture->File =
+        CreateFileW(Capture->Path, GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (Capture->File == INVALID_HANDLE_VALUE)
+    {
+        LOG_LAST_ERROR(L"Failed to create capture file %s", Capture->Path);
+        return FALSE;
+    }
+    Capture->FileSize = 0;
+    Capture->BufferSize = TunPcapngSectionHeader(Capture->Buffer);
+    Capture->BufferSize += TunPcapngInterfaceDescription(Capture->Buffer + Capture->BufferSize, Capture->SnapLength);
+    return TRUE;
+}
+
+/* Ends the file with the count of packets the staging ring had no room for since the capture started. */
+_Return_type_success_(return != FALSE)
+static BOOL
+CloseCaptureFile(_Inout_ CAPTURE *Capture)
+{
+    LARGE_INTEGER Counter;
+    QueryPerformanceCounter(&Counter);
+    Capture->BufferSize += TunPcapngInterfaceStatistics(
+        Capture->Buffer + Capture->BufferSize,
+        CaptureTime(Capture, Counter.QuadPart),
+        ReadNoFence64(&Capture->Queue.Dropped) - Capture->StartDropped);
+    BOOL Flushed = FlushCaptureBuffer(Capture);
+    CloseHandle(Capture->File);
+    Capture->File = INVALID_HANDLE_VALUE;
+    return Flushed;
+}
+
+/* Returns the name of rotated file Index, where the current file is index zero. */
+_Return_type_success_(return != FALSE)
+static BOOL
+RotatedCapturePath(_In_z_ LPCWSTR Path, _In_ DWORD Index, _Out_writes_z_(MAX_PATH) LPWSTR RotatedPath)
+{
+    int Result = Index ? _snwprintf_s(RotatedPath, MAX_PATH, _TRUNCATE, L"%s.%u", Path, Index)
+                       : _snwprintf_s(RotatedPath, MAX_PATH, _TRUNCATE, L"%s", Path);
+    if (Result == -1)
+    {
+        SetLastError(ERROR_BUFFER_OVERFLOW);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/* Shifts Path.N to Path.N+1, dropping the oldest file, moves the current file to Path.1 and starts a new one. A file
+ * that cannot be moved is overwritten, so a reader holding one open only loses that file. */
+_Return_type_success_(return != FALSE)
+static BOOL
+RotateCaptureFile(_Inout_ CAPTURE *Capture)
+{
+    if (!CloseCaptureFile(Capture))
+        return FALSE;
+    WCHAR From[MAX_PATH], To[MAX_PATH];
+    for (DWORD i = Capture->MaxFiles - 1; i > 0; --i)
+    {
+        if (!RotatedCapturePath(Capture->Path, i - 1, From) || !RotatedCapturePath(Capture->Path, i, To))
+            return FALSE;
+        if (!MoveFileExW(From, To, MOVEFILE_REPLACE_EXISTING) && GetLastError() != ERROR_FILE_NOT_FOUND)
+            LOG_LAST_ERROR(L"Failed to rename capture file %s", From);
+    }
+    return OpenCaptureFile(Capture);
+}
+
+_Return_type_success_(return != FALSE)
+static BOOL
+WriteCaptureRecord(_Inout_ CAPTURE *Capture, _In_ const TUN_CAPTURE_RECORD *Record)
+{
+    LONG64 Counter = (LONG64)((ULONG64)Record->TimestampHigh << 32 | Record->TimestampLow);
+    ULONG Captured = Record->Size - (ULONG)sizeof(TUN_CAPTURE_RECORD);
+    /* Producers that saw the previous capture still enabled may have staged records after it stopped. */
+    if (Counter < Capture->StartCounter || Captured > Capture->SnapLength)
+        return TRUE;
+    ULONG BlockSize = TUN_PCAPNG_ENHANCED_PACKET_SIZE(Captured);
+    if (Capture->BufferSize + BlockSize + TUN_PCAPNG_INTERFACE_STATISTICS_SIZE > CAPTURE_BUFFER_SIZE &&
+        !FlushCaptureBuffer(Capture))
+        return FALSE;
+    DWORD64 FileSize = Capture->FileSize + Capture->BufferSize;
+    if (Capture->MaxFileSize && FileSize + BlockSize + TUN_PCAPNG_INTERFACE_STATISTICS_SIZE > Capture->MaxFileSize &&
+        FileSize > CAPTURE_HEADER_SIZE && !RotateCaptureFile(Capture))
+        return FALSE;
+    Capture->BufferSize +=
+        TunPcapngEnhancedPacket(Capture->Buffer + Capture->BufferSize, Record, CaptureTime(Capture, Counter));
+    return TRUE;
+}
+
+static DWORD WINAPI
+CaptureWriter(_In_ LPVOID Parameter)
+{
+    CAPTURE *Capture = Parameter;
+    TUN_CAPTURE_QUEUE *Queue = &Capture->Queue;
+    ULONG Head = Queue->Ring->Head;
+    for (;;)
+    {
+        /* Read before draining, so every packet staged before StopCapture gets written. */
+        BOOL Stopping = ReadAcquire(&Capture->Stopping);
+        TUN_CAPTURE_RECORD *Record;
+        ULONG AlignedSize;
+        while ((AlignedSize = TunCaptureNext(Queue, Head, &Record)) != 0)
+        {
+            if (!WriteCaptureRecord(Capture, Record))
+                goto cleanup;
+            Head = TunCaptureRelease(Queue, Head, AlignedSize);
+        }
+        if (!FlushCaptureBuffer(Capture))
+            goto cleanup;
+        if (Stopping)
+            break;
+        WaitForSingleObject(Capture->Wake, CAPTURE_FLUSH_INTERVAL);
+    }
+    return CloseCaptureFile(Capture) ? ERROR_SUCCESS : GetLastError();
+cleanup:
+    WriteRelease(&Capture->Enabled, FALSE);
+    DWORD LastError = GetLastError();
+    if (Capture->File != INVALID_HANDLE_VALUE)
+        CloseHandle(Capture->File);
+    return LastError;
+}
+
+static VOID
+StopCapture(_Inout_ CAPTURE *Capture)
+{
+    if (!Capture->Thread)
+        return;
+    WriteRelease(&Capture->Enabled, FALSE);
+    WriteRelease(&Capture->Stopping, TRUE);
+    SetEvent(Capture->Wake);
+    WaitForSingleObject(Capture->Thread, INFINITE);
+    CloseHandle(Capture->Thread);
+    Capture->Thread = NULL;
+}
+
+_Use_decl_annotations_
+BOOL
+CaptureStart(CAPTURE *Capture, LPCWSTR Path, DWORD SnapLength, DWORD64 MaxFileSize, DWORD MaxFiles)
+{
+    DWORD LastError;
+    if (wcslen(Path) >= MAX_PATH - CAPTURE_MAX_SUFFIX)
+    {
+        SetLastError(LOG_ERROR(ERROR_FILENAME_EXCED_RANGE, L"Capture file path too long"));
+        return FALSE;
+    }
+    AcquireSRWLockExclusive(&Capture->Lock);
+    StopCapture(Capture);
+    wcscpy_s(Capture->Path, _countof(Capture->Path), Path);
+    Capture->SnapLength = SnapLength && SnapLength < TUN_MAX_IP_PACKET_SIZE ? SnapLength : TUN_MAX_IP_PACKET_SIZE;
+    Capture->MaxFileSize = MaxFileSize;
+    Capture->MaxFiles = max(MaxFiles, 1);
+    if (!OpenCaptureFile(Capture))
+    {
+        LastError = GetLastError();
+        goto cleanupLock;
+    }
+    LARGE_INTEGER Counter;
+    FILETIME Time;
+    QueryPerformanceCounter(&Counter);
+    GetSystemTimeAsFileTime(&Time);
+    Capture->StartCounter = Counter.QuadPart;
+    Capture->StartTime = ((ULONG64)Time.dwHighDateTime << 32 | Time.dwLowDateTime) - CAPTURE_UNIX_EPOCH;
+    Capture->StartDropped = ReadNoFence64(&Capture->Queue.Dropped);
+    Capture->Stopping = FALSE;
+    Capture->Thread = CreateThread(NULL, 0, CaptureWriter, Capture, 0, NULL);
+    if (!Capture->Thread)
+    {
+        LastError = LOG_LAST_ERROR(L"Failed to create capture thread");
+        goto cleanupFile;
+    }
+    WriteRelease(&Capture->Enabled, TRUE);
+    ReleaseSRWLockExclusive(&Capture->Lock);
+    return TRUE;
+cleanupFile:
+    CloseHandle(Capture->File);
+cleanupLock:
+    ReleaseSRWLockExclusive(&Capture->Lock);
+    SetLastError(LastError);
+    return FALSE;
+}
+
+_Use_decl_annotations_
+VOID
+CaptureStop(CAPTURE *Capture)
+{
+    AcquireSRWLockExclusive(&Capture->Lock);
+    StopCapture(Capture);
+    ReleaseSRWLockExclusive(&Capture->Lock);
+}
+
+_Use_decl_annotations_
+VOID
+CapturePacket(CAPTURE *Capture, const BYTE *Packet, DWORD Size, DWORD Flags)
+{
+    if (!ReadAcquire(&Capture->Enabled))
+        return;
+    const ULONG SnapLength = Capture->SnapLength;
+    LARGE_INTEGER Counter;
+    QueryPerformanceCounter(&Counter);
+    ULONG Content;
+    if (!TunCapturePut(&Capture->Queue, Counter.QuadPart, Flags, Packet, Size, SnapLength, &Content))
+        return;
+    /* Only the record crossing the ring's half mark wakes the writer early, so a burst costs one SetEvent. */
+    const ULONG Half = Capture->Queue.Capacity / 2;
+    if (Content >= Half && Content - TUN_ALIGN(sizeof(TUN_CAPTURE_RECORD) + min(Size, SnapLength)) < Half)
+        SetEvent(Capture->Wake);
+}
@@ -0,0 +1,42 @@
+/* SPDX-License-Identifier: GPL-2.0
+ *
+ * Copyright (C) 2018-2021 WireGuard LLC. All Rights Reserved.
+ */
+
+#pragma once
+
+#include "../common/capture.h"
+#include <Windows.h>
+
+typedef struct _CAPTURE CAPTURE;
+
+_Must_inspect_result_
+_Return_type_success_(return != NULL)
+_Post_maybenull_
+CAPTURE *
+CaptureCreate(VOID);
+
+VOID
+CaptureFree(_Frees_ptr_opt_ CAPTURE *Capture);
+
+/* Starts writing the packets passed to CapturePacket to a pcapng file at Path, replacing the running capture, if any.
+ * Keeps the first SnapLength bytes of every packet, or all of them if SnapLength is zero. Once a file would grow past
+ * MaxFileSize bytes, it is renamed to Path.1, Path.1 to Path.2 and so on, keeping up to MaxFiles files in total. A
+ * MaxFileSize of zero never rotates. */
+_Return_type_success_(return != FALSE)
+BOOL
+CaptureStart(
+    _Inout_ CAPTURE *Capture,
+    _In_z_ LPCWSTR Path,
+    _In_ DWORD SnapLength,
+    _In_ DWORD64 MaxFileSize,
+    _In_ DWORD MaxFiles);
+
+/* Writes out the packets captured so far and closes the file. */
+VOID
+CaptureStop(_Inout_ CAPTURE *Capture);
+
+/* Stages Size bytes of packet at Packet for the writer, if a capture is running. Flags is TUN_CAPTURE_INBOUND or
+ * TUN_CAPTURE_OUTBOUND. Any number of threads may call this concurrently, and with CaptureStart and CaptureStop. */
+VOID
+CapturePacket(_Inout_ CAPTURE *Capture, _In_reads_bytes_(Size) const BYTE *Packet, _In_ DWORD Size, _In_ DWORD Flags);
@@ -0,0 +1,37 @@
+/* SPDX-License-Identifier: GPL-2.0
+ *
+ * Copyright (C) 2018-2021 WireGuard LLC. All Rights Reserved.
+ */
+
+#include "wintun.h"
+#include "../common/checksum.h"
+#include <Windows.h>
+
+WINTUN_CHECKSUM_FUNC WintunChecksum;
+_Use_decl_annotations_
+WORD WINAPI
+WintunChecksum(const BYTE *Data, DWORD Size)
+{
+    return TunChecksumFinish(TunChecksumAdd(0, Data, Size));
+}
+
+WINTUN_UPDATE_CHECKSUM_FUNC WintunUpdateChecksum;
+_Use_decl_annotations_
+WORD WINAPI
+WintunUpdateChecksum(WORD Checksum, const BYTE *Old, const BYTE *New, DWORD Size)
+{
+    return TunChecksumUpdate(Checksum, Old, New, Size);
+}
+
+WINTUN_SET_PACKET_CHECKSUMS_FUNC WintunSetPacketChecksums;
+_Use_decl_annotations_
+BOOL WINAPI
+WintunSetPacketChecksums(BYTE *Packet, DWORD PacketSize)
+{
+    if (!TunChecksumPacket(Packet, PacketSize))
+    {
+        SetLastError(ERROR_INVALID_DATA);
+        return FALSE;
+    }
+    return TRUE;
+}
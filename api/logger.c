@@ -6,12 +6,49 @@
 #include "logger.h"
 #include "adapter.h"
 #include "ntdll.h"
+#include "../common/log.h"
 #include <Windows.h>
 #include <iphlpapi.h>
 #include <winternl.h>
 #include <wchar.h>
 #include <stdlib.h>
 
+/* Messages are queued and passed to the logger callback by a drain thread, so a slow callback never holds up the
+ * threads logging. Callers still format their own arguments, as those may not outlive the call, but looking up system
+ * error text is left to the drain thread. */
+#define LOG_QUEUE_SIZE 128 /* Power of two */
+#define LOG_LINE_CHARS 0x400
+/* Rate limiting slots, which call sites share by the address of their format string. Prime, as string addresses are all
+ * but random. */
+#define LOG_RATE_SITES 61
+/* Messages the call sites of a slot may log per interval before the rest of the interval is suppressed */
+#define LOG_RATE_BURST 20
+/* Rate limiting interval, in 100 ns units */
+#define LOG_RATE_INTERVAL 10000000 /* 1s */
+/* Time the drain thread waits for more messages before it exits, in milliseconds */
+#define LOG_DRAIN_LINGER 1000
+
+typedef struct _LOG_ENTRY
+{
+    WINTUN_LOGGER_LEVEL Level;
+    BOOL HasError;
+    DWORD Error;
+    DWORD64 Timestamp;
+    WCHAR Line[LOG_LINE_CHARS];
+} LOG_ENTRY;
+
+static LOG_ENTRY LogEntries[LOG_QUEUE_SIZE];
+static volatile LONG64 LogSequences[LOG_QUEUE_SIZE];
+static TUN_LOG_QUEUE LogEntryQueue = { .Sequences = LogSequences, .Size = LOG_QUEUE_SIZE };
+static TUN_LOG_RATE LogRates[LOG_RATE_SITES];
+static TUN_LOG_LIMIT LogLimit = {
+    .Rates = LogRates, .Sites = LOG_RATE_SITES, .Burst = LOG_RATE_BURST, .Interval = LOG_RATE_INTERVAL
+};
+static LONG64 LogDroppedReported, LogSuppressedReported; /* Only touched by the drain thread */
+static DWORD64 LogReportedAt;
+static volatile LONG LogDraining;
+static HANDLE LogWake;
+
 static BOOL CALLBACK
 NopLogger(_In_ WINTUN_LOGGER_LEVEL Level, _In_ DWORD64 Timestamp, _In_z_ LPCWSTR LogLine)
 {
@@ -43,32 +80,49 @@ StrTruncate(_Inout_count_(StrChars) LPWSTR Str, _In_ SIZE_T StrChars)
     Str[StrChars - 1] = 0;
 }
 
-_Use_decl_annotations_
-DWORD
-LoggerLog(WINTUN_LOGGER_LEVEL Level, LPCWSTR LogLine)
-{
-    DWORD LastError = GetLastError();
-    Logger(Level, Now(), LogLine);
-    SetLastError(LastError);
-    return LastError;
-}
+static DWORD WINAPI
+LogDrain(_In_ LPVOID Module);
 
-_Use_decl_annotations_
-DWORD
-LoggerLogV(WINTUN_LOGGER_LEVEL Level, LPCWSTR Format, va_list Args)
+/* Makes the message at Position visible to the drain thread, and starts the thread if it is not running. */
+static VOID
+LogPublish(_In_ LONG64 Position)
 {
-    DWORD LastError = GetLastError();
-    WCHAR LogLine[0x400];
-    if (_vsnwprintf_s(LogLine, _countof(LogLine), _TRUNCATE, Format, Args) == -1)
-        StrTruncate(LogLine, _countof(LogLine));
-    Logger(Level, Now(), LogLine);
-    SetLastError(LastError);
-    return LastError;
+    TunLogPublish(&LogEntryQueue, Position);
+    if (InterlockedCompareExchange(&LogDraining, TRUE, FALSE))
+    {
+        /* Before the first thread has its event, it is yet to start and will see the message anyway. */
+        HANDLE Wake = ReadPointerAcquire(&LogWake);
+        if (Wake)
+            SetEvent(Wake);
+        return;
+    }
+    /* Only one thread at a time gets here. */
+    if (!LogWake)
+    {
+        HANDLE Wake = CreateEventW(NULL, FALSE, FALSE, NULL);
+        if (!Wake)
+            goto cleanup;
+        WritePointerRelease(&LogWake, Wake);
+    }
+    /* The drain thread holds a reference to the module, so the module stays loaded until the thread exits. */
+    HMODULE Module;
+    if (!GetModuleHandleExW(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS, (LPCWSTR)LogDrain, &Module))
+        goto cleanup;
+    HANDLE Thread = CreateThread(NULL, 0, LogDrain, Module, 0, NULL);
+    if (!Thread)
+    {
+        FreeLibrary(Module);
+        goto cleanup;
+    }
+    CloseHandle(Thread);
+    return;
+cleanup:
+    /* The message stays queued for the next one to start the thread. */
+    InterlockedExchange(&LogDraining, FALSE);
 }
 
-_Use_decl_annotations_
-DWORD
-LoggerError(DWORD Error, LPCWSTR Prefix)
+static VOID
+LogDeliverError(_In_ DWORD64 Timestamp, _In_ DWORD Error, _In_z_ LPCWSTR Prefix)
 {
     LPWSTR SystemMessage = NULL, FormattedMessage = NULL;
     FormatMessageW(
@@ -89,9 +143,124 @@ LoggerError(DWORD Error, LPCWSTR Prefix)
         0,
         (va_list *)(DWORD_PTR[]){ (DWORD_PTR)Prefix, (DWORD_PTR)Error, (DWORD_PTR)SystemMessage });
     if (FormattedMessage)
-        Logger(WINTUN_LOG_ERR, Now(), FormattedMessage);
+        Logger(WINTUN_LOG_ERR, Timestamp, FormattedMessage);
     LocalFree(FormattedMessage);
     LocalFree(SystemMessage);
+}
+
+/* Reports the messages left out since the last report, in order with the ones that made it. Unless Force is set,
+ * reports at most once per LOG_RATE_INTERVAL, so a queue that keeps overflowing is not warned about every message. */
+static VOID
+LogReportDropped(_In_ BOOL Force)
+{
+    LONG64 Dropped = ReadNoFence64(&LogEntryQueue.Dropped), Suppressed = ReadNoFence64(&LogLimit.Suppressed);
+    if (Dropped == LogDroppedReported && Suppressed == LogSuppressedReported)
+        return;
+    DWORD64 Timestamp = Now();
+    if (!Force && Timestamp - LogReportedAt < LOG_RATE_INTERVAL)
+        return;
+    WCHAR LogLine[0x80];
+    if (_snwprintf_s(
+            LogLine,
+            _countof(LogLine),
+            _TRUNCATE,
+            L"%I64d log messages dropped with the queue full, %I64d suppressed by rate limiting",
+            Dropped - LogDroppedReported,
+            Suppressed - LogSuppressedReported) == -1)
+        StrTruncate(LogLine, _countof(LogLine));
+    LogDroppedReported = Dropped;
+    LogSuppressedReported = Suppressed;
+    LogReportedAt = Timestamp;
+    Logger(WINTUN_LOG_WARN, Timestamp, LogLine);
+}
+
+static DWORD WINAPI
+LogDrain(_In_ LPVOID Module)
+{
+    for (;;)
+    {
+        while (TunLogPeek(&LogEntryQueue))
+        {
+            LOG_ENTRY *Entry = &LogEntries[TunLogIndex(&LogEntryQueue, LogEntryQueue.Head)];
+            LogReportDropped(FALSE);
+            if (Entry->HasError)
+                LogDeliverError(Entry->Timestamp, Entry->Error, Entry->Line);
+            else
+                Logger(Entry->Level, Entry->Timestamp, Entry->Line);
+            TunLogRelease(&LogEntryQueue);
+        }
+        LogReportDropped(TRUE);
+        if (WaitForSingleObject(LogWake, LOG_DRAIN_LINGER) == WAIT_OBJECT_0)
+            continue;
+        /* A message published before LogDraining is cleared wakes this thread, and one published after starts a new
+         * thread, unless this one takes the flag back first to deliver it. */
+        InterlockedExchange(&LogDraining, FALSE);
+        if (!TunLogPeek(&LogEntryQueue) || InterlockedCompareExchange(&LogDraining, TRUE, FALSE))
+            break;
+    }
+    FreeLibraryAndExitThread(Module, ERROR_SUCCESS);
+}
+
+/* Queues a message of Level for the drain thread. Site identifies the call site for rate limiting. With Format, the
+ * line is formatted from it and Args, otherwise Text is copied. */
+static VOID
+LogQueue(
+    _In_ WINTUN_LOGGER_LEVEL Level,
+    _In_ BOOL HasError,
+    _In_ DWORD Error,
+    _In_ const VOID *Site,
+    _In_z_ LPCWSTR Text,
+    _In_opt_ va_list *Args)
+{
+    if (Logger == NopLogger)
+        return;
+    DWORD64 Timestamp = Now();
+    LONG64 Position;
+    if (!TunLogRateAllow(&LogLimit, Site, (LONG64)Timestamp) || !TunLogClaim(&LogEntryQueue, &Position))
+        return;
+    LOG_ENTRY *Entry = &LogEntries[TunLogIndex(&LogEntryQueue, Position)];
+    Entry->Level = Level;
+    Entry->HasError = HasError;
+    Entry->Error = Error;
+    Entry->Timestamp = Timestamp;
+    if (Args ? _vsnwprintf_s(Entry->Line, _countof(Entry->Line), _TRUNCATE, Text, *Args) == -1
+             : wcsncpy_s(Entry->Line, _countof(Entry->Line), Text, _TRUNCATE) == STRUNCATE)
+        StrTruncate(Entry->Line, _countof(Entry->Line));
+    LogPublish(Position);
+}
+
+VOID
+LoggerDone(VOID)
+{
+    if (LogWake)
+        CloseHandle(LogWake);
+}
+
+_Use_decl_annotations_
+DWORD
+LoggerLog(WINTUN_LOGGER_LEVEL Level, LPCWSTR LogLine)
+{
+    DWORD LastError = GetLastError();
+    LogQueue(Level, FALSE, 0, LogLine, LogLine, NULL);
+    SetLastError(LastError);
+    return LastError;
+}
+
+_Use_decl_annotations_
+DWORD
+LoggerLogV(WINTUN_LOGGER_LEVEL Level, LPCWSTR Format, va_list Args)
+{
+    DWORD LastError = GetLastError();
+    LogQueue(Level, FALSE, 0, Format, Format, &Args);
+    SetLastError(LastError);
+    return LastError;
+}
+
+_Use_decl_annotations_
+DWORD
+LoggerError(DWORD Error, LPCWSTR Prefix)
+{
+    LogQueue(WINTUN_LOG_ERR, TRUE, Error, Prefix, Prefix, NULL);
     return Error;
 }
 
@@ -99,10 +268,8 @@ _Use_decl_annotations_
 DWORD
 LoggerErrorV(DWORD Error, LPCWSTR Format, va_list Args)
 {
-    WCHAR LogLine[0x400];
-    if (_vsnwprintf_s(LogLine, _countof(LogLine), _TRUNCATE, Format, Args) == -1)
-        StrTruncate(LogLine, _countof(LogLine));
-    return LoggerError(Error, LogLine);
+    LogQueue(WINTUN_LOG_ERR, TRUE, Error, Format, Format, &Args);
+    return Error;
 }
 
 _Use_decl_annotations_
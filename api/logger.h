@@ -20,6 +20,9 @@ extern WINTUN_LOGGER_CALLBACK Logger;
  */
 WINTUN_SET_LOGGER_FUNC WintunSetLogger;
 
+VOID
+LoggerDone(VOID);
+
 _Post_equals_last_error_
 DWORD
 LoggerLog(_In_ WINTUN_LOGGER_LEVEL Level, _In_z_ LPCWSTR LogLine);
@@ -126,6 +126,7 @@ DllMain(_In_ HINSTANCE hinstDLL, _In_ DWORD fdwReason, _In_ LPVOID lpvReserved)
 
     case DLL_PROCESS_DETACH:
         NamespaceDone();
+        LoggerDone();
         LocalFree(SecurityAttributes.lpSecurityDescriptor);
         HeapDestroy(ModuleHeap);
         break;
@@ -15,6 +15,8 @@
 #        define WINNT 1
 #        define NTDDI_VERSION 0x06010000
 #        define PY_SSIZE_T_CLEAN
+#        include "capture.c"
+#        include "checksum.c"
 #        include "driver.c"
 #        include "logger.c"
 #        include "main.c"
@@ -57,6 +59,9 @@ static void raise_error(const char* errmsg) {
     PyErr_SetString(py_wintun_error, errmsg);
 }
 
+#include "pysession.h"
+#include "pyreader.h"
+
 // netsh interface ipv6 set subinterface %1% mtu=%2%
 typedef struct wintun_t {
     PyObject_HEAD WINTUN_ADAPTER_HANDLE adapter;
@@ -69,8 +74,78 @@ typedef struct wintun_t {
     int mtu6;
     int proto_aware;
     int proto_bits;
+    // Calls that drop the GIL while using the session hold a reference, so the session is not ended under them.
+    LONG session_users;
+    HANDLE session_idle;
+    // Signaled while the session is being torn down, so blocking waits return early.
+    HANDLE stop_event;
+    // Packets handed out by read_view() that still pin a ring slot.
+    Py_ssize_t views;
+    reader_t reader;
 } wintun_t;
 
+static WINTUN_SESSION_HANDLE session_acquire(wintun_t* tuntap) {
+    if (!tuntap->session)
+    {
+        raise_error("Session is not up");
+        return NULL;
+    }
+    InterlockedIncrement(&tuntap->session_users);
+    return tuntap->session;
+}
+
+static void session_release(wintun_t* tuntap) {
+    if (!InterlockedDecrement(&tuntap->session_users))
+    {
+        SetEvent(tuntap->session_idle);
+    }
+}
+
+static reader_t* reader_of(PyObject* owner) {
+    return &((wintun_t*)owner)->reader;
+}
+
+static void owner_session_release(PyObject* owner) {
+    session_release((wintun_t*)owner);
+}
+
+static const session_backend_t wintun_session_backend = {
+    WintunReceivePacket,
+    WintunReleaseReceivePacket,
+    WintunReceivePackets,
+    WintunReleaseReceivePackets,
+    WintunAllocateSendPacket,
+    WintunSendPacket,
+    WintunAllocateSendPackets,
+    WintunSendPackets,
+    WintunGetReadWaitEvent,
+    owner_session_release,
+};
+
+static int session_end(wintun_t* tuntap) {
+    WINTUN_SESSION_HANDLE session = tuntap->session;
+    if (!session)
+    {
+        return 0;
+    }
+    if (tuntap->views)
+    {
+        PyErr_Format(PyExc_BufferError, "%zd packet view(s) still pin the session, release them first", tuntap->views);
+        return -1;
+    }
+    reader_end(&tuntap->reader);
+    tuntap->session = NULL;
+    SetEvent(tuntap->stop_event);
+    Py_BEGIN_ALLOW_THREADS
+    while (ReadAcquire(&tuntap->session_users))
+    {
+        WaitForSingleObject(tuntap->session_idle, INFINITE);
+    }
+    WintunEndSession(session);
+    Py_END_ALLOW_THREADS
+    return 0;
+}
+
 LONG admin_err_cnt = 0;
 
 BOOL IsRunAsAdmin() {
@@ -137,6 +212,12 @@ wintun_new(PyTypeObject *type, PyObject *args, PyObject *kwds) {
     strcpy(tuntap->name, name);
     tuntap->capacity = DEFAULT_RING_CAPCITY;
     tuntap->proto_aware = proto_aware;
+    tuntap->session_idle = CreateEventW(NULL, FALSE, FALSE, NULL);
+    tuntap->stop_event = CreateEventW(NULL, TRUE, FALSE, NULL);
+    if (!tuntap->session_idle || !tuntap->stop_event)
+    {
+        goto error;
+    }
     tuntap->adapter = WintunOpenAdapter(name1);
     if (!tuntap->adapter)
     {
@@ -159,6 +240,12 @@ error:
             WintunCloseAdapter(tuntap->adapter);
             tuntap->adapter = NULL;
         }
+        if (tuntap->session_idle) {
+            CloseHandle(tuntap->session_idle);
+        }
+        if (tuntap->stop_event) {
+            CloseHandle(tuntap->stop_event);
+        }
         type->tp_free(tuntap);
     }
     Py_RETURN_NONE;
@@ -168,16 +255,14 @@ static void
 wintun_dealloc(PyObject *self)
 {
     wintun_t *tuntap = (wintun_t *)self;
-    if (tuntap->session != NULL)
-    {
-        WintunEndSession(tuntap->session);
-        tuntap->session = NULL;
-    }
+    session_end(tuntap);
     if (tuntap->adapter)
     {
         WintunCloseAdapter(tuntap->adapter);
         tuntap->adapter = NULL;
     }
+    CloseHandle(tuntap->session_idle);
+    CloseHandle(tuntap->stop_event);
     self->ob_type->tp_free(self);
 }
 
@@ -185,10 +270,9 @@ static PyObject *
 wintun_close(PyObject *self)
 {
     wintun_t *tuntap = (wintun_t *)self;
-    if (tuntap->session != NULL)
+    if (session_end(tuntap) < 0)
     {
-        WintunEndSession(tuntap->session);
-        tuntap->session = NULL;
+        return NULL;
     }
     if (tuntap->adapter)
     {
@@ -201,68 +285,253 @@ wintun_close(PyObject *self)
 PyDoc_STRVAR(wintun_close_doc, "close() -> None.\n\
 Close the device.");
 
-inline PyObject* new_buffer(unsigned int len) {
-#if PY_MAJOR_VERSION >= 3
-    return PyBytes_FromStringAndSize(NULL, len);
-#else
-    return PyString_FromStringAndSize(NULL, len);
-#endif
+// With proto_aware, the session only receives packets of the IP versions the adapter has addresses for. Rejected
+// packets are released inside the receive call, so they never reach Python.
+static void apply_proto_filter(wintun_t* tuntap) {
+    if (!tuntap->session)
+    {
+        return;
+    }
+    WINTUN_FILTER_INSTRUCTION program[] = {
+        { WINTUN_FILTER_JUMP_EQUAL, WINTUN_FILTER_VERSION, 0, 1, 4 },
+        { (tuntap->proto_bits & 1) ? WINTUN_FILTER_ACCEPT : WINTUN_FILTER_REJECT },
+        { WINTUN_FILTER_JUMP_EQUAL, WINTUN_FILTER_VERSION, 0, 1, 6 },
+        { (tuntap->proto_bits & 2) ? WINTUN_FILTER_ACCEPT : WINTUN_FILTER_REJECT },
+        { WINTUN_FILTER_REJECT },
+    };
+    WintunSetReceiveFilter(tuntap->session, program, tuntap->proto_aware ? _countof(program) : 0);
 }
 
 static PyObject *
 wintun_read(PyObject *self, PyObject *args, PyObject* kwds)
 {
     wintun_t *tuntap = (wintun_t *)self;
-    unsigned int rdlen;
-    PyObject *buf = NULL;
+    WINTUN_SESSION_HANDLE session = session_acquire(tuntap);
+    if (!session)
+    {
+        return NULL;
+    }
+    PyObject *buf = session_read(&wintun_session_backend, session);
+    session_release(tuntap);
+    return buf;
+}
 
-    BYTE* packet = WintunReceivePacket(tuntap->session, &rdlen);
-    if (packet)
+PyDoc_STRVAR(wintun_read_doc, "read() -> non-blocking read a whole packet buffer, returned as a string.");
+
+// A received packet left in its ring slot. It exposes the slot through the buffer protocol and hands the slot back to
+// the ring on release() or when garbage collected.
+typedef struct wintun_packet_t {
+    PyObject_HEAD wintun_t* owner;
+    BYTE* data;
+    DWORD size;
+    Py_ssize_t exports;
+} wintun_packet_t;
+
+// Recycled packet objects, so steady-state read_view() does not allocate.
+#define PACKET_FREE_LIST_SIZE 64
+static wintun_packet_t* packet_free_list[PACKET_FREE_LIST_SIZE];
+static int packet_free_count = 0;
+
+static PyTypeObject wintun_packet_type;
+
+static int packet_release_slot(wintun_packet_t* pkt) {
+    if (!pkt->data)
     {
-        if (tuntap->proto_aware == 0)
-        {
-            goto ready;
-        }
-        else // Aware
+        return 0;
+    }
+    if (pkt->exports)
+    {
+        PyErr_SetString(PyExc_BufferError, "cannot release packet while its buffer is exported");
+        return -1;
+    }
+    WintunReleaseReceivePacket(pkt->owner->session, pkt->data);
+    pkt->data = NULL;
+    pkt->owner->views--;
+    Py_CLEAR(pkt->owner);
+    return 0;
+}
+
+static void
+packet_dealloc(PyObject* self)
+{
+    wintun_packet_t* pkt = (wintun_packet_t*)self;
+    // Exporters hold a reference to us, so nothing can still be exported here.
+    packet_release_slot(pkt);
+    if (packet_free_count < PACKET_FREE_LIST_SIZE)
+    {
+        packet_free_list[packet_free_count++] = pkt;
+    }
+    else
+    {
+        PyObject_Del(self);
+    }
+}
+
+static wintun_packet_t* packet_new(wintun_t* tuntap, BYTE* data, DWORD size) {
+    wintun_packet_t* pkt;
+    if (packet_free_count)
+    {
+        pkt = packet_free_list[--packet_free_count];
+        PyObject_Init((PyObject*)pkt, &wintun_packet_type);
+    }
+    else
+    {
+        pkt = PyObject_New(wintun_packet_t, &wintun_packet_type);
+        if (!pkt)
         {
-            // v6 or v4
-            if (((packet[0] >> 4) == 6 && (tuntap->proto_bits & 2) != 0)
-                || (tuntap->proto_bits & 1) != 0)
-            {
-                goto ready;
-            }
-            else 
-            {
-                goto cleanup;
-            }
+            return NULL;
         }
-ready:
-        buf = new_buffer(rdlen);
-        memcpy(PyBytes_AS_STRING(buf), packet, rdlen);
-        WintunReleaseReceivePacket(tuntap->session, packet);
-        goto ret;
-cleanup:
+    }
+    Py_INCREF(tuntap);
+    pkt->owner = tuntap;
+    pkt->data = data;
+    pkt->size = size;
+    pkt->exports = 0;
+    tuntap->views++;
+    return pkt;
+}
+
+static int
+packet_getbuffer(PyObject* self, Py_buffer* view, int flags)
+{
+    wintun_packet_t* pkt = (wintun_packet_t*)self;
+    if (!pkt->data)
+    {
+        PyErr_SetString(PyExc_ValueError, "operation on released packet");
+        view->obj = NULL;
+        return -1;
+    }
+    if (PyBuffer_FillInfo(view, self, pkt->data, pkt->size, 0, flags) < 0)
+    {
+        return -1;
+    }
+    pkt->exports++;
+    return 0;
+}
+
+static void
+packet_releasebuffer(PyObject* self, Py_buffer* view)
+{
+    ((wintun_packet_t*)self)->exports--;
+}
+
+static Py_ssize_t
+packet_length(PyObject* self)
+{
+    return ((wintun_packet_t*)self)->size;
+}
+
+static PyObject*
+packet_release(PyObject* self, PyObject* args)
+{
+    if (packet_release_slot((wintun_packet_t*)self) < 0)
+    {
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+static PyObject*
+packet_enter(PyObject* self, PyObject* args)
+{
+    Py_INCREF(self);
+    return self;
+}
+
+static PyBufferProcs packet_as_buffer = { .bf_getbuffer = packet_getbuffer, .bf_releasebuffer = packet_releasebuffer };
+
+static PySequenceMethods packet_as_sequence = { .sq_length = packet_length };
+
+static PyMethodDef packet_meth[] = { { "release", packet_release, METH_NOARGS, "release() -> hand the ring slot back." },
+                                     { "__enter__", packet_enter, METH_NOARGS, NULL },
+                                     { "__exit__", packet_release, METH_VARARGS, NULL },
+                                     { NULL, NULL, 0, NULL } };
+
+PyDoc_STRVAR(packet_doc, "Packet returned by TunTapDevice.read_view(). Supports the buffer protocol, so memoryview(packet)\n\
+and bytes(packet) work without an intermediate copy. The ring slot stays pinned until release() is called, the with\n\
+block exits or the packet is garbage collected; the session cannot be brought down meanwhile.");
+
+static PyTypeObject wintun_packet_type = { PyVarObject_HEAD_INIT(NULL, 0)
+                                           .tp_name = "wintun.Packet",
+                                           .tp_basicsize = sizeof(wintun_packet_t),
+                                           .tp_dealloc = packet_dealloc,
+                                           .tp_as_sequence = &packet_as_sequence,
+                                           .tp_as_buffer = &packet_as_buffer,
+                                           .tp_flags = Py_TPFLAGS_DEFAULT,
+                                           .tp_doc = packet_doc,
+                                           .tp_methods = packet_meth };
+
+static PyObject *
+wintun_read_view(PyObject *self, PyObject *args)
+{
+    wintun_t *tuntap = (wintun_t *)self;
+    if (!tuntap->session)
+    {
+        raise_error("Session is not up");
+        return NULL;
+    }
+    DWORD rdlen;
+    BYTE* packet = WintunReceivePacket(tuntap->session, &rdlen);
+    if (!packet)
+    {
+        return receive_failed();
+    }
+    wintun_packet_t* pkt = packet_new(tuntap, packet, rdlen);
+    if (!pkt)
+    {
         WintunReleaseReceivePacket(tuntap->session, packet);
     }
+    return (PyObject*)pkt;
+}
 
-ret:
-    if (buf)
+PyDoc_STRVAR(wintun_read_view_doc, "read_view() -> non-blocking read of a whole packet without copying it, returned as a Packet.\n\
+Returns None when no packet is available.");
+
+static PyObject *
+wintun_recv_into(PyObject *self, PyObject *args)
+{
+    wintun_t *tuntap = (wintun_t *)self;
+    Py_buffer buffer;
+    if (!PyArg_ParseTuple(args, "w*:recv_into", &buffer))
     {
-        return buf;
+        return NULL;
     }
-    else
+    WINTUN_SESSION_HANDLE session = session_acquire(tuntap);
+    if (!session)
     {
-        DWORD LastError = GetLastError();
-        if (LastError != ERROR_NO_MORE_ITEMS && LastError != ERROR_SUCCESS)
+        PyBuffer_Release(&buffer);
+        return NULL;
+    }
+    DWORD rdlen = 0;
+    BYTE* packet = WintunReceivePacket(session, &rdlen);
+    if (!packet)
+    {
+        session_release(tuntap);
+        PyBuffer_Release(&buffer);
+        PyObject* ret = receive_failed();
+        if (!ret)
         {
-            // ERROR_HANDLE_EOF ERROR_INVALID_DATA
-            raise_error_from_errno();
+            return NULL;
         }
-        Py_RETURN_NONE;
+        Py_DECREF(ret);
+        return PyLong_FromLong(0);
     }
+    if ((Py_ssize_t)rdlen > buffer.len)
+    {
+        rdlen = (DWORD)buffer.len;
+    }
+    Py_BEGIN_ALLOW_THREADS
+    memcpy(buffer.buf, packet, rdlen);
+    WintunReleaseReceivePacket(session, packet);
+    Py_END_ALLOW_THREADS
+    session_release(tuntap);
+    PyBuffer_Release(&buffer);
+    return PyLong_FromUnsignedLong(rdlen);
 }
 
-PyDoc_STRVAR(wintun_read_doc, "read() -> non-blocking read a whole packet buffer, returned as a string.");
+PyDoc_STRVAR(wintun_recv_into_doc, "recv_into(buffer) -> number of bytes received, 0 when no packet is available.\n\
+Non-blocking read of a whole packet into a caller-owned writable buffer. Packets longer than the buffer are\n\
+truncated, so size it for the MTU.");
 
 static PyObject* wintun_write(PyObject *self, PyObject *args) {
     wintun_t *tuntap = (wintun_t *)self;
@@ -272,57 +541,138 @@ static PyObject* wintun_write(PyObject *self, PyObject *args) {
     {
         return NULL;
     }
-    size_t written = 0;
-    // For pymobiledevice3
-    static const char* LOOPBACK_HEADER = "\x00\x00\x86\xdd";
-    if (len > 4 && memcmp(LOOPBACK_HEADER, buf, 4) == 0)
+    WINTUN_SESSION_HANDLE session = session_acquire(tuntap);
+    if (!session)
     {
-        len -= 4;
-        buf += 4;
+        return NULL;
     }
-    BYTE *packet = WintunAllocateSendPacket(tuntap->session, len);
-    if (packet)
+    PyObject *ret = session_write(&wintun_session_backend, session, buf, len);
+    session_release(tuntap);
+    return ret;
+}
+
+PyDoc_STRVAR(wintun_write_doc, "write(str) -> number of bytes written.\n\
+Write str to device.");
+
+static PyObject *
+wintun_read_many(PyObject *self, PyObject *args)
+{
+    wintun_t *tuntap = (wintun_t *)self;
+    unsigned int max_count = 64;
+    if (!PyArg_ParseTuple(args, "|I:read_many", &max_count))
     {
-        memcpy(packet, buf, len);
-        WintunSendPacket(tuntap->session, packet);
-        written = len;
+        return NULL;
     }
-    else
+    WINTUN_SESSION_HANDLE session = session_acquire(tuntap);
+    if (!session)
+    {
+        return NULL;
+    }
+    DWORD received;
+    PyObject* list = max_count ? receive_batch(&wintun_session_backend, session, max_count, &received) : PyList_New(0);
+    session_release(tuntap);
+    return list;
+}
+
+PyDoc_STRVAR(wintun_read_many_doc, "read_many(max_count=64) -> list of packets, empty when none is available.\n\
+Non-blocking read of up to max_count (at most 256) whole packets with a single ring lock round-trip.");
+
+static PyObject *
+wintun_write_many(PyObject *self, PyObject *args)
+{
+    wintun_t *tuntap = (wintun_t *)self;
+    PyObject* iterable = NULL;
+    if (!PyArg_ParseTuple(args, "O:write_many", &iterable))
     {
-        written = -1;
+        return NULL;
     }
-    if (written < 0)
+    PyObject* seq = PySequence_Fast(iterable, "write_many() argument must be iterable");
+    if (!seq)
     {
-        // ERROR_HANDLE_EOF ERROR_BUFFER_OVERFLOW
-        raise_error_from_errno();
         return NULL;
     }
+    WINTUN_SESSION_HANDLE session = session_acquire(tuntap);
+    if (!session)
+    {
+        Py_DECREF(seq);
+        return NULL;
+    }
+    PyObject* ret = session_write_many(&wintun_session_backend, session, seq);
+    session_release(tuntap);
+    Py_DECREF(seq);
+    return ret;
+}
 
-#if PY_MAJOR_VERSION >= 3
-    return PyLong_FromSsize_t(written);
-#else
-    return PyInt_FromSsize_t(written);
-#endif
+PyDoc_STRVAR(wintun_write_many_doc, "write_many(iterable) -> number of packets written.\n\
+Write each buffer of iterable to device, up to 256 per ring lock round-trip. Stops early when the ring is full, so\n\
+the return value may be less than the number of buffers given.");
+
+static PyObject* wintun_start_reading(PyObject* self, PyObject* args) {
+    wintun_t* tuntap = (wintun_t*)self;
+    PyObject *loop, *protocol;
+    if (!PyArg_ParseTuple(args, "OO:start_reading", &loop, &protocol))
+    {
+        return NULL;
+    }
+    WINTUN_SESSION_HANDLE session = session_acquire(tuntap);
+    if (!session)
+    {
+        return NULL;
+    }
+    if (reader_start(&tuntap->reader, &wintun_session_backend, self, session, loop, protocol))
+    {
+        session_release(tuntap);
+        return NULL;
+    }
+    Py_RETURN_NONE;
 }
 
-PyDoc_STRVAR(wintun_write_doc, "write(str) -> number of bytes written.\n\
-Write str to device.");
+PyDoc_STRVAR(wintun_start_reading_doc, "start_reading(loop, protocol) -> None.\n\
+Deliver received packets to protocol.data_received() on the asyncio event loop, without a Python thread. A native\n\
+thread waits for the read event and schedules one drain per batch with loop.call_soon_threadsafe(). When the\n\
+adapter goes away, protocol.connection_lost(exc) is called and reading stops.");
 
-static PyObject* wintun_wait_read_event(PyObject* self, PyObject* args) {
+static PyObject* wintun_stop_reading(PyObject* self, PyObject* args) {
+    reader_end(&((wintun_t*)self)->reader);
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(wintun_stop_reading_doc, "stop_reading() -> None.\n\
+Stop delivering packets started by start_reading(). Call it before closing the event loop.");
+
+static PyObject* wintun_wait_read_event(PyObject* self, PyObject* args, PyObject* kwds) {
     wintun_t* tuntap = (wintun_t*)self;
-    HANDLE ev = WintunGetReadWaitEvent(tuntap->session);
-    return PyLong_FromUnsignedLong( WaitForSingleObject(ev, INFINITE) );
+    PyObject* timeout = Py_None;
+    char* kwlist[] = { "timeout", NULL };
+    DWORD ms;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|O:wait_read_event", kwlist, &timeout) || wait_timeout(timeout, &ms))
+    {
+        return NULL;
+    }
+    WINTUN_SESSION_HANDLE session = session_acquire(tuntap);
+    if (!session)
+    {
+        return NULL;
+    }
+    PyObject* ret = session_wait_read(&wintun_session_backend, session, tuntap->stop_event, ms);
+    session_release(tuntap);
+    return ret;
 }
 
-PyDoc_STRVAR(wintun_wait_read_event_doc, "wait_read_event() .\n\
-Wait read event signaled.");
+PyDoc_STRVAR(wintun_wait_read_event_doc, "wait_read_event(timeout=None) -> WAIT_OBJECT_0 when packets may be available.\n\
+Wait read event signaled, for at most timeout seconds when given. Returns WAIT_TIMEOUT (258) when the timeout\n\
+elapses and WAIT_OBJECT_0 + 1 when the session is brought down by another thread. Other Python threads keep\n\
+running while waiting.");
 
 static PyObject* wintun_up(PyObject* self) {
     wintun_t* tuntap = (wintun_t*)self;
-    if (tuntap->session) {
-        WintunEndSession(tuntap->session);
+    if (session_end(tuntap) < 0)
+    {
+        return NULL;
     }
+    ResetEvent(tuntap->stop_event);
     tuntap->session = WintunStartSession(tuntap->adapter, tuntap->capacity);
+    apply_proto_filter(tuntap);
     Py_RETURN_NONE;
 }
 
@@ -331,8 +681,9 @@ Start tunnel session.");
 
 static PyObject* wintun_down(PyObject* self) {
     wintun_t* tuntap = (wintun_t*)self;
-    if (tuntap->session) {
-        WintunEndSession(tuntap->session);
+    if (session_end(tuntap) < 0)
+    {
+        return NULL;
     }
     Py_RETURN_NONE;
 }
@@ -342,18 +693,30 @@ End tunnel session.");
 
 static PyMethodDef wintun_meth[] = { { "close", (PyCFunction)wintun_close, METH_NOARGS, wintun_close_doc },
                                      { "read", (PyCFunction)wintun_read, METH_VARARGS, wintun_read_doc },
+                                     { "read_view", (PyCFunction)wintun_read_view, METH_NOARGS, wintun_read_view_doc },
+                                     { "recv_into", (PyCFunction)wintun_recv_into, METH_VARARGS, wintun_recv_into_doc },
                                      { "write", (PyCFunction)wintun_write, METH_VARARGS, wintun_write_doc },
+                                     { "read_many", (PyCFunction)wintun_read_many, METH_VARARGS, wintun_read_many_doc },
+                                     { "write_many", (PyCFunction)wintun_write_many, METH_VARARGS, wintun_write_many_doc },
                                      { "up", (PyCFunction)wintun_up, METH_VARARGS, wintun_up_doc },
                                      { "down", (PyCFunction)wintun_down, METH_VARARGS, wintun_down_doc },
-                                     { "wait_read_event", (PyCFunction)wintun_wait_read_event, METH_VARARGS, wintun_wait_read_event_doc },
+                                     { "start_reading", (PyCFunction)wintun_start_reading, METH_VARARGS, wintun_start_reading_doc },
+                                     { "stop_reading", (PyCFunction)wintun_stop_reading, METH_NOARGS, wintun_stop_reading_doc },
+                                     { "wait_read_event", (PyCFunction)wintun_wait_read_event, METH_VARARGS | METH_KEYWORDS, wintun_wait_read_event_doc },
                                      { NULL, NULL, 0, NULL } };
 
 static PyObject *
 wintun_readwait_event(PyObject *self, PyObject *args)
 {
     wintun_t *tuntap = (wintun_t *)self;
-    HANDLE ev = NULL;
-    ev = WintunGetReadWaitEvent(tuntap->session);
+    WINTUN_SESSION_HANDLE session = session_acquire(tuntap);
+    if (!session)
+    {
+        return NULL;
+    }
+    /* The handle belongs to the session and is closed with it, by down() or close(). */
+    HANDLE ev = WintunGetReadWaitEvent(session);
+    session_release(tuntap);
 #if PY_MAJOR_VERSION >= 3
         return PyLong_FromSsize_t((Py_ssize_t)ev);
 #else
@@ -488,6 +851,7 @@ static int wintun_set_addr6(PyObject* self, PyObject* value, void* d) {
         AddressRow.Address.Ipv6.sin6_family = AF_INET6;
         AddressRow.OnLinkPrefixLength = 64; /* This is a /64 network */
         tuntap->proto_bits |= 2;
+        apply_proto_filter(tuntap);
         goto done;
 
     }
@@ -522,6 +886,7 @@ static int wintun_set_addr4(PyObject* self, PyObject* value, void* d) {
         AddressRow.Address.Ipv4.sin_family = AF_INET;
         AddressRow.OnLinkPrefixLength = 24; /* This is a /24 network */
         tuntap->proto_bits |= 1;
+        apply_proto_filter(tuntap);
         goto done;
     }
 done:
@@ -575,41 +940,19 @@ py_get_driver_version(PyObject *self, PyObject *args)
     return Py_BuildValue("i", WintunGetRunningDriverVersion());
 }
 
-static PyObject *gLogCallback = NULL;
-static void
-_logCallback(WINTUN_LOGGER_LEVEL Level, DWORD64 Timestamp, LPCWSTR Message)
-{
-    if (gLogCallback)
-    {
-        PyGILState_STATE gstate= PyGILState_Ensure();
-        PyObject* mesage = PyUnicode_FromWideChar(Message,  -1);
-        PyObject *result = PyEval_CallFunction(gLogCallback, "iKO", Level, Timestamp, mesage);
-        PyGILState_Release(gstate);
-    }
-}
+#include "pylogger.h"
 
 static PyObject *
-py_set_logger(PyObject *self, PyObject *args)
+py_set_logger(PyObject *self, PyObject *args, PyObject *kwds)
 {
-    PyObject *callback = NULL;
-    if (!PyArg_ParseTuple(args, "O", &callback))
-    {
-        return NULL;
-    }
-    if (callback != gLogCallback)
-    {
-        //if (gLogCallback)
-        //{
-        //    Py_DECREF(gLogCallback);
-        //    gLogCallback = NULL;
-        //}
-        gLogCallback = callback;
-        //Py_INCREF(callback);
-    }
-    WintunSetLogger(_logCallback);
-    Py_RETURN_NONE;
+    return log_set_logger(WintunSetLogger, args, kwds);
 }
 
+PyDoc_STRVAR(set_logger_doc, "set_logger(callback, min_level=LOG_INFO, max_batch=64, max_delay=100)\n\
+Pass log messages of min_level and above to callback, as a list of (level, timestamp, message) tuples. Messages are\n\
+collected until max_batch of them are waiting or the first has waited max_delay milliseconds. A callback of None\n\
+passes on the messages collected so far and stops logging.");
+
 static PyObject*
 py_install_wetest_driver(PyObject* self, PyObject* args)
 {
@@ -645,7 +988,7 @@ py_delete_driver(PyObject *self, PyObject *args)
 /* Module method table */
 static struct PyMethodDef wintunMethods[] = {
     { "get_driver_version", py_get_driver_version, METH_VARARGS, "Get running driver version" },
-    { "set_logger", py_set_logger, METH_VARARGS, "Set logger" },
+    { "set_logger", (PyCFunction)(void (*)(void))py_set_logger, METH_VARARGS | METH_KEYWORDS, set_logger_doc },
     { "delete_driver", py_delete_driver, METH_VARARGS, "Delete driver" },
     { "install_wetest_driver", py_install_wetest_driver, METH_VARARGS, "Install Wetest driver" },
     { "uninstall_wetest_driver", py_uninstall_wetest_driver, METH_VARARGS, "Uninstall Wetest driver" },
@@ -689,6 +1032,10 @@ initpywintunx_pmd3(void)
     {
         // goto error;
     }
+    if (PyType_Ready(&wintun_packet_type) != 0)
+    {
+        goto error;
+    }
     
     pytun_error_dict = Py_BuildValue("{ss}", "__doc__", wintun_error_doc);
     if (pytun_error_dict == NULL)
@@ -708,12 +1055,26 @@ initpywintunx_pmd3(void)
         goto error;
     }
 
+    if (PyModule_AddIntConstant(m, "LOG_INFO", WINTUN_LOG_INFO) != 0 ||
+        PyModule_AddIntConstant(m, "LOG_WARN", WINTUN_LOG_WARN) != 0 ||
+        PyModule_AddIntConstant(m, "LOG_ERR", WINTUN_LOG_ERR) != 0)
+    {
+        goto error;
+    }
+
     Py_INCREF((PyObject *)&wintun_type);
     if (PyModule_AddObject(m, "TunTapDevice", (PyObject *)&wintun_type) != 0)
     {
         Py_DECREF((PyObject *)&wintun_type);
         // goto error;
     }
+
+    Py_INCREF((PyObject *)&wintun_packet_type);
+    if (PyModule_AddObject(m, "Packet", (PyObject *)&wintun_packet_type) != 0)
+    {
+        Py_DECREF((PyObject *)&wintun_packet_type);
+        goto error;
+    }
 error:
     return m;
 }
@@ -0,0 +1,209 @@
+/* SPDX-License-Identifier: GPL-2.0
+ *
+ * Copyright (C) 2018-2021 WireGuard LLC. All Rights Reserved.
+ */
+
+#pragma once
+
+// set_logger() of the Python binding. The log lines come from whatever log_set_logger() is given to register
+// log_line_callback() with: WintunSetLogger() in the binding, a fake source in the host tests. Otherwise only Win32
+// lock and threadpool timer calls are made. The includer defines raise_error_from_errno() before including this.
+
+// Log lines reach Python in batches, so a burst of native logging takes the GIL once rather than once per line. The
+// logger's drain thread buffers the lines at or above the minimum level, which is checked before anything is copied,
+// and hands them over as a list of (level, timestamp, message) tuples once max_batch lines are buffered or the oldest
+// has waited max_delay milliseconds.
+#define LOG_LEVEL_OFF (WINTUN_LOG_ERR + 1)
+#define DEFAULT_LOG_MAX_BATCH 64
+#define DEFAULT_LOG_MAX_DELAY 100
+
+typedef struct log_line
+{
+    struct log_line* next;
+    WINTUN_LOGGER_LEVEL level;
+    DWORD64 timestamp;
+    WCHAR message[];
+} log_line_t;
+
+static PyObject* log_callback = NULL; // Only touched with the GIL held
+static volatile LONG log_min_level = LOG_LEVEL_OFF;
+static PTP_TIMER log_timer = NULL;
+// Lines waiting for delivery, and the batch limits. Never held while waiting for the GIL.
+static SRWLOCK log_lines_lock = SRWLOCK_INIT;
+static log_line_t* log_first = NULL;
+static log_line_t** log_last = &log_first;
+static Py_ssize_t log_lines = 0;
+static Py_ssize_t log_max_batch = DEFAULT_LOG_MAX_BATCH;
+static DWORD log_max_delay = DEFAULT_LOG_MAX_DELAY;
+// Keeps batches in order when the timer and a full batch race.
+static SRWLOCK log_deliver_lock = SRWLOCK_INIT;
+
+static void log_deliver(void) {
+    AcquireSRWLockExclusive(&log_deliver_lock);
+    AcquireSRWLockExclusive(&log_lines_lock);
+    log_line_t* line = log_first;
+    Py_ssize_t count = log_lines;
+    log_first = NULL;
+    log_last = &log_first;
+    log_lines = 0;
+    ReleaseSRWLockExclusive(&log_lines_lock);
+    if (line)
+    {
+        PyGILState_STATE gstate = PyGILState_Ensure();
+        PyObject* batch = PyList_New(count);
+        for (Py_ssize_t i = 0; line; ++i)
+        {
+            log_line_t* next = line->next;
+            if (batch)
+            {
+                PyObject* item = Py_BuildValue("(iKN)", line->level, line->timestamp,
+                                               PyUnicode_FromWideChar(line->message, -1));
+                if (item)
+                {
+                    PyList_SET_ITEM(batch, i, item);
+                }
+                else
+                {
+                    Py_CLEAR(batch);
+                }
+            }
+            PyMem_RawFree(line);
+            line = next;
+        }
+        // The callback may replace itself through set_logger().
+        PyObject* callback = log_callback;
+        Py_XINCREF(callback);
+        PyObject* result = batch && callback ? PyObject_CallFunctionObjArgs(callback, batch, NULL) : NULL;
+        if (!result && PyErr_Occurred())
+        {
+            PyErr_WriteUnraisable(callback);
+        }
+        Py_XDECREF(result);
+        Py_XDECREF(callback);
+        Py_XDECREF(batch);
+        PyGILState_Release(gstate);
+    }
+    ReleaseSRWLockExclusive(&log_deliver_lock);
+}
+
+static VOID CALLBACK log_timer_callback(PTP_CALLBACK_INSTANCE instance, PVOID context, PTP_TIMER timer) {
+    log_deliver();
+}
+
+static VOID CALLBACK log_line_callback(WINTUN_LOGGER_LEVEL level, DWORD64 timestamp, LPCWSTR message) {
+    if ((LONG)level < ReadNoFence(&log_min_level))
+    {
+        return;
+    }
+    size_t size = (wcslen(message) + 1) * sizeof(WCHAR);
+    log_line_t* line = PyMem_RawMalloc(sizeof(log_line_t) + size);
+    if (!line)
+    {
+        return;
+    }
+    line->next = NULL;
+    line->level = level;
+    line->timestamp = timestamp;
+    memcpy(line->message, message, size);
+    AcquireSRWLockExclusive(&log_lines_lock);
+    *log_last = line;
+    log_last = &line->next;
+    Py_ssize_t count = ++log_lines;
+    BOOL full = count >= log_max_batch;
+    DWORD delay = log_max_delay;
+    ReleaseSRWLockExclusive(&log_lines_lock);
+    if (full)
+    {
+        log_deliver();
+    }
+    else if (count == 1)
+    {
+        ULARGE_INTEGER due = { .QuadPart = (ULONGLONG)(-(LONGLONG)delay * 10000) }; // Relative, in 100 ns units
+        FILETIME due_time = { .dwLowDateTime = due.LowPart, .dwHighDateTime = due.HighPart };
+        SetThreadpoolTimer(log_timer, &due_time, 0, 0);
+    }
+}
+
+// Stops buffering and hands the lines buffered so far to the callback. Called with the GIL held.
+static void log_flush(void) {
+    WriteNoFence(&log_min_level, LOG_LEVEL_OFF);
+    if (!log_timer)
+    {
+        return;
+    }
+    Py_BEGIN_ALLOW_THREADS
+    SetThreadpoolTimer(log_timer, NULL, 0, 0);
+    WaitForThreadpoolTimerCallbacks(log_timer, TRUE);
+    log_deliver();
+    Py_END_ALLOW_THREADS
+}
+
+static PyObject *
+py_stop_logger(PyObject *self, PyObject *unused)
+{
+    log_flush();
+    Py_CLEAR(log_callback);
+    Py_RETURN_NONE;
+}
+
+static PyMethodDef log_atexit_def = { "_stop_logger", py_stop_logger, METH_NOARGS, NULL };
+
+// set_logger() with set_logger as the source of the log lines, WintunSetLogger() but for the host tests.
+static PyObject *
+log_set_logger(WINTUN_SET_LOGGER_FUNC *set_logger, PyObject *args, PyObject *kwds)
+{
+    PyObject *callback = NULL;
+    int min_level = WINTUN_LOG_INFO;
+    Py_ssize_t max_batch = DEFAULT_LOG_MAX_BATCH;
+    unsigned long max_delay = DEFAULT_LOG_MAX_DELAY;
+    char *kwlist[] = { "callback", "min_level", "max_batch", "max_delay", NULL };
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|ink", kwlist, &callback, &min_level, &max_batch, &max_delay))
+    {
+        return NULL;
+    }
+    if (callback == Py_None)
+    {
+        return py_stop_logger(NULL, NULL);
+    }
+    if (!PyCallable_Check(callback))
+    {
+        PyErr_SetString(PyExc_TypeError, "callback must be callable");
+        return NULL;
+    }
+    if (min_level < WINTUN_LOG_INFO || min_level > WINTUN_LOG_ERR || max_batch < 1 || max_delay > MAXDWORD / 2)
+    {
+        PyErr_SetString(PyExc_ValueError, "min_level, max_batch or max_delay out of range");
+        return NULL;
+    }
+    if (!log_timer)
+    {
+        log_timer = CreateThreadpoolTimer(log_timer_callback, NULL, NULL);
+        if (!log_timer)
+        {
+            raise_error_from_errno();
+            return NULL;
+        }
+        // Deliver what is left before the interpreter goes away.
+        PyObject *atexit = PyImport_ImportModule("atexit");
+        PyObject *stop = PyCFunction_New(&log_atexit_def, NULL);
+        PyObject *result = atexit && stop ? PyObject_CallMethod(atexit, "register", "O", stop) : NULL;
+        Py_XDECREF(stop);
+        Py_XDECREF(atexit);
+        if (!result)
+        {
+            return NULL;
+        }
+        Py_DECREF(result);
+    }
+    PyObject *previous = log_callback;
+    Py_INCREF(callback);
+    log_callback = callback;
+    Py_XDECREF(previous);
+    AcquireSRWLockExclusive(&log_lines_lock);
+    log_max_batch = max_batch;
+    log_max_delay = (DWORD)max_delay;
+    ReleaseSRWLockExclusive(&log_lines_lock);
+    WriteNoFence(&log_min_level, min_level);
+    set_logger(log_line_callback);
+    Py_RETURN_NONE;
+}
@@ -0,0 +1,216 @@
+/* SPDX-License-Identifier: GPL-2.0
+ *
+ * Copyright (C) 2018-2021 WireGuard LLC. All Rights Reserved.
+ */
+
+#pragma once
+
+// The asyncio reader behind start_reading() of the Python binding, delivering the packets of a session through a
+// session_backend_t. The includer defines reader_of(), which finds the reader_t of the object start_reading() was
+// called on, anywhere.
+
+#include "pysession.h"
+
+// Packets delivered per drain callback before yielding back to the event loop.
+#define DRAIN_ROUNDS 4
+
+// start_reading() state. A native thread waits for packets and schedules drain on loop, once per batch; the thread
+// holds a session reference until stop_reading().
+typedef struct reader_t {
+    const session_backend_t* backend;
+    PyObject* owner; // Embeds the reader, so is not referenced
+    HANDLE thread;
+    HANDLE stop;
+    HANDLE drained;
+    WINTUN_SESSION_HANDLE session;
+    PyObject* loop;
+    PyObject* protocol;
+    PyObject* drain;
+} reader_t;
+
+static reader_t* reader_of(PyObject* owner);
+
+static DWORD WINAPI reader_thread(LPVOID param) {
+    reader_t* reader = (reader_t*)param;
+    HANDLE wait_read[] = { reader->backend->get_read_wait_event(reader->session), reader->stop };
+    HANDLE wait_drained[] = { reader->drained, reader->stop };
+    for (;;)
+    {
+        if (WaitForMultipleObjects(_countof(wait_read), wait_read, FALSE, INFINITE) != WAIT_OBJECT_0)
+        {
+            break;
+        }
+        PyGILState_STATE gstate = PyGILState_Ensure();
+        PyObject* ret = PyObject_CallMethod(reader->loop, "call_soon_threadsafe", "O", reader->drain);
+        if (!ret)
+        {
+            // Typically the loop was closed without calling stop_reading().
+            PyErr_WriteUnraisable(reader->loop);
+        }
+        Py_XDECREF(ret);
+        PyGILState_Release(gstate);
+        if (!ret)
+        {
+            break;
+        }
+        // Packets arriving meanwhile leave the read-wait event signaled, so the next batch is not missed.
+        if (WaitForMultipleObjects(_countof(wait_drained), wait_drained, FALSE, INFINITE) != WAIT_OBJECT_0)
+        {
+            break;
+        }
+    }
+    return 0;
+}
+
+// Stops the reader thread, if any, and drops the session reference it held. Called with the GIL held.
+static void reader_end(reader_t* reader) {
+    if (!reader->thread)
+    {
+        return;
+    }
+    SetEvent(reader->stop);
+    Py_BEGIN_ALLOW_THREADS
+    WaitForSingleObject(reader->thread, INFINITE);
+    Py_END_ALLOW_THREADS
+    CloseHandle(reader->thread);
+    CloseHandle(reader->stop);
+    CloseHandle(reader->drained);
+    reader->thread = NULL;
+    reader->session = NULL;
+    reader->backend->session_release(reader->owner);
+    Py_CLEAR(reader->loop);
+    Py_CLEAR(reader->protocol);
+    Py_CLEAR(reader->drain);
+}
+
+static PyObject* reader_drain(PyObject* self, PyObject* unused) {
+    reader_t* reader = reader_of(self);
+    PyObject* protocol = reader->protocol;
+    if (!protocol)
+    {
+        // Scheduled right before stop_reading().
+        Py_RETURN_NONE;
+    }
+    Py_INCREF(protocol);
+    PyObject* result = NULL;
+    DWORD received = MAX_BATCH;
+    for (int round = 0; round < DRAIN_ROUNDS && received == MAX_BATCH; ++round)
+    {
+        PyObject* list = receive_batch(reader->backend, reader->session, MAX_BATCH, &received);
+        if (!list)
+        {
+            // ERROR_HANDLE_EOF ERROR_INVALID_DATA
+            PyObject *type, *value, *traceback;
+            PyErr_Fetch(&type, &value, &traceback);
+            PyErr_NormalizeException(&type, &value, &traceback);
+            reader_end(reader);
+            result = PyObject_CallMethod(protocol, "connection_lost", "O", value ? value : Py_None);
+            Py_XDECREF(type);
+            Py_XDECREF(value);
+            Py_XDECREF(traceback);
+            goto cleanup;
+        }
+        for (Py_ssize_t i = 0; i < PyList_GET_SIZE(list); ++i)
+        {
+            // The protocol may stop or restart reading from data_received(), which also drops our session reference.
+            // The rest of the batch is already off the ring, and is dropped rather than handed to a protocol that quit.
+            if (reader->protocol != protocol)
+            {
+                Py_DECREF(list);
+                result = Py_None;
+                Py_INCREF(result);
+                goto cleanup;
+            }
+            PyObject* ret = PyObject_CallMethod(protocol, "data_received", "O", PyList_GET_ITEM(list, i));
+            if (!ret)
+            {
+                Py_DECREF(list);
+                if (reader->protocol == protocol)
+                {
+                    // Let the loop report the error, and come back for whatever is left in the ring.
+                    SetEvent(reader->backend->get_read_wait_event(reader->session));
+                    SetEvent(reader->drained);
+                }
+                goto cleanup;
+            }
+            Py_DECREF(ret);
+        }
+        Py_DECREF(list);
+        if (reader->protocol != protocol)
+        {
+            break;
+        }
+    }
+    if (reader->protocol != protocol)
+    {
+        result = Py_None;
+        Py_INCREF(result);
+    }
+    else if (received == MAX_BATCH)
+    {
+        // Likely more to come: yield to other callbacks, then carry on without another thread hop.
+        result = PyObject_CallMethod(reader->loop, "call_soon", "O", reader->drain);
+    }
+    else
+    {
+        SetEvent(reader->drained);
+        result = Py_None;
+        Py_INCREF(result);
+    }
+cleanup:
+    Py_DECREF(protocol);
+    return result;
+}
+
+static PyMethodDef reader_drain_def = { "_drain", reader_drain, METH_NOARGS, NULL };
+
+// Starts delivering the packets of session, which the caller holds a reference to, to protocol on loop. Takes over the
+// session reference and returns 0, or raises and returns -1, leaving the caller to drop it.
+static int reader_start(reader_t* reader, const session_backend_t* backend, PyObject* owner,
+                        WINTUN_SESSION_HANDLE session, PyObject* loop, PyObject* protocol) {
+    if (reader->thread)
+    {
+        raise_error("Already reading");
+        return -1;
+    }
+    reader->backend = backend;
+    reader->owner = owner;
+    reader->drain = PyCFunction_New(&reader_drain_def, owner);
+    reader->stop = CreateEventW(NULL, TRUE, FALSE, NULL);
+    reader->drained = CreateEventW(NULL, FALSE, FALSE, NULL);
+    if (!reader->drain || !reader->stop || !reader->drained)
+    {
+        goto error;
+    }
+    Py_INCREF(loop);
+    reader->loop = loop;
+    Py_INCREF(protocol);
+    reader->protocol = protocol;
+    reader->session = session;
+    reader->thread = CreateThread(NULL, 0, reader_thread, reader, 0, NULL);
+    if (!reader->thread)
+    {
+        goto error;
+    }
+    return 0;
+error:
+    if (!PyErr_Occurred())
+    {
+        PyErr_SetFromWindowsErr(0);
+    }
+    if (reader->stop)
+    {
+        CloseHandle(reader->stop);
+        reader->stop = NULL;
+    }
+    if (reader->drained)
+    {
+        CloseHandle(reader->drained);
+        reader->drained = NULL;
+    }
+    reader->session = NULL;
+    Py_CLEAR(reader->loop);
+    Py_CLEAR(reader->protocol);
+    Py_CLEAR(reader->drain);
+    return -1;
+}
@@ -0,0 +1,233 @@
+/* SPDX-License-Identifier: GPL-2.0
+ *
+ * Copyright (C) 2018-2021 WireGuard LLC. All Rights Reserved.
+ */
+
+#pragma once
+
+// Packet I/O of the Python binding on a session it holds a reference to. The session is reached through a
+// session_backend_t, which the binding points at the wintun.dll calls and the host tests at a fake session; otherwise
+// only Win32 wait calls are made. Copies and waits drop the GIL. The includer defines raise_error() and
+// raise_error_from_errno() before including this.
+
+// Upper bound of packets moved per ring lock round-trip by read_many() and write_many().
+#define MAX_BATCH 256
+
+typedef struct session_backend_t {
+    WINTUN_RECEIVE_PACKET_FUNC* receive_packet;
+    WINTUN_RELEASE_RECEIVE_PACKET_FUNC* release_receive_packet;
+    WINTUN_RECEIVE_PACKETS_FUNC* receive_packets;
+    WINTUN_RELEASE_RECEIVE_PACKETS_FUNC* release_receive_packets;
+    WINTUN_ALLOCATE_SEND_PACKET_FUNC* allocate_send_packet;
+    WINTUN_SEND_PACKET_FUNC* send_packet;
+    WINTUN_ALLOCATE_SEND_PACKETS_FUNC* allocate_send_packets;
+    WINTUN_SEND_PACKETS_FUNC* send_packets;
+    WINTUN_GET_READ_WAIT_EVENT_FUNC* get_read_wait_event;
+    // Drops a session reference of owner, the object the session belongs to.
+    void (*session_release)(PyObject* owner);
+} session_backend_t;
+
+static inline PyObject* new_buffer(unsigned int len) {
+#if PY_MAJOR_VERSION >= 3
+    return PyBytes_FromStringAndSize(NULL, len);
+#else
+    return PyString_FromStringAndSize(NULL, len);
+#endif
+}
+
+// Turns the last error of a failed receive into a Python result: None when the ring is merely empty.
+static PyObject* receive_failed(void) {
+    DWORD LastError = GetLastError();
+    if (LastError != ERROR_NO_MORE_ITEMS && LastError != ERROR_SUCCESS)
+    {
+        // ERROR_HANDLE_EOF ERROR_INVALID_DATA
+        raise_error_from_errno();
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+static void strip_loopback_header(char** buf, Py_ssize_t* len) {
+    // For pymobiledevice3
+    static const char* LOOPBACK_HEADER = "\x00\x00\x86\xdd";
+    if (*len > 4 && memcmp(LOOPBACK_HEADER, *buf, 4) == 0)
+    {
+        *len -= 4;
+        *buf += 4;
+    }
+}
+
+// Receives one packet and returns it as bytes, or None when the ring has nothing.
+static PyObject* session_read(const session_backend_t* backend, WINTUN_SESSION_HANDLE session) {
+    DWORD rdlen;
+    BYTE* packet = backend->receive_packet(session, &rdlen);
+    if (!packet)
+    {
+        return receive_failed();
+    }
+    PyObject* buf = new_buffer(rdlen);
+    if (buf)
+    {
+        char* dst = PyBytes_AS_STRING(buf);
+        Py_BEGIN_ALLOW_THREADS
+        memcpy(dst, packet, rdlen);
+        Py_END_ALLOW_THREADS
+    }
+    backend->release_receive_packet(session, packet);
+    return buf;
+}
+
+// Receives up to max_count packets with a single ring lock round-trip and returns them as a list of bytes, empty when
+// the ring has nothing. *received is set to the number of packets taken off the ring.
+static PyObject* receive_batch(const session_backend_t* backend, WINTUN_SESSION_HANDLE session, DWORD max_count,
+                               DWORD* received) {
+    BYTE* packets[MAX_BATCH];
+    DWORD sizes[MAX_BATCH];
+    DWORD count = backend->receive_packets(session, packets, sizes, min(max_count, MAX_BATCH));
+    *received = count;
+    if (!count)
+    {
+        PyObject* ret = receive_failed();
+        if (!ret)
+        {
+            return NULL;
+        }
+        Py_DECREF(ret);
+        return PyList_New(0);
+    }
+    PyObject* list = PyList_New(count);
+    for (DWORD i = 0; list && i < count; ++i)
+    {
+        PyObject* buf = new_buffer(sizes[i]);
+        if (!buf)
+        {
+            Py_CLEAR(list);
+            break;
+        }
+        PyList_SET_ITEM(list, i, buf);
+    }
+    Py_BEGIN_ALLOW_THREADS
+    for (DWORD i = 0; list && i < count; ++i)
+    {
+        memcpy(PyBytes_AS_STRING(PyList_GET_ITEM(list, i)), packets[i], sizes[i]);
+    }
+    backend->release_receive_packets(session, (const BYTE**)packets, count);
+    Py_END_ALLOW_THREADS
+    return list;
+}
+
+// Sends the len bytes at buf, without a loopback header, and returns the number of bytes sent.
+static PyObject* session_write(const session_backend_t* backend, WINTUN_SESSION_HANDLE session, char* buf,
+                               Py_ssize_t len) {
+    strip_loopback_header(&buf, &len);
+    BYTE* packet = backend->allocate_send_packet(session, (DWORD)len);
+    if (!packet)
+    {
+        // ERROR_HANDLE_EOF ERROR_BUFFER_OVERFLOW
+        raise_error_from_errno();
+        return NULL;
+    }
+    Py_BEGIN_ALLOW_THREADS
+    memcpy(packet, buf, len);
+    backend->send_packet(session, packet);
+    Py_END_ALLOW_THREADS
+
+#if PY_MAJOR_VERSION >= 3
+    return PyLong_FromSsize_t(len);
+#else
+    return PyInt_FromSsize_t(len);
+#endif
+}
+
+// Sends the buffers of seq, a sequence from PySequence_Fast(), up to MAX_BATCH per ring lock round-trip, and returns
+// the number of packets sent, which stops short of the whole sequence when the ring fills up.
+static PyObject* session_write_many(const session_backend_t* backend, WINTUN_SESSION_HANDLE session, PyObject* seq) {
+    Py_buffer views[MAX_BATCH];
+    char* srcs[MAX_BATCH];
+    DWORD sizes[MAX_BATCH];
+    BYTE* packets[MAX_BATCH];
+    Py_ssize_t total = PySequence_Fast_GET_SIZE(seq), written = 0;
+    int failed = 0;
+    while (written < total && !failed)
+    {
+        Py_ssize_t batch = min(total - written, MAX_BATCH), held = 0;
+        for (; held < batch; ++held)
+        {
+            Py_buffer* view = &views[held];
+            if (PyObject_GetBuffer(PySequence_Fast_GET_ITEM(seq, written + held), view, PyBUF_SIMPLE) < 0)
+            {
+                failed = 1;
+                break;
+            }
+            srcs[held] = view->buf;
+            Py_ssize_t len = view->len;
+            strip_loopback_header(&srcs[held], &len);
+            if (len > WINTUN_MAX_IP_PACKET_SIZE)
+            {
+                PyBuffer_Release(view);
+                PyErr_SetString(PyExc_ValueError, "packet exceeds WINTUN_MAX_IP_PACKET_SIZE");
+                failed = 1;
+                break;
+            }
+            sizes[held] = (DWORD)len;
+        }
+        // A bad buffer fails the whole batch rather than sending part of it.
+        DWORD allocated = held && !failed ? backend->allocate_send_packets(session, sizes, packets, (DWORD)held) : 0;
+        DWORD LastError = GetLastError();
+        Py_BEGIN_ALLOW_THREADS
+        for (DWORD i = 0; i < allocated; ++i)
+        {
+            memcpy(packets[i], srcs[i], sizes[i]);
+        }
+        backend->send_packets(session, (const BYTE**)packets, allocated);
+        Py_END_ALLOW_THREADS
+        for (Py_ssize_t i = 0; i < held; ++i)
+        {
+            PyBuffer_Release(&views[i]);
+        }
+        written += allocated;
+        if ((Py_ssize_t)allocated < held)
+        {
+            // The ring is full: report how far we got, unless nothing could be written at all.
+            if (!allocated && LastError != ERROR_BUFFER_OVERFLOW && !failed)
+            {
+                SetLastError(LastError);
+                // ERROR_HANDLE_EOF
+                raise_error_from_errno();
+                failed = 1;
+            }
+            break;
+        }
+    }
+    if (failed)
+    {
+        return NULL;
+    }
+    return PyLong_FromSsize_t(written);
+}
+
+// Converts the timeout argument of wait_read_event(), in seconds or None, to milliseconds. Returns -1 if it raised.
+static int wait_timeout(PyObject* timeout, DWORD* ms) {
+    *ms = INFINITE;
+    if (timeout != Py_None)
+    {
+        double seconds = PyFloat_AsDouble(timeout);
+        if (seconds == -1.0 && PyErr_Occurred())
+        {
+            return -1;
+        }
+        *ms = seconds <= 0 ? 0 : seconds * 1000 >= INFINITE ? INFINITE - 1 : (DWORD)(seconds * 1000);
+    }
+    return 0;
+}
+
+// Waits up to ms milliseconds for the read-wait event of session, or stop_event, and returns what the wait did.
+static PyObject* session_wait_read(const session_backend_t* backend, WINTUN_SESSION_HANDLE session, HANDLE stop_event,
+                                   DWORD ms) {
+    HANDLE events[] = { backend->get_read_wait_event(session), stop_event };
+    DWORD ret;
+    Py_BEGIN_ALLOW_THREADS
+    ret = WaitForMultipleObjects(_countof(events), events, FALSE, ms);
+    Py_END_ALLOW_THREADS
+    return PyLong_FromUnsignedLong(ret);
+}
@@ -4,43 +4,21 @@
  */
 
 #include "adapter.h"
+#include "capture.h"
 #include "logger.h"
 #include "main.h"
 #include "wintun.h"
+#include "../common/filter.h"
+#include "../common/flow.h"
+#include "../common/gso.h"
+#include "../common/ring.h"
+#include "../common/stats.h"
+#include "../common/wait.h"
 #include <Windows.h>
 #include <devioctl.h>
 #include <stdlib.h>
 
-#ifndef PACKET_DEBUG
-#define PACKET_DEBUG 0
-#endif
-
-#pragma warning(disable : 4200) /* nonstandard: zero-sized array in struct/union */
-
-#define TUN_ALIGNMENT sizeof(ULONG)
-#define TUN_ALIGN(Size) (((ULONG)(Size) + ((ULONG)TUN_ALIGNMENT - 1)) & ~((ULONG)TUN_ALIGNMENT - 1))
-#define TUN_IS_ALIGNED(Size) (!((ULONG)(Size) & ((ULONG)TUN_ALIGNMENT - 1)))
-#define TUN_MAX_PACKET_SIZE TUN_ALIGN(sizeof(TUN_PACKET) + WINTUN_MAX_IP_PACKET_SIZE)
-#define TUN_RING_CAPACITY(Size) ((Size) - sizeof(TUN_RING) - (TUN_MAX_PACKET_SIZE - TUN_ALIGNMENT))
-#define TUN_RING_SIZE(Capacity) (sizeof(TUN_RING) + (Capacity) + (TUN_MAX_PACKET_SIZE - TUN_ALIGNMENT))
-#define TUN_RING_WRAP(Value, Capacity) ((Value) & (Capacity - 1))
 #define LOCK_SPIN_COUNT 0x10000
-#define TUN_PACKET_RELEASE ((DWORD)0x80000000)
-
-
-typedef struct _TUN_PACKET
-{
-    ULONG Size;
-    UCHAR Data[];
-} TUN_PACKET;
-
-typedef struct _TUN_RING
-{
-    volatile ULONG Head;
-    volatile ULONG Tail;
-    volatile LONG Alertable;
-    UCHAR Data[];
-} TUN_RING;
 
 #define TUN_IOCTL_REGISTER_RINGS CTL_CODE(51820U, 0x970U, METHOD_BUFFERED, FILE_READ_DATA | FILE_WRITE_DATA)
 
@@ -54,14 +32,51 @@ typedef struct _TUN_REGISTER_RINGS
     } Send, Receive;
 } TUN_REGISTER_RINGS;
 
+typedef struct _TUN_REGISTER_RINGS_EX
+{
+    TUN_REGISTER_RINGS Rings;
+    ULONG StatisticsSize;
+    TUN_DRIVER_STATISTICS *Statistics;
+} TUN_REGISTER_RINGS_EX;
+
+#define TUN_IOCTL_REGISTER_QUEUES CTL_CODE(51820U, 0x971U, METHOD_BUFFERED, FILE_READ_DATA | FILE_WRITE_DATA)
+
+typedef struct _TUN_REGISTER_QUEUES
+{
+    ULONG QueueCount;
+    ULONG StatisticsSize;
+    TUN_DRIVER_STATISTICS *Statistics;
+    ULONG Flags;
+    TUN_REGISTER_RINGS Queues[TUN_MAX_QUEUES]; /* Only QueueCount elements are passed to the driver */
+} TUN_REGISTER_QUEUES;
+
+C_ASSERT(WINTUN_MAX_QUEUES == TUN_MAX_QUEUES);
+C_ASSERT(INFINITE == TUN_WAIT_INFINITE);
+C_ASSERT(FIELD_OFFSET(TUN_DRIVER_STATISTICS, SendOverflowNbls) == TUN_STATS_HEADER_SIZE);
+C_ASSERT(TUN_STATS_COUNTERS == sizeof(WINTUN_DRIVER_STATISTICS) / sizeof(DWORD64));
+
+/* Ring counters. Only the thread owning the ring side (holding its lock, or the single consumer) updates them. The
+ * single consumer does so without the lock, so they are stored and loaded whole with CountAdd and CountRead. */
+typedef struct _TUN_RING_STATISTICS
+{
+    ULONG64 Packets;
+    ULONG64 Bytes;
+    ULONG64 Failures; /* ERROR_NO_MORE_ITEMS on the send ring, ERROR_BUFFER_OVERFLOW on the receive ring */
+    ULONG HighWater;
+    ULONG64 PacketSizes[WINTUN_HISTOGRAM_BUCKETS];
+    ULONG64 BatchSizes[WINTUN_HISTOGRAM_BUCKETS];
+} TUN_RING_STATISTICS;
+
 typedef struct _TUN_SESSION
 {
     ULONG Capacity;
+    DWORD Flags;
     struct
     {
         ULONG Tail;
         ULONG TailRelease;
         ULONG PacketsToRelease;
+        TUN_RING_STATISTICS Stats;
         CRITICAL_SECTION Lock;
     } Receive;
     struct
@@ -69,88 +84,257 @@ typedef struct _TUN_SESSION
         ULONG Head;
         ULONG HeadRelease;
         ULONG PacketsToRelease;
+        TUN_FILTER_PROGRAM *Filter;
+        ULONG64 Filtered;
+        TUN_RING_STATISTICS Stats;
         CRITICAL_SECTION Lock;
     } Send;
-    TUN_REGISTER_RINGS Descriptor;
-    HANDLE Handle;
+    struct
+    {
+        LONG64 Frequency;
+        LONG64 AverageGap;
+        LONG64 Spins;
+        LONG64 Blocks;
+    } Wait;
+    TUN_REGISTER_RINGS_EX Descriptor;
+    HANDLE Handle; /* Only valid on the first queue */
+    struct _TUN_SESSION *First; /* Queue owning the device handle and the ring memory */
+    CAPTURE *Capture;           /* On the first queue: created by the first WintunSetSessionCapture */
+    volatile LONG ActiveQueues; /* On the first queue: queues not ended yet */
 } TUN_SESSION;
 
-WINTUN_START_SESSION_FUNC WintunStartSession;
-_Use_decl_annotations_
-TUN_SESSION *WINAPI
-WintunStartSession(WINTUN_ADAPTER *Adapter, DWORD Capacity)
+/* Enables the privilege to lock pages in memory, which large page allocations need, if the process token holds it. */
+static _Return_type_success_(return != FALSE)
+BOOL
+EnableLockMemoryPrivilege(VOID)
+{
+    HANDLE ProcessToken;
+    if (!OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES, &ProcessToken))
+        return FALSE;
+    TOKEN_PRIVILEGES Privileges = { .PrivilegeCount = 1, .Privileges[0].Attributes = SE_PRIVILEGE_ENABLED };
+    DWORD LastError = ERROR_SUCCESS;
+    if (!LookupPrivilegeValueW(NULL, SE_LOCK_MEMORY_NAME, &Privileges.Privileges[0].Luid) ||
+        !AdjustTokenPrivileges(ProcessToken, FALSE, &Privileges, sizeof(Privileges), NULL, NULL))
+        LastError = GetLastError();
+    /* AdjustTokenPrivileges succeeds without the privilege, only reporting it as not assigned. */
+    else if (GetLastError() == ERROR_NOT_ALL_ASSIGNED)
+        LastError = ERROR_PRIVILEGE_NOT_HELD;
+    CloseHandle(ProcessToken);
+    return RET_ERROR(TRUE, LastError);
+}
+
+/* Allocates Size bytes of zeroed ring memory. With WINTUN_SESSION_LARGE_PAGES in *Flags, tries large pages first, and
+ * clears the flag if it falls back to regular pages. */
+_Must_inspect_result_
+static _Return_type_success_(return != NULL)
+_Post_maybenull_
+BYTE *
+AllocateRingMemory(_In_ SIZE_T Size, _Inout_ DWORD *Flags)
+{
+    if (*Flags & WINTUN_SESSION_LARGE_PAGES)
+    {
+        SIZE_T LargePageSize = GetLargePageMinimum();
+        BYTE *Region = NULL;
+        if (!LargePageSize)
+            SetLastError(ERROR_NOT_SUPPORTED);
+        else if (EnableLockMemoryPrivilege())
+            Region = VirtualAlloc(
+                NULL,
+                (Size + LargePageSize - 1) & ~(LargePageSize - 1),
+                MEM_COMMIT | MEM_RESERVE | MEM_LARGE_PAGES,
+                PAGE_READWRITE);
+        if (Region)
+            return Region;
+        LOG(WINTUN_LOG_WARN,
+            L"Failed to allocate ring memory from large pages (error %u), using regular pages",
+            GetLastError());
+        *Flags &= ~WINTUN_SESSION_LARGE_PAGES;
+    }
+    return VirtualAlloc(NULL, Size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+}
+
+/* Starts QueueCount sessions sharing one device handle and one allocation, and returns them as an array. */
+_Must_inspect_result_
+static _Return_type_success_(return != NULL)
+_Post_maybenull_
+TUN_SESSION *
+StartSessions(_In_ WINTUN_ADAPTER *Adapter, _In_ DWORD Capacity, _In_ DWORD Flags, _In_ DWORD QueueCount)
 {
     DWORD LastError;
-    TUN_SESSION *Session = Zalloc(sizeof(TUN_SESSION));
-    if (!Session)
+    if (Flags & ~(WINTUN_SESSION_SINGLE_CONSUMER | WINTUN_SESSION_GSO | WINTUN_SESSION_LARGE_PAGES))
+    {
+        LastError = LOG_ERROR(ERROR_INVALID_PARAMETER, L"Unsupported session flags 0x%x", Flags);
+        goto cleanup;
+    }
+    if (!QueueCount || QueueCount > WINTUN_MAX_QUEUES)
+    {
+        LastError = LOG_ERROR(ERROR_INVALID_PARAMETER, L"Unsupported queue count %u", QueueCount);
+        goto cleanup;
+    }
+    TUN_SESSION *Sessions = ZallocArray(QueueCount, sizeof(TUN_SESSION));
+    if (!Sessions)
     {
         LastError = GetLastError();
         goto cleanup;
     }
     const ULONG RingSize = TUN_RING_SIZE(Capacity);
-    BYTE *AllocatedRegion = VirtualAlloc(0, (size_t)RingSize * 2, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+    /* The statistics page follows the rings, aligned so the driver's counters never share a line with ring data. */
+    const size_t StatisticsOffset =
+        ((size_t)RingSize * 2 * QueueCount + TUN_STATS_ALIGNMENT - 1) & ~((size_t)TUN_STATS_ALIGNMENT - 1);
+    const size_t RegionSize = StatisticsOffset + sizeof(TUN_DRIVER_STATISTICS);
+    BYTE *AllocatedRegion = AllocateRingMemory(RegionSize, &Flags);
     if (!AllocatedRegion)
     {
-        LastError = LOG_LAST_ERROR(L"Failed to allocate ring memory (requested size: 0x%zx)", (size_t)RingSize * 2);
+        LastError = LOG_LAST_ERROR(L"Failed to allocate ring memory (requested size: 0x%zx)", RegionSize);
         goto cleanupRings;
     }
-    Session->Descriptor.Send.RingSize = RingSize;
-    Session->Descriptor.Send.Ring = (TUN_RING *)AllocatedRegion;
-    Session->Descriptor.Send.TailMoved = CreateEventW(&SecurityAttributes, FALSE, FALSE, NULL);
-    if (!Session->Descriptor.Send.TailMoved)
+    DWORD QueuesCreated;
+    for (QueuesCreated = 0; QueuesCreated < QueueCount; ++QueuesCreated)
     {
-        LastError = LOG_LAST_ERROR(L"Failed to create send event");
-        goto cleanupAllocatedRegion;
-    }
+        TUN_SESSION *Session = &Sessions[QueuesCreated];
+        BYTE *Rings = AllocatedRegion + (size_t)RingSize * 2 * QueuesCreated;
+        Session->Descriptor.StatisticsSize = sizeof(TUN_DRIVER_STATISTICS);
+        Session->Descriptor.Statistics = (TUN_DRIVER_STATISTICS *)(AllocatedRegion + StatisticsOffset);
+        Session->Descriptor.Rings.Send.RingSize = RingSize;
+        Session->Descriptor.Rings.Send.Ring = (TUN_RING *)Rings;
+        Session->Descriptor.Rings.Send.TailMoved = CreateEventW(&SecurityAttributes, FALSE, FALSE, NULL);
+        if (!Session->Descriptor.Rings.Send.TailMoved)
+        {
+            LastError = LOG_LAST_ERROR(L"Failed to create send event");
+            goto cleanupQueues;
+        }
 
-    Session->Descriptor.Receive.RingSize = RingSize;
-    Session->Descriptor.Receive.Ring = (TUN_RING *)(AllocatedRegion + RingSize);
-    Session->Descriptor.Receive.TailMoved = CreateEventW(&SecurityAttributes, FALSE, FALSE, NULL);
-    if (!Session->Descriptor.Receive.TailMoved)
-    {
-        LastError = LOG_LAST_ERROR(L"Failed to create receive event");
-        goto cleanupSendTailMoved;
+        Session->Descriptor.Rings.Receive.RingSize = RingSize;
+        Session->Descriptor.Rings.Receive.Ring = (TUN_RING *)(Rings + RingSize);
+        Session->Descriptor.Rings.Receive.TailMoved = CreateEventW(&SecurityAttributes, FALSE, FALSE, NULL);
+        if (!Session->Descriptor.Rings.Receive.TailMoved)
+        {
+            LastError = LOG_LAST_ERROR(L"Failed to create receive event");
+            CloseHandle(Session->Descriptor.Rings.Send.TailMoved);
+            goto cleanupQueues;
+        }
     }
 
-    Session->Handle = AdapterOpenDeviceObject(Adapter);
-    if (Session->Handle == INVALID_HANDLE_VALUE)
+    Sessions->Handle = AdapterOpenDeviceObject(Adapter);
+    if (Sessions->Handle == INVALID_HANDLE_VALUE)
     {
         LastError = LOG(WINTUN_LOG_ERR, L"Failed to open adapter device object");
-        goto cleanupReceiveTailMoved;
+        goto cleanupQueues;
     }
     DWORD BytesReturned;
-    if (!DeviceIoControl(
-            Session->Handle,
+    /* Only the queue registration carries flags, so it also serves single queues that need them. */
+    if (QueueCount > 1 || (Flags & WINTUN_SESSION_GSO))
+    {
+        TUN_REGISTER_QUEUES Rqb = { .QueueCount = QueueCount,
+                                    .StatisticsSize = Sessions->Descriptor.StatisticsSize,
+                                    .Statistics = Sessions->Descriptor.Statistics,
+                                    .Flags = (Flags & WINTUN_SESSION_GSO) ? TUN_REGISTER_FLAG_GSO : 0 };
+        for (DWORD i = 0; i < QueueCount; ++i)
+            Rqb.Queues[i] = Sessions[i].Descriptor.Rings;
+        if (!DeviceIoControl(
+                Sessions->Handle,
+                TUN_IOCTL_REGISTER_QUEUES,
+                &Rqb,
+                FIELD_OFFSET(TUN_REGISTER_QUEUES, Queues) + QueueCount * sizeof(TUN_REGISTER_RINGS),
+                NULL,
+                0,
+                &BytesReturned,
+                NULL))
+        {
+            LastError = LOG_LAST_ERROR(L"Failed to register queues");
+            goto cleanupHandle;
+        }
+    }
+    /* Drivers predating the statistics page reject the extended descriptor, so fall back to registering rings only. The
+     * page then keeps a zero size and WintunGetDriverStatistics reports it unsupported. */
+    else if (
+        !DeviceIoControl(
+            Sessions->Handle,
             TUN_IOCTL_REGISTER_RINGS,
-            &Session->Descriptor,
-            sizeof(TUN_REGISTER_RINGS),
+            &Sessions->Descriptor,
+            sizeof(TUN_REGISTER_RINGS_EX),
             NULL,
             0,
             &BytesReturned,
-            NULL))
+            NULL) &&
+        (GetLastError() != ERROR_INVALID_PARAMETER ||
+         !DeviceIoControl(
+             Sessions->Handle,
+             TUN_IOCTL_REGISTER_RINGS,
+             &Sessions->Descriptor.Rings,
+             sizeof(TUN_REGISTER_RINGS),
+             NULL,
+             0,
+             &BytesReturned,
+             NULL)))
     {
         LastError = LOG_LAST_ERROR(L"Failed to register rings");
         goto cleanupHandle;
     }
-    Session->Capacity = Capacity;
-    (VOID) InitializeCriticalSectionAndSpinCount(&Session->Receive.Lock, LOCK_SPIN_COUNT);
-    (VOID) InitializeCriticalSectionAndSpinCount(&Session->Send.Lock, LOCK_SPIN_COUNT);
-    return Session;
+    LARGE_INTEGER Frequency;
+    QueryPerformanceFrequency(&Frequency);
+    for (DWORD i = 0; i < QueueCount; ++i)
+    {
+        TUN_SESSION *Session = &Sessions[i];
+        Session->Capacity = Capacity;
+        Session->Flags = Flags;
+        Session->Wait.Frequency = Frequency.QuadPart;
+        Session->First = Sessions;
+        (VOID) InitializeCriticalSectionAndSpinCount(&Session->Receive.Lock, LOCK_SPIN_COUNT);
+        (VOID) InitializeCriticalSectionAndSpinCount(&Session->Send.Lock, LOCK_SPIN_COUNT);
+    }
+    Sessions->ActiveQueues = QueueCount;
+    return Sessions;
 cleanupHandle:
-    CloseHandle(Session->Handle);
-cleanupReceiveTailMoved:
-    CloseHandle(Session->Descriptor.Receive.TailMoved);
-cleanupSendTailMoved:
-    CloseHandle(Session->Descriptor.Send.TailMoved);
-cleanupAllocatedRegion:
+    CloseHandle(Sessions->Handle);
+cleanupQueues:
+    for (DWORD i = 0; i < QueuesCreated; ++i)
+    {
+        CloseHandle(Sessions[i].Descriptor.Rings.Receive.TailMoved);
+        CloseHandle(Sessions[i].Descriptor.Rings.Send.TailMoved);
+    }
     VirtualFree(AllocatedRegion, 0, MEM_RELEASE);
 cleanupRings:
-    Free(Session);
+    Free(Sessions);
 cleanup:
     SetLastError(LastError);
     return NULL;
 }
 
+WINTUN_START_SESSION_EX_FUNC WintunStartSessionEx;
+_Use_decl_annotations_
+TUN_SESSION *WINAPI
+WintunStartSessionEx(WINTUN_ADAPTER *Adapter, DWORD Capacity, DWORD Flags)
+{
+    return StartSessions(Adapter, Capacity, Flags, 1);
+}
+
+WINTUN_START_SESSION_FUNC WintunStartSession;
+_Use_decl_annotations_
+TUN_SESSION *WINAPI
+WintunStartSession(WINTUN_ADAPTER *Adapter, DWORD Capacity)
+{
+    return WintunStartSessionEx(Adapter, Capacity, 0);
+}
+
+WINTUN_START_SESSION_QUEUES_FUNC WintunStartSessionQueues;
+_Use_decl_annotations_
+BOOL WINAPI
+WintunStartSessionQueues(
+    WINTUN_ADAPTER *Adapter,
+    DWORD Capacity,
+    DWORD Flags,
+    DWORD QueueCount,
+    WINTUN_SESSION_HANDLE *Sessions)
+{
+    TUN_SESSION *Queues = StartSessions(Adapter, Capacity, Flags, QueueCount);
+    if (!Queues)
+        return FALSE;
+    for (DWORD i = 0; i < QueueCount; ++i)
+        Sessions[i] = &Queues[i];
+    return TRUE;
+}
+
 WINTUN_END_SESSION_FUNC WintunEndSession;
 _Use_decl_annotations_
 VOID WINAPI
@@ -158,11 +342,16 @@ WintunEndSession(TUN_SESSION *Session)
 {
     DeleteCriticalSection(&Session->Send.Lock);
     DeleteCriticalSection(&Session->Receive.Lock);
-    CloseHandle(Session->Handle);
-    CloseHandle(Session->Descriptor.Send.TailMoved);
-    CloseHandle(Session->Descriptor.Receive.TailMoved);
-    VirtualFree(Session->Descriptor.Send.Ring, 0, MEM_RELEASE);
-    Free(Session);
+    Free(Session->Send.Filter);
+    CloseHandle(Session->Descriptor.Rings.Send.TailMoved);
+    CloseHandle(Session->Descriptor.Rings.Receive.TailMoved);
+    TUN_SESSION *First = Session->First;
+    if (InterlockedDecrement(&First->ActiveQueues))
+        return;
+    CaptureFree(First->Capture);
+    CloseHandle(First->Handle);
+    VirtualFree(First->Descriptor.Rings.Send.Ring, 0, MEM_RELEASE);
+    Free(First);
 }
 
 WINTUN_GET_READ_WAIT_EVENT_FUNC WintunGetReadWaitEvent;
@@ -170,74 +359,436 @@ _Use_decl_annotations_
 HANDLE WINAPI
 WintunGetReadWaitEvent(TUN_SESSION *Session)
 {
-    return Session->Descriptor.Send.TailMoved;
+    return Session->Descriptor.Rings.Send.TailMoved;
 }
 
-#if defined(_DEBUG) && PACKET_DEBUG
-LONG PacketCounter = 0;
-#endif
+static ULONG
+HistogramBucket(_In_ ULONG Value)
+{
+    ULONG Index;
+    if (!_BitScanReverse(&Index, Value))
+        return 0;
+    return min(Index + 1, WINTUN_HISTOGRAM_BUCKETS - 1);
+}
 
-WINTUN_RECEIVE_PACKET_FUNC WintunReceivePacket;
+/* Counters have a single writer, so a plain load and store suffice. They only need to be untorn for readers. */
+static inline VOID
+CountAdd(_Inout_ ULONG64 *Counter, _In_ ULONG64 Value)
+{
+    WriteNoFence64((LONG64 *)Counter, ReadNoFence64((LONG64 *)Counter) + Value);
+}
+
+static inline ULONG64
+CountRead(_In_ const ULONG64 *Counter)
+{
+    return ReadNoFence64((const LONG64 *)Counter);
+}
+
+static VOID
+CountPacket(_Inout_ TUN_RING_STATISTICS *Stats, _In_ ULONG Size)
+{
+    CountAdd(&Stats->Packets, 1);
+    CountAdd(&Stats->Bytes, Size);
+    CountAdd(&Stats->PacketSizes[HistogramBucket(Size)], 1);
+}
+
+/* Counts a batch of packets whose sizes add up to Bytes. Callers tally those, and whether the sizes are Mixed, while
+ * taking the packets, so each counter is added to once per batch. Only a batch of mixed sizes takes another pass,
+ * adding to the size histogram once per run of packets of the same size. */
+static VOID
+CountPackets(
+    _Inout_ TUN_RING_STATISTICS *Stats,
+    _In_reads_(Count) const DWORD *PacketSizes,
+    _In_ ULONG Count,
+    _In_ ULONG Bytes,
+    _In_ ULONG Mixed)
+{
+    if (!Count)
+        return;
+    if (!Mixed)
+        CountAdd(&Stats->PacketSizes[HistogramBucket(PacketSizes[0])], Count);
+    else
+    {
+        for (ULONG i = 0, Run = 1; i < Count; ++i, ++Run)
+        {
+            if (i + 1 == Count || PacketSizes[i + 1] != PacketSizes[i])
+            {
+                CountAdd(&Stats->PacketSizes[HistogramBucket(PacketSizes[i])], Run);
+                Run = 0;
+            }
+        }
+    }
+    CountAdd(&Stats->Packets, Count);
+    CountAdd(&Stats->Bytes, Bytes);
+}
+
+static VOID
+CountBatch(_Inout_ TUN_RING_STATISTICS *Stats, _In_ ULONG Count, _In_ ULONG Occupancy)
+{
+    if (Count)
+        CountAdd(&Stats->BatchSizes[HistogramBucket(Count)], 1);
+    if (Occupancy > Stats->HighWater)
+        WriteULongNoFence(&Stats->HighWater, Occupancy);
+}
+
+/* Copies the counters of one ring side. Without the side's lock, as with WINTUN_SESSION_SINGLE_CONSUMER, each counter
+ * is read whole, but they may be a few packets apart from each other. */
+static VOID
+ReadRingStatistics(
+    _In_ const TUN_RING_STATISTICS *Stats,
+    _Out_ DWORD64 *Packets,
+    _Out_ DWORD64 *Bytes,
+    _Out_ DWORD64 *Failures,
+    _Out_ DWORD *HighWater,
+    _Out_writes_(WINTUN_HISTOGRAM_BUCKETS) DWORD64 *PacketSizes,
+    _Out_writes_(WINTUN_HISTOGRAM_BUCKETS) DWORD64 *BatchSizes)
+{
+    *Packets = CountRead(&Stats->Packets);
+    *Bytes = CountRead(&Stats->Bytes);
+    *Failures = CountRead(&Stats->Failures);
+    *HighWater = ReadULongNoFence(&Stats->HighWater);
+    for (ULONG i = 0; i < WINTUN_HISTOGRAM_BUCKETS; ++i)
+    {
+        PacketSizes[i] = CountRead(&Stats->PacketSizes[i]);
+        BatchSizes[i] = CountRead(&Stats->BatchSizes[i]);
+    }
+}
+
+static TUN_RING_STATUS
+PeekSendRing(_In_ TUN_SESSION *Session)
+{
+    ULONG BuffTail = TUN_RING_READ_ACQUIRE(&Session->Descriptor.Rings.Send.Ring->Tail);
+    if (BuffTail >= Session->Capacity)
+        return TUN_RING_EOF;
+    return BuffTail != ReadULongNoFence(&Session->Send.Head) ? TUN_RING_OK : TUN_RING_EMPTY;
+}
+
+static VOID
+RecordArrivalGap(_Inout_ TUN_SESSION *Session, _In_ LONG64 Gap)
+{
+    /* Concurrent waiters may lose each other's samples. That only slows the average down a bit. */
+    LONG64 AverageGap = ReadNoFence64(&Session->Wait.AverageGap);
+    WriteNoFence64(&Session->Wait.AverageGap, TunWaitAverageGap(AverageGap, Gap));
+}
+
+WINTUN_WAIT_FOR_PACKETS_FUNC WintunWaitForPackets;
 _Use_decl_annotations_
-BYTE *WINAPI
-WintunReceivePacket(TUN_SESSION *Session, DWORD *PacketSize)
+BOOL WINAPI
+WintunWaitForPackets(TUN_SESSION *Session, DWORD Timeout, DWORD SpinBudget)
 {
     DWORD LastError;
+    LARGE_INTEGER Start, Now;
+    QueryPerformanceCounter(&Start);
+    TUN_WAIT Wait;
+    TunWaitBegin(
+        &Wait, Session->Wait.Frequency, Start.QuadPart, Timeout, SpinBudget, ReadNoFence64(&Session->Wait.AverageGap));
+    for (;;)
+    {
+        TUN_RING_STATUS Status = PeekSendRing(Session);
+        if (Status == TUN_RING_EOF)
+        {
+            LastError = ERROR_HANDLE_EOF;
+            goto cleanup;
+        }
+        QueryPerformanceCounter(&Now);
+        if (Status == TUN_RING_OK)
+        {
+            /* A packet that was already there on the first look did not need spinning for. */
+            if (Wait.Spun)
+                InterlockedIncrementNoFence64(&Session->Wait.Spins);
+            RecordArrivalGap(Session, Now.QuadPart - Start.QuadPart);
+            return TRUE;
+        }
+        if (!TunWaitSpin(&Wait, Now.QuadPart))
+            break;
+    }
+
+    InterlockedIncrementNoFence64(&Session->Wait.Blocks);
+    for (;;)
+    {
+        DWORD Result =
+            WaitForSingleObject(Session->Descriptor.Rings.Send.TailMoved, TunWaitRemaining(&Wait, Now.QuadPart));
+        if (Result == WAIT_FAILED)
+        {
+            LastError = LOG_LAST_ERROR(L"Failed to wait for read-wait event");
+            goto cleanup;
+        }
+        TUN_RING_STATUS Status = PeekSendRing(Session);
+        if (Status == TUN_RING_EOF)
+        {
+            LastError = ERROR_HANDLE_EOF;
+            goto cleanup;
+        }
+        QueryPerformanceCounter(&Now);
+        if (Status == TUN_RING_OK)
+        {
+            RecordArrivalGap(Session, Now.QuadPart - Start.QuadPart);
+            return TRUE;
+        }
+        /* The event is auto-reset and may have been left signaled by packets that were already consumed. */
+        if (Result == WAIT_TIMEOUT)
+        {
+            LastError = ERROR_TIMEOUT;
+            goto cleanup;
+        }
+    }
+cleanup:
+    SetLastError(LastError);
+    return FALSE;
+}
+
+/* With WINTUN_SESSION_SINGLE_CONSUMER, the client guarantees receive and release calls never overlap, so the send ring
+ * cursors are only touched by one thread at a time and only the ring head and tail need ordering. */
+static inline VOID
+LockSendRing(_Inout_ TUN_SESSION *Session)
+{
+    if (!(Session->Flags & WINTUN_SESSION_SINGLE_CONSUMER))
+        EnterCriticalSection(&Session->Send.Lock);
+}
+
+static inline VOID
+UnlockSendRing(_Inout_ TUN_SESSION *Session)
+{
+    if (!(Session->Flags & WINTUN_SESSION_SINGLE_CONSUMER))
+        LeaveCriticalSection(&Session->Send.Lock);
+}
+
+WINTUN_GET_SESSION_FLAGS_FUNC WintunGetSessionFlags;
+_Use_decl_annotations_
+DWORD WINAPI
+WintunGetSessionFlags(TUN_SESSION *Session)
+{
+    return Session->Flags;
+}
+
+WINTUN_GET_SESSION_STATISTICS_FUNC WintunGetSessionStatistics;
+_Use_decl_annotations_
+VOID WINAPI
+WintunGetSessionStatistics(TUN_SESSION *Session, WINTUN_SESSION_STATISTICS *Statistics)
+{
+    /* With WINTUN_SESSION_SINGLE_CONSUMER, the consumer counts without the lock, which then only keeps concurrent
+     * statistics readers apart. */
     EnterCriticalSection(&Session->Send.Lock);
-    if (Session->Send.Head >= Session->Capacity)
+    ReadRingStatistics(
+        &Session->Send.Stats,
+        &Statistics->ReceivedPackets,
+        &Statistics->ReceivedBytes,
+        &Statistics->ReceiveEmptyPolls,
+        &Statistics->ReceiveRingHighWater,
+        Statistics->ReceivedPacketSizes,
+        Statistics->ReceiveBatchSizes);
+    Statistics->FilteredPackets = CountRead(&Session->Send.Filtered);
+    LeaveCriticalSection(&Session->Send.Lock);
+
+    EnterCriticalSection(&Session->Receive.Lock);
+    ReadRingStatistics(
+        &Session->Receive.Stats,
+        &Statistics->SentPackets,
+        &Statistics->SentBytes,
+        &Statistics->SendOverflows,
+        &Statistics->SendRingHighWater,
+        Statistics->SentPacketSizes,
+        Statistics->SendBatchSizes);
+    LeaveCriticalSection(&Session->Receive.Lock);
+
+    Statistics->WaitSpins = ReadNoFence64(&Session->Wait.Spins);
+    Statistics->WaitBlocks = ReadNoFence64(&Session->Wait.Blocks);
+}
+
+WINTUN_GET_DRIVER_STATISTICS_FUNC WintunGetDriverStatistics;
+_Use_decl_annotations_
+BOOL WINAPI
+WintunGetDriverStatistics(TUN_SESSION *Session, WINTUN_DRIVER_STATISTICS *Statistics)
+{
+    if (!TunStatsRead(Session->Descriptor.Statistics, (LONG64 *)Statistics))
     {
-        LastError = ERROR_HANDLE_EOF;
-        goto cleanup;
+        SetLastError(ERROR_NOT_SUPPORTED);
+        return FALSE;
     }
-    const ULONG BuffTail = ReadULongAcquire(&Session->Descriptor.Send.Ring->Tail);
-    if (BuffTail >= Session->Capacity)
+    return TRUE;
+}
+
+/* Every header is passed by the release cursor exactly once, so the walk is amortized O(1) per released packet. The
+ * ring head shares a cache line with the tail the driver keeps polling, so it is only stored when it actually moves. */
+static VOID
+PublishSendHead(_Inout_ TUN_SESSION *Session)
+{
+    const ULONG HeadRelease = TunRingAdvanceReleased(
+        Session->Descriptor.Rings.Send.Ring,
+        Session->Capacity,
+        Session->Send.HeadRelease,
+        &Session->Send.PacketsToRelease);
+    if (HeadRelease == Session->Send.HeadRelease)
+        return;
+    Session->Send.HeadRelease = HeadRelease;
+    TUN_RING_WRITE_RELEASE(&Session->Descriptor.Rings.Send.Ring->Head, HeadRelease);
+}
+
+static int
+AcceptSendPacket(_In_ const void *Filter, _In_reads_bytes_(Size) const UCHAR *Data, _In_ ULONG Size)
+{
+    return TunFilterRun(Filter, Data, Size);
+}
+
+/* Takes up to MaxCount packets off the send ring up to BuffTail, marking the ones the receive filter rejects on the way
+ * as released. Returns the number of packets taken, and sets *Status to what ended the batch. */
+static DWORD
+TakeSendPackets(
+    _Inout_ TUN_SESSION *Session,
+    _In_ ULONG BuffTail,
+    _Out_writes_to_(MaxCount, return) BYTE **Packets,
+    _Out_writes_to_(MaxCount, return) DWORD *PacketSizes,
+    _In_ DWORD MaxCount,
+    _Out_ TUN_RING_STATUS *Status,
+    _Inout_ BOOL *Filtered)
+{
+    TUN_RING_BATCH Batch;
+    ULONG Skipped = 0;
+    TunRingBatchBegin(&Batch, Session->Send.Head, BuffTail, MaxCount);
+    *Status = TunRingBatchTake(
+        &Batch,
+        Session->Descriptor.Rings.Send.Ring,
+        Session->Capacity,
+        !!(Session->Flags & WINTUN_SESSION_GSO),
+        Session->Send.Filter ? AcceptSendPacket : NULL,
+        Session->Send.Filter,
+        Packets,
+        PacketSizes,
+        &Skipped);
+    Session->Send.Head = Batch.Head;
+    Session->Send.PacketsToRelease += Batch.Count + Skipped;
+    CountPackets(&Session->Send.Stats, PacketSizes, Batch.Count, Batch.Bytes, Batch.Mixed);
+    if (Skipped)
     {
-        LastError = ERROR_HANDLE_EOF;
-        goto cleanup;
+        CountAdd(&Session->Send.Filtered, Skipped);
+        *Filtered = TRUE;
     }
-    if (Session->Send.Head == BuffTail)
+    return Batch.Count;
+}
+
+C_ASSERT(sizeof(WINTUN_FILTER_INSTRUCTION) == sizeof(TUN_FILTER_INSN));
+C_ASSERT(offsetof(WINTUN_FILTER_INSTRUCTION, Value) == offsetof(TUN_FILTER_INSN, Value));
+C_ASSERT(offsetof(WINTUN_FILTER_INSTRUCTION, Address) == offsetof(TUN_FILTER_INSN, Address));
+C_ASSERT(WINTUN_FILTER_JUMP_PREFIX == TUN_FILTER_OP_JPREFIX);
+C_ASSERT(WINTUN_FILTER_DESTINATION_ADDRESS6 == TUN_FILTER_FIELD_DESTINATION_ADDRESS6);
+C_ASSERT(WINTUN_MAX_FILTER_INSTRUCTIONS == TUN_FILTER_MAX_INSNS);
+
+WINTUN_SET_RECEIVE_FILTER_FUNC WintunSetReceiveFilter;
+_Use_decl_annotations_
+BOOL WINAPI
+WintunSetReceiveFilter(TUN_SESSION *Session, const WINTUN_FILTER_INSTRUCTION *Program, DWORD Count)
+{
+    TUN_FILTER_PROGRAM *Filter = NULL;
+    if (Count)
     {
-        LastError = ERROR_NO_MORE_ITEMS;
-        goto cleanup;
+        if (Count > WINTUN_MAX_FILTER_INSTRUCTIONS)
+        {
+            SetLastError(LOG_ERROR(ERROR_INVALID_PARAMETER, L"Filter program too long (%u instructions)", Count));
+            return FALSE;
+        }
+        Filter = Alloc(TUN_FILTER_PROGRAM_SIZE(Count));
+        if (!Filter)
+            return FALSE;
+        if (!TunFilterCompile((const TUN_FILTER_INSN *)Program, Count, Filter))
+        {
+            Free(Filter);
+            SetLastError(LOG_ERROR(ERROR_INVALID_PARAMETER, L"Invalid filter program"));
+            return FALSE;
+        }
     }
-    const ULONG BuffContent = TUN_RING_WRAP(BuffTail - Session->Send.Head, Session->Capacity);
-    if (BuffContent < sizeof(TUN_PACKET))
+    LockSendRing(Session);
+    TUN_FILTER_PROGRAM *OldFilter = Session->Send.Filter;
+    Session->Send.Filter = Filter;
+    UnlockSendRing(Session);
+    Free(OldFilter);
+    return TRUE;
+}
+
+/* Packets are captured outside the ring locks, while the client owns them: after receiving, and before sending. */
+static inline VOID
+CaptureSessionPacket(
+    _In_ TUN_SESSION *Session,
+    _In_reads_bytes_(PacketSize) const BYTE *Packet,
+    _In_ DWORD PacketSize,
+    _In_ DWORD Flags)
+{
+    CAPTURE *Capture = ReadPointerNoFence((PVOID *)&Session->First->Capture);
+    if (Capture)
+        CapturePacket(Capture, Packet, PacketSize, Flags);
+}
+
+WINTUN_SET_SESSION_CAPTURE_FUNC WintunSetSessionCapture;
+_Use_decl_annotations_
+BOOL WINAPI
+WintunSetSessionCapture(TUN_SESSION *Session, LPCWSTR Path, DWORD SnapLength, DWORD64 MaxFileSize, DWORD MaxFiles)
+{
+    TUN_SESSION *First = Session->First;
+    CAPTURE *Capture = ReadPointerAcquire((PVOID *)&First->Capture);
+    if (!Path)
     {
-        LastError = ERROR_INVALID_DATA;
-        goto cleanup;
+        if (Capture)
+            CaptureStop(Capture);
+        return TRUE;
     }
-    TUN_PACKET *BuffPacket = (TUN_PACKET *)&Session->Descriptor.Send.Ring->Data[Session->Send.Head];
-    if (BuffPacket->Size > WINTUN_MAX_IP_PACKET_SIZE)
+    if (!Capture)
     {
-        LastError = ERROR_INVALID_DATA;
-        goto cleanup;
+        CAPTURE *NewCapture = CaptureCreate();
+        if (!NewCapture)
+            return FALSE;
+        Capture = InterlockedCompareExchangePointer((PVOID *)&First->Capture, NewCapture, NULL);
+        if (Capture)
+            CaptureFree(NewCapture);
+        else
+            Capture = NewCapture;
     }
-    const ULONG AlignedPacketSize = TUN_ALIGN(sizeof(TUN_PACKET) + BuffPacket->Size);
-    if (AlignedPacketSize > BuffContent)
+    return CaptureStart(Capture, Path, SnapLength, MaxFileSize, MaxFiles);
+}
+
+static DWORD
+RingStatusToError(_In_ TUN_RING_STATUS Status)
+{
+    switch (Status)
     {
-        LastError = ERROR_INVALID_DATA;
+    case TUN_RING_OK:
+        return ERROR_SUCCESS;
+    case TUN_RING_EMPTY:
+        return ERROR_NO_MORE_ITEMS;
+    case TUN_RING_EOF:
+        return ERROR_HANDLE_EOF;
+    default:
+        return ERROR_INVALID_DATA;
+    }
+}
+
+WINTUN_RECEIVE_PACKET_FUNC WintunReceivePacket;
+_Use_decl_annotations_
+BYTE *WINAPI
+WintunReceivePacket(TUN_SESSION *Session, DWORD *PacketSize)
+{
+    DWORD LastError;
+    BOOL Filtered = FALSE;
+    LockSendRing(Session);
+    const ULONG BuffTail = TUN_RING_READ_ACQUIRE(&Session->Descriptor.Rings.Send.Ring->Tail);
+    BYTE *Packet;
+    TUN_RING_STATUS Status;
+    const ULONG Occupancy = TunRingContent(Session->Send.HeadRelease, BuffTail, Session->Capacity);
+    if (!TakeSendPackets(Session, BuffTail, &Packet, PacketSize, 1, &Status, &Filtered))
+    {
+        LastError = RingStatusToError(Status);
+        if (Status == TUN_RING_EMPTY)
+            CountAdd(&Session->Send.Stats.Failures, 1);
         goto cleanup;
     }
-    *PacketSize = BuffPacket->Size;
-    BYTE *Packet = BuffPacket->Data;
-    Session->Send.Head = TUN_RING_WRAP(Session->Send.Head + AlignedPacketSize, Session->Capacity);
-    Session->Send.PacketsToRelease++;
-
-#if defined(_DEBUG) && PACKET_DEBUG
-    InterlockedIncrement(&PacketCounter);
-    WCHAR FileName[MAX_PATH] = { 0 };
-    wsprintfW(FileName, L"%d-recv.packet", PacketCounter);
-    HANDLE File = CreateFileW(FileName, GENERIC_READ | GENERIC_WRITE,
-        FILE_SHARE_WRITE | FILE_SHARE_READ,
-        NULL, CREATE_ALWAYS, 0, NULL);
-    DWORD Written = 0;
-    WriteFile(File, Packet, *PacketSize, &Written, NULL);
-    CloseHandle(File);
-#endif
-    LeaveCriticalSection(&Session->Send.Lock);
+    CountBatch(&Session->Send.Stats, 1, Occupancy);
+    if (Filtered)
+        PublishSendHead(Session);
+    UnlockSendRing(Session);
+    CaptureSessionPacket(Session, Packet, *PacketSize, TUN_CAPTURE_OUTBOUND);
     return Packet;
 cleanup:
-    LeaveCriticalSection(&Session->Send.Lock);
+    if (Filtered)
+        PublishSendHead(Session);
+    UnlockSendRing(Session);
     SetLastError(LastError);
     return NULL;
 }
@@ -247,20 +798,102 @@ _Use_decl_annotations_
 VOID WINAPI
 WintunReleaseReceivePacket(TUN_SESSION *Session, const BYTE *Packet)
 {
-    EnterCriticalSection(&Session->Send.Lock);
+    LockSendRing(Session);
     TUN_PACKET *ReleasedBuffPacket = (TUN_PACKET *)(Packet - offsetof(TUN_PACKET, Data));
     ReleasedBuffPacket->Size |= TUN_PACKET_RELEASE;
-    while (Session->Send.PacketsToRelease)
+    /* Packets released out of order only get marked: the head cannot move until the oldest pending packet is back. */
+    if (ReleasedBuffPacket == TunRingPacketAt(Session->Descriptor.Rings.Send.Ring, Session->Send.HeadRelease))
+        PublishSendHead(Session);
+    UnlockSendRing(Session);
+}
+
+WINTUN_RECEIVE_PACKETS_FUNC WintunReceivePackets;
+_Use_decl_annotations_
+DWORD WINAPI
+WintunReceivePackets(TUN_SESSION *Session, BYTE **Packets, DWORD *PacketSizes, DWORD MaxCount)
+{
+    if (!MaxCount)
     {
-        const TUN_PACKET *BuffPacket = (TUN_PACKET *)&Session->Descriptor.Send.Ring->Data[Session->Send.HeadRelease];
-        if ((BuffPacket->Size & TUN_PACKET_RELEASE) == 0)
-            break;
-        const ULONG AlignedPacketSize = TUN_ALIGN(sizeof(TUN_PACKET) + (BuffPacket->Size & ~TUN_PACKET_RELEASE));
-        Session->Send.HeadRelease = TUN_RING_WRAP(Session->Send.HeadRelease + AlignedPacketSize, Session->Capacity);
-        Session->Send.PacketsToRelease--;
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return 0;
     }
-    WriteULongRelease(&Session->Descriptor.Send.Ring->Head, Session->Send.HeadRelease);
-    LeaveCriticalSection(&Session->Send.Lock);
+    BOOL Filtered = FALSE;
+    TUN_RING_STATUS Status;
+    LockSendRing(Session);
+    const ULONG BuffTail = TUN_RING_READ_ACQUIRE(&Session->Descriptor.Rings.Send.Ring->Tail);
+    const ULONG Occupancy = TunRingContent(Session->Send.HeadRelease, BuffTail, Session->Capacity);
+    /* A batch cut short by an invalid packet still returns the packets before it. The head stays on the invalid one,
+     * so the next call reports it. */
+    const DWORD Count = TakeSendPackets(Session, BuffTail, Packets, PacketSizes, MaxCount, &Status, &Filtered);
+    if (!Count && Status == TUN_RING_EMPTY)
+        CountAdd(&Session->Send.Stats.Failures, 1);
+    CountBatch(&Session->Send.Stats, Count, Occupancy);
+    if (Filtered)
+        PublishSendHead(Session);
+    UnlockSendRing(Session);
+    for (DWORD i = 0; i < Count; ++i)
+        CaptureSessionPacket(Session, Packets[i], PacketSizes[i], TUN_CAPTURE_OUTBOUND);
+    if (!Count)
+        SetLastError(RingStatusToError(Status));
+    return Count;
+}
+
+WINTUN_RELEASE_RECEIVE_PACKETS_FUNC WintunReleaseReceivePackets;
+_Use_decl_annotations_
+VOID WINAPI
+WintunReleaseReceivePackets(TUN_SESSION *Session, const BYTE **Packets, DWORD Count)
+{
+    LockSendRing(Session);
+    for (DWORD i = 0; i < Count; ++i)
+    {
+        TUN_PACKET *ReleasedBuffPacket = (TUN_PACKET *)(Packets[i] - offsetof(TUN_PACKET, Data));
+        ReleasedBuffPacket->Size |= TUN_PACKET_RELEASE;
+    }
+    PublishSendHead(Session);
+    UnlockSendRing(Session);
+}
+
+WINTUN_GET_PACKET_MSS_FUNC WintunGetPacketMss;
+_Use_decl_annotations_
+DWORD WINAPI
+WintunGetPacketMss(TUN_SESSION *Session, const BYTE *Packet)
+{
+    /* Without WINTUN_SESSION_GSO, a super-packet never gets past TakeSendPackets, so asking is a client bug. */
+    if (!(Session->Flags & WINTUN_SESSION_GSO))
+    {
+        SetLastError(ERROR_NOT_SUPPORTED);
+        return 0;
+    }
+    const TUN_PACKET *BuffPacket = (const TUN_PACKET *)(Packet - offsetof(TUN_PACKET, Data));
+    DWORD Mss = TUN_PACKET_GSO_MSS(BuffPacket->Size);
+    if (!Mss)
+        SetLastError(ERROR_SUCCESS);
+    return Mss;
+}
+
+WINTUN_SEGMENT_PACKET_FUNC WintunSegmentPacket;
+_Use_decl_annotations_
+DWORD WINAPI
+WintunSegmentPacket(const BYTE *Packet, DWORD PacketSize, DWORD Mss, DWORD Index, BYTE *Segment, DWORD SegmentSize)
+{
+    TUN_GSO Gso;
+    if (PacketSize > WINTUN_MAX_IP_PACKET_SIZE || !TunGsoParse(Packet, PacketSize, Mss, &Gso))
+    {
+        SetLastError(ERROR_INVALID_DATA);
+        return 0;
+    }
+    if (Index >= Gso.Segments)
+    {
+        SetLastError(ERROR_NO_MORE_ITEMS);
+        return 0;
+    }
+    const DWORD Offset = Index * Mss;
+    if (SegmentSize < Gso.HeaderSize + min(Gso.PayloadSize - Offset, Mss))
+    {
+        SetLastError(ERROR_INSUFFICIENT_BUFFER);
+        return 0;
+    }
+    return TunGsoSegment(Packet, &Gso, Index, Segment);
 }
 
 WINTUN_ALLOCATE_SEND_PACKET_FUNC WintunAllocateSendPacket;
@@ -276,23 +909,26 @@ WintunAllocateSendPacket(TUN_SESSION *Session, DWORD PacketSize)
         goto cleanup;
     }
     const ULONG AlignedPacketSize = TUN_ALIGN(sizeof(TUN_PACKET) + PacketSize);
-    const ULONG BuffHead = ReadULongAcquire(&Session->Descriptor.Receive.Ring->Head);
+    const ULONG BuffHead = TUN_RING_READ_ACQUIRE(&Session->Descriptor.Rings.Receive.Ring->Head);
     if (BuffHead >= Session->Capacity)
     {
         LastError = ERROR_HANDLE_EOF;
         goto cleanup;
     }
-    const ULONG BuffSpace = TUN_RING_WRAP(BuffHead - Session->Receive.Tail - TUN_ALIGNMENT, Session->Capacity);
+    const ULONG BuffSpace = TunRingSpace(BuffHead, Session->Receive.Tail, Session->Capacity);
     if (AlignedPacketSize > BuffSpace)
     {
         LastError = ERROR_BUFFER_OVERFLOW;
+        CountAdd(&Session->Receive.Stats.Failures, 1);
         goto cleanup;
     }
-    TUN_PACKET *BuffPacket = (TUN_PACKET *)&Session->Descriptor.Receive.Ring->Data[Session->Receive.Tail];
+    TUN_PACKET *BuffPacket = TunRingPacketAt(Session->Descriptor.Rings.Receive.Ring, Session->Receive.Tail);
     BuffPacket->Size = PacketSize | TUN_PACKET_RELEASE;
     BYTE *Packet = BuffPacket->Data;
     Session->Receive.Tail = TUN_RING_WRAP(Session->Receive.Tail + AlignedPacketSize, Session->Capacity);
     Session->Receive.PacketsToRelease++;
+    CountPacket(&Session->Receive.Stats, PacketSize);
+    CountBatch(&Session->Receive.Stats, 1, TunRingContent(BuffHead, Session->Receive.Tail, Session->Capacity));
     LeaveCriticalSection(&Session->Receive.Lock);
     return Packet;
 cleanup:
@@ -301,43 +937,98 @@ cleanup:
     return NULL;
 }
 
+static VOID
+PublishReceiveTail(_Inout_ TUN_SESSION *Session)
+{
+    Session->Receive.TailRelease = TunRingAdvanceCommitted(
+        Session->Descriptor.Rings.Receive.Ring,
+        Session->Capacity,
+        Session->Receive.TailRelease,
+        &Session->Receive.PacketsToRelease);
+    if (Session->Descriptor.Rings.Receive.Ring->Tail != Session->Receive.TailRelease)
+    {
+        TUN_RING_WRITE_RELEASE(&Session->Descriptor.Rings.Receive.Ring->Tail, Session->Receive.TailRelease);
+        if (TUN_RING_READ_ACQUIRE_LONG(&Session->Descriptor.Rings.Receive.Ring->Alertable))
+            SetEvent(Session->Descriptor.Rings.Receive.TailMoved);
+    }
+}
+
 WINTUN_SEND_PACKET_FUNC WintunSendPacket;
 _Use_decl_annotations_
 VOID WINAPI
 WintunSendPacket(TUN_SESSION *Session, const BYTE *Packet)
 {
-    EnterCriticalSection(&Session->Receive.Lock);
     TUN_PACKET *ReleasedBuffPacket = (TUN_PACKET *)(Packet - offsetof(TUN_PACKET, Data));
+    CaptureSessionPacket(Session, Packet, ReleasedBuffPacket->Size & TUN_PACKET_SIZE_MASK, TUN_CAPTURE_INBOUND);
+    EnterCriticalSection(&Session->Receive.Lock);
     ReleasedBuffPacket->Size &= ~TUN_PACKET_RELEASE;
+    PublishReceiveTail(Session);
+    LeaveCriticalSection(&Session->Receive.Lock);
+}
 
-#if defined(_DEBUG) && PACKET_DEBUG
-    InterlockedIncrement(&PacketCounter);
-    WCHAR FileName[MAX_PATH] = { 0 };
-    wsprintfW(FileName, L"%d-send.packet", PacketCounter);
-    HANDLE File = CreateFileW(FileName, GENERIC_READ | GENERIC_WRITE,
-        FILE_SHARE_WRITE | FILE_SHARE_READ,
-        NULL, CREATE_ALWAYS, 0, NULL);
-    DWORD Written = 0;
-    WriteFile(File, Packet, ReleasedBuffPacket->Size, &Written, NULL);
-    CloseHandle(File);
-#endif
-
-    while (Session->Receive.PacketsToRelease)
-    {
-        const TUN_PACKET *BuffPacket =
-            (TUN_PACKET *)&Session->Descriptor.Receive.Ring->Data[Session->Receive.TailRelease];
-        if (BuffPacket->Size & TUN_PACKET_RELEASE)
+WINTUN_ALLOCATE_SEND_PACKETS_FUNC WintunAllocateSendPackets;
+_Use_decl_annotations_
+DWORD WINAPI
+WintunAllocateSendPackets(TUN_SESSION *Session, const DWORD *PacketSizes, BYTE **Packets, DWORD Count)
+{
+    DWORD LastError = ERROR_SUCCESS, Allocated = 0;
+    ULONG Bytes = 0, Mixed = 0;
+    EnterCriticalSection(&Session->Receive.Lock);
+    if (Session->Receive.Tail >= Session->Capacity)
+    {
+        LastError = ERROR_HANDLE_EOF;
+        goto cleanup;
+    }
+    const ULONG BuffHead = TUN_RING_READ_ACQUIRE(&Session->Descriptor.Rings.Receive.Ring->Head);
+    if (BuffHead >= Session->Capacity)
+    {
+        LastError = ERROR_HANDLE_EOF;
+        goto cleanup;
+    }
+    ULONG BuffSpace = TunRingSpace(BuffHead, Session->Receive.Tail, Session->Capacity);
+    for (; Allocated < Count; ++Allocated)
+    {
+        const ULONG AlignedPacketSize = TUN_ALIGN(sizeof(TUN_PACKET) + PacketSizes[Allocated]);
+        if (AlignedPacketSize > BuffSpace)
+        {
+            LastError = ERROR_BUFFER_OVERFLOW;
+            CountAdd(&Session->Receive.Stats.Failures, 1);
             break;
-        const ULONG AlignedPacketSize = TUN_ALIGN(sizeof(TUN_PACKET) + BuffPacket->Size);
-        Session->Receive.TailRelease =
-            TUN_RING_WRAP(Session->Receive.TailRelease + AlignedPacketSize, Session->Capacity);
-        Session->Receive.PacketsToRelease--;
+        }
+        TUN_PACKET *BuffPacket = TunRingPacketAt(Session->Descriptor.Rings.Receive.Ring, Session->Receive.Tail);
+        BuffPacket->Size = PacketSizes[Allocated] | TUN_PACKET_RELEASE;
+        Packets[Allocated] = BuffPacket->Data;
+        Session->Receive.Tail = TUN_RING_WRAP(Session->Receive.Tail + AlignedPacketSize, Session->Capacity);
+        Session->Receive.PacketsToRelease++;
+        BuffSpace -= AlignedPacketSize;
+        Bytes += PacketSizes[Allocated];
+        Mixed |= PacketSizes[Allocated] ^ PacketSizes[0];
+    }
+    CountPackets(&Session->Receive.Stats, PacketSizes, Allocated, Bytes, Mixed);
+    CountBatch(&Session->Receive.Stats, Allocated, TunRingContent(BuffHead, Session->Receive.Tail, Session->Capacity));
+cleanup:
+    LeaveCriticalSection(&Session->Receive.Lock);
+    if (!Allocated)
+        SetLastError(LastError);
+    return Allocated;
+}
+
+WINTUN_SEND_PACKETS_FUNC WintunSendPackets;
+_Use_decl_annotations_
+VOID WINAPI
+WintunSendPackets(TUN_SESSION *Session, const BYTE **Packets, DWORD Count)
+{
+    for (DWORD i = 0; i < Count; ++i)
+    {
+        const TUN_PACKET *BuffPacket = (const TUN_PACKET *)(Packets[i] - offsetof(TUN_PACKET, Data));
+        CaptureSessionPacket(Session, Packets[i], BuffPacket->Size & TUN_PACKET_SIZE_MASK, TUN_CAPTURE_INBOUND);
     }
-    if (Session->Descriptor.Receive.Ring->Tail != Session->Receive.TailRelease)
+    EnterCriticalSection(&Session->Receive.Lock);
+    for (DWORD i = 0; i < Count; ++i)
     {
-        WriteULongRelease(&Session->Descriptor.Receive.Ring->Tail, Session->Receive.TailRelease);
-        if (ReadAcquire(&Session->Descriptor.Receive.Ring->Alertable))
-            SetEvent(Session->Descriptor.Receive.TailMoved);
+        TUN_PACKET *ReleasedBuffPacket = (TUN_PACKET *)(Packets[i] - offsetof(TUN_PACKET, Data));
+        ReleasedBuffPacket->Size &= ~TUN_PACKET_RELEASE;
     }
+    PublishReceiveTail(Session);
     LeaveCriticalSection(&Session->Receive.Lock);
 }
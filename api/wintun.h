@@ -141,9 +141,11 @@ typedef VOID(CALLBACK *WINTUN_LOGGER_CALLBACK)(
 /**
  * Sets logger callback function.
  *
- * @param NewLogger     Pointer to callback function to use as a new global logger. NewLogger may be called from various
- *                      threads concurrently. Should the logging require serialization, you must handle serialization in
- *                      NewLogger. Set to NULL to disable.
+ * @param NewLogger     Pointer to callback function to use as a new global logger. Messages are queued and passed to
+ *                      NewLogger in order from a background thread, so logging never waits for NewLogger. Messages
+ *                      queued before the call may still be passed to the previous logger. While the queue is full, or
+ *                      once one source logs more than 20 messages in a second, messages are left out and a warning
+ *                      tells how many. Set to NULL to disable.
  */
 typedef VOID(WINAPI WINTUN_SET_LOGGER_FUNC)(_In_ WINTUN_LOGGER_CALLBACK NewLogger);
 
@@ -178,6 +180,86 @@ _Return_type_success_(return != NULL)
 _Post_maybenull_
 WINTUN_SESSION_HANDLE(WINAPI WINTUN_START_SESSION_FUNC)(_In_ WINTUN_ADAPTER_HANDLE Adapter, _In_ DWORD Capacity);
 
+/**
+ * Session flag: receive and release calls are never made concurrently. The send ring lock is skipped and packets are
+ * received with plain acquire/release loads and stores only.
+ */
+#define WINTUN_SESSION_SINGLE_CONSUMER 0x1
+
+/**
+ * Session flag: the adapter offers large send offload, and packets received may be TCP super-packets of up to
+ * WINTUN_MAX_IP_PACKET_SIZE bytes. Check each with WintunGetPacketMss and cut it with WintunSegmentPacket.
+ */
+#define WINTUN_SESSION_GSO 0x2
+
+/**
+ * Session flag: allocate the rings from large pages, so that accessing them takes fewer TLB entries. Needs a process
+ * token holding the privilege to lock pages in memory (SeLockMemoryPrivilege), which the session enables, and enough
+ * contiguous physical memory. Otherwise, the session falls back to regular pages and WintunGetSessionFlags reports the
+ * flag cleared. Ring memory is rounded up to the large page size.
+ */
+#define WINTUN_SESSION_LARGE_PAGES 0x4
+
+/**
+ * Starts Wintun session with additional options.
+ *
+ * @param Adapter       Adapter handle obtained with WintunOpenAdapter or WintunCreateAdapter
+ *
+ * @param Capacity      Rings capacity. Must be between WINTUN_MIN_RING_CAPACITY and WINTUN_MAX_RING_CAPACITY (incl.)
+ *                      Must be a power of two.
+ *
+ * @param Flags         Combination of WINTUN_SESSION_* flags. With WINTUN_SESSION_SINGLE_CONSUMER, the client must
+ *                      serialize all calls to WintunReceivePacket, WintunReceivePackets, WintunReleaseReceivePacket and
+ *                      WintunReleaseReceivePackets itself, typically by making them from a single thread. With
+ *                      WINTUN_SESSION_GSO, the client must segment super-packets itself. WINTUN_SESSION_LARGE_PAGES is
+ *                      a request; see WintunGetSessionFlags for its outcome.
+ *
+ * @return Wintun session handle. Must be released with WintunEndSession. If the function fails, the return value is
+ *         NULL. To get extended error information, call GetLastError.
+ */
+typedef _Must_inspect_result_
+_Return_type_success_(return != NULL)
+_Post_maybenull_
+WINTUN_SESSION_HANDLE(WINAPI WINTUN_START_SESSION_EX_FUNC)
+(_In_ WINTUN_ADAPTER_HANDLE Adapter, _In_ DWORD Capacity, _In_ DWORD Flags);
+
+/**
+ * Maximum number of queues per session.
+ */
+#define WINTUN_MAX_QUEUES 16
+
+/**
+ * Starts Wintun session with several queues, each a ring pair with its own lock and kernel receive thread, so traffic
+ * can be processed on several cores. Packets from the adapter are steered to a queue by a hash of their addresses,
+ * protocol and ports, so packets of one flow always arrive on the same queue, in order. Packets to the adapter may be
+ * sent on any queue.
+ *
+ * @param Adapter       Adapter handle obtained with WintunOpenAdapter or WintunCreateAdapter
+ *
+ * @param Capacity      Capacity of each ring. Must be between WINTUN_MIN_RING_CAPACITY and WINTUN_MAX_RING_CAPACITY
+ *                      (incl.) Must be a power of two.
+ *
+ * @param Flags         Combination of WINTUN_SESSION_* flags, applied to every queue.
+ *
+ * @param QueueCount    Number of queues. Must be between 1 and WINTUN_MAX_QUEUES (incl.)
+ *
+ * @param Sessions      Array of QueueCount elements to receive a session handle per queue. Each handle is used like
+ *                      one obtained with WintunStartSessionEx and must be released with WintunEndSession. The queues
+ *                      stay registered with the adapter until all of them are ended, so end them together.
+ *
+ * @return If the function succeeds, the return value is nonzero. If the function fails, the return value is zero. To
+ *         get extended error information, call GetLastError. Wintun drivers without queue support reject
+ *         QueueCount above one.
+ */
+typedef _Must_inspect_result_
+_Return_type_success_(return != FALSE)
+BOOL(WINAPI WINTUN_START_SESSION_QUEUES_FUNC)(
+    _In_ WINTUN_ADAPTER_HANDLE Adapter,
+    _In_ DWORD Capacity,
+    _In_ DWORD Flags,
+    _In_ DWORD QueueCount,
+    _Out_writes_(QueueCount) WINTUN_SESSION_HANDLE *Sessions);
+
 /**
  * Ends Wintun session.
  *
@@ -197,6 +279,116 @@ typedef VOID(WINAPI WINTUN_END_SESSION_FUNC)(_In_ WINTUN_SESSION_HANDLE Session)
  */
 typedef HANDLE(WINAPI WINTUN_GET_READ_WAIT_EVENT_FUNC)(_In_ WINTUN_SESSION_HANDLE Session);
 
+/**
+ * Waits until the session has packets to receive. The function first spins on the ring, then blocks on the read-wait
+ * event. The time spent spinning adapts to how soon packets arrived in recent waits: while packets keep arriving
+ * within SpinBudget, it spins for a small multiple of the average arrival gap; otherwise it only probes the ring
+ * briefly before blocking. This function is thread-safe.
+ *
+ * @param Session       Wintun session handle obtained with WintunStartSession
+ *
+ * @param Timeout       Maximum time to wait in milliseconds, spinning included, or INFINITE.
+ *
+ * @param SpinBudget    Maximum time to spin in microseconds before blocking. Zero blocks right away.
+ *
+ * @return If packets are available, the return value is nonzero. Otherwise, the return value is zero. To get extended
+ *         error information, call GetLastError. Possible errors include the following:
+ *         ERROR_TIMEOUT     No packets arrived within Timeout
+ *         ERROR_HANDLE_EOF  Wintun adapter is terminating
+ */
+typedef _Must_inspect_result_
+_Return_type_success_(return != FALSE)
+BOOL(WINAPI WINTUN_WAIT_FOR_PACKETS_FUNC)(
+    _In_ WINTUN_SESSION_HANDLE Session,
+    _In_ DWORD Timeout,
+    _In_ DWORD SpinBudget);
+
+/**
+ * Number of buckets in session statistics histograms. Bucket 0 counts zeros, bucket n counts values from 2^(n-1) to
+ * 2^n-1, and the last bucket also counts everything larger.
+ */
+#define WINTUN_HISTOGRAM_BUCKETS 17
+
+/**
+ * Returns the flags a session runs with. These are the flags it was started with, less WINTUN_SESSION_LARGE_PAGES if
+ * large pages could not be allocated. This function is thread-safe.
+ *
+ * @param Session       Wintun session handle obtained with WintunStartSession
+ *
+ * @return Combination of WINTUN_SESSION_* flags.
+ */
+typedef DWORD(WINAPI WINTUN_GET_SESSION_FLAGS_FUNC)(_In_ WINTUN_SESSION_HANDLE Session);
+
+/**
+ * Session statistics. Received counters cover packets from the adapter returned by WintunReceivePacket(s), sent
+ * counters cover packets to the adapter allocated by WintunAllocateSendPacket(s).
+ */
+typedef struct _WINTUN_SESSION_STATISTICS
+{
+    DWORD64 ReceivedPackets;    /**< Packets received */
+    DWORD64 ReceivedBytes;      /**< Bytes received */
+    DWORD64 ReceiveEmptyPolls;  /**< Receive calls that failed with ERROR_NO_MORE_ITEMS */
+    DWORD64 FilteredPackets;    /**< Packets rejected by the receive filter */
+    DWORD64 SentPackets;        /**< Packets sent */
+    DWORD64 SentBytes;          /**< Bytes sent */
+    DWORD64 SendOverflows;      /**< Allocation calls that failed or stopped short with ERROR_BUFFER_OVERFLOW */
+    DWORD64 WaitSpins;          /**< WintunWaitForPackets calls satisfied while spinning */
+    DWORD64 WaitBlocks;         /**< WintunWaitForPackets calls that blocked on the read-wait event */
+    DWORD ReceiveRingHighWater; /**< Most bytes seen pending in the ring packets are received from */
+    DWORD SendRingHighWater;    /**< Most bytes seen pending in the ring packets are sent to */
+    DWORD64 ReceivedPacketSizes[WINTUN_HISTOGRAM_BUCKETS]; /**< Received packet sizes in bytes */
+    DWORD64 SentPacketSizes[WINTUN_HISTOGRAM_BUCKETS];     /**< Sent packet sizes in bytes */
+    DWORD64 ReceiveBatchSizes[WINTUN_HISTOGRAM_BUCKETS];   /**< Packets returned per successful receive call */
+    DWORD64 SendBatchSizes[WINTUN_HISTOGRAM_BUCKETS];      /**< Packets allocated per successful allocation call */
+} WINTUN_SESSION_STATISTICS;
+
+/**
+ * Retrieves session statistics. Counters are updated by the calling threads while they own their ring side, so values
+ * may trail in-flight calls. With WINTUN_SESSION_SINGLE_CONSUMER, the snapshot of received counters is not atomic: each
+ * counter is read whole, but they may be a few packets apart from each other. This function is thread-safe.
+ *
+ * @param Session       Wintun session handle obtained with WintunStartSession
+ *
+ * @param Statistics    Pointer to structure to receive the statistics.
+ */
+typedef VOID(WINAPI WINTUN_GET_SESSION_STATISTICS_FUNC)(
+    _In_ WINTUN_SESSION_HANDLE Session,
+    _Out_ WINTUN_SESSION_STATISTICS *Statistics);
+
+/**
+ * Driver statistics, counted by the driver into a page mapped next to the session rings.
+ */
+typedef struct _WINTUN_DRIVER_STATISTICS
+{
+    DWORD64 SendOverflowNbls;      /**< Packet chains dropped because the ring packets are received from was full */
+    DWORD64 SendOverflowPackets;   /**< Packets in those chains */
+    DWORD64 SendTailMovedSignals;  /**< Times the driver signaled the read-wait event */
+    DWORD64 ReceiveSpins;          /**< Polls of the ring packets are sent to that found packets while spinning */
+    DWORD64 ReceiveSleeps;         /**< Times the driver went to sleep waiting for packets to be sent */
+    DWORD64 ReceiveDiscards;       /**< Sent packets the driver dropped: not IP, or out of resources */
+    DWORD64 ReceiveNblAllocations; /**< Buffer descriptors the driver allocated because none were cached for reuse */
+    DWORD64 ReceiveIndications;    /**< Batches of sent packets the driver handed to the network stack */
+    DWORD64 ReceiveCoalesced;      /**< Sent TCP segments the driver merged into the segment before them */
+} WINTUN_DRIVER_STATISTICS;
+
+/**
+ * Retrieves driver statistics. The driver updates the counters with relaxed atomic adds, so this function reads them
+ * straight from the shared page without issuing an IOCTL, and values from different counters may be momentarily
+ * inconsistent. Counters a driver does not maintain read zero. This function is thread-safe.
+ *
+ * @param Session       Wintun session handle obtained with WintunStartSession
+ *
+ * @param Statistics    Pointer to structure to receive the statistics.
+ *
+ * @return If the function succeeds, the return value is nonzero. If the function fails, the return value is zero. To
+ *         get extended error information, call GetLastError. Possible errors include the following:
+ *         ERROR_NOT_SUPPORTED  Wintun driver does not maintain a statistics page
+ */
+typedef _Return_type_success_(return != FALSE)
+BOOL(WINAPI WINTUN_GET_DRIVER_STATISTICS_FUNC)(
+    _In_ WINTUN_SESSION_HANDLE Session,
+    _Out_ WINTUN_DRIVER_STATISTICS *Statistics);
+
 /**
  * Maximum IP packet size
  */
@@ -204,7 +396,8 @@ typedef HANDLE(WINAPI WINTUN_GET_READ_WAIT_EVENT_FUNC)(_In_ WINTUN_SESSION_HANDL
 
 /**
  * Retrieves one or packet. After the packet content is consumed, call WintunReleaseReceivePacket with Packet returned
- * from this function to release internal buffer. This function is thread-safe.
+ * from this function to release internal buffer. This function is thread-safe, unless the session was started with
+ * WINTUN_SESSION_SINGLE_CONSUMER.
  *
  * @param Session       Wintun session handle obtained with WintunStartSession
  *
@@ -224,7 +417,8 @@ _Post_writable_byte_size_(*PacketSize)
 BYTE *(WINAPI WINTUN_RECEIVE_PACKET_FUNC)(_In_ WINTUN_SESSION_HANDLE Session, _Out_ DWORD *PacketSize);
 
 /**
- * Releases internal buffer after the received packet has been processed by the client. This function is thread-safe.
+ * Releases internal buffer after the received packet has been processed by the client. This function is thread-safe,
+ * unless the session was started with WINTUN_SESSION_SINGLE_CONSUMER.
  *
  * @param Session       Wintun session handle obtained with WintunStartSession
  *
@@ -233,6 +427,201 @@ BYTE *(WINAPI WINTUN_RECEIVE_PACKET_FUNC)(_In_ WINTUN_SESSION_HANDLE Session, _O
 typedef VOID(
     WINAPI WINTUN_RELEASE_RECEIVE_PACKET_FUNC)(_In_ WINTUN_SESSION_HANDLE Session, _In_ const BYTE *Packet);
 
+/**
+ * Retrieves up to MaxCount packets with a single ring lock acquisition. After the packet contents are consumed, call
+ * WintunReleaseReceivePackets (or WintunReleaseReceivePacket for each packet) to release internal buffers. This
+ * function is thread-safe, unless the session was started with WINTUN_SESSION_SINGLE_CONSUMER.
+ *
+ * @param Session       Wintun session handle obtained with WintunStartSession
+ *
+ * @param Packets       Array of MaxCount elements to receive pointers to layer 3 IPv4 or IPv6 packets. Client may
+ *                      modify their content at will.
+ *
+ * @param PacketSizes   Array of MaxCount elements to receive packet sizes.
+ *
+ * @param MaxCount      Maximum number of packets to retrieve. Must not be zero.
+ *
+ * @return Number of packets retrieved. If the buffer turns out corrupt or the adapter terminating after some packets,
+ *         those are returned and the next call reports the error. If no packets were retrieved, the return value is
+ *         zero. To get extended error information, call GetLastError. Possible errors include the following:
+ *         ERROR_HANDLE_EOF           Wintun adapter is terminating;
+ *         ERROR_NO_MORE_ITEMS        Wintun buffer is exhausted;
+ *         ERROR_INVALID_DATA         Wintun buffer is corrupt;
+ *         ERROR_INVALID_PARAMETER    MaxCount is zero
+ */
+typedef _Must_inspect_result_
+DWORD(WINAPI WINTUN_RECEIVE_PACKETS_FUNC)(
+    _In_ WINTUN_SESSION_HANDLE Session,
+    _Out_writes_to_(MaxCount, return) BYTE **Packets,
+    _Out_writes_to_(MaxCount, return) DWORD *PacketSizes,
+    _In_ DWORD MaxCount);
+
+/**
+ * Releases internal buffers of several received packets at once. This function is thread-safe, unless the session was
+ * started with WINTUN_SESSION_SINGLE_CONSUMER.
+ *
+ * @param Session       Wintun session handle obtained with WintunStartSession
+ *
+ * @param Packets       Array of packets obtained with WintunReceivePackets or WintunReceivePacket
+ *
+ * @param Count         Number of elements in Packets
+ */
+typedef VOID(WINAPI WINTUN_RELEASE_RECEIVE_PACKETS_FUNC)(
+    _In_ WINTUN_SESSION_HANDLE Session,
+    _In_reads_(Count) const BYTE **Packets,
+    _In_ DWORD Count);
+
+/**
+ * Tells whether a received packet is a TCP super-packet, which the adapter only hands to sessions started with
+ * WINTUN_SESSION_GSO.
+ *
+ * @param Session       Wintun session handle obtained with WintunStartSession with WINTUN_SESSION_GSO
+ *
+ * @param Packet        Packet obtained with WintunReceivePacket or WintunReceivePackets, not yet released
+ *
+ * @return Most TCP payload bytes per segment the packet must be cut into. If the return value is zero, call
+ *         GetLastError: ERROR_SUCCESS means an ordinary packet, ERROR_NOT_SUPPORTED a session started without
+ *         WINTUN_SESSION_GSO.
+ */
+typedef DWORD(WINAPI WINTUN_GET_PACKET_MSS_FUNC)(_In_ WINTUN_SESSION_HANDLE Session, _In_ const BYTE *Packet);
+
+/**
+ * Cuts one segment out of a TCP super-packet. Each segment carries a copy of the IP and TCP headers with lengths,
+ * IPv4 identification, TCP sequence number, flags and checksums fixed up, ready to be sent on its own. Call with
+ * Index 0, 1, 2... until the function fails with ERROR_NO_MORE_ITEMS. This function needs no session and is
+ * thread-safe.
+ *
+ * @param Packet        IPv4 or IPv6 TCP super-packet
+ *
+ * @param PacketSize    Size of Packet in bytes
+ *
+ * @param Mss           Most TCP payload bytes per segment, as returned by WintunGetPacketMss
+ *
+ * @param Index         Zero-based index of the segment to write
+ *
+ * @param Segment       Buffer to receive the segment
+ *
+ * @param SegmentSize   Size of Segment in bytes. Mss plus 120 bytes of headers is always enough.
+ *
+ * @return Size of the segment written. If the function fails, the return value is zero. To get extended error
+ *         information, call GetLastError. Possible errors include the following:
+ *         ERROR_NO_MORE_ITEMS          Index is past the last segment;
+ *         ERROR_INVALID_DATA           Packet is not an unfragmented TCP packet;
+ *         ERROR_INSUFFICIENT_BUFFER    Segment is too small
+ */
+typedef _Must_inspect_result_
+_Return_type_success_(return != 0)
+DWORD(WINAPI WINTUN_SEGMENT_PACKET_FUNC)(
+    _In_reads_bytes_(PacketSize) const BYTE *Packet,
+    _In_ DWORD PacketSize,
+    _In_ DWORD Mss,
+    _In_ DWORD Index,
+    _Out_writes_bytes_to_(SegmentSize, return) BYTE *Segment,
+    _In_ DWORD SegmentSize);
+
+/**
+ * Maximum number of instructions in a receive filter program.
+ */
+#define WINTUN_MAX_FILTER_INSTRUCTIONS 256
+
+/**
+ * Receive filter operations.
+ */
+typedef enum
+{
+    WINTUN_FILTER_ACCEPT,       /**< Accept the packet */
+    WINTUN_FILTER_REJECT,       /**< Reject the packet */
+    WINTUN_FILTER_JUMP_EQUAL,   /**< Test Field == Value */
+    WINTUN_FILTER_JUMP_GREATER, /**< Test Field > Value */
+    WINTUN_FILTER_JUMP_PREFIX   /**< Test the address Field lies within Address/Value */
+} WINTUN_FILTER_OPERATION;
+
+/**
+ * Packet fields receive filter instructions test.
+ */
+typedef enum
+{
+    WINTUN_FILTER_VERSION,              /**< IP version: 4 or 6 */
+    WINTUN_FILTER_PROTOCOL,             /**< IPv4 protocol or IPv6 upper-layer next header */
+    WINTUN_FILTER_LENGTH,               /**< Packet size in bytes */
+    WINTUN_FILTER_SOURCE_PORT,          /**< TCP, UDP, UDP-Lite or SCTP source port of a first fragment */
+    WINTUN_FILTER_DESTINATION_PORT,     /**< TCP, UDP, UDP-Lite or SCTP destination port of a first fragment */
+    WINTUN_FILTER_SOURCE_ADDRESS4,      /**< IPv4 source address */
+    WINTUN_FILTER_DESTINATION_ADDRESS4, /**< IPv4 destination address */
+    WINTUN_FILTER_SOURCE_ADDRESS6,      /**< IPv6 source address */
+    WINTUN_FILTER_DESTINATION_ADDRESS6  /**< IPv6 destination address */
+} WINTUN_FILTER_FIELD;
+
+/**
+ * Receive filter instruction. Jump operations test Field and then skip JumpTrue or JumpFalse instructions, so zero
+ * continues with the next one. Tests on fields the packet does not have, like ports of an ICMP packet or IPv6 addresses
+ * of an IPv4 packet, are false. Value is in host byte order. Address is in network byte order, and IPv4 addresses use
+ * its first four bytes.
+ */
+typedef struct _WINTUN_FILTER_INSTRUCTION
+{
+    BYTE Operation;   /**< WINTUN_FILTER_OPERATION */
+    BYTE Field;       /**< WINTUN_FILTER_FIELD */
+    BYTE JumpTrue;    /**< Instructions to skip when the test is true */
+    BYTE JumpFalse;   /**< Instructions to skip when the test is false */
+    DWORD Value;      /**< Value to compare Field with, or prefix length for WINTUN_FILTER_JUMP_PREFIX */
+    BYTE Address[16]; /**< Address prefix for WINTUN_FILTER_JUMP_PREFIX */
+} WINTUN_FILTER_INSTRUCTION;
+
+/**
+ * Sets the filter packets must pass to be returned by WintunReceivePacket and WintunReceivePackets. Rejected packets
+ * are released in the receive path without ever being returned. This function is thread-safe, unless the session was
+ * started with WINTUN_SESSION_SINGLE_CONSUMER, in which case it must be serialized with the receive calls.
+ *
+ * @param Session       Wintun session handle obtained with WintunStartSession
+ *
+ * @param Program       Filter program. Every jump must land on an instruction of the program and the last instruction
+ *                      must be WINTUN_FILTER_ACCEPT or WINTUN_FILTER_REJECT. The program is copied.
+ *
+ * @param Count         Number of instructions in Program, up to WINTUN_MAX_FILTER_INSTRUCTIONS. Zero removes the
+ *                      filter.
+ *
+ * @return If the function succeeds, the return value is nonzero. If the function fails, the return value is zero. To
+ *         get extended error information, call GetLastError. Possible errors include the following:
+ *         ERROR_INVALID_PARAMETER  Program is invalid
+ */
+typedef _Return_type_success_(return != FALSE)
+BOOL(WINAPI WINTUN_SET_RECEIVE_FILTER_FUNC)(
+    _In_ WINTUN_SESSION_HANDLE Session,
+    _In_reads_opt_(Count) const WINTUN_FILTER_INSTRUCTION *Program,
+    _In_ DWORD Count);
+
+/**
+ * Starts or stops capturing the packets of a session to a pcapng file, at runtime. Every packet returned by
+ * WintunReceivePacket or WintunReceivePackets and every packet passed to WintunSendPacket or WintunSendPackets, on all
+ * queues of the session, is copied to a staging buffer without taking locks, and a background thread writes it out
+ * with its timestamp and direction. Packets arriving while the staging buffer is full are left out and counted in the
+ * interface statistics written at the end of every file. Calling this function again while a capture runs finishes
+ * the running capture first. This function is thread-safe.
+ *
+ * @param Session       Wintun session handle obtained with WintunStartSession
+ *
+ * @param Path          Path of the capture file, which gets overwritten. NULL stops the capture.
+ *
+ * @param SnapLength    Number of leading bytes of every packet to keep, or zero to keep whole packets
+ *
+ * @param MaxFileSize   File size at which the file is rotated: Path is renamed to Path.1, Path.1 to Path.2 and so
+ *                      on, and a new Path is started. Zero never rotates.
+ *
+ * @param MaxFiles      Number of files to keep while rotating, including Path
+ *
+ * @return If the function succeeds, the return value is nonzero. If the function fails, the return value is zero. To
+ *         get extended error information, call GetLastError. Possible errors include the following:
+ *         ERROR_FILENAME_EXCED_RANGE   Path is too long to append a rotation suffix
+ */
+typedef _Return_type_success_(return != FALSE)
+BOOL(WINAPI WINTUN_SET_SESSION_CAPTURE_FUNC)(
+    _In_ WINTUN_SESSION_HANDLE Session,
+    _In_opt_z_ LPCWSTR Path,
+    _In_ DWORD SnapLength,
+    _In_ DWORD64 MaxFileSize,
+    _In_ DWORD MaxFiles);
+
 /**
  * Allocates memory for a packet to send. After the memory is filled with packet data, call WintunSendPacket to send
  * and release internal buffer. WintunAllocateSendPacket is thread-safe and the WintunAllocateSendPacket order of
@@ -265,6 +654,99 @@ BYTE *(WINAPI WINTUN_ALLOCATE_SEND_PACKET_FUNC)(_In_ WINTUN_SESSION_HANDLE Sessi
  */
 typedef VOID(WINAPI WINTUN_SEND_PACKET_FUNC)(_In_ WINTUN_SESSION_HANDLE Session, _In_ const BYTE *Packet);
 
+/**
+ * Allocates memory for several packets to send with a single ring lock acquisition. Packets are allocated in order
+ * until the ring runs out of space. After the memory is filled with packet data, call WintunSendPackets (or
+ * WintunSendPacket for each packet) to send and release internal buffers. WintunAllocateSendPackets is thread-safe and
+ * the order of allocations defines the packet sending order.
+ *
+ * @param Session       Wintun session handle obtained with WintunStartSession
+ *
+ * @param PacketSizes   Array of Count exact packet sizes. Each must be less or equal to WINTUN_MAX_IP_PACKET_SIZE.
+ *
+ * @param Packets       Array of Count elements to receive pointers to memory where to prepare layer 3 IPv4 or IPv6
+ *                      packets for sending.
+ *
+ * @param Count         Number of packets to allocate.
+ *
+ * @return Number of packets allocated. Packets past the returned count did not fit in the ring and were not
+ *         allocated. If no packets were allocated, the return value is zero. To get extended error information, call
+ *         GetLastError. Possible errors include the following:
+ *         ERROR_HANDLE_EOF       Wintun adapter is terminating;
+ *         ERROR_BUFFER_OVERFLOW  Wintun buffer is full;
+ */
+typedef _Must_inspect_result_
+DWORD(WINAPI WINTUN_ALLOCATE_SEND_PACKETS_FUNC)(
+    _In_ WINTUN_SESSION_HANDLE Session,
+    _In_reads_(Count) const DWORD *PacketSizes,
+    _Out_writes_to_(Count, return) BYTE **Packets,
+    _In_ DWORD Count);
+
+/**
+ * Sends several packets and releases their internal buffers. The ring tail is published and the driver woken at most
+ * once per call. WintunSendPackets is thread-safe, but the allocation order of calls defines the packet sending order.
+ *
+ * @param Session       Wintun session handle obtained with WintunStartSession
+ *
+ * @param Packets       Array of packets obtained with WintunAllocateSendPackets or WintunAllocateSendPacket
+ *
+ * @param Count         Number of elements in Packets
+ */
+typedef VOID(WINAPI WINTUN_SEND_PACKETS_FUNC)(
+    _In_ WINTUN_SESSION_HANDLE Session,
+    _In_reads_(Count) const BYTE **Packets,
+    _In_ DWORD Count);
+
+/**
+ * Computes the internet checksum (RFC 1071) of a buffer, using SIMD instructions where the CPU has them. This function
+ * is thread-safe.
+ *
+ * @param Data          Data to checksum, such as an IPv4 header with its checksum field zeroed
+ *
+ * @param Size          Size of Data in bytes
+ *
+ * @return Checksum in network byte order, to be stored into the header as is.
+ */
+typedef WORD(WINAPI WINTUN_CHECKSUM_FUNC)(_In_reads_bytes_(Size) const BYTE *Data, _In_ DWORD Size);
+
+/**
+ * Updates a checksum after some of the data it covers changed, without summing the rest again (RFC 1624). Useful when
+ * rewriting addresses or ports. This function is thread-safe.
+ *
+ * @param Checksum      Checksum as stored in the header, in network byte order
+ *
+ * @param Old           Bytes as they were before the change. They must start at an even offset within the data the
+ *                      checksum covers, including the pseudo-header for TCP and UDP.
+ *
+ * @param New           Bytes as they are now
+ *
+ * @param Size          Number of bytes that changed, in Old and New
+ *
+ * @return Updated checksum in network byte order. Callers rewriting UDP headers should leave a zero checksum alone, as
+ *         it means the sender did not compute one.
+ */
+typedef WORD(WINAPI WINTUN_UPDATE_CHECKSUM_FUNC)(
+    _In_ WORD Checksum,
+    _In_reads_bytes_(Size) const BYTE *Old,
+    _In_reads_bytes_(Size) const BYTE *New,
+    _In_ DWORD Size);
+
+/**
+ * Recomputes all checksums of a packet: the IPv4 header checksum, and the TCP, UDP, ICMP or ICMPv6 checksum including
+ * the pseudo-header. Fragments and IPv6 packets with extension headers keep their transport checksum. This function is
+ * thread-safe.
+ *
+ * @param Packet        Layer 3 IPv4 or IPv6 packet
+ *
+ * @param PacketSize    Size of Packet in bytes
+ *
+ * @return If the function succeeds, the return value is nonzero. If the function fails, the return value is zero. To
+ *         get extended error information, call GetLastError. Possible errors include the following:
+ *         ERROR_INVALID_DATA   Packet is not IP or is shorter than its headers claim
+ */
+typedef _Return_type_success_(return != FALSE)
+BOOL(WINAPI WINTUN_SET_PACKET_CHECKSUMS_FUNC)(_Inout_updates_bytes_(PacketSize) BYTE *Packet, _In_ DWORD PacketSize);
+
 #if defined(_MSC_VER)
 #    pragma warning(pop)
 #endif
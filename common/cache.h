@@ -0,0 +1,94 @@
+/* SPDX-License-Identifier: GPL-2.0 OR MIT
+ *
+ * Copyright (C) 2018-2021 WireGuard LLC. All Rights Reserved.
+ */
+
+#pragma once
+
+/* Bounded LIFO of recycled objects. Each object embeds a TUN_CACHE_ENTRY, so the cache itself never allocates. The
+ * most recently returned object is handed out first, while it is still warm in the cache. Callers serialize access.
+ * Like ring.h, this header builds without Win32 types. */
+
+#include "ring.h"
+
+/* Ring bytes per cached object: about one full-sized packet */
+#define TUN_CACHE_RING_BYTES_PER_ENTRY 2048
+/* Upper bound on cached objects per cache */
+#define TUN_CACHE_MAX_DEPTH 4096
+
+typedef struct _TUN_CACHE_ENTRY
+{
+    struct _TUN_CACHE_ENTRY *Next;
+} TUN_CACHE_ENTRY;
+
+typedef struct _TUN_CACHE
+{
+    TUN_CACHE_ENTRY *Head;
+    ULONG Depth;
+    ULONG MaxDepth;
+} TUN_CACHE;
+
+/* Returns the number of objects worth keeping for a ring of Capacity bytes. More could never be in flight at once
+ * for full-sized packets, and smaller packets are rarely outstanding long enough to need them. */
+static inline ULONG
+TunCacheDepthForRing(ULONG Capacity)
+{
+    ULONG Depth = Capacity / TUN_CACHE_RING_BYTES_PER_ENTRY;
+    return Depth < TUN_CACHE_MAX_DEPTH ? Depth : TUN_CACHE_MAX_DEPTH;
+}
+
+static inline void
+TunCacheInit(TUN_CACHE *Cache, ULONG MaxDepth)
+{
+    Cache->Head = NULL;
+    Cache->Depth = 0;
+    Cache->MaxDepth = MaxDepth;
+}
+
+/* Takes the most recently returned object. Returns NULL if the cache is empty and the caller must allocate. */
+static inline TUN_CACHE_ENTRY *
+TunCachePop(TUN_CACHE *Cache)
+{
+    TUN_CACHE_ENTRY *Entry = Cache->Head;
+    if (!Entry)
+        return NULL;
+    Cache->Head = Entry->Next;
+    Cache->Depth--;
+    return Entry;
+}
+
+/* Returns an object to the cache. Returns zero if the cache is full and the caller must free the object. */
+static inline int
+TunCachePush(TUN_CACHE *Cache, TUN_CACHE_ENTRY *Entry)
+{
+    if (Cache->Depth >= Cache->MaxDepth)
+        return 0;
+    Entry->Next = Cache->Head;
+    Cache->Head = Entry;
+    Cache->Depth++;
+    return 1;
+}
+
+/* Moves up to Count objects from Source to Destination, stopping early once Destination is full. Returns the number
+ * moved. Lets a consumer take a batch worth of objects, or give them back, in one critical section. */
+static inline ULONG
+TunCacheMove(TUN_CACHE *Destination, TUN_CACHE *Source, ULONG Count)
+{
+    ULONG Moved = 0;
+    while (Moved < Count && Source->Head && Destination->Depth < Destination->MaxDepth)
+    {
+        TunCachePush(Destination, TunCachePop(Source));
+        Moved++;
+    }
+    return Moved;
+}
+
+/* Empties the cache. Returns the former contents as a list linked by Next for the caller to free. */
+static inline TUN_CACHE_ENTRY *
+TunCacheDetach(TUN_CACHE *Cache)
+{
+    TUN_CACHE_ENTRY *Entries = Cache->Head;
+    Cache->Head = NULL;
+    Cache->Depth = 0;
+    return Entries;
+}
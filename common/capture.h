@@ -0,0 +1,237 @@
+/* SPDX-License-Identifier: GPL-2.0 OR MIT
+ *
+ * Copyright (C) 2018-2021 WireGuard LLC. All Rights Reserved.
+ */
+
+#pragma once
+
+/* Packet capture: a staging queue that any number of threads copy packets into without locking, and the pcapng blocks
+ * a single writer turns them into. The queue reuses the ring layout and reservation of ring.h, but every record
+ * carries its own commit word instead of being published in order, so a producer preempted while copying never holds
+ * up the others. The writer zeroes the records it consumes, which keeps the commit word of the next record in free
+ * space zero until its producer is done. Like ring.h, this header builds without Win32 types. */
+
+#include "ring.h"
+#include <string.h>
+
+#ifndef TUN_CAPTURE_INCREMENT64
+#    if defined(_WIN32)
+#        define TUN_CAPTURE_INCREMENT64(Ptr) InterlockedIncrementNoFence64(Ptr)
+#    else
+#        define TUN_CAPTURE_INCREMENT64(Ptr) __atomic_add_fetch((Ptr), 1, __ATOMIC_RELAXED)
+#    endif
+#endif
+#ifndef TUN_CAPTURE_READ_NO_FENCE64
+#    if defined(_WIN32)
+#        define TUN_CAPTURE_READ_NO_FENCE64(Ptr) ReadNoFence64(Ptr)
+#    else
+#        define TUN_CAPTURE_READ_NO_FENCE64(Ptr) __atomic_load_n((Ptr), __ATOMIC_RELAXED)
+#    endif
+#endif
+
+/* Direction of a captured packet as seen from the adapter, in pcapng epb_flags encoding */
+#define TUN_CAPTURE_INBOUND 1
+#define TUN_CAPTURE_OUTBOUND 2
+
+typedef struct _TUN_CAPTURE_RECORD
+{
+    /* Size of the record header and captured data. Zero while the producer is still writing the record. */
+    ULONG Size;
+    ULONG Flags;
+    ULONG OriginalSize;
+    ULONG TimestampHigh, TimestampLow;
+    UCHAR Data[];
+} TUN_CAPTURE_RECORD;
+
+/* Largest record: a whole packet of the largest size */
+#define TUN_CAPTURE_MAX_RECORD_SIZE TUN_ALIGN(sizeof(TUN_CAPTURE_RECORD) + TUN_MAX_IP_PACKET_SIZE)
+/* Calculates staging ring size. The slack past capacity lets records run over the end instead of wrapping. */
+#define TUN_CAPTURE_RING_SIZE(Capacity) (sizeof(TUN_RING) + (Capacity) + TUN_CAPTURE_MAX_RECORD_SIZE)
+
+typedef struct _TUN_CAPTURE_QUEUE
+{
+    TUN_RING *Ring;          /* Zeroed memory of TUN_CAPTURE_RING_SIZE(Capacity). Ring->Head is the writer's. */
+    ULONG Capacity;          /* Power of two */
+    volatile ULONG Reserved; /* Free-running tail of TunRingReserve */
+    volatile LONG64 Dropped; /* Packets not captured because the ring was full */
+} TUN_CAPTURE_QUEUE;
+
+static inline void
+TunCaptureInit(TUN_CAPTURE_QUEUE *Queue, TUN_RING *Ring, ULONG Capacity)
+{
+    Queue->Ring = Ring;
+    Queue->Capacity = Capacity;
+    Queue->Reserved = 0;
+    Queue->Dropped = 0;
+}
+
+/* Producer side, for any number of concurrent producers: copies the first SnapLength bytes of the Size bytes of packet
+ * at Packet into the queue, stamped with Timestamp and Flags. Returns zero and counts the packet as dropped if the
+ * queue is full. Otherwise stores the bytes queued after this record in *Content, for the producer to decide whether
+ * the writer needs waking. */
+static inline int
+TunCapturePut(
+    TUN_CAPTURE_QUEUE *Queue,
+    ULONG64 Timestamp,
+    ULONG Flags,
+    const UCHAR *Packet,
+    ULONG Size,
+    ULONG SnapLength,
+    ULONG *Content)
+{
+    ULONG Captured = Size < SnapLength ? Size : SnapLength;
+    if (Captured > TUN_MAX_IP_PACKET_SIZE)
+        Captured = TUN_MAX_IP_PACKET_SIZE;
+    ULONG Required = TUN_ALIGN(sizeof(TUN_CAPTURE_RECORD) + Captured);
+    ULONG Start;
+    if (!TunRingReserve(&Queue->Reserved, &Queue->Ring->Head, Queue->Capacity, Required, &Start))
+    {
+        TUN_CAPTURE_INCREMENT64(&Queue->Dropped);
+        return 0;
+    }
+    TUN_CAPTURE_RECORD *Record = (TUN_CAPTURE_RECORD *)(Queue->Ring->Data + TUN_RING_WRAP(Start, Queue->Capacity));
+    Record->Flags = Flags;
+    Record->OriginalSize = Size;
+    Record->TimestampHigh = (ULONG)(Timestamp >> 32);
+    Record->TimestampLow = (ULONG)Timestamp;
+    memcpy(Record->Data, Packet, Captured);
+    TUN_RING_WRITE_RELEASE(&Record->Size, (ULONG)sizeof(TUN_CAPTURE_RECORD) + Captured);
+    *Content = TunRingContent(TUN_RING_READ_NO_FENCE(&Queue->Ring->Head), Start + Required, Queue->Capacity);
+    return 1;
+}
+
+/* Writer side: returns the record at Head in *Record and its aligned size, or zero if there is none yet. Records past
+ * one still being written wait for it, so the writer sees them in reservation order. */
+static inline ULONG
+TunCaptureNext(TUN_CAPTURE_QUEUE *Queue, ULONG Head, TUN_CAPTURE_RECORD **Record)
+{
+    if (!TunRingContent(Head, TUN_RING_READ_ACQUIRE(&Queue->Reserved), Queue->Capacity))
+        return 0;
+    *Record = (TUN_CAPTURE_RECORD *)(Queue->Ring->Data + Head);
+    ULONG Size = TUN_RING_READ_ACQUIRE(&(*Record)->Size);
+    return Size ? TUN_ALIGN(Size) : 0;
+}
+
+/* Writer side: hands the AlignedSize bytes of record at Head back to the producers. Returns the new head. */
+static inline ULONG
+TunCaptureRelease(TUN_CAPTURE_QUEUE *Queue, ULONG Head, ULONG AlignedSize)
+{
+    memset(Queue->Ring->Data + Head, 0, AlignedSize);
+    Head = TUN_RING_WRAP(Head + AlignedSize, Queue->Capacity);
+    TUN_RING_WRITE_RELEASE(&Queue->Ring->Head, Head);
+    return Head;
+}
+
+/* pcapng (draft-ietf-opsawg-pcapng) blocks for one interface carrying raw IP packets. Blocks are written in host byte
+ * order, which readers tell from the byte-order magic of the section header. Timestamps count 100 ns units since the
+ * Unix epoch. */
+#define TUN_PCAPNG_SECTION_HEADER_SIZE 28
+#define TUN_PCAPNG_INTERFACE_DESCRIPTION_SIZE 32
+#define TUN_PCAPNG_INTERFACE_STATISTICS_SIZE 40
+/* Calculates the size of the enhanced packet block for Captured bytes of packet data */
+#define TUN_PCAPNG_ENHANCED_PACKET_SIZE(Captured) (44 + TUN_ALIGN(Captured))
+#define TUN_PCAPNG_LINKTYPE_RAW 101
+
+static inline UCHAR *
+TunPcapngPut16(UCHAR *Block, USHORT Value)
+{
+    memcpy(Block, &Value, sizeof(Value));
+    return Block + sizeof(Value);
+}
+
+static inline UCHAR *
+TunPcapngPut32(UCHAR *Block, ULONG Value)
+{
+    memcpy(Block, &Value, sizeof(Value));
+    return Block + sizeof(Value);
+}
+
+static inline UCHAR *
+TunPcapngPut64(UCHAR *Block, ULONG64 Value)
+{
+    memcpy(Block, &Value, sizeof(Value));
+    return Block + sizeof(Value);
+}
+
+/* Writes an option header, followed by Length bytes of value the caller pads to 32 bits. */
+static inline UCHAR *
+TunPcapngPutOption(UCHAR *Block, USHORT Code, USHORT Length)
+{
+    return TunPcapngPut16(TunPcapngPut16(Block, Code), Length);
+}
+
+/* Writes the section header block every file starts with. Returns its size. */
+static inline ULONG
+TunPcapngSectionHeader(UCHAR *Block)
+{
+    UCHAR *End = Block;
+    End = TunPcapngPut32(End, 0x0A0D0D0A);
+    End = TunPcapngPut32(End, TUN_PCAPNG_SECTION_HEADER_SIZE);
+    End = TunPcapngPut32(End, 0x1A2B3C4D);
+    End = TunPcapngPut16(End, 1); /* Version 1.0 */
+    End = TunPcapngPut16(End, 0);
+    End = TunPcapngPut64(End, ~(ULONG64)0); /* Section length unknown */
+    End = TunPcapngPut32(End, TUN_PCAPNG_SECTION_HEADER_SIZE);
+    return (ULONG)(End - Block);
+}
+
+/* Writes the block describing the adapter as interface 0. Returns its size. */
+static inline ULONG
+TunPcapngInterfaceDescription(UCHAR *Block, ULONG SnapLength)
+{
+    UCHAR *End = Block;
+    End = TunPcapngPut32(End, 0x00000001);
+    End = TunPcapngPut32(End, TUN_PCAPNG_INTERFACE_DESCRIPTION_SIZE);
+    End = TunPcapngPut16(End, TUN_PCAPNG_LINKTYPE_RAW);
+    End = TunPcapngPut16(End, 0);
+    End = TunPcapngPut32(End, SnapLength);
+    End = TunPcapngPutOption(End, 9 /* if_tsresol */, 1);
+    End[0] = 7; /* 10^-7 s */
+    End[1] = End[2] = End[3] = 0;
+    End += 4;
+    End = TunPcapngPut32(End, 0); /* opt_endofopt */
+    End = TunPcapngPut32(End, TUN_PCAPNG_INTERFACE_DESCRIPTION_SIZE);
+    return (ULONG)(End - Block);
+}
+
+/* Writes the block carrying a captured packet, with Timestamp converted by the caller from the one the record holds.
+ * Returns its size. */
+static inline ULONG
+TunPcapngEnhancedPacket(UCHAR *Block, const TUN_CAPTURE_RECORD *Record, ULONG64 Timestamp)
+{
+    ULONG Captured = Record->Size - (ULONG)sizeof(TUN_CAPTURE_RECORD);
+    ULONG Size = TUN_PCAPNG_ENHANCED_PACKET_SIZE(Captured);
+    UCHAR *End = Block;
+    End = TunPcapngPut32(End, 0x00000006);
+    End = TunPcapngPut32(End, Size);
+    End = TunPcapngPut32(End, 0); /* Interface */
+    End = TunPcapngPut32(End, (ULONG)(Timestamp >> 32));
+    End = TunPcapngPut32(End, (ULONG)Timestamp);
+    End = TunPcapngPut32(End, Captured);
+    End = TunPcapngPut32(End, Record->OriginalSize);
+    memcpy(End, Record->Data, Captured);
+    memset(End + Captured, 0, TUN_ALIGN(Captured) - Captured);
+    End += TUN_ALIGN(Captured);
+    End = TunPcapngPutOption(End, 2 /* epb_flags */, 4);
+    End = TunPcapngPut32(End, Record->Flags);
+    End = TunPcapngPut32(End, 0); /* opt_endofopt */
+    End = TunPcapngPut32(End, Size);
+    return (ULONG)(End - Block);
+}
+
+/* Writes the block reporting the packets dropped since the capture started, as of Timestamp. Returns its size. */
+static inline ULONG
+TunPcapngInterfaceStatistics(UCHAR *Block, ULONG64 Timestamp, ULONG64 Dropped)
+{
+    UCHAR *End = Block;
+    End = TunPcapngPut32(End, 0x00000005);
+    End = TunPcapngPut32(End, TUN_PCAPNG_INTERFACE_STATISTICS_SIZE);
+    End = TunPcapngPut32(End, 0); /* Interface */
+    End = TunPcapngPut32(End, (ULONG)(Timestamp >> 32));
+    End = TunPcapngPut32(End, (ULONG)Timestamp);
+    End = TunPcapngPutOption(End, 5 /* isb_ifdrop */, 8);
+    End = TunPcapngPut64(End, Dropped);
+    End = TunPcapngPut32(End, 0); /* opt_endofopt */
+    End = TunPcapngPut32(End, TUN_PCAPNG_INTERFACE_STATISTICS_SIZE);
+    return (ULONG)(End - Block);
+}
@@ -0,0 +1,304 @@
+/* SPDX-License-Identifier: GPL-2.0 OR MIT
+ *
+ * Copyright (C) 2018-2021 WireGuard LLC. All Rights Reserved.
+ */
+
+#pragma once
+
+/* Internet checksum (RFC 1071) and its incremental update (RFC 1624). The ones' complement sum does not depend on byte
+ * order, so data is summed in native words and checksums are returned in network byte order, to be stored into headers
+ * as they are. Sums run in 64 bits with end-around carry and are folded to 16 bits only at the end. Large buffers use
+ * SSE2 or AVX2 on x86, picked at runtime, and NEON on ARM. Kernel-mode builds only get the scalar kernel, as the vector
+ * kernels would need the extended register state saved first. Like ring.h, this header builds without Win32 types. */
+
+#include "ring.h"
+#include <string.h>
+
+#if defined(_KERNEL_MODE)
+#elif defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__)
+#    define TUN_CHECKSUM_X86
+#    include <immintrin.h>
+#    if defined(_MSC_VER)
+#        include <intrin.h>
+#        define TUN_CHECKSUM_TARGET_AVX2
+#    else
+#        define TUN_CHECKSUM_TARGET_AVX2 __attribute__((target("avx2")))
+#    endif
+#elif defined(_M_ARM64) || defined(_M_ARM) || defined(__ARM_NEON)
+#    define TUN_CHECKSUM_NEON
+#    include <arm_neon.h>
+#endif
+
+#if defined(_WIN32) || (defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+#    define TUN_CHECKSUM_LITTLE_ENDIAN
+#endif
+
+/* Buffers shorter than this are summed by the scalar kernel, as headers mostly are. */
+#define TUN_CHECKSUM_VECTOR_MIN_SIZE 64
+
+/* Adds two 64-bit ones' complement numbers. 2^64 is 1 modulo 0xFFFF, so the carry goes back in at the bottom. */
+static inline ULONG64
+TunChecksumAdd64(ULONG64 Sum, ULONG64 Value)
+{
+    Sum += Value;
+    return Sum + (Sum < Value);
+}
+
+/* Adds Size bytes at Data to a ones' complement Sum. Sums of consecutive pieces can be chained, as long as all but the
+ * last piece have an even size. */
+static inline ULONG64
+TunChecksumAddScalar(ULONG64 Sum, const UCHAR *Data, ULONG Size)
+{
+    for (; Size >= 8; Data += 8, Size -= 8)
+    {
+        ULONG64 Word;
+        memcpy(&Word, Data, sizeof(Word));
+        Sum = TunChecksumAdd64(Sum, Word);
+    }
+    if (Size >= 4)
+    {
+        ULONG Word;
+        memcpy(&Word, Data, sizeof(Word));
+        Sum = TunChecksumAdd64(Sum, Word);
+        Data += 4;
+        Size -= 4;
+    }
+    if (Size >= 2)
+    {
+        USHORT Word;
+        memcpy(&Word, Data, sizeof(Word));
+        Sum = TunChecksumAdd64(Sum, Word);
+        Data += 2;
+        Size -= 2;
+    }
+    if (Size)
+    {
+#ifdef TUN_CHECKSUM_LITTLE_ENDIAN
+        Sum = TunChecksumAdd64(Sum, Data[0]);
+#else
+        Sum = TunChecksumAdd64(Sum, (ULONG)Data[0] << 8);
+#endif
+    }
+    return Sum;
+}
+
+#ifdef TUN_CHECKSUM_X86
+/* Both x86 kernels widen 32-bit words into 64-bit lanes, which cannot overflow for any buffer that fits in memory. */
+static inline ULONG64
+TunChecksumAddSse2(ULONG64 Sum, const UCHAR *Data, ULONG Size)
+{
+    const __m128i Zero = _mm_setzero_si128();
+    __m128i Low = Zero, High = Zero;
+    for (; Size >= 32; Data += 32, Size -= 32)
+    {
+        __m128i A = _mm_loadu_si128((const __m128i *)Data);
+        __m128i B = _mm_loadu_si128((const __m128i *)(Data + 16));
+        Low = _mm_add_epi64(Low, _mm_unpacklo_epi32(A, Zero));
+        High = _mm_add_epi64(High, _mm_unpackhi_epi32(A, Zero));
+        Low = _mm_add_epi64(Low, _mm_unpacklo_epi32(B, Zero));
+        High = _mm_add_epi64(High, _mm_unpackhi_epi32(B, Zero));
+    }
+    ULONG64 Lanes[2];
+    _mm_storeu_si128((__m128i *)Lanes, _mm_add_epi64(Low, High));
+    Sum = TunChecksumAdd64(TunChecksumAdd64(Sum, Lanes[0]), Lanes[1]);
+    return TunChecksumAddScalar(Sum, Data, Size);
+}
+
+static inline TUN_CHECKSUM_TARGET_AVX2 ULONG64
+TunChecksumAddAvx2(ULONG64 Sum, const UCHAR *Data, ULONG Size)
+{
+    const __m256i Zero = _mm256_setzero_si256();
+    __m256i Low = Zero, High = Zero;
+    for (; Size >= 64; Data += 64, Size -= 64)
+    {
+        __m256i A = _mm256_loadu_si256((const __m256i *)Data);
+        __m256i B = _mm256_loadu_si256((const __m256i *)(Data + 32));
+        Low = _mm256_add_epi64(Low, _mm256_unpacklo_epi32(A, Zero));
+        High = _mm256_add_epi64(High, _mm256_unpackhi_epi32(A, Zero));
+        Low = _mm256_add_epi64(Low, _mm256_unpacklo_epi32(B, Zero));
+        High = _mm256_add_epi64(High, _mm256_unpackhi_epi32(B, Zero));
+    }
+    Low = _mm256_add_epi64(Low, High);
+    ULONG64 Lanes[2];
+    _mm_storeu_si128(
+        (__m128i *)Lanes, _mm_add_epi64(_mm256_castsi256_si128(Low), _mm256_extracti128_si256(Low, 1)));
+    Sum = TunChecksumAdd64(TunChecksumAdd64(Sum, Lanes[0]), Lanes[1]);
+    return TunChecksumAddScalar(Sum, Data, Size);
+}
+
+/* Tells whether the CPU and OS support AVX2. The answer is cached; racing first callers merely both ask the CPU. */
+static inline int
+TunChecksumHaveAvx2(void)
+{
+    static volatile LONG Cached; /* 0: not asked yet, 1: no, 2: yes */
+    LONG Have = Cached;
+    if (Have)
+        return Have == 2;
+#    if defined(_MSC_VER)
+    int Info[4];
+    __cpuid(Info, 0);
+    int MaxLeaf = Info[0];
+    __cpuid(Info, 1);
+    /* OSXSAVE and AVX, then XMM and YMM state enabled by the OS, then AVX2 */
+    Have = MaxLeaf >= 7 && (Info[2] & (1 << 27 | 1 << 28)) == (1 << 27 | 1 << 28) && (_xgetbv(0) & 6) == 6;
+    if (Have)
+    {
+        __cpuidex(Info, 7, 0);
+        Have = !!(Info[1] & (1 << 5));
+    }
+#    else
+    __builtin_cpu_init();
+    Have = !!__builtin_cpu_supports("avx2");
+#    endif
+    Cached = Have ? 2 : 1;
+    return Have;
+}
+#endif
+
+#ifdef TUN_CHECKSUM_NEON
+static inline ULONG64
+TunChecksumAddNeon(ULONG64 Sum, const UCHAR *Data, ULONG Size)
+{
+    uint64x2_t Low = vdupq_n_u64(0), High = vdupq_n_u64(0);
+    for (; Size >= 32; Data += 32, Size -= 32)
+    {
+        Low = vpadalq_u32(Low, vreinterpretq_u32_u8(vld1q_u8(Data)));
+        High = vpadalq_u32(High, vreinterpretq_u32_u8(vld1q_u8(Data + 16)));
+    }
+    Low = vaddq_u64(Low, High);
+    Sum = TunChecksumAdd64(TunChecksumAdd64(Sum, vgetq_lane_u64(Low, 0)), vgetq_lane_u64(Low, 1));
+    return TunChecksumAddScalar(Sum, Data, Size);
+}
+#endif
+
+/* Like TunChecksumAddScalar, using the fastest kernel the CPU has for larger buffers. */
+static inline ULONG64
+TunChecksumAdd(ULONG64 Sum, const void *Data, ULONG Size)
+{
+    if (Size < TUN_CHECKSUM_VECTOR_MIN_SIZE)
+        return TunChecksumAddScalar(Sum, Data, Size);
+#if defined(TUN_CHECKSUM_X86)
+    if (TunChecksumHaveAvx2())
+        return TunChecksumAddAvx2(Sum, Data, Size);
+    return TunChecksumAddSse2(Sum, Data, Size);
+#elif defined(TUN_CHECKSUM_NEON)
+    return TunChecksumAddNeon(Sum, Data, Size);
+#else
+    return TunChecksumAddScalar(Sum, Data, Size);
+#endif
+}
+
+/* Folds a sum to 16 bits, without taking the complement. */
+static inline USHORT
+TunChecksumFold(ULONG64 Sum)
+{
+    Sum = TunChecksumAdd64(Sum & 0xFFFFFFFF, Sum >> 32);
+    while (Sum >> 16)
+        Sum = (Sum & 0xFFFF) + (Sum >> 16);
+    return (USHORT)Sum;
+}
+
+/* Turns a sum into the checksum to store, in network byte order. */
+static inline USHORT
+TunChecksumFinish(ULONG64 Sum)
+{
+    return (USHORT)~TunChecksumFold(Sum);
+}
+
+/* Adds the TCP, UDP or ICMPv6 pseudo-header to a sum. Addresses points to the source address followed by the
+ * destination address, as they are laid out in IPv4 and IPv6 headers. */
+static inline ULONG64
+TunChecksumPseudoHeader(ULONG64 Sum, const UCHAR *Addresses, ULONG AddressesSize, UCHAR Protocol, ULONG Length)
+{
+    const UCHAR Tail[4] = { 0, Protocol, (UCHAR)(Length >> 8), (UCHAR)Length };
+    Sum = TunChecksumAddScalar(Sum, Addresses, AddressesSize);
+    return TunChecksumAddScalar(Sum, Tail, sizeof(Tail));
+}
+
+/* Updates Checksum after Size bytes of the data it covers changed from Old to New, without summing the rest again:
+ * RFC 1624 equation 3. The changed bytes must start at an even offset within the data. */
+static inline USHORT
+TunChecksumUpdate(USHORT Checksum, const UCHAR *Old, const UCHAR *New, ULONG Size)
+{
+    ULONG64 Sum = (USHORT)~Checksum;
+    Sum += (USHORT)~TunChecksumFold(TunChecksumAddScalar(0, Old, Size));
+    return TunChecksumFinish(TunChecksumAddScalar(Sum, New, Size));
+}
+
+/* Recomputes the IPv4 header checksum and the TCP, UDP, ICMP or ICMPv6 checksum of the Size bytes of packet at Packet.
+ * Fragments and IPv6 packets with extension headers keep their transport checksum. Returns zero if the packet is not
+ * IP or is shorter than its headers claim. */
+static inline int
+TunChecksumPacket(UCHAR *Packet, ULONG Size)
+{
+    ULONG HeaderSize, Length, Offset;
+    const UCHAR *Addresses;
+    ULONG AddressesSize;
+    UCHAR Protocol;
+    USHORT Checksum;
+
+    if (Size >= 20 && Packet[0] >> 4 == 4)
+    {
+        HeaderSize = (Packet[0] & 0xF) * 4;
+        Length = (ULONG)Packet[2] << 8 | Packet[3];
+        if (HeaderSize < 20 || Length < HeaderSize || Length > Size)
+            return 0;
+        Packet[10] = Packet[11] = 0;
+        Checksum = TunChecksumFinish(TunChecksumAddScalar(0, Packet, HeaderSize));
+        memcpy(Packet + 10, &Checksum, sizeof(Checksum));
+        if ((Packet[6] & 0x3F) || Packet[7]) /* More fragments or non-zero offset */
+            return 1;
+        Protocol = Packet[9];
+        Addresses = Packet + 12;
+        AddressesSize = 8;
+    }
+    else if (Size >= 40 && Packet[0] >> 4 == 6)
+    {
+        HeaderSize = 40;
+        Length = 40 + ((ULONG)Packet[4] << 8 | Packet[5]);
+        if (Length > Size)
+            return 0;
+        Protocol = Packet[6];
+        Addresses = Packet + 8;
+        AddressesSize = 32;
+    }
+    else
+        return 0;
+
+    UCHAR *Transport = Packet + HeaderSize;
+    ULONG TransportSize = Length - HeaderSize;
+    ULONG64 Sum = 0;
+    switch (Protocol)
+    {
+    case 6: /* TCP */
+        if (TransportSize < 20)
+            return 0;
+        Offset = 16;
+        break;
+    case 17: /* UDP */
+        if (TransportSize < 8)
+            return 0;
+        Offset = 6;
+        break;
+    case 1: /* ICMP */
+        if (TransportSize < 4 || AddressesSize != 8)
+            return 1;
+        Offset = 2;
+        break;
+    case 58: /* ICMPv6 */
+        if (TransportSize < 4 || AddressesSize != 32)
+            return 1;
+        Offset = 2;
+        break;
+    default:
+        return 1;
+    }
+    if (Protocol != 1)
+        Sum = TunChecksumPseudoHeader(Sum, Addresses, AddressesSize, Protocol, TransportSize);
+    Transport[Offset] = Transport[Offset + 1] = 0;
+    Checksum = TunChecksumFinish(TunChecksumAdd(Sum, Transport, TransportSize));
+    if (Protocol == 17 && !Checksum)
+        Checksum = 0xFFFF; /* Zero means no checksum in UDP */
+    memcpy(Transport + Offset, &Checksum, sizeof(Checksum));
+    return 1;
+}
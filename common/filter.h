@@ -0,0 +1,249 @@
+/* SPDX-License-Identifier: GPL-2.0 OR MIT
+ *
+ * Copyright (C) 2018-2021 WireGuard LLC. All Rights Reserved.
+ */
+
+#pragma once
+
+/* Receive filter: a small forward-only bytecode evaluated over the IPv4/IPv6 header of each packet. Programs are
+ * validated once by TunFilterCompile, which also precomputes address masks, so TunFilterRun needs no bounds checks on
+ * the program and always terminates. Like ring.h, this header builds without Win32 types. */
+
+#include "ring.h"
+
+#if defined(_WIN32)
+#    pragma warning(push)
+#    pragma warning(disable : 4200) /* nonstandard: zero-sized array in struct/union */
+#endif
+
+/* Maximum number of instructions in a program */
+#define TUN_FILTER_MAX_INSNS 256
+
+typedef enum _TUN_FILTER_OP
+{
+    TUN_FILTER_OP_ACCEPT,    /* Accept the packet */
+    TUN_FILTER_OP_REJECT,    /* Reject the packet */
+    TUN_FILTER_OP_JEQ,       /* Jump if Field == Value */
+    TUN_FILTER_OP_JGT,       /* Jump if Field > Value */
+    TUN_FILTER_OP_JPREFIX,   /* Jump if the address Field lies within Address/Value */
+    TUN_FILTER_OP_COUNT
+} TUN_FILTER_OP;
+
+typedef enum _TUN_FILTER_FIELD
+{
+    TUN_FILTER_FIELD_VERSION,              /* IP version: 4 or 6 */
+    TUN_FILTER_FIELD_PROTOCOL,             /* IPv4 protocol or IPv6 upper-layer next header */
+    TUN_FILTER_FIELD_LENGTH,               /* Packet size in bytes */
+    TUN_FILTER_FIELD_SOURCE_PORT,          /* TCP, UDP, UDP-Lite or SCTP source port of a first fragment */
+    TUN_FILTER_FIELD_DESTINATION_PORT,     /* TCP, UDP, UDP-Lite or SCTP destination port of a first fragment */
+    TUN_FILTER_FIELD_SOURCE_ADDRESS4,      /* IPv4 source address */
+    TUN_FILTER_FIELD_DESTINATION_ADDRESS4, /* IPv4 destination address */
+    TUN_FILTER_FIELD_SOURCE_ADDRESS6,      /* IPv6 source address */
+    TUN_FILTER_FIELD_DESTINATION_ADDRESS6, /* IPv6 destination address */
+    TUN_FILTER_FIELD_COUNT
+} TUN_FILTER_FIELD;
+
+/* Tests on fields the packet does not have (ports of an ICMP packet, IPv6 addresses of an IPv4 packet, anything of a
+ * truncated header) are false. After a test, execution skips JumpTrue or JumpFalse instructions, so zero continues with
+ * the next one. */
+typedef struct _TUN_FILTER_INSN
+{
+    UCHAR Op;
+    UCHAR Field;
+    UCHAR JumpTrue;
+    UCHAR JumpFalse;
+    ULONG Value;
+    UCHAR Address[16];
+} TUN_FILTER_INSN;
+
+typedef struct _TUN_FILTER_PROGRAM
+{
+    ULONG Count;
+    struct
+    {
+        TUN_FILTER_INSN Insn;
+        UCHAR Mask[16];
+    } Insns[];
+} TUN_FILTER_PROGRAM;
+
+/* Calculates compiled program size */
+#define TUN_FILTER_PROGRAM_SIZE(Count) \
+    (sizeof(TUN_FILTER_PROGRAM) + (Count) * (sizeof(TUN_FILTER_INSN) + 16))
+
+typedef struct _TUN_FILTER_HEADERS
+{
+    ULONG Fields[TUN_FILTER_FIELD_SOURCE_ADDRESS4];
+    ULONG Present; /* Bit mask of TUN_FILTER_FIELD_* values found in the packet */
+    const UCHAR *Source;
+    const UCHAR *Destination;
+} TUN_FILTER_HEADERS;
+
+static inline int
+TunFilterIsAddressField(ULONG Field)
+{
+    return Field >= TUN_FILTER_FIELD_SOURCE_ADDRESS4 && Field < TUN_FILTER_FIELD_COUNT;
+}
+
+static inline ULONG
+TunFilterAddressBits(ULONG Field)
+{
+    return Field <= TUN_FILTER_FIELD_DESTINATION_ADDRESS4 ? 32 : 128;
+}
+
+/* Validates Count instructions and stores the compiled program in Program, which must be at least
+ * TUN_FILTER_PROGRAM_SIZE(Count) bytes. Every jump must land on an instruction and the last instruction must accept or
+ * reject. Returns zero if the program is invalid. */
+static inline int
+TunFilterCompile(const TUN_FILTER_INSN *Insns, ULONG Count, TUN_FILTER_PROGRAM *Program)
+{
+    if (!Count || Count > TUN_FILTER_MAX_INSNS)
+        return 0;
+    if (Insns[Count - 1].Op != TUN_FILTER_OP_ACCEPT && Insns[Count - 1].Op != TUN_FILTER_OP_REJECT)
+        return 0;
+    for (ULONG i = 0; i < Count; ++i)
+    {
+        const TUN_FILTER_INSN *Insn = &Insns[i];
+        if (Insn->Op >= TUN_FILTER_OP_COUNT)
+            return 0;
+        if (Insn->Op == TUN_FILTER_OP_JEQ || Insn->Op == TUN_FILTER_OP_JGT)
+        {
+            if (Insn->Field >= TUN_FILTER_FIELD_SOURCE_ADDRESS4)
+                return 0;
+        }
+        else if (Insn->Op == TUN_FILTER_OP_JPREFIX)
+        {
+            if (!TunFilterIsAddressField(Insn->Field) || Insn->Value > TunFilterAddressBits(Insn->Field))
+                return 0;
+        }
+        if (Insn->Op >= TUN_FILTER_OP_JEQ &&
+            (i + 1 + Insn->JumpTrue >= Count || i + 1 + Insn->JumpFalse >= Count))
+            return 0;
+        Program->Insns[i].Insn = *Insn;
+        for (ULONG Byte = 0; Byte < 16; ++Byte)
+        {
+            ULONG Bits = Insn->Op != TUN_FILTER_OP_JPREFIX ? 0 : Insn->Value > Byte * 8 ? Insn->Value - Byte * 8 : 0;
+            Program->Insns[i].Mask[Byte] = Bits >= 8 ? 0xFF : (UCHAR)(0xFF00 >> Bits);
+        }
+    }
+    Program->Count = Count;
+    return 1;
+}
+
+static inline ULONG
+TunFilterLoad16(const UCHAR *Data)
+{
+    return ((ULONG)Data[0] << 8) | Data[1];
+}
+
+static inline int
+TunFilterIsPortProtocol(ULONG Protocol)
+{
+    return Protocol == 6 /* TCP */ || Protocol == 17 /* UDP */ || Protocol == 132 /* SCTP */ ||
+           Protocol == 136 /* UDP-Lite */;
+}
+
+/* Extracts the fields filter programs may test. Only the common IPv6 extension headers are walked. */
+static inline void
+TunFilterParse(const UCHAR *Packet, ULONG Size, TUN_FILTER_HEADERS *Headers)
+{
+    ULONG Transport, Protocol;
+    int FirstFragment = 1;
+
+    Headers->Present = 1 << TUN_FILTER_FIELD_LENGTH;
+    Headers->Fields[TUN_FILTER_FIELD_LENGTH] = Size;
+    if (!Size)
+        return;
+    Headers->Fields[TUN_FILTER_FIELD_VERSION] = Packet[0] >> 4;
+    Headers->Present |= 1 << TUN_FILTER_FIELD_VERSION;
+    if (Packet[0] >> 4 == 4)
+    {
+        Transport = (Packet[0] & 0xF) * 4;
+        if (Size < 20 || Transport < 20 || Transport > Size)
+            return;
+        Protocol = Packet[9];
+        FirstFragment = !(TunFilterLoad16(Packet + 6) & 0x1FFF);
+        Headers->Source = Packet + 12;
+        Headers->Destination = Packet + 16;
+        Headers->Present |= (1 << TUN_FILTER_FIELD_SOURCE_ADDRESS4) | (1 << TUN_FILTER_FIELD_DESTINATION_ADDRESS4);
+    }
+    else if (Packet[0] >> 4 == 6)
+    {
+        if (Size < 40)
+            return;
+        Headers->Source = Packet + 8;
+        Headers->Destination = Packet + 24;
+        Headers->Present |= (1 << TUN_FILTER_FIELD_SOURCE_ADDRESS6) | (1 << TUN_FILTER_FIELD_DESTINATION_ADDRESS6);
+        Protocol = Packet[6];
+        Transport = 40;
+        for (int Extensions = 0; Extensions < 8; ++Extensions)
+        {
+            if (Protocol == 44 /* Fragment */)
+            {
+                if (Size - Transport < 8)
+                    return;
+                FirstFragment = !(TunFilterLoad16(Packet + Transport + 2) & 0xFFF8);
+                Protocol = Packet[Transport];
+                Transport += 8;
+            }
+            else if (Protocol == 0 /* Hop-by-Hop */ || Protocol == 43 /* Routing */ || Protocol == 60 /* Destination */)
+            {
+                if (Size - Transport < 8 || Size - Transport < ((ULONG)Packet[Transport + 1] + 1) * 8)
+                    return;
+                Protocol = Packet[Transport];
+                Transport += ((ULONG)Packet[Transport + 1] + 1) * 8;
+            }
+            else
+                break;
+        }
+    }
+    else
+        return;
+    Headers->Fields[TUN_FILTER_FIELD_PROTOCOL] = Protocol;
+    Headers->Present |= 1 << TUN_FILTER_FIELD_PROTOCOL;
+    if (FirstFragment && TunFilterIsPortProtocol(Protocol) && Size - Transport >= 4)
+    {
+        Headers->Fields[TUN_FILTER_FIELD_SOURCE_PORT] = TunFilterLoad16(Packet + Transport);
+        Headers->Fields[TUN_FILTER_FIELD_DESTINATION_PORT] = TunFilterLoad16(Packet + Transport + 2);
+        Headers->Present |= (1 << TUN_FILTER_FIELD_SOURCE_PORT) | (1 << TUN_FILTER_FIELD_DESTINATION_PORT);
+    }
+}
+
+/* Runs a compiled program over a packet. Returns non-zero if the packet is accepted. */
+static inline int
+TunFilterRun(const TUN_FILTER_PROGRAM *Program, const UCHAR *Packet, ULONG Size)
+{
+    TUN_FILTER_HEADERS Headers;
+    TunFilterParse(Packet, Size, &Headers);
+    for (ULONG i = 0;;)
+    {
+        const TUN_FILTER_INSN *Insn = &Program->Insns[i].Insn;
+        int Hit = 0;
+        if (Insn->Op == TUN_FILTER_OP_ACCEPT)
+            return 1;
+        if (Insn->Op == TUN_FILTER_OP_REJECT)
+            return 0;
+        if (Headers.Present & (1 << Insn->Field))
+        {
+            if (Insn->Op == TUN_FILTER_OP_JPREFIX)
+            {
+                const UCHAR *Address =
+                    Insn->Field == TUN_FILTER_FIELD_SOURCE_ADDRESS4 || Insn->Field == TUN_FILTER_FIELD_SOURCE_ADDRESS6
+                        ? Headers.Source
+                        : Headers.Destination;
+                const UCHAR *Mask = Program->Insns[i].Mask;
+                Hit = 1;
+                for (ULONG Byte = 0; Byte < TunFilterAddressBits(Insn->Field) / 8; ++Byte)
+                    Hit &= !((Address[Byte] ^ Insn->Address[Byte]) & Mask[Byte]);
+            }
+            else if (Insn->Op == TUN_FILTER_OP_JEQ)
+                Hit = Headers.Fields[Insn->Field] == Insn->Value;
+            else
+                Hit = Headers.Fields[Insn->Field] > Insn->Value;
+        }
+        i += 1 + (Hit ? Insn->JumpTrue : Insn->JumpFalse);
+    }
+}
+
+#if defined(_WIN32)
+#    pragma warning(pop)
+#endif
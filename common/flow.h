@@ -0,0 +1,75 @@
+/* SPDX-License-Identifier: GPL-2.0 OR MIT
+ *
+ * Copyright (C) 2018-2021 WireGuard LLC. All Rights Reserved.
+ */
+
+#pragma once
+
+/* Flow steering for adapters with several ring pairs. Packets of one flow must always hash to the same queue so the
+ * client sees them in order, so the hash only covers fields every packet of the flow carries: addresses and protocol,
+ * plus ports of unfragmented TCP, UDP, UDP-Lite and SCTP packets. Like ring.h, this header builds without Win32
+ * types. */
+
+#include "ring.h"
+
+/* Maximum number of ring pairs per adapter */
+#define TUN_MAX_QUEUES 16
+/* Header bytes TunFlowHash looks at: the longest IPv4 header followed by both ports. */
+#define TUN_FLOW_HEADER_SIZE 64
+
+static inline ULONG
+TunFlowMix(ULONG Hash, ULONG Value)
+{
+    Hash ^= Value;
+    Hash *= 0x9E3779B1;
+    return Hash ^ (Hash >> 15);
+}
+
+static inline ULONG
+TunFlowLoad32(const UCHAR *Data)
+{
+    return ((ULONG)Data[0] << 24) | ((ULONG)Data[1] << 16) | ((ULONG)Data[2] << 8) | Data[3];
+}
+
+/* Hashes the flow of the Size bytes of packet header at Packet, keyed with Seed so remote peers cannot aim all their
+ * flows at one queue. Packets too short to parse, and anything that is not IP, hash to the bare seed. */
+static inline ULONG
+TunFlowHash(ULONG Seed, const UCHAR *Packet, ULONG Size)
+{
+    ULONG Hash = Seed, Transport, Protocol;
+    int Fragmented;
+
+    if (Size >= 20 && Packet[0] >> 4 == 4)
+    {
+        Transport = (Packet[0] & 0xF) * 4;
+        if (Transport < 20)
+            return Seed;
+        Protocol = Packet[9];
+        Fragmented = (Packet[6] & 0x3F) || Packet[7]; /* More fragments or non-zero offset */
+        Hash = TunFlowMix(Hash, TunFlowLoad32(Packet + 12));
+        Hash = TunFlowMix(Hash, TunFlowLoad32(Packet + 16));
+    }
+    else if (Size >= 40 && Packet[0] >> 4 == 6)
+    {
+        Transport = 40;
+        Protocol = Packet[6];
+        Fragmented = Protocol == 44; /* Fragment header */
+        for (ULONG Offset = 8; Offset < 40; Offset += 4)
+            Hash = TunFlowMix(Hash, TunFlowLoad32(Packet + Offset));
+    }
+    else
+        return Seed;
+    Hash = TunFlowMix(Hash, Protocol);
+    if (!Fragmented && Size >= Transport + 4 &&
+        (Protocol == 6 /* TCP */ || Protocol == 17 /* UDP */ || Protocol == 132 /* SCTP */ ||
+         Protocol == 136 /* UDP-Lite */))
+        Hash = TunFlowMix(Hash, TunFlowLoad32(Packet + Transport));
+    return Hash;
+}
+
+/* Maps a flow hash to one of Count queues without a division. */
+static inline ULONG
+TunFlowQueue(ULONG Hash, ULONG Count)
+{
+    return (ULONG)(((ULONG64)Hash * Count) >> 32);
+}
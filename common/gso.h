@@ -0,0 +1,120 @@
+/* SPDX-License-Identifier: GPL-2.0 OR MIT
+ *
+ * Copyright (C) 2018-2021 WireGuard LLC. All Rights Reserved.
+ */
+
+#pragma once
+
+/* Segmentation of the TCP super-packets the network stack hands over with large send offload. Every segment gets its
+ * own IP length, IPv4 identification and header checksum, TCP sequence number and TCP checksum; FIN and PSH stay on
+ * the last segment and CWR on the first. The stack only writes a pseudo-header checksum into super-packets, so even a
+ * single segment needs this. Like ring.h, this header builds without Win32 types. */
+
+#include "checksum.h"
+
+/* Longest IP and TCP header a segment repeats: an IPv4 header with options followed by a TCP header with options. */
+#define TUN_GSO_MAX_HEADER_SIZE (60 + 60)
+
+typedef struct _TUN_GSO
+{
+    ULONG Mss;
+    ULONG IpHeaderSize;
+    ULONG HeaderSize; /* IP and TCP headers */
+    ULONG PayloadSize;
+    ULONG Segments;
+    UCHAR Version;
+} TUN_GSO;
+
+static inline ULONG
+TunGsoLoad16(const UCHAR *Data)
+{
+    return ((ULONG)Data[0] << 8) | Data[1];
+}
+
+static inline void
+TunGsoStore16(UCHAR *Data, ULONG Value)
+{
+    Data[0] = (UCHAR)(Value >> 8);
+    Data[1] = (UCHAR)Value;
+}
+
+/* Parses the Size bytes of super-packet at Packet for segmentation into Mss payload bytes each. IPv6 packets must
+ * carry TCP right after the fixed header, as the driver does not offer segmentation of packets with extension
+ * headers. Returns zero if the packet is not an unfragmented TCP/IP packet. */
+static inline int
+TunGsoParse(const UCHAR *Packet, ULONG Size, ULONG Mss, TUN_GSO *Gso)
+{
+    if (!Mss || !Size)
+        return 0;
+    Gso->Version = Packet[0] >> 4;
+    if (Gso->Version == 4)
+    {
+        Gso->IpHeaderSize = (Packet[0] & 0xF) * 4;
+        if (Size < 20 || Gso->IpHeaderSize < 20 || Packet[9] != 6 /* TCP */ || TunGsoLoad16(Packet + 6) & 0x3FFF)
+            return 0;
+    }
+    else if (Gso->Version == 6)
+    {
+        Gso->IpHeaderSize = 40;
+        if (Size < 40 || Packet[6] != 6 /* TCP */)
+            return 0;
+    }
+    else
+        return 0;
+    if (Size < Gso->IpHeaderSize + 20)
+        return 0;
+    Gso->HeaderSize = Gso->IpHeaderSize + (Packet[Gso->IpHeaderSize + 12] >> 4) * 4;
+    if (Gso->HeaderSize < Gso->IpHeaderSize + 20 || Gso->HeaderSize > Size)
+        return 0;
+    Gso->Mss = Mss;
+    Gso->PayloadSize = Size - Gso->HeaderSize;
+    Gso->Segments = Gso->PayloadSize ? (Gso->PayloadSize - 1) / Mss + 1 : 1;
+    return 1;
+}
+
+/* Writes segment Index of the super-packet Gso describes to Segment, which must hold Gso->HeaderSize + Gso->Mss
+ * bytes. Returns the segment size, or zero if Index is past the last segment. */
+static inline ULONG
+TunGsoSegment(const UCHAR *Packet, const TUN_GSO *Gso, ULONG Index, UCHAR *Segment)
+{
+    if (Index >= Gso->Segments)
+        return 0;
+    ULONG Offset = Index * Gso->Mss;
+    ULONG PayloadSize = Gso->PayloadSize - Offset < Gso->Mss ? Gso->PayloadSize - Offset : Gso->Mss;
+    ULONG Size = Gso->HeaderSize + PayloadSize;
+    memcpy(Segment, Packet, Gso->HeaderSize);
+    memcpy(Segment + Gso->HeaderSize, Packet + Gso->HeaderSize + Offset, PayloadSize);
+
+    UCHAR *Tcp = Segment + Gso->IpHeaderSize;
+    ULONG TcpSize = Size - Gso->IpHeaderSize;
+    USHORT Checksum;
+    ULONG64 Sum;
+    if (Gso->Version == 4)
+    {
+        TunGsoStore16(Segment + 2, Size);
+        TunGsoStore16(Segment + 4, TunGsoLoad16(Segment + 4) + Index);
+        TunGsoStore16(Segment + 10, 0);
+        Checksum = TunChecksumFinish(TunChecksumAddScalar(0, Segment, Gso->IpHeaderSize));
+        memcpy(Segment + 10, &Checksum, sizeof(Checksum));
+        Sum = TunChecksumPseudoHeader(0, Segment + 12, 8, 6 /* TCP */, TcpSize);
+    }
+    else
+    {
+        TunGsoStore16(Segment + 4, TcpSize);
+        Sum = TunChecksumPseudoHeader(0, Segment + 8, 32, 6 /* TCP */, TcpSize);
+    }
+
+    ULONG Sequence = ((ULONG)Tcp[4] << 24 | (ULONG)Tcp[5] << 16 | (ULONG)Tcp[6] << 8 | Tcp[7]) + Offset;
+    Tcp[4] = (UCHAR)(Sequence >> 24);
+    Tcp[5] = (UCHAR)(Sequence >> 16);
+    Tcp[6] = (UCHAR)(Sequence >> 8);
+    Tcp[7] = (UCHAR)Sequence;
+    if (Index != Gso->Segments - 1)
+        Tcp[13] &= ~(0x01 /* FIN */ | 0x08 /* PSH */);
+    if (Index)
+        Tcp[13] &= ~0x80 /* CWR */;
+    TunGsoStore16(Tcp + 16, 0);
+    Checksum = TunChecksumFinish(TunChecksumAdd(Sum, Tcp, TcpSize));
+    memcpy(Tcp + 16, &Checksum, sizeof(Checksum));
+    return Size;
+}
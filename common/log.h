@@ -0,0 +1,204 @@
+/* SPDX-License-Identifier: GPL-2.0 OR MIT
+ *
+ * Copyright (C) 2018-2021 WireGuard LLC. All Rights Reserved.
+ */
+
+#pragma once
+
+/* Log message queue: a bounded queue that any number of threads claim entries of without locking and never wait on,
+ * drained in order by a single thread, and the per call site rate limiting in front of it. The queue only sequences
+ * entries; the messages live in an array of the caller's, at the index a claim returns. Like ring.h, this header builds
+ * without Win32 types. */
+
+#include "ring.h"
+#include <stddef.h>
+
+#ifndef TUN_LOG_READ_NO_FENCE64
+#    if defined(_WIN32)
+#        define TUN_LOG_READ_NO_FENCE64(Ptr) ReadNoFence64(Ptr)
+#    else
+#        define TUN_LOG_READ_NO_FENCE64(Ptr) __atomic_load_n((Ptr), __ATOMIC_RELAXED)
+#    endif
+#endif
+#ifndef TUN_LOG_WRITE_NO_FENCE64
+#    if defined(_WIN32)
+#        define TUN_LOG_WRITE_NO_FENCE64(Ptr, Value) WriteNoFence64((Ptr), (Value))
+#    else
+#        define TUN_LOG_WRITE_NO_FENCE64(Ptr, Value) __atomic_store_n((Ptr), (Value), __ATOMIC_RELAXED)
+#    endif
+#endif
+#ifndef TUN_LOG_READ_ACQUIRE64
+#    if defined(_WIN32)
+#        define TUN_LOG_READ_ACQUIRE64(Ptr) ReadAcquire64(Ptr)
+#    else
+#        define TUN_LOG_READ_ACQUIRE64(Ptr) __atomic_load_n((Ptr), __ATOMIC_ACQUIRE)
+#    endif
+#endif
+#ifndef TUN_LOG_WRITE_RELEASE64
+#    if defined(_WIN32)
+#        define TUN_LOG_WRITE_RELEASE64(Ptr, Value) WriteRelease64((Ptr), (Value))
+#    else
+#        define TUN_LOG_WRITE_RELEASE64(Ptr, Value) __atomic_store_n((Ptr), (Value), __ATOMIC_RELEASE)
+#    endif
+#endif
+/* Returns the value *Ptr held, which equals Comparand if Exchange was stored. */
+#ifndef TUN_LOG_COMPARE_EXCHANGE64
+#    if defined(_WIN32)
+#        define TUN_LOG_COMPARE_EXCHANGE64(Ptr, Exchange, Comparand) \
+            InterlockedCompareExchange64((Ptr), (Exchange), (Comparand))
+#    else
+#        define TUN_LOG_COMPARE_EXCHANGE64(Ptr, Exchange, Comparand) \
+            __sync_val_compare_and_swap((Ptr), (Comparand), (Exchange))
+#    endif
+#endif
+#ifndef TUN_LOG_INCREMENT64
+#    if defined(_WIN32)
+#        define TUN_LOG_INCREMENT64(Ptr) InterlockedIncrementNoFence64(Ptr)
+#    else
+#        define TUN_LOG_INCREMENT64(Ptr) __atomic_add_fetch((Ptr), 1, __ATOMIC_RELAXED)
+#    endif
+#endif
+#ifndef TUN_LOG_INCREMENT
+#    if defined(_WIN32)
+#        define TUN_LOG_INCREMENT(Ptr) InterlockedIncrementNoFence(Ptr)
+#    else
+#        define TUN_LOG_INCREMENT(Ptr) __atomic_add_fetch((Ptr), 1, __ATOMIC_RELAXED)
+#    endif
+#endif
+#ifndef TUN_LOG_WRITE_NO_FENCE
+#    if defined(_WIN32)
+#        define TUN_LOG_WRITE_NO_FENCE(Ptr, Value) WriteNoFence((Ptr), (Value))
+#    else
+#        define TUN_LOG_WRITE_NO_FENCE(Ptr, Value) __atomic_store_n((Ptr), (Value), __ATOMIC_RELAXED)
+#    endif
+#endif
+
+typedef struct _TUN_LOG_QUEUE
+{
+    /* Zeroed, Size of them. The sequence of an entry, less its index so zeroed entries start out free: equals the queue
+     * position the entry is free for, or that position plus one once the message is in. */
+    volatile LONG64 *Sequences;
+    ULONG Size;              /* Power of two */
+    volatile LONG64 Tail;    /* Next position to claim */
+    LONG64 Head;             /* Next position to drain. Only touched by the draining thread. */
+    volatile LONG64 Dropped; /* Messages not queued because the queue was full */
+} TUN_LOG_QUEUE;
+
+static inline void
+TunLogInit(TUN_LOG_QUEUE *Queue, volatile LONG64 *Sequences, ULONG Size)
+{
+    Queue->Sequences = Sequences;
+    Queue->Size = Size;
+    Queue->Tail = 0;
+    Queue->Head = 0;
+    Queue->Dropped = 0;
+}
+
+/* Claims the next free entry. Returns its position, whose entry index is TunLogIndex of it, and nonzero. Returns zero
+ * and counts the message as dropped if the queue is full. Never waits. */
+static inline int
+TunLogClaim(TUN_LOG_QUEUE *Queue, LONG64 *Position)
+{
+    LONG64 Tail = TUN_LOG_READ_NO_FENCE64(&Queue->Tail);
+    for (;;)
+    {
+        ULONG Index = (ULONG)Tail & (Queue->Size - 1);
+        LONG64 Free = TUN_LOG_READ_ACQUIRE64(&Queue->Sequences[Index]) + Index - Tail;
+        if (Free < 0)
+        {
+            TUN_LOG_INCREMENT64(&Queue->Dropped);
+            return 0;
+        }
+        if (!Free)
+        {
+            LONG64 Seen = TUN_LOG_COMPARE_EXCHANGE64(&Queue->Tail, Tail + 1, Tail);
+            if (Seen == Tail)
+            {
+                *Position = Tail;
+                return 1;
+            }
+            Tail = Seen;
+        }
+        else
+            Tail = TUN_LOG_READ_NO_FENCE64(&Queue->Tail);
+    }
+}
+
+static inline ULONG
+TunLogIndex(const TUN_LOG_QUEUE *Queue, LONG64 Position)
+{
+    return (ULONG)Position & (Queue->Size - 1);
+}
+
+/* Hands the message written to the entry claimed for Position to the draining thread. */
+static inline void
+TunLogPublish(TUN_LOG_QUEUE *Queue, LONG64 Position)
+{
+    ULONG Index = TunLogIndex(Queue, Position);
+    TUN_LOG_WRITE_RELEASE64(&Queue->Sequences[Index], Position + 1 - Index);
+}
+
+/* Returns nonzero if the message at the head is in, its entry index being TunLogIndex of Queue->Head. Messages come out
+ * in the order they were claimed, so one still being written holds up those claimed after it. */
+static inline int
+TunLogPeek(TUN_LOG_QUEUE *Queue)
+{
+    ULONG Index = TunLogIndex(Queue, Queue->Head);
+    return TUN_LOG_READ_ACQUIRE64(&Queue->Sequences[Index]) + Index == Queue->Head + 1;
+}
+
+/* Frees the entry at the head for a later claim, once its message is no longer needed, and moves on to the next. */
+static inline void
+TunLogRelease(TUN_LOG_QUEUE *Queue)
+{
+    ULONG Index = TunLogIndex(Queue, Queue->Head);
+    TUN_LOG_WRITE_RELEASE64(&Queue->Sequences[Index], Queue->Head + Queue->Size - Index);
+    ++Queue->Head;
+}
+
+typedef struct _TUN_LOG_RATE
+{
+    volatile LONG64 IntervalStart;
+    volatile LONG Count;
+} TUN_LOG_RATE;
+
+typedef struct _TUN_LOG_LIMIT
+{
+    TUN_LOG_RATE *Rates;        /* Zeroed, Sites of them */
+    ULONG Sites;                /* Rate limiting slots, which call sites share by address. Prime, as those are all
+                                 * but random. */
+    LONG Burst;                 /* Messages the call sites of a slot may log per interval */
+    LONG64 Interval;            /* In timestamp units */
+    volatile LONG64 Suppressed; /* Messages left out by rate limiting */
+} TUN_LOG_LIMIT;
+
+static inline void
+TunLogLimitInit(TUN_LOG_LIMIT *Limit, TUN_LOG_RATE *Rates, ULONG Sites, LONG Burst, LONG64 Interval)
+{
+    Limit->Rates = Rates;
+    Limit->Sites = Sites;
+    Limit->Burst = Burst;
+    Limit->Interval = Interval;
+    Limit->Suppressed = 0;
+}
+
+/* Returns nonzero for the first Burst messages of every interval of the slot of Site, counting the rest as
+ * suppressed. A new interval only starts once the current one is over, whichever call site logs, so sites sharing a
+ * slot are limited together rather than restarting each other's interval. Racing interval starts only let a few more
+ * through. */
+static inline int
+TunLogRateAllow(TUN_LOG_LIMIT *Limit, const void *Site, LONG64 Timestamp)
+{
+    TUN_LOG_RATE *Rate = &Limit->Rates[((size_t)Site >> 1) % Limit->Sites];
+    /* Signed, as a thread that took its timestamp before another started the interval may get here after it. */
+    if (Timestamp - TUN_LOG_READ_NO_FENCE64(&Rate->IntervalStart) >= Limit->Interval)
+    {
+        TUN_LOG_WRITE_NO_FENCE64(&Rate->IntervalStart, Timestamp);
+        TUN_LOG_WRITE_NO_FENCE(&Rate->Count, 1);
+        return 1;
+    }
+    if (TUN_LOG_INCREMENT(&Rate->Count) <= Limit->Burst)
+        return 1;
+    TUN_LOG_INCREMENT64(&Limit->Suppressed);
+    return 0;
+}
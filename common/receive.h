@@ -0,0 +1,132 @@
+/* SPDX-License-Identifier: GPL-2.0 OR MIT
+ *
+ * Copyright (C) 2018-2021 WireGuard LLC. All Rights Reserved.
+ */
+
+#pragma once
+
+/* Receive batch policy of the driver: which ring packets the receive thread indicates together, and how receive
+ * segment coalescing merges them within a batch. The driver builds an NBL for every packet TunReceiveBatchAdd takes and
+ * chains the payload of every one TunReceiveBatchAppend takes behind the NBL at the batch tail; this header only keeps
+ * the count. Like ring.h, this header builds without Win32 types. */
+
+#include "rsc.h"
+
+/* Ring packets the receive thread takes into one indication, unless the ReceiveBatchSize adapter setting says
+ * otherwise, and the most that setting may say. */
+#define TUN_RECEIVE_BATCH_DEFAULT 64
+#define TUN_RECEIVE_BATCH_MAX 256
+
+/* Returns the batch size for a ReceiveBatchSize adapter setting of Setting, zero if there is none. Settings out of
+ * range fall back to the default. */
+static inline ULONG
+TunReceiveBatchSize(ULONG Setting)
+{
+    return Setting >= 1 && Setting <= TUN_RECEIVE_BATCH_MAX ? Setting : TUN_RECEIVE_BATCH_DEFAULT;
+}
+
+typedef struct _TUN_RECEIVE_BATCH
+{
+    TUN_RING_BATCH Ring; /* Ring packets taken, up to the batch size, whether they go up or not */
+    int RscIPv4, RscIPv6;
+    int Coalescing; /* Nonzero while Rsc grows the packet at the batch tail */
+    TUN_RSC Rsc;
+    ULONG Indicated; /* Packets going up, the segments coalesced into one counting once */
+    ULONG Packets;   /* Ring packets going up */
+    ULONG Version;   /* IP version of the first packet going up */
+    int Mixed;       /* Nonzero if packets of both IP versions go up */
+} TUN_RECEIVE_BATCH;
+
+/* Starts a batch at ring offset Head with Tail last observed, of up to Max ring packets. */
+static inline void
+TunReceiveBatchBegin(TUN_RECEIVE_BATCH *Batch, ULONG Head, ULONG Tail, ULONG Max, int RscIPv4, int RscIPv6)
+{
+    TunRingBatchBegin(&Batch->Ring, Head, Tail, Max);
+    Batch->RscIPv4 = RscIPv4;
+    Batch->RscIPv6 = RscIPv6;
+    Batch->Coalescing = 0;
+    Batch->Indicated = 0;
+    Batch->Packets = 0;
+    Batch->Version = 0;
+    Batch->Mixed = 0;
+}
+
+/* Takes the next ring packet of the batch that can go up, setting *Version to 4 or 6. Packets that are not IP are
+ * skipped, but count against the batch size like any other. Returns the status of TunRingBatchNext otherwise:
+ * TUN_RING_EMPTY once the batch is full or the ring drained, or TUN_RING_EOF or TUN_RING_CORRUPT. The packets taken
+ * before still go up whatever the status, so the batch is indicated before the thread waits or gives up on the ring. */
+static inline TUN_RING_STATUS
+TunReceiveBatchNext(
+    TUN_RECEIVE_BATCH *Batch,
+    TUN_RING *Ring,
+    ULONG Capacity,
+    TUN_PACKET **Packet,
+    ULONG *PacketSize,
+    ULONG *Version)
+{
+    TUN_RING_STATUS Status;
+    while ((Status = TunRingBatchNext(&Batch->Ring, Ring, Capacity, Packet, PacketSize)) == TUN_RING_OK)
+    {
+        if (*PacketSize >= 20 && (*Packet)->Data[0] >> 4 == 4)
+        {
+            *Version = 4;
+            break;
+        }
+        if (*PacketSize >= 40 && (*Packet)->Data[0] >> 4 == 6)
+        {
+            *Version = 6;
+            break;
+        }
+    }
+    return Status;
+}
+
+/* Checks whether the packet continues the one coalescing grows at the batch tail, and fills in Segment for
+ * TunReceiveBatchAppend if so. */
+static inline int
+TunReceiveBatchCoalesces(
+    TUN_RECEIVE_BATCH *Batch,
+    const UCHAR *Packet,
+    ULONG PacketSize,
+    TUN_RSC_SEGMENT *Segment)
+{
+    return Batch->Coalescing && TunRscCheck(&Batch->Rsc, Packet, PacketSize, Segment);
+}
+
+/* Appends a segment TunReceiveBatchCoalesces accepted to the packet at the batch tail. */
+static inline void
+TunReceiveBatchAppend(TUN_RECEIVE_BATCH *Batch, const TUN_RSC_SEGMENT *Segment)
+{
+    TunRscAppend(&Batch->Rsc, Segment);
+    Batch->Packets++;
+}
+
+/* Ends coalescing into the packet at the batch tail. Returns the segments coalesced into it, its headers rewritten to
+ * describe them, if more than one; zero otherwise. Call before the next packet goes up on its own, and once the batch
+ * is complete: a coalesced packet never spans two indications. */
+static inline ULONG
+TunReceiveBatchEndRsc(TUN_RECEIVE_BATCH *Batch)
+{
+    if (!Batch->Coalescing)
+        return 0;
+    Batch->Coalescing = 0;
+    if (Batch->Rsc.Segments < 2)
+        return 0;
+    TunRscFinish(&Batch->Rsc);
+    return Batch->Rsc.Segments;
+}
+
+/* Adds the packet TunReceiveBatchNext took, of IP Version, to the batch tail, on its own. Coalescing into it starts if
+ * enabled for its IP version and the packet may start a coalesced one. */
+static inline void
+TunReceiveBatchAdd(TUN_RECEIVE_BATCH *Batch, UCHAR *Packet, ULONG PacketSize, ULONG Version)
+{
+    if (!Batch->Indicated)
+        Batch->Version = Version;
+    else if (Version != Batch->Version)
+        Batch->Mixed = 1;
+    Batch->Indicated++;
+    Batch->Packets++;
+    Batch->Coalescing =
+        (Version == 4 ? Batch->RscIPv4 : Batch->RscIPv6) && TunRscStart(&Batch->Rsc, Packet, PacketSize);
+}
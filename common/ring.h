@@ -0,0 +1,395 @@
+/* SPDX-License-Identifier: GPL-2.0 OR MIT
+ *
+ * Copyright (C) 2018-2021 WireGuard LLC. All Rights Reserved.
+ */
+
+#pragma once
+
+/* Ring layout and ring arithmetic shared by the driver and the user-mode API. This header does not depend on kernel,
+ * Win32 or NDIS types, so it builds with MSVC in both modes and with GCC/Clang elsewhere. Atomics and the CPU relax
+ * hint used while spinning are pluggable: define any of the TUN_RING_* primitives below before including this header
+ * to override the defaults. */
+
+#if defined(_WIN32)
+#    pragma warning(push)
+#    pragma warning(disable : 4200) /* nonstandard: zero-sized array in struct/union */
+#else
+#    include <stddef.h>
+#    include <stdint.h>
+typedef uint8_t UCHAR;
+typedef uint16_t USHORT;
+typedef int32_t LONG;
+typedef uint32_t ULONG;
+typedef int64_t LONG64;
+typedef uint64_t ULONG64;
+#endif
+
+#ifndef TUN_RING_READ_ACQUIRE
+#    if defined(_WIN32)
+#        define TUN_RING_READ_ACQUIRE(Ptr) ReadULongAcquire(Ptr)
+#    else
+#        define TUN_RING_READ_ACQUIRE(Ptr) __atomic_load_n((Ptr), __ATOMIC_ACQUIRE)
+#    endif
+#endif
+#ifndef TUN_RING_READ_NO_FENCE
+#    if defined(_WIN32)
+#        define TUN_RING_READ_NO_FENCE(Ptr) ReadULongNoFence(Ptr)
+#    else
+#        define TUN_RING_READ_NO_FENCE(Ptr) __atomic_load_n((Ptr), __ATOMIC_RELAXED)
+#    endif
+#endif
+#ifndef TUN_RING_WRITE_RELEASE
+#    if defined(_WIN32)
+#        define TUN_RING_WRITE_RELEASE(Ptr, Value) WriteULongRelease((Ptr), (Value))
+#    else
+#        define TUN_RING_WRITE_RELEASE(Ptr, Value) __atomic_store_n((Ptr), (Value), __ATOMIC_RELEASE)
+#    endif
+#endif
+#ifndef TUN_RING_READ_ACQUIRE_LONG
+#    if defined(_WIN32)
+#        define TUN_RING_READ_ACQUIRE_LONG(Ptr) ReadAcquire(Ptr)
+#    else
+#        define TUN_RING_READ_ACQUIRE_LONG(Ptr) __atomic_load_n((Ptr), __ATOMIC_ACQUIRE)
+#    endif
+#endif
+#ifndef TUN_RING_WRITE_RELEASE_LONG
+#    if defined(_WIN32)
+#        define TUN_RING_WRITE_RELEASE_LONG(Ptr, Value) WriteRelease((Ptr), (Value))
+#    else
+#        define TUN_RING_WRITE_RELEASE_LONG(Ptr, Value) __atomic_store_n((Ptr), (Value), __ATOMIC_RELEASE)
+#    endif
+#endif
+#ifndef TUN_RING_COMPARE_EXCHANGE
+#    if defined(_WIN32)
+#        define TUN_RING_COMPARE_EXCHANGE(Ptr, Exchange, Comparand) \
+            ((ULONG)InterlockedCompareExchange((volatile LONG *)(Ptr), (LONG)(Exchange), (LONG)(Comparand)))
+#    else
+#        define TUN_RING_COMPARE_EXCHANGE(Ptr, Exchange, Comparand) \
+            __sync_val_compare_and_swap((Ptr), (Comparand), (Exchange))
+#    endif
+#endif
+#ifndef TUN_RING_CPU_RELAX
+#    if defined(_WIN32)
+#        define TUN_RING_CPU_RELAX() YieldProcessor()
+#    elif defined(__x86_64__) || defined(__i386__)
+#        define TUN_RING_CPU_RELAX() __builtin_ia32_pause()
+#    elif defined(__aarch64__) || defined(__arm__)
+#        define TUN_RING_CPU_RELAX() __asm__ __volatile__("yield")
+#    else
+#        define TUN_RING_CPU_RELAX() __asm__ __volatile__("" ::: "memory")
+#    endif
+#endif
+
+/* Memory alignment of packets and rings */
+#define TUN_ALIGNMENT sizeof(ULONG)
+#define TUN_ALIGN(Size) (((ULONG)(Size) + ((ULONG)TUN_ALIGNMENT - 1)) & ~((ULONG)TUN_ALIGNMENT - 1))
+#define TUN_IS_ALIGNED(Size) (!((ULONG)(Size) & ((ULONG)TUN_ALIGNMENT - 1)))
+/* Maximum IP packet size */
+#define TUN_MAX_IP_PACKET_SIZE 0xFFFF
+/* Maximum packet size */
+#define TUN_MAX_PACKET_SIZE TUN_ALIGN(sizeof(TUN_PACKET) + TUN_MAX_IP_PACKET_SIZE)
+/* Minimum ring capacity. */
+#define TUN_MIN_RING_CAPACITY 0x20000 /* 128kiB */
+/* Maximum ring capacity. */
+#define TUN_MAX_RING_CAPACITY 0x4000000 /* 64MiB */
+/* Calculates ring capacity */
+#define TUN_RING_CAPACITY(Size) ((Size) - sizeof(TUN_RING) - (TUN_MAX_PACKET_SIZE - TUN_ALIGNMENT))
+/* Calculates ring size */
+#define TUN_RING_SIZE(Capacity) (sizeof(TUN_RING) + (Capacity) + (TUN_MAX_PACKET_SIZE - TUN_ALIGNMENT))
+/* Calculates ring offset modulo capacity */
+#define TUN_RING_WRAP(Value, Capacity) ((Value) & ((Capacity)-1))
+/* Set in TUN_PACKET.Size by the user-mode side while the packet is still owned by it: on the send ring the packet has
+ * been released by the client, on the receive ring the packet is still being filled in by the client. The driver never
+ * sees this bit. */
+#define TUN_PACKET_RELEASE ((ULONG)0x80000000)
+/* Bits of TUN_PACKET.Size holding the packet data size */
+#define TUN_PACKET_SIZE_MASK ((ULONG)0xFFFF)
+/* Set in bits 16-30 of TUN_PACKET.Size by the driver on the send ring, for clients that registered with
+ * TUN_REGISTER_FLAG_GSO: the packet is a TCP super-packet to be cut into segments of at most this many payload bytes.
+ * Zero for ordinary packets. */
+#define TUN_PACKET_GSO_SHIFT 16
+#define TUN_PACKET_GSO_MAX_MSS 0x7FFF
+#define TUN_PACKET_GSO_MSS(Size) (((ULONG)(Size) >> TUN_PACKET_GSO_SHIFT) & TUN_PACKET_GSO_MAX_MSS)
+/* Registration flag: the client accepts TCP super-packets on the send ring, see TUN_PACKET_GSO_SHIFT. */
+#define TUN_REGISTER_FLAG_GSO 0x1
+
+typedef struct _TUN_PACKET
+{
+    /* Size of packet data (TUN_MAX_IP_PACKET_SIZE max) */
+    ULONG Size;
+
+    /* Packet data */
+    UCHAR Data[];
+} TUN_PACKET;
+
+typedef struct _TUN_RING
+{
+    /* Byte offset of the first packet in the ring. Its value must be a multiple of TUN_ALIGNMENT and less than ring
+     * capacity. */
+    volatile ULONG Head;
+
+    /* Byte offset of the first free space in the ring. Its value must be multiple of TUN_ALIGNMENT and less than ring
+     * capacity. */
+    volatile ULONG Tail;
+
+    /* Non-zero when consumer is in alertable state. */
+    volatile LONG Alertable;
+
+    /* Ring data. Its capacity must be a power of 2 + extra TUN_MAX_PACKET_SIZE-TUN_ALIGNMENT space to
+     * eliminate need for wrapping. */
+    UCHAR Data[];
+} TUN_RING;
+
+typedef enum _TUN_RING_STATUS
+{
+    TUN_RING_OK,      /* A complete packet is available */
+    TUN_RING_EMPTY,   /* Head caught up with tail */
+    TUN_RING_EOF,     /* Peer invalidated the ring */
+    TUN_RING_CORRUPT  /* Ring content is inconsistent */
+} TUN_RING_STATUS;
+
+/* Checks ring capacity is within bounds and a power of two. */
+static inline int
+TunRingIsValidCapacity(ULONG Capacity)
+{
+    return Capacity >= TUN_MIN_RING_CAPACITY && Capacity <= TUN_MAX_RING_CAPACITY && !(Capacity & (Capacity - 1));
+}
+
+/* Returns number of bytes the producer may still write before catching up with the head. */
+static inline ULONG
+TunRingSpace(ULONG Head, ULONG Tail, ULONG Capacity)
+{
+    return TUN_RING_WRAP(Head - Tail - TUN_ALIGNMENT, Capacity);
+}
+
+/* Returns number of bytes between the head and the tail. */
+static inline ULONG
+TunRingContent(ULONG Head, ULONG Tail, ULONG Capacity)
+{
+    return TUN_RING_WRAP(Tail - Head, Capacity);
+}
+
+static inline TUN_PACKET *
+TunRingPacketAt(TUN_RING *Ring, ULONG Offset)
+{
+    return (TUN_PACKET *)(Ring->Data + Offset);
+}
+
+/* Validates the packet at Head given a previously observed Tail. The packet size is fetched exactly once, as the peer
+ * may be rewriting it concurrently. On TUN_RING_OK, *Packet, *PacketSize and *AlignedPacketSize describe the packet,
+ * TUN_RING_WRAP(Head + *AlignedPacketSize, Capacity) is the offset of the next one, and *Mss is the GSO segment size,
+ * or zero for an ordinary packet. */
+static inline TUN_RING_STATUS
+TunRingPeekPacketGso(
+    TUN_RING *Ring,
+    ULONG Capacity,
+    ULONG Head,
+    ULONG Tail,
+    TUN_PACKET **Packet,
+    ULONG *PacketSize,
+    ULONG *AlignedPacketSize,
+    ULONG *Mss)
+{
+    if (Head >= Capacity || Tail >= Capacity)
+        return TUN_RING_EOF;
+    if (Head == Tail)
+        return TUN_RING_EMPTY;
+    ULONG Content = TunRingContent(Head, Tail, Capacity);
+    if (Content < sizeof(TUN_PACKET))
+        return TUN_RING_CORRUPT;
+    TUN_PACKET *BuffPacket = TunRingPacketAt(Ring, Head);
+    ULONG Size = *(volatile ULONG *)&BuffPacket->Size;
+    if ((Size & ~(TUN_PACKET_GSO_MAX_MSS << TUN_PACKET_GSO_SHIFT)) > TUN_MAX_IP_PACKET_SIZE)
+        return TUN_RING_CORRUPT;
+    ULONG Aligned = TUN_ALIGN(sizeof(TUN_PACKET) + (Size & TUN_PACKET_SIZE_MASK));
+    if (Aligned > Content)
+        return TUN_RING_CORRUPT;
+    *Packet = BuffPacket;
+    *PacketSize = Size & TUN_PACKET_SIZE_MASK;
+    *AlignedPacketSize = Aligned;
+    *Mss = TUN_PACKET_GSO_MSS(Size);
+    return TUN_RING_OK;
+}
+
+/* Like TunRingPeekPacketGso, but for rings that only carry ordinary packets. */
+static inline TUN_RING_STATUS
+TunRingPeekPacket(
+    TUN_RING *Ring,
+    ULONG Capacity,
+    ULONG Head,
+    ULONG Tail,
+    TUN_PACKET **Packet,
+    ULONG *PacketSize,
+    ULONG *AlignedPacketSize)
+{
+    ULONG Mss;
+    TUN_RING_STATUS Status =
+        TunRingPeekPacketGso(Ring, Capacity, Head, Tail, Packet, PacketSize, AlignedPacketSize, &Mss);
+    return Status == TUN_RING_OK && Mss ? TUN_RING_CORRUPT : Status;
+}
+
+/* Producer side, for any number of concurrent producers: reserves Required bytes of ring space. *Reserved is the
+ * producers' private tail and *Published the tail made visible so far. Both start at the ring tail and then run free
+ * rather than wrap at capacity, so a compare-and-swap cannot mistake a later lap for the value it read. *Head is the
+ * ring head. Returns zero if the ring lacks the space. Otherwise stores the reservation start in *Start, and the
+ * producer must pass it to TunRingPublish once it has written the packets. */
+static inline int
+TunRingReserve(volatile ULONG *Reserved, const volatile ULONG *Head, ULONG Capacity, ULONG Required, ULONG *Start)
+{
+    ULONG Tail = TUN_RING_READ_ACQUIRE(Reserved);
+    for (;;)
+    {
+        /* The head is read after the tail it is compared with. A head read earlier may be a lap behind by the time the
+         * tail is, and then show space that was handed out since. While the tail holds still, the head cannot pass it,
+         * so if the compare-and-swap below finds the same tail, the space was free. */
+        if (TunRingSpace(TUN_RING_READ_ACQUIRE(Head), Tail, Capacity) < Required)
+            return 0;
+        ULONG Seen = TUN_RING_COMPARE_EXCHANGE(Reserved, Tail + Required, Tail);
+        if (Seen == Tail)
+        {
+            *Start = Tail;
+            return 1;
+        }
+        Tail = Seen;
+    }
+}
+
+/* Producer side: moves the ring tail up to End, the reservation start plus the bytes reserved, once every earlier
+ * reservation has been published. Producers publish in reservation order, so the consumer never sees a tail past
+ * space still being written. Each producer waits for its predecessors here, which stays short as long as producers
+ * cannot be preempted between reserving and publishing. */
+static inline void
+TunRingPublish(TUN_RING *Ring, ULONG Capacity, volatile ULONG *Published, ULONG Start, ULONG End)
+{
+    while (TUN_RING_READ_ACQUIRE(Published) != Start)
+        TUN_RING_CPU_RELAX();
+    TUN_RING_WRITE_RELEASE(&Ring->Tail, TUN_RING_WRAP(End, Capacity));
+    TUN_RING_WRITE_RELEASE(Published, End);
+}
+
+/* Consumer side batch: up to Max packets taken from the ring in one go. */
+typedef struct _TUN_RING_BATCH
+{
+    ULONG Head;  /* Offset of the next packet, and of the first byte past the batch once it is complete */
+    ULONG Tail;  /* Tail last observed */
+    ULONG Count; /* Packets taken so far */
+    ULONG Max;
+    /* Size of the packets TunRingBatchTake took so far, which lie within the ring and so add up to less than the
+     * largest capacity, and nonzero if they were not all of the same size. Lets the client count the batch without
+     * another pass over it. */
+    ULONG Bytes;
+    ULONG Mixed;
+} TUN_RING_BATCH;
+
+static inline void
+TunRingBatchBegin(TUN_RING_BATCH *Batch, ULONG Head, ULONG Tail, ULONG Max)
+{
+    Batch->Head = Head;
+    Batch->Tail = Tail;
+    Batch->Count = 0;
+    Batch->Max = Max;
+    Batch->Bytes = 0;
+    Batch->Mixed = 0;
+}
+
+/* Takes the next packet into the batch. Once the packets up to the observed tail are used up, the tail is read again,
+ * so packets the producer adds meanwhile join the batch. Returns TUN_RING_EMPTY when the batch is full or the ring is
+ * drained. On TUN_RING_EOF or TUN_RING_CORRUPT, Head stays at the offending packet. */
+static inline TUN_RING_STATUS
+TunRingBatchNext(TUN_RING_BATCH *Batch, TUN_RING *Ring, ULONG Capacity, TUN_PACKET **Packet, ULONG *PacketSize)
+{
+    ULONG AlignedPacketSize;
+    if (Batch->Count >= Batch->Max)
+        return TUN_RING_EMPTY;
+    if (Batch->Head == Batch->Tail)
+        Batch->Tail = TUN_RING_READ_ACQUIRE(&Ring->Tail);
+    TUN_RING_STATUS Status =
+        TunRingPeekPacket(Ring, Capacity, Batch->Head, Batch->Tail, Packet, PacketSize, &AlignedPacketSize);
+    if (Status != TUN_RING_OK)
+        return Status;
+    Batch->Head = TUN_RING_WRAP(Batch->Head + AlignedPacketSize, Capacity);
+    Batch->Count++;
+    return TUN_RING_OK;
+}
+
+/* Returns nonzero if the packet is to be handed to the client. */
+typedef int (*TUN_RING_ACCEPT)(const void *Context, const UCHAR *Data, ULONG Size);
+
+/* Client side of the send ring: takes the data of up to Batch->Max packets up to the observed tail into Packets, and
+ * their sizes into Sizes, without rereading the tail. Super-packets count as corrupt unless Gso is set. Packets Accept
+ * rejects get TUN_PACKET_RELEASE set and are skipped, adding to *Skipped. Returns TUN_RING_EMPTY once the batch is full
+ * or the tail is reached. Otherwise returns the status of the packet at Batch->Head, which stays on it: the packets
+ * taken before it are still returned, and the next batch stops on it again. */
+static inline TUN_RING_STATUS
+TunRingBatchTake(
+    TUN_RING_BATCH *Batch,
+    TUN_RING *Ring,
+    ULONG Capacity,
+    int Gso,
+    TUN_RING_ACCEPT Accept,
+    const void *Context,
+    UCHAR **Packets,
+    ULONG *Sizes,
+    ULONG *Skipped)
+{
+    while (Batch->Count < Batch->Max)
+    {
+        TUN_PACKET *Packet;
+        ULONG PacketSize, AlignedPacketSize, Mss;
+        TUN_RING_STATUS Status = TunRingPeekPacketGso(
+            Ring, Capacity, Batch->Head, Batch->Tail, &Packet, &PacketSize, &AlignedPacketSize, &Mss);
+        if (Status == TUN_RING_OK && Mss && !Gso)
+            Status = TUN_RING_CORRUPT;
+        if (Status != TUN_RING_OK)
+            return Status;
+        Batch->Head = TUN_RING_WRAP(Batch->Head + AlignedPacketSize, Capacity);
+        if (Accept && !Accept(Context, Packet->Data, PacketSize))
+        {
+            Packet->Size = PacketSize | TUN_PACKET_RELEASE;
+            ++*Skipped;
+            continue;
+        }
+        Packets[Batch->Count] = Packet->Data;
+        Sizes[Batch->Count] = PacketSize;
+        Batch->Bytes += PacketSize;
+        Batch->Mixed |= PacketSize ^ Sizes[0];
+        Batch->Count++;
+    }
+    return TUN_RING_EMPTY;
+}
+
+/* Consumer side: walks from Cursor over packets the client has marked with TUN_PACKET_RELEASE, decrementing *Pending
+ * for each. Returns the new cursor, which is the ring head to publish. */
+static inline ULONG
+TunRingAdvanceReleased(TUN_RING *Ring, ULONG Capacity, ULONG Cursor, ULONG *Pending)
+{
+    while (*Pending)
+    {
+        ULONG Size = TunRingPacketAt(Ring, Cursor)->Size;
+        if (!(Size & TUN_PACKET_RELEASE))
+            break;
+        Cursor = TUN_RING_WRAP(Cursor + TUN_ALIGN(sizeof(TUN_PACKET) + (Size & TUN_PACKET_SIZE_MASK)), Capacity);
+        --*Pending;
+    }
+    return Cursor;
+}
+
+/* Producer side: walks from Cursor over packets the client has finished filling in (TUN_PACKET_RELEASE cleared),
+ * decrementing *Pending for each. Returns the new cursor, which is the ring tail to publish. */
+static inline ULONG
+TunRingAdvanceCommitted(TUN_RING *Ring, ULONG Capacity, ULONG Cursor, ULONG *Pending)
+{
+    while (*Pending)
+    {
+        ULONG Size = TunRingPacketAt(Ring, Cursor)->Size;
+        if (Size & TUN_PACKET_RELEASE)
+            break;
+        Cursor = TUN_RING_WRAP(Cursor + TUN_ALIGN(sizeof(TUN_PACKET) + Size), Capacity);
+        --*Pending;
+    }
+    return Cursor;
+}
+
+#if defined(_WIN32)
+#    pragma warning(pop)
+#endif
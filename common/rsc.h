@@ -0,0 +1,207 @@
+/* SPDX-License-Identifier: GPL-2.0 OR MIT
+ *
+ * Copyright (C) 2018-2021 WireGuard LLC. All Rights Reserved.
+ */
+
+#pragma once
+
+/* Receive segment coalescing: merges consecutive in-order TCP segments of one flow into one larger packet, so the
+ * network stack processes them at once. The coalesced packet keeps the headers of the first segment, with lengths,
+ * flags and checksums fixed up in place, followed by the payloads of all segments; the caller is left to describe that
+ * layout, without copying payloads. Segments only merge if nothing but their payload and sequence number differs, as
+ * TCP would otherwise need to see them one by one: plain ACK segments, with PSH allowed on the last one, carrying the
+ * same ACK number, window and TCP options. Every segment's checksums are verified while coalescing, so a corrupt
+ * segment is left on its own rather than spoiling the coalesced packet, and the coalesced packet's TCP checksum is
+ * composed from the segments' payload sums, so payloads are read once. Like ring.h, this header builds without Win32
+ * types. */
+
+#include "checksum.h"
+
+#define TUN_RSC_TCP_ACK 0x10
+#define TUN_RSC_TCP_PSH 0x08
+
+typedef struct _TUN_RSC
+{
+    UCHAR *Packet;       /* First segment, whose headers become those of the coalesced packet */
+    ULONG IpHeaderSize;
+    ULONG HeaderSize;    /* IP and TCP headers */
+    ULONG Mss;           /* Payload size of the first segment, which all but the last segment must match */
+    ULONG Size;          /* Coalesced packet size so far */
+    ULONG NextSequence;  /* Sequence number the next segment must start at */
+    ULONG Segments;
+    ULONG64 PayloadSum;  /* Ones' complement sum of the payloads so far, as laid out in the coalesced packet */
+    UCHAR Push;          /* Last segment has PSH set */
+    UCHAR Closed;        /* No more segments may follow */
+} TUN_RSC;
+
+/* A segment TunRscCheck found to continue the coalesced packet, for TunRscAppend. */
+typedef struct _TUN_RSC_SEGMENT
+{
+    ULONG PayloadSize;
+    ULONG64 PayloadSum;
+    UCHAR Push;
+} TUN_RSC_SEGMENT;
+
+static inline ULONG
+TunRscLoad32(const UCHAR *Data)
+{
+    return ((ULONG)Data[0] << 24) | ((ULONG)Data[1] << 16) | ((ULONG)Data[2] << 8) | Data[3];
+}
+
+/* Returns the IP header size of a packet that may be coalesced, or zero: unfragmented IPv4 without options, or IPv6
+ * without extension headers, not marked as having experienced congestion, carrying TCP with payload and only ACK, and
+ * maybe PSH, set. Congestion marks must reach TCP once per segment. */
+static inline ULONG
+TunRscParse(const UCHAR *Packet, ULONG Size, ULONG *HeaderSize)
+{
+    ULONG IpHeaderSize;
+    if (Size >= 40 && Packet[0] == 0x45)
+    {
+        if (Packet[9] != 6 /* TCP */ || ((ULONG)Packet[2] << 8 | Packet[3]) != Size || (Packet[6] & 0x3F) ||
+            Packet[7] || (Packet[1] & 3) == 3 /* CE */)
+            return 0;
+        IpHeaderSize = 20;
+    }
+    else if (Size >= 60 && Packet[0] >> 4 == 6)
+    {
+        if (Packet[6] != 6 /* TCP */ || 40 + ((ULONG)Packet[4] << 8 | Packet[5]) != Size ||
+            (Packet[1] >> 4 & 3) == 3 /* CE */)
+            return 0;
+        IpHeaderSize = 40;
+    }
+    else
+        return 0;
+    const UCHAR *Tcp = Packet + IpHeaderSize;
+    *HeaderSize = IpHeaderSize + (Tcp[12] >> 4) * 4;
+    if (*HeaderSize < IpHeaderSize + 20 || *HeaderSize >= Size || (Tcp[13] & ~TUN_RSC_TCP_PSH) != TUN_RSC_TCP_ACK ||
+        Tcp[18] || Tcp[19])
+        return 0;
+    return IpHeaderSize;
+}
+
+/* Sums the payload of a segment and verifies its checksums. Returns zero if they are wrong. */
+static inline int
+TunRscVerify(const UCHAR *Packet, ULONG IpHeaderSize, ULONG HeaderSize, ULONG Size, ULONG64 *PayloadSum)
+{
+    if (IpHeaderSize == 20 && TunChecksumFold(TunChecksumAddScalar(0, Packet, 20)) != 0xFFFF)
+        return 0;
+    *PayloadSum = TunChecksumAdd(0, Packet + HeaderSize, Size - HeaderSize);
+    ULONG64 Sum = TunChecksumPseudoHeader(
+        *PayloadSum, Packet + IpHeaderSize - (IpHeaderSize == 20 ? 8 : 32), IpHeaderSize == 20 ? 8 : 32, 6,
+        Size - IpHeaderSize);
+    Sum = TunChecksumAddScalar(Sum, Packet + IpHeaderSize, HeaderSize - IpHeaderSize);
+    return TunChecksumFold(Sum) == 0xFFFF;
+}
+
+/* Considers the Size bytes of packet at Packet as the first segment of a coalesced packet. Returns zero if it cannot
+ * be coalesced with anything. Packet stays untouched unless TunRscFinish is called with more segments appended. */
+static inline int
+TunRscStart(TUN_RSC *Rsc, UCHAR *Packet, ULONG Size)
+{
+    ULONG HeaderSize = 0, IpHeaderSize = TunRscParse(Packet, Size, &HeaderSize);
+    if (!IpHeaderSize || Packet[IpHeaderSize + 13] & TUN_RSC_TCP_PSH)
+        return 0;
+    Rsc->Packet = Packet;
+    Rsc->IpHeaderSize = IpHeaderSize;
+    Rsc->HeaderSize = HeaderSize;
+    Rsc->Mss = Size - HeaderSize;
+    Rsc->Size = Size;
+    Rsc->NextSequence = TunRscLoad32(Packet + IpHeaderSize + 4) + Rsc->Mss;
+    Rsc->Segments = 1;
+    Rsc->PayloadSum = 0;
+    Rsc->Push = 0;
+    Rsc->Closed = 0;
+    return 1;
+}
+
+/* Checks whether the Size bytes of packet at Packet continue the coalesced packet, and fills in Segment for
+ * TunRscAppend if so. The first segment is only verified here, once it has company. Returns zero if the packet does
+ * not continue the coalesced packet, which is then complete. */
+static inline int
+TunRscCheck(TUN_RSC *Rsc, const UCHAR *Packet, ULONG Size, TUN_RSC_SEGMENT *Segment)
+{
+    ULONG HeaderSize = 0;
+    if (Rsc->Closed || TunRscParse(Packet, Size, &HeaderSize) != Rsc->IpHeaderSize || HeaderSize != Rsc->HeaderSize)
+        return 0;
+    const UCHAR *First = Rsc->Packet;
+    ULONG IpHeaderSize = Rsc->IpHeaderSize;
+    if (IpHeaderSize == 20)
+    {
+        /* Version to DSCP, then DF and TTL to protocol, then addresses */
+        if (First[0] != Packet[0] || First[1] != Packet[1] || First[6] != Packet[6] || First[8] != Packet[8] ||
+            First[9] != Packet[9] || memcmp(First + 12, Packet + 12, 8))
+            return 0;
+    }
+    else
+    {
+        /* Version, traffic class and flow label, then next header to addresses */
+        if (memcmp(First, Packet, 4) || memcmp(First + 6, Packet + 6, 34))
+            return 0;
+    }
+    const UCHAR *FirstTcp = First + IpHeaderSize, *Tcp = Packet + IpHeaderSize;
+    ULONG PayloadSize = Size - HeaderSize;
+    /* Ports, then ACK number, then window, then options */
+    if (memcmp(FirstTcp, Tcp, 4) || TunRscLoad32(Tcp + 4) != Rsc->NextSequence || memcmp(FirstTcp + 8, Tcp + 8, 4) ||
+        memcmp(FirstTcp + 14, Tcp + 14, 2) || memcmp(FirstTcp + 20, Tcp + 20, HeaderSize - IpHeaderSize - 20) ||
+        PayloadSize > Rsc->Mss || Rsc->Size + PayloadSize > TUN_MAX_IP_PACKET_SIZE)
+        return 0;
+    if (Rsc->Segments == 1 && !TunRscVerify(First, IpHeaderSize, HeaderSize, Rsc->Size, &Rsc->PayloadSum))
+    {
+        Rsc->Closed = 1;
+        return 0;
+    }
+    if (!TunRscVerify(Packet, IpHeaderSize, HeaderSize, Size, &Segment->PayloadSum))
+        return 0;
+    Segment->PayloadSize = PayloadSize;
+    Segment->Push = (UCHAR)!!(Tcp[13] & TUN_RSC_TCP_PSH);
+    return 1;
+}
+
+/* Appends a segment TunRscCheck accepted. */
+static inline void
+TunRscAppend(TUN_RSC *Rsc, const TUN_RSC_SEGMENT *Segment)
+{
+    /* A payload landing at an odd offset has its bytes summed in swapped order. */
+    USHORT Sum = TunChecksumFold(Segment->PayloadSum);
+    if ((Rsc->Size - Rsc->HeaderSize) & 1)
+        Sum = (USHORT)(Sum << 8 | Sum >> 8);
+    Rsc->PayloadSum = TunChecksumAdd64(Rsc->PayloadSum, Sum);
+    Rsc->Size += Segment->PayloadSize;
+    Rsc->NextSequence += Segment->PayloadSize;
+    Rsc->Segments++;
+    Rsc->Push = Segment->Push;
+    /* A short segment or a push ends what the sender meant as one run of full-sized segments. */
+    if (Segment->PayloadSize < Rsc->Mss || Segment->Push)
+        Rsc->Closed = 1;
+}
+
+/* Rewrites the headers of the first segment to describe the coalesced packet of Rsc->Size bytes. Only call if
+ * segments were appended. */
+static inline void
+TunRscFinish(TUN_RSC *Rsc)
+{
+    UCHAR *Packet = Rsc->Packet, *Tcp = Packet + Rsc->IpHeaderSize;
+    ULONG TcpSize = Rsc->Size - Rsc->IpHeaderSize;
+    USHORT Checksum;
+    ULONG64 Sum;
+    if (Rsc->IpHeaderSize == 20)
+    {
+        Packet[2] = (UCHAR)(Rsc->Size >> 8);
+        Packet[3] = (UCHAR)Rsc->Size;
+        Packet[10] = Packet[11] = 0;
+        Checksum = TunChecksumFinish(TunChecksumAddScalar(0, Packet, 20));
+        memcpy(Packet + 10, &Checksum, sizeof(Checksum));
+        Sum = TunChecksumPseudoHeader(Rsc->PayloadSum, Packet + 12, 8, 6, TcpSize);
+    }
+    else
+    {
+        Packet[4] = (UCHAR)(TcpSize >> 8);
+        Packet[5] = (UCHAR)TcpSize;
+        Sum = TunChecksumPseudoHeader(Rsc->PayloadSum, Packet + 8, 32, 6, TcpSize);
+    }
+    if (Rsc->Push)
+        Tcp[13] |= TUN_RSC_TCP_PSH;
+    Tcp[16] = Tcp[17] = 0;
+    Checksum = TunChecksumFinish(TunChecksumAddScalar(Sum, Tcp, Rsc->HeaderSize - Rsc->IpHeaderSize));
+    memcpy(Tcp + 16, &Checksum, sizeof(Checksum));
+}
@@ -0,0 +1,79 @@
+/* SPDX-License-Identifier: GPL-2.0 OR MIT
+ *
+ * Copyright (C) 2018-2021 WireGuard LLC. All Rights Reserved.
+ */
+
+#pragma once
+
+/* Statistics page the client registers next to its rings. The driver locks it, bumps the counters with relaxed atomic
+ * adds and never reads them back; the client reads them without any IOCTL. Like ring.h, this header builds without
+ * Win32 types. */
+
+#include "ring.h"
+
+#ifndef TUN_STATS_READ_NO_FENCE
+#    if defined(_WIN32)
+#        define TUN_STATS_READ_NO_FENCE(Ptr) ReadNoFence64(Ptr)
+#    else
+#        define TUN_STATS_READ_NO_FENCE(Ptr) __atomic_load_n((Ptr), __ATOMIC_RELAXED)
+#    endif
+#endif
+
+/* Alignment the statistics page requires */
+#define TUN_STATS_ALIGNMENT 64
+
+typedef struct _TUN_DRIVER_STATISTICS
+{
+    /* Size of the structure the driver maintains, written once on registration. Counters beyond it stay zero. */
+    volatile ULONG Size;
+    ULONG Reserved;
+
+    /* Send NBL chains and their packets dropped with NDIS_STATUS_BUFFER_OVERFLOW because the send ring was full. */
+    volatile LONG64 SendOverflowNbls;
+    volatile LONG64 SendOverflowPackets;
+
+    /* Times the driver signaled the send ring TailMoved event. */
+    volatile LONG64 SendTailMovedSignals;
+
+    /* Receive ring polls that found packets while spinning, and times the receive thread went to sleep instead. */
+    volatile LONG64 ReceiveSpins;
+    volatile LONG64 ReceiveSleeps;
+
+    /* Receive ring packets dropped before indication: not IP, or out of MDLs or NBLs. */
+    volatile LONG64 ReceiveDiscards;
+
+    /* Receive NBLs and MDLs allocated because the queue had none cached for reuse. */
+    volatile LONG64 ReceiveNblAllocations;
+
+    /* Receive NBL chains indicated to NDIS, each holding up to a batch of packets. */
+    volatile LONG64 ReceiveIndications;
+
+    /* Receive ring packets merged into the packet before them by receive segment coalescing. */
+    volatile LONG64 ReceiveCoalesced;
+} TUN_DRIVER_STATISTICS;
+
+/* Size of the Size and Reserved fields preceding the counters */
+#define TUN_STATS_HEADER_SIZE (2 * sizeof(ULONG))
+/* Number of counters following the header */
+#define TUN_STATS_COUNTERS ((sizeof(TUN_DRIVER_STATISTICS) - TUN_STATS_HEADER_SIZE) / sizeof(LONG64))
+
+/* Copies the counters the driver maintains from Page to Counters, an array of TUN_STATS_COUNTERS elements, zeroing the
+ * ones it does not. Returns the number of counters maintained, zero if the driver did not take the page. */
+static inline ULONG
+TunStatsRead(const TUN_DRIVER_STATISTICS *Page, LONG64 *Counters)
+{
+    ULONG Size = TUN_RING_READ_ACQUIRE(&Page->Size);
+    ULONG Maintained = 0;
+    const volatile LONG64 *First = &Page->SendOverflowNbls;
+    for (ULONG i = 0; i < TUN_STATS_COUNTERS; ++i)
+    {
+        if (TUN_STATS_HEADER_SIZE + (i + 1) * sizeof(LONG64) <= Size)
+        {
+            Counters[i] = TUN_STATS_READ_NO_FENCE(&First[i]);
+            Maintained++;
+        }
+        else
+            Counters[i] = 0;
+    }
+    return Maintained;
+}
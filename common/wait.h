@@ -0,0 +1,95 @@
+/* SPDX-License-Identifier: GPL-2.0 OR MIT
+ *
+ * Copyright (C) 2018-2021 WireGuard LLC. All Rights Reserved.
+ */
+
+#pragma once
+
+/* Spin-then-block timing of WintunWaitForPackets, in performance counter ticks: how long to spin on the ring before
+ * blocking, how the CPU relax hints between ring checks back off, and how long to block for what remains of the
+ * timeout. Like ring.h, this header builds without Win32 types. */
+
+#include "ring.h"
+
+/* Longest run of CPU relax hints between two ring checks while spinning. */
+#define TUN_WAIT_MAX_BACKOFF 64
+/* Spin budget fraction spent probing the ring when packets usually arrive later than the budget allows. */
+#define TUN_WAIT_PROBE_DIVISOR 8
+/* Multiple of the average arrival gap worth spinning for when packets usually arrive within the budget. */
+#define TUN_WAIT_GAP_SPIN_FACTOR 2
+/* Weight of a new sample in the average arrival gap, as a power of two. */
+#define TUN_WAIT_GAP_WEIGHT_SHIFT 3
+/* Timeout in milliseconds that never expires, the value of INFINITE */
+#define TUN_WAIT_INFINITE 0xFFFFFFFF
+/* Tick count of a timeout that never expires */
+#define TUN_WAIT_NEVER ((LONG64)(~(ULONG64)0 >> 1))
+
+typedef struct _TUN_WAIT
+{
+    LONG64 Frequency;    /* Ticks per second */
+    LONG64 Start;        /* Tick count on entry */
+    LONG64 TimeoutTicks; /* Ticks after Start the wait times out, TUN_WAIT_NEVER without a timeout */
+    LONG64 SpinTicks;    /* Ticks after Start spinning gives up */
+    ULONG Backoff;       /* CPU relax hints before the next ring check */
+    int Spun;            /* Nonzero once a ring check came up empty and the CPU was relaxed */
+} TUN_WAIT;
+
+/* Starts a wait at tick count Start, for Timeout milliseconds, spinning for at most SpinBudget microseconds of it.
+ * Packets that usually arrive within the budget, going by AverageGap, are spun for up to twice the average gap.
+ * Otherwise only a fraction of the budget is spent probing. */
+static inline void
+TunWaitBegin(TUN_WAIT *Wait, LONG64 Frequency, LONG64 Start, ULONG Timeout, ULONG SpinBudget, LONG64 AverageGap)
+{
+    Wait->Frequency = Frequency;
+    Wait->Start = Start;
+    Wait->TimeoutTicks = Timeout == TUN_WAIT_INFINITE ? TUN_WAIT_NEVER : (LONG64)Timeout * Frequency / 1000;
+    LONG64 BudgetTicks = (LONG64)SpinBudget * Frequency / 1000000;
+    if (BudgetTicks > Wait->TimeoutTicks)
+        BudgetTicks = Wait->TimeoutTicks;
+    Wait->SpinTicks = BudgetTicks / TUN_WAIT_PROBE_DIVISOR;
+    if (AverageGap <= BudgetTicks)
+    {
+        LONG64 GapTicks = AverageGap * TUN_WAIT_GAP_SPIN_FACTOR;
+        if (GapTicks > BudgetTicks)
+            GapTicks = BudgetTicks;
+        if (GapTicks > Wait->SpinTicks)
+            Wait->SpinTicks = GapTicks;
+    }
+    Wait->Backoff = 1;
+    Wait->Spun = 0;
+}
+
+/* Called when a ring check at tick count Now found no packet. Returns zero once spinning is over. Otherwise relaxes the
+ * CPU before the next check, twice as long each time up to TUN_WAIT_MAX_BACKOFF hints, and returns nonzero. */
+static inline int
+TunWaitSpin(TUN_WAIT *Wait, LONG64 Now)
+{
+    if (Now - Wait->Start >= Wait->SpinTicks)
+        return 0;
+    for (ULONG i = 0; i < Wait->Backoff; ++i)
+        TUN_RING_CPU_RELAX();
+    if (Wait->Backoff < TUN_WAIT_MAX_BACKOFF)
+        Wait->Backoff *= 2;
+    Wait->Spun = 1;
+    return 1;
+}
+
+/* Returns the milliseconds left to block for at tick count Now, TUN_WAIT_INFINITE without a timeout. Rounded up:
+ * truncating would turn the last fraction of a millisecond into a zero wait. */
+static inline ULONG
+TunWaitRemaining(const TUN_WAIT *Wait, LONG64 Now)
+{
+    if (Wait->TimeoutTicks == TUN_WAIT_NEVER)
+        return TUN_WAIT_INFINITE;
+    LONG64 Elapsed = Now - Wait->Start;
+    if (Elapsed >= Wait->TimeoutTicks)
+        return 0;
+    return (ULONG)(((Wait->TimeoutTicks - Elapsed) * 1000 + Wait->Frequency - 1) / Wait->Frequency);
+}
+
+/* Folds the ticks a wait took for a packet to arrive into the average arrival gap. */
+static inline LONG64
+TunWaitAverageGap(LONG64 AverageGap, LONG64 Gap)
+{
+    return AverageGap + ((Gap - AverageGap) >> TUN_WAIT_GAP_WEIGHT_SHIFT);
+}
@@ -9,6 +9,12 @@
 #include <ndis.h>
 #include <ntstrsafe.h>
 #include "undocumented.h"
+#include "../common/cache.h"
+#include "../common/flow.h"
+#include "../common/receive.h"
+#include "../common/ring.h"
+#include "../common/rsc.h"
+#include "../common/stats.h"
 
 #pragma warning(disable : 4100) /* unreferenced formal parameter */
 #pragma warning(disable : 4200) /* nonstandard: zero-sized array in struct/union */
@@ -23,23 +29,6 @@
 #define TUN_VENDOR_ID 0xFFFFFF00
 #define TUN_LINK_SPEED 100000000000ULL /* 100gbps */
 
-/* Memory alignment of packets and rings */
-#define TUN_ALIGNMENT sizeof(ULONG)
-#define TUN_ALIGN(Size) (((ULONG)(Size) + ((ULONG)TUN_ALIGNMENT - 1)) & ~((ULONG)TUN_ALIGNMENT - 1))
-#define TUN_IS_ALIGNED(Size) (!((ULONG)(Size) & ((ULONG)TUN_ALIGNMENT - 1)))
-/* Maximum IP packet size */
-#define TUN_MAX_IP_PACKET_SIZE 0xFFFF
-/* Maximum packet size */
-#define TUN_MAX_PACKET_SIZE TUN_ALIGN(sizeof(TUN_PACKET) + TUN_MAX_IP_PACKET_SIZE)
-/* Minimum ring capacity. */
-#define TUN_MIN_RING_CAPACITY 0x20000 /* 128kiB */
-/* Maximum ring capacity. */
-#define TUN_MAX_RING_CAPACITY 0x4000000 /* 64MiB */
-/* Calculates ring capacity */
-#define TUN_RING_CAPACITY(Size) ((Size) - sizeof(TUN_RING) - (TUN_MAX_PACKET_SIZE - TUN_ALIGNMENT))
-/* Calculates ring offset modulo capacity */
-#define TUN_RING_WRAP(Value, Capacity) ((Value) & (Capacity - 1))
-
 #if REG_DWORD == REG_DWORD_BIG_ENDIAN
 #    define HTONS(x) ((USHORT)(x))
 #    define HTONL(x) ((ULONG)(x))
@@ -54,34 +43,6 @@
 
 #define TUN_MEMORY_TAG HTONL('wtun')
 
-typedef struct _TUN_PACKET
-{
-    /* Size of packet data (TUN_MAX_IP_PACKET_SIZE max) */
-    ULONG Size;
-
-    /* Packet data */
-    UCHAR _Field_size_bytes_(Size)
-    Data[];
-} TUN_PACKET;
-
-typedef struct _TUN_RING
-{
-    /* Byte offset of the first packet in the ring. Its value must be a multiple of TUN_ALIGNMENT and less than ring
-     * capacity. */
-    volatile ULONG Head;
-
-    /* Byte offset of the first free space in the ring. Its value must be multiple of TUN_ALIGNMENT and less than ring
-     * capacity. */
-    volatile ULONG Tail;
-
-    /* Non-zero when consumer is in alertable state. */
-    volatile LONG Alertable;
-
-    /* Ring data. Its capacity must be a power of 2 + extra TUN_MAX_PACKET_SIZE-TUN_ALIGNMENT space to
-     * eliminate need for wrapping. */
-    UCHAR Data[];
-} TUN_RING;
-
 typedef struct _TUN_REGISTER_RINGS
 {
     struct
@@ -99,6 +60,17 @@ typedef struct _TUN_REGISTER_RINGS
     } Send, Receive;
 } TUN_REGISTER_RINGS;
 
+typedef struct _TUN_REGISTER_RINGS_EX
+{
+    TUN_REGISTER_RINGS Rings;
+
+    /* Size of the statistics page */
+    ULONG StatisticsSize;
+
+    /* Pointer to client allocated statistics page, aligned to TUN_STATS_ALIGNMENT */
+    TUN_DRIVER_STATISTICS *Statistics;
+} TUN_REGISTER_RINGS_EX;
+
 #ifdef _WIN64
 typedef struct _TUN_REGISTER_RINGS_32
 {
@@ -116,13 +88,105 @@ typedef struct _TUN_REGISTER_RINGS_32
         ULONG TailMoved;
     } Send, Receive;
 } TUN_REGISTER_RINGS_32;
+
+typedef struct _TUN_REGISTER_RINGS_EX_32
+{
+    TUN_REGISTER_RINGS_32 Rings;
+
+    /* Size of the statistics page */
+    ULONG StatisticsSize;
+
+    /* 32-bit address of client allocated statistics page */
+    ULONG Statistics;
+} TUN_REGISTER_RINGS_EX_32;
+#endif
+
+typedef struct _TUN_REGISTER_QUEUES
+{
+    /* Number of ring pairs, up to TUN_MAX_QUEUES */
+    ULONG QueueCount;
+
+    /* Size of the statistics page */
+    ULONG StatisticsSize;
+
+    /* Pointer to client allocated statistics page, aligned to TUN_STATS_ALIGNMENT, or NULL */
+    TUN_DRIVER_STATISTICS *Statistics;
+
+    /* Combination of TUN_REGISTER_FLAG_* flags */
+    ULONG Flags;
+
+    /* Ring pairs, one per queue */
+    TUN_REGISTER_RINGS Queues[];
+} TUN_REGISTER_QUEUES;
+
+#ifdef _WIN64
+typedef struct _TUN_REGISTER_QUEUES_32
+{
+    /* Number of ring pairs, up to TUN_MAX_QUEUES */
+    ULONG QueueCount;
+
+    /* Size of the statistics page */
+    ULONG StatisticsSize;
+
+    /* 32-bit address of client allocated statistics page, or zero */
+    ULONG Statistics;
+
+    /* Combination of TUN_REGISTER_FLAG_* flags */
+    ULONG Flags;
+
+    /* Ring pairs, one per queue */
+    TUN_REGISTER_RINGS_32 Queues[];
+} TUN_REGISTER_QUEUES_32;
 #endif
 
 /* Register rings hosted by the client.
- * The lpInBuffer and nInBufferSize parameters of DeviceIoControl() must point to an TUN_REGISTER_RINGS struct.
- * Client must wait for this IOCTL to finish before adding packets to the ring. */
+ * The lpInBuffer and nInBufferSize parameters of DeviceIoControl() must point to an TUN_REGISTER_RINGS struct, or to an
+ * TUN_REGISTER_RINGS_EX struct to also register a statistics page. Client must wait for this IOCTL to finish before
+ * adding packets to the ring. */
 #define TUN_IOCTL_REGISTER_RINGS CTL_CODE(51820U, 0x970U, METHOD_BUFFERED, FILE_READ_DATA | FILE_WRITE_DATA)
 
+/* Register several ring pairs hosted by the client, each served by its own lock and receive thread.
+ * The lpInBuffer and nInBufferSize parameters of DeviceIoControl() must point to an TUN_REGISTER_QUEUES struct followed
+ * by QueueCount TUN_REGISTER_RINGS structs. Client must wait for this IOCTL to finish before adding packets to the
+ * rings. This is also the only way to pass registration flags, so clients use it for a single queue with flags. */
+#define TUN_IOCTL_REGISTER_QUEUES CTL_CODE(51820U, 0x971U, METHOD_BUFFERED, FILE_READ_DATA | FILE_WRITE_DATA)
+
+typedef struct _TUN_QUEUE
+{
+    struct _TUN_CTX *Ctx;
+
+    struct
+    {
+        MDL *Mdl;
+        TUN_RING *Ring;
+        ULONG Capacity;
+        KEVENT *TailMoved;
+        /* Free-running tails of TunRingReserve and TunRingPublish: space reserved by senders, and space made
+         * visible to the client. */
+        volatile ULONG ReservedTail;
+        volatile ULONG PublishedTail;
+    } Send;
+
+    struct
+    {
+        MDL *Mdl;
+        TUN_RING *Ring;
+        ULONG Capacity;
+        KEVENT *TailMoved;
+        HANDLE Thread;
+        KSPIN_LOCK Lock;
+        struct
+        {
+            NET_BUFFER_LIST *Head, *Tail;
+            KEVENT Empty;
+        } ActiveNbls;
+        /* Returned NBLs with their MDLs, kept for reuse. Protected by Lock. */
+        TUN_CACHE NblCache;
+        /* MDLs receive segment coalescing chained behind returned NBLs' own, kept for reuse. Protected by Lock. */
+        TUN_CACHE MdlCache;
+    } Receive;
+} TUN_QUEUE;
+
 typedef struct _TUN_CTX
 {
     volatile LONG Running;
@@ -147,34 +211,34 @@ typedef struct _TUN_CTX
         struct
         {
             MDL *Mdl;
-            TUN_RING *Ring;
-            ULONG Capacity;
-            KEVENT *TailMoved;
-            KSPIN_LOCK Lock;
-            ULONG RingTail;
-            struct
-            {
-                NET_BUFFER_LIST *Head, *Tail;
-            } ActiveNbls;
-        } Send;
-
-        struct
-        {
-            MDL *Mdl;
-            TUN_RING *Ring;
-            ULONG Capacity;
-            KEVENT *TailMoved;
-            HANDLE Thread;
-            KSPIN_LOCK Lock;
-            struct
-            {
-                NET_BUFFER_LIST *Head, *Tail;
-                KEVENT Empty;
-            } ActiveNbls;
-        } Receive;
+            /* Points to Sink while no page is registered, so counting never needs to check. */
+            TUN_DRIVER_STATISTICS *Page;
+            TUN_DRIVER_STATISTICS Sink;
+        } Statistics;
+
+        /* Outbound NBLs are steered to a queue by their flow hash. */
+        ULONG QueueCount;
+        ULONG FlowSeed;
+        TUN_QUEUE Queues[TUN_MAX_QUEUES];
+
+        /* Client registered with TUN_REGISTER_FLAG_GSO and takes TCP super-packets on the send rings. */
+        BOOLEAN Gso;
     } Device;
 
+    /* Large send offload and receive segment coalescing the protocol stack allows through OID_TCP_OFFLOAD_PARAMETERS.
+     * Large send offload is only in effect while Device.Gso is set. Receive segment coalescing starts out as the
+     * *RscIPv4 and *RscIPv6 adapter settings say. Protected by Device.RegistrationLock; the receive threads read the
+     * Rsc flags without it. */
+    struct
+    {
+        BOOLEAN LsoV2IPv4, LsoV2IPv6;
+        BOOLEAN RscIPv4, RscIPv6;
+    } Offload;
+
     NDIS_HANDLE NblPool;
+
+    /* Most packets the receive thread indicates at once. Read from the ReceiveBatchSize adapter setting. */
+    ULONG ReceiveBatchSize;
 } TUN_CTX;
 
 static UINT NdisVersion;
@@ -216,7 +280,75 @@ TunIndicateStatus(_In_ NDIS_HANDLE MiniportAdapterHandle, _In_ NDIS_MEDIA_CONNEC
     NdisMIndicateStatusEx(MiniportAdapterHandle, &Indication);
 }
 
-/* Send: We should not modify NET_BUFFER_LIST_NEXT_NBL(Nbl) to prevent fragmented NBLs to separate.
+/* Describes large send offload version 2 and receive segment coalescing for IPv4 and IPv6 packets, if enabled, and no
+ * other task offload. The client segments super-packets, which may carry IPv4 and TCP options but no IPv6 extension
+ * headers. Receive segment coalescing needs NDIS 6.30, and is left out before. */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+static VOID
+TunInitOffload(
+    _Out_ NDIS_OFFLOAD *Offload,
+    _In_ BOOLEAN LsoV2IPv4,
+    _In_ BOOLEAN LsoV2IPv6,
+    _In_ BOOLEAN RscIPv4,
+    _In_ BOOLEAN RscIPv6)
+{
+    NdisZeroMemory(Offload, sizeof(*Offload));
+    Offload->Header.Type = NDIS_OBJECT_TYPE_OFFLOAD;
+    if (NdisVersion < NDIS_RUNTIME_VERSION_630)
+    {
+        Offload->Header.Revision = NDIS_OFFLOAD_REVISION_1;
+        Offload->Header.Size = NDIS_SIZEOF_NDIS_OFFLOAD_REVISION_1;
+    }
+    else
+    {
+        Offload->Header.Revision = NDIS_OFFLOAD_REVISION_3;
+        Offload->Header.Size = NDIS_SIZEOF_NDIS_OFFLOAD_REVISION_3;
+        Offload->Rsc.IPv4.Enabled = RscIPv4;
+        Offload->Rsc.IPv6.Enabled = RscIPv6;
+    }
+    if (LsoV2IPv4)
+    {
+        Offload->LsoV2.IPv4.Encapsulation = NDIS_ENCAPSULATION_NULL;
+        Offload->LsoV2.IPv4.MaxOffLoadSize = TUN_MAX_IP_PACKET_SIZE;
+        Offload->LsoV2.IPv4.MinSegmentCount = 2;
+    }
+    if (LsoV2IPv6)
+    {
+        Offload->LsoV2.IPv6.Encapsulation = NDIS_ENCAPSULATION_NULL;
+        Offload->LsoV2.IPv6.MaxOffLoadSize = TUN_MAX_IP_PACKET_SIZE;
+        Offload->LsoV2.IPv6.MinSegmentCount = 2;
+        Offload->LsoV2.IPv6.IpExtensionHeadersSupported = NDIS_OFFLOAD_NOT_SUPPORTED;
+        Offload->LsoV2.IPv6.TcpOptionsSupported = NDIS_OFFLOAD_SUPPORTED;
+    }
+}
+
+/* Tells the protocol stack which offloads are in effect. Call with Device.RegistrationLock held, after changing
+ * Device.Gso or Offload. */
+_IRQL_requires_max_(PASSIVE_LEVEL)
+static VOID
+TunIndicateOffloadConfig(_In_ TUN_CTX *Ctx)
+{
+    NDIS_OFFLOAD Offload;
+    TunInitOffload(
+        &Offload,
+        Ctx->Device.Gso && Ctx->Offload.LsoV2IPv4,
+        Ctx->Device.Gso && Ctx->Offload.LsoV2IPv6,
+        Ctx->Offload.RscIPv4,
+        Ctx->Offload.RscIPv6);
+
+    NDIS_STATUS_INDICATION Indication = { .Header = { .Type = NDIS_OBJECT_TYPE_STATUS_INDICATION,
+                                                      .Revision = NDIS_STATUS_INDICATION_REVISION_1,
+                                                      .Size = NDIS_SIZEOF_STATUS_INDICATION_REVISION_1 },
+                                          .SourceHandle = Ctx->MiniportAdapterHandle,
+                                          .StatusCode = NDIS_STATUS_TASK_OFFLOAD_CURRENT_CONFIG,
+                                          .StatusBuffer = &Offload,
+                                          .StatusBufferSize = sizeof(Offload) };
+
+    NdisMIndicateStatusEx(Ctx->MiniportAdapterHandle, &Indication);
+}
+
+/* Send: We should not modify NET_BUFFER_LIST_NEXT_NBL(Nbl) to prevent fragmented NBLs to separate, other than to split
+ * the chain by queue before any NBL is placed in a ring.
  * Receive: NDIS may change NET_BUFFER_LIST_NEXT_NBL(Nbl) at will between the NdisMIndicateReceiveNetBufferLists() and
  * MINIPORT_RETURN_NET_BUFFER_LISTS calls. Therefore, we use our own ->Next pointer for book-keeping. */
 #define NET_BUFFER_LIST_NEXT_NBL_EX(Nbl) (NET_BUFFER_LIST_MINIPORT_RESERVED(Nbl)[1])
@@ -246,75 +378,306 @@ TunNblIsCompleted(_In_ NET_BUFFER_LIST *Nbl)
     return (ULONG_PTR)(NET_BUFFER_LIST_MINIPORT_RESERVED(Nbl)[0]) & 1;
 }
 
-static MINIPORT_SEND_NET_BUFFER_LISTS TunSendNetBufferLists;
-_Use_decl_annotations_
+/* Receive: Remembers the queue the NBL was indicated from, for TunReturnNetBufferLists. */
+#define NET_BUFFER_LIST_QUEUE(Nbl) (NET_BUFFER_MINIPORT_RESERVED(NET_BUFFER_LIST_FIRST_NB(Nbl))[0])
+/* Receive: The partial MDL the NBL owns. It stays with the NBL while it is cached and is rebuilt for every packet. */
+#define NET_BUFFER_LIST_MDL(Nbl) (NET_BUFFER_MINIPORT_RESERVED(NET_BUFFER_LIST_FIRST_NB(Nbl))[1])
+/* Size the owned MDL is allocated for, so it can describe the largest packet at any page offset. */
+#define TUN_RECEIVE_MDL_SIZE (TUN_MAX_IP_PACKET_SIZE + PAGE_SIZE - 1)
+
 static VOID
-TunSendNetBufferLists(
-    NDIS_HANDLE MiniportAdapterContext,
-    NET_BUFFER_LIST *NetBufferLists,
-    NDIS_PORT_NUMBER PortNumber,
-    ULONG SendFlags)
+TunNblSetQueue(_Inout_ NET_BUFFER_LIST *Nbl, _In_ TUN_QUEUE *Queue)
+{
+    NET_BUFFER_LIST_QUEUE(Nbl) = Queue;
+}
+
+static TUN_QUEUE *
+TunNblGetQueue(_In_ NET_BUFFER_LIST *Nbl)
+{
+    return NET_BUFFER_LIST_QUEUE(Nbl);
+}
+
+/* Receive: Cached NBLs are linked through NET_BUFFER_LIST_NEXT_NBL_EX, which is unused while they are not active. */
+static TUN_CACHE_ENTRY *
+TunNblCacheEntry(_In_ NET_BUFFER_LIST *Nbl)
+{
+    return (TUN_CACHE_ENTRY *)&NET_BUFFER_LIST_NEXT_NBL_EX(Nbl);
+}
+
+static NET_BUFFER_LIST *
+TunNblFromCacheEntry(_In_ TUN_CACHE_ENTRY *Entry)
+{
+    return CONTAINING_RECORD(Entry, NET_BUFFER_LIST, MiniportReserved[1]);
+}
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+static VOID
+TunFreeReceiveNbl(_In_ __drv_freesMem(Mem) NET_BUFFER_LIST *Nbl)
+{
+    MDL *Mdl = NET_BUFFER_LIST_MDL(Nbl);
+    NdisFreeNetBufferList(Nbl);
+    IoFreeMdl(Mdl);
+}
+
+/* Receive: Cached payload MDLs are linked through their own Next, which is unused while they are not chained. */
+static TUN_CACHE_ENTRY *
+TunMdlCacheEntry(_In_ MDL *Mdl)
+{
+    return (TUN_CACHE_ENTRY *)&Mdl->Next;
+}
+
+static MDL *
+TunMdlFromCacheEntry(_In_ TUN_CACHE_ENTRY *Entry)
+{
+    return CONTAINING_RECORD(Entry, MDL, Next);
+}
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+static VOID
+TunFreeCachedMdls(_In_opt_ TUN_CACHE_ENTRY *Entries)
+{
+    for (TUN_CACHE_ENTRY *Entry = Entries, *Next; Entry; Entry = Next)
+    {
+        Next = Entry->Next;
+        IoFreeMdl(TunMdlFromCacheEntry(Entry));
+    }
+}
+
+/* Receive: Unchains the MDLs receive segment coalescing chained behind the owned MDL, one per payload appended, and
+ * puts them into Cache, or frees those that do not fit. */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+static VOID
+TunPutReceiveNblPayloadMdls(_Inout_ TUN_CACHE *Cache, _Inout_ NET_BUFFER_LIST *Nbl)
+{
+    MDL *Mdl = NET_BUFFER_LIST_MDL(Nbl);
+    for (MDL *PayloadMdl = Mdl->Next, *NextMdl; PayloadMdl; PayloadMdl = NextMdl)
+    {
+        NextMdl = PayloadMdl->Next;
+        if (!TunCachePush(Cache, TunMdlCacheEntry(PayloadMdl)))
+            IoFreeMdl(PayloadMdl);
+    }
+    Mdl->Next = NULL;
+}
+
+/* Receive: Returns the number of ring packets the NBL carries, more than one if receive segment coalescing merged
+ * them. */
+static ULONG
+TunNblPacketCount(_In_ NET_BUFFER_LIST *Nbl)
+{
+    NDIS_RSC_NBL_INFO RscInfo = { .Value = NET_BUFFER_LIST_INFO(Nbl, TcpRecvSegCoalesceInfo) };
+    return RscInfo.Info.CoalescedSegCount ? RscInfo.Info.CoalescedSegCount : 1;
+}
+
+/* Adds to a statistics page counter. Call within TransitionLock or from the receive thread. */
+#define TUN_STAT_ADD(Ctx, Counter, Value) \
+    InterlockedAddNoFence64( \
+        &((TUN_DRIVER_STATISTICS *)ReadPointerNoFence((PVOID *)&(Ctx)->Device.Statistics.Page))->Counter, (Value))
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+static VOID
+TunFreeCachedNbls(_In_opt_ TUN_CACHE_ENTRY *Entries)
+{
+    for (TUN_CACHE_ENTRY *Entry = Entries, *Next; Entry; Entry = Next)
+    {
+        Next = Entry->Next;
+        TunFreeReceiveNbl(TunNblFromCacheEntry(Entry));
+    }
+}
+
+/* Returns an NBL describing the PacketSize bytes of the receive ring at PacketAddr, reusing one from the receive
+ * thread's Stash if possible. Returns NULL if out of memory. */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+_Must_inspect_result_
+static NET_BUFFER_LIST *
+TunGetReceiveNbl(_Inout_ TUN_QUEUE *Queue, _Inout_ TUN_CACHE *Stash, _In_ VOID *PacketAddr, _In_ ULONG PacketSize)
+{
+    TUN_CTX *Ctx = Queue->Ctx;
+    NET_BUFFER_LIST *Nbl;
+    MDL *Mdl;
+
+    TUN_CACHE_ENTRY *Entry = TunCachePop(Stash);
+    if (Entry)
+    {
+        Nbl = TunNblFromCacheEntry(Entry);
+        Mdl = NET_BUFFER_LIST_MDL(Nbl);
+        /* Upper layers may have mapped the previous packet. */
+        MmPrepareMdlForReuse(Mdl);
+        NdisClearNblFlag(Nbl, NDIS_NBL_FLAGS_IS_IPV4 | NDIS_NBL_FLAGS_IS_IPV6);
+        NET_BUFFER_LIST_INFO(Nbl, TcpRecvSegCoalesceInfo) = NULL;
+        NET_BUFFER_LIST_INFO(Nbl, TcpIpChecksumNetBufferListInfo) = NULL;
+        /* NDIS returned it chained to others, and the cache linked it through NET_BUFFER_LIST_NEXT_NBL_EX. */
+        NET_BUFFER_LIST_NEXT_NBL(Nbl) = NULL;
+        NET_BUFFER_LIST_NEXT_NBL_EX(Nbl) = NULL;
+    }
+    else
+    {
+        TUN_STAT_ADD(Ctx, ReceiveNblAllocations, 1);
+        Mdl = IoAllocateMdl(PacketAddr, TUN_RECEIVE_MDL_SIZE, FALSE, FALSE, NULL);
+        if (!Mdl)
+            return NULL;
+        Nbl = NdisAllocateNetBufferAndNetBufferList(Ctx->NblPool, 0, 0, Mdl, 0, 0);
+        if (!Nbl)
+        {
+            IoFreeMdl(Mdl);
+            return NULL;
+        }
+        Nbl->SourceHandle = Ctx->MiniportAdapterHandle;
+        NET_BUFFER_LIST_MDL(Nbl) = Mdl;
+        TunNblSetQueue(Nbl, Queue);
+    }
+
+    IoBuildPartialMdl(Queue->Receive.Mdl, Mdl, PacketAddr, PacketSize);
+    NET_BUFFER *Nb = NET_BUFFER_LIST_FIRST_NB(Nbl);
+    NET_BUFFER_FIRST_MDL(Nb) = Mdl;
+    NET_BUFFER_CURRENT_MDL(Nb) = Mdl;
+    NET_BUFFER_CURRENT_MDL_OFFSET(Nb) = 0;
+    NET_BUFFER_DATA_OFFSET(Nb) = 0;
+    NET_BUFFER_DATA_LENGTH(Nb) = PacketSize;
+    return Nbl;
+}
+
+/* Chains an MDL describing the PayloadSize bytes of the receive ring at PayloadAddr behind MdlTail, the last MDL of an
+ * NBL receive segment coalescing is growing, and makes it the new tail. Reuses an MDL from the receive thread's
+ * MdlStash if possible. Returns FALSE if out of memory. */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+_Must_inspect_result_
+static BOOLEAN
+TunChainReceivePayload(
+    _In_ TUN_QUEUE *Queue,
+    _Inout_ TUN_CACHE *MdlStash,
+    _Inout_ MDL **MdlTail,
+    _In_ VOID *PayloadAddr,
+    _In_ ULONG PayloadSize)
+{
+    MDL *Mdl;
+    TUN_CACHE_ENTRY *Entry = TunCachePop(MdlStash);
+    if (Entry)
+    {
+        Mdl = TunMdlFromCacheEntry(Entry);
+        /* Upper layers may have mapped the previous payload. */
+        MmPrepareMdlForReuse(Mdl);
+    }
+    else
+    {
+        /* Sized for any payload, so it can be reused for all of them. */
+        Mdl = IoAllocateMdl(PayloadAddr, TUN_RECEIVE_MDL_SIZE, FALSE, FALSE, NULL);
+        if (!Mdl)
+            return FALSE;
+    }
+    IoBuildPartialMdl(Queue->Receive.Mdl, Mdl, PayloadAddr, PayloadSize);
+    Mdl->Next = NULL;
+    (*MdlTail)->Next = Mdl;
+    *MdlTail = Mdl;
+    return TRUE;
+}
+
+/* Describes the packet receive segment coalescing built in Nbl to the protocol stack, if Segments went in, as
+ * TunReceiveBatchEndRsc returns. The packet still lives in the receive ring, where the client may rewrite it at any
+ * time, so the checksums verified on the way vouch for nothing by the time the stack reads it. Checksum success is not
+ * claimed, and the stack verifies the coalesced packet itself, as it does any other received packet. */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+static VOID
+TunCompleteReceiveRsc(_In_ NET_BUFFER_LIST *Nbl, _In_ ULONG Segments)
+{
+    if (!Segments)
+        return;
+    NDIS_RSC_NBL_INFO RscInfo = { 0 };
+    RscInfo.Info.CoalescedSegCount = (USHORT)Segments;
+    NET_BUFFER_LIST_INFO(Nbl, TcpRecvSegCoalesceInfo) = RscInfo.Value;
+}
+
+/* Puts an NBL obtained by TunGetReceiveNbl back into the Stash, and its payload MDLs into the MdlStash, or frees
+ * whatever does not fit. */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+static VOID
+TunPutReceiveNbl(_Inout_ TUN_CACHE *Stash, _Inout_ TUN_CACHE *MdlStash, _In_ NET_BUFFER_LIST *Nbl)
+{
+    TunPutReceiveNblPayloadMdls(MdlStash, Nbl);
+    if (!TunCachePush(Stash, TunNblCacheEntry(Nbl)))
+        TunFreeReceiveNbl(Nbl);
+}
+
+/* Returns the MSS of an NBL the protocol stack handed over for large send offload, or zero for ordinary NBLs. */
+static ULONG
+TunNblLsoMss(_In_ NET_BUFFER_LIST *Nbl)
+{
+    NDIS_TCP_LARGE_SEND_OFFLOAD_NET_BUFFER_LIST_INFO Info;
+    Info.Value = NET_BUFFER_LIST_INFO(Nbl, TcpLargeSendNetBufferListInfo);
+    return Info.LsoV2Transmit.Type == NDIS_TCP_LARGE_SEND_OFFLOAD_V2_TYPE ? Info.LsoV2Transmit.MSS : 0;
+}
+
+/* Replaces the large send offload request of an NBL with the completion information NDIS expects back. This
+ * overwrites the MSS, so call it once per NBL, last thing before completing it. */
+static VOID
+TunNblCompleteLso(_Inout_ NET_BUFFER_LIST *Nbl)
+{
+    if (!TunNblLsoMss(Nbl))
+        return;
+    NDIS_TCP_LARGE_SEND_OFFLOAD_NET_BUFFER_LIST_INFO Info = { .Value = NULL };
+    Info.LsoV2TransmitComplete.Type = NDIS_TCP_LARGE_SEND_OFFLOAD_V2_TYPE;
+    NET_BUFFER_LIST_INFO(Nbl, TcpLargeSendNetBufferListInfo) = Info.Value;
+}
+
+/* Sends an NBL chain to one queue. Call within shared TransitionLock while the rings are registered. */
+_IRQL_requires_(DISPATCH_LEVEL)
+static VOID
+TunSendQueue(_Inout_ TUN_CTX *Ctx, _Inout_ TUN_QUEUE *Queue, _In_ NET_BUFFER_LIST *NetBufferLists)
 {
-    TUN_CTX *Ctx = (TUN_CTX *)MiniportAdapterContext;
     LONG64 SentPacketsCount = 0, SentPacketsSize = 0, ErrorPacketsCount = 0, DiscardedPacketsCount = 0;
 
-    /* Measure NBLs. */
+    /* Measure NBLs. Super-packets only go to clients that segment them, which is the case unless registration changed
+     * since the protocol stack learned large send offload was on. */
+    BOOLEAN Gso = Ctx->Device.Gso;
     ULONG PacketsCount = 0, RequiredRingSpace = 0;
     for (NET_BUFFER_LIST *Nbl = NetBufferLists; Nbl; Nbl = NET_BUFFER_LIST_NEXT_NBL(Nbl))
     {
+        BOOLEAN Lso = !!TunNblLsoMss(Nbl);
         for (NET_BUFFER *Nb = NET_BUFFER_LIST_FIRST_NB(Nbl); Nb; Nb = NET_BUFFER_NEXT_NB(Nb))
         {
             PacketsCount++;
             UINT PacketSize = NET_BUFFER_DATA_LENGTH(Nb);
-            if (PacketSize > TUN_MAX_IP_PACKET_SIZE)
+            if (PacketSize > TUN_MAX_IP_PACKET_SIZE || (Lso && !Gso))
                 continue; /* The same condition holds down below, where we `goto skipPacket`. */
             RequiredRingSpace += TUN_ALIGN(sizeof(TUN_PACKET) + PacketSize);
         }
     }
 
-    KIRQL Irql = ExAcquireSpinLockShared(&Ctx->TransitionLock);
     NDIS_STATUS Status;
-    if ((Status = NDIS_STATUS_PAUSED, !ReadAcquire(&Ctx->Running)) ||
-        (Status = NDIS_STATUS_MEDIA_DISCONNECTED, KeReadStateEvent(&Ctx->Device.Disconnected)))
-        goto skipNbl;
-
-    TUN_RING *Ring = Ctx->Device.Send.Ring;
-    ULONG RingCapacity = Ctx->Device.Send.Capacity;
+    TUN_RING *Ring = Queue->Send.Ring;
+    ULONG RingCapacity = Queue->Send.Capacity;
 
     /* Allocate space for packets in the ring. */
     ULONG RingHead = ReadULongAcquire(&Ring->Head);
     if (Status = NDIS_STATUS_ADAPTER_NOT_READY, RingHead >= RingCapacity)
         goto skipNbl;
 
-    KLOCK_QUEUE_HANDLE LockHandle;
-    KeAcquireInStackQueuedSpinLock(&Ctx->Device.Send.Lock, &LockHandle);
-
-    ULONG RingTail = Ctx->Device.Send.RingTail;
-    ASSERT(RingTail < RingCapacity);
-
-    ULONG RingSpace = TUN_RING_WRAP(RingHead - RingTail - TUN_ALIGNMENT, RingCapacity);
-    if (Status = NDIS_STATUS_BUFFER_OVERFLOW, RingSpace < RequiredRingSpace)
-        goto cleanupKeReleaseInStackQueuedSpinLock;
-
-    Ctx->Device.Send.RingTail = TUN_RING_WRAP(RingTail + RequiredRingSpace, RingCapacity);
-    TunNblSetOffsetAndMarkActive(NetBufferLists, Ctx->Device.Send.RingTail);
-    *(Ctx->Device.Send.ActiveNbls.Head ? &NET_BUFFER_LIST_NEXT_NBL_EX(Ctx->Device.Send.ActiveNbls.Tail)
-                                       : &Ctx->Device.Send.ActiveNbls.Head) = NetBufferLists;
-    Ctx->Device.Send.ActiveNbls.Tail = NetBufferLists;
-
-    KeReleaseInStackQueuedSpinLock(&LockHandle);
+    ULONG ReservedTail;
+    if (Status = NDIS_STATUS_BUFFER_OVERFLOW,
+        !TunRingReserve(&Queue->Send.ReservedTail, &Ring->Head, RingCapacity, RequiredRingSpace, &ReservedTail))
+    {
+        TUN_STAT_ADD(Ctx, SendOverflowNbls, 1);
+        TUN_STAT_ADD(Ctx, SendOverflowPackets, PacketsCount);
+        goto skipNbl;
+    }
+    ULONG RingTail = TUN_RING_WRAP(ReservedTail, RingCapacity);
 
     /* Copy packets. */
     for (NET_BUFFER_LIST *Nbl = NetBufferLists; Nbl; Nbl = NET_BUFFER_LIST_NEXT_NBL(Nbl))
     {
+        /* Segments smaller than the stack asked for are always fine, so an MSS beyond the ring format is clamped. */
+        ULONG Mss = TunNblLsoMss(Nbl);
+        if (Mss > TUN_PACKET_GSO_MAX_MSS)
+            Mss = TUN_PACKET_GSO_MAX_MSS;
         for (NET_BUFFER *Nb = NET_BUFFER_LIST_FIRST_NB(Nbl); Nb; Nb = NET_BUFFER_NEXT_NB(Nb))
         {
             UINT PacketSize = NET_BUFFER_DATA_LENGTH(Nb);
             if (Status = NDIS_STATUS_INVALID_LENGTH, PacketSize > TUN_MAX_IP_PACKET_SIZE)
                 goto skipPacket;
+            if (Status = NDIS_STATUS_FAILURE, Mss && !Gso)
+                goto skipPacket;
 
-            TUN_PACKET *Packet = (TUN_PACKET *)(Ring->Data + RingTail);
-            Packet->Size = PacketSize;
+            TUN_PACKET *Packet = TunRingPacketAt(Ring, RingTail);
+            Packet->Size = PacketSize | Mss << TUN_PACKET_GSO_SHIFT;
             void *NbData = NdisGetDataBuffer(Nb, PacketSize, Packet->Data, 1, 0);
             if (!NbData)
             {
@@ -339,33 +702,28 @@ TunSendNetBufferLists(
             ErrorPacketsCount++;
             NET_BUFFER_LIST_STATUS(Nbl) = Status;
         }
+        TunNblCompleteLso(Nbl);
     }
-    ASSERT(RingTail == TunNblGetOffset(NetBufferLists));
-    TunNblMarkCompleted(NetBufferLists);
-
-    /* Adjust the ring tail. */
-    KeAcquireInStackQueuedSpinLock(&Ctx->Device.Send.Lock, &LockHandle);
-    while (Ctx->Device.Send.ActiveNbls.Head && TunNblIsCompleted(Ctx->Device.Send.ActiveNbls.Head))
-    {
-        NET_BUFFER_LIST *CompletedNbl = Ctx->Device.Send.ActiveNbls.Head;
-        Ctx->Device.Send.ActiveNbls.Head = NET_BUFFER_LIST_NEXT_NBL_EX(CompletedNbl);
-        WriteULongRelease(&Ring->Tail, TunNblGetOffset(CompletedNbl));
-        KeSetEvent(Ctx->Device.Send.TailMoved, IO_NETWORK_INCREMENT, FALSE);
-        NdisMSendNetBufferListsComplete(
-            Ctx->MiniportAdapterHandle, CompletedNbl, NDIS_SEND_COMPLETE_FLAGS_DISPATCH_LEVEL);
-    }
-    KeReleaseInStackQueuedSpinLock(&LockHandle);
-    ExReleaseSpinLockShared(&Ctx->TransitionLock, Irql);
+    ASSERT(RingTail == TUN_RING_WRAP(ReservedTail + RequiredRingSpace, RingCapacity));
+
+    /* Adjust the ring tail once senders that reserved before us have adjusted it. We run at DISPATCH_LEVEL within
+     * TransitionLock from reservation on, so they are already copying on other CPUs. */
+    TunRingPublish(Ring, RingCapacity, &Queue->Send.PublishedTail, ReservedTail, ReservedTail + RequiredRingSpace);
+    KeSetEvent(Queue->Send.TailMoved, IO_NETWORK_INCREMENT, FALSE);
+    TUN_STAT_ADD(Ctx, SendTailMovedSignals, 1);
+    NdisMSendNetBufferListsComplete(
+        Ctx->MiniportAdapterHandle, NetBufferLists, NDIS_SEND_COMPLETE_FLAGS_DISPATCH_LEVEL);
     goto updateStatistics;
 
-cleanupKeReleaseInStackQueuedSpinLock:
-    KeReleaseInStackQueuedSpinLock(&LockHandle);
 skipNbl:
     for (NET_BUFFER_LIST *Nbl = NetBufferLists; Nbl; Nbl = NET_BUFFER_LIST_NEXT_NBL(Nbl))
+    {
         NET_BUFFER_LIST_STATUS(Nbl) = Status;
+        TunNblCompleteLso(Nbl);
+    }
     DiscardedPacketsCount += PacketsCount;
-    ExReleaseSpinLockShared(&Ctx->TransitionLock, Irql);
-    NdisMSendNetBufferListsComplete(Ctx->MiniportAdapterHandle, NetBufferLists, 0);
+    NdisMSendNetBufferListsComplete(
+        Ctx->MiniportAdapterHandle, NetBufferLists, NDIS_SEND_COMPLETE_FLAGS_DISPATCH_LEVEL);
 updateStatistics:
     InterlockedAddNoFence64((LONG64 *)&Ctx->Statistics.ifHCOutOctets, SentPacketsSize);
     InterlockedAddNoFence64((LONG64 *)&Ctx->Statistics.ifHCOutUcastOctets, SentPacketsSize);
@@ -374,6 +732,81 @@ updateStatistics:
     InterlockedAddNoFence64((LONG64 *)&Ctx->Statistics.ifOutDiscards, DiscardedPacketsCount);
 }
 
+/* Hashes the flow of the first packet of an NBL. */
+static ULONG
+TunNblFlowHash(_In_ TUN_CTX *Ctx, _In_ NET_BUFFER_LIST *Nbl)
+{
+    NET_BUFFER *Nb = NET_BUFFER_LIST_FIRST_NB(Nbl);
+    UCHAR Storage[TUN_FLOW_HEADER_SIZE];
+    ULONG Size = NET_BUFFER_DATA_LENGTH(Nb);
+    if (Size > sizeof(Storage))
+        Size = sizeof(Storage);
+    UCHAR *Header = Size ? NdisGetDataBuffer(Nb, Size, Storage, 1, 0) : NULL;
+    return Header ? TunFlowHash(Ctx->Device.FlowSeed, Header, Size) : Ctx->Device.FlowSeed;
+}
+
+static MINIPORT_SEND_NET_BUFFER_LISTS TunSendNetBufferLists;
+_Use_decl_annotations_
+static VOID
+TunSendNetBufferLists(
+    NDIS_HANDLE MiniportAdapterContext,
+    NET_BUFFER_LIST *NetBufferLists,
+    NDIS_PORT_NUMBER PortNumber,
+    ULONG SendFlags)
+{
+    TUN_CTX *Ctx = (TUN_CTX *)MiniportAdapterContext;
+    LONG64 DiscardedPacketsCount = 0;
+
+    KIRQL Irql = ExAcquireSpinLockShared(&Ctx->TransitionLock);
+    NDIS_STATUS Status;
+    if ((Status = NDIS_STATUS_PAUSED, !ReadAcquire(&Ctx->Running)) ||
+        (Status = NDIS_STATUS_MEDIA_DISCONNECTED, KeReadStateEvent(&Ctx->Device.Disconnected)))
+        goto skipNbl;
+
+    ULONG QueueCount = Ctx->Device.QueueCount;
+    if (QueueCount == 1)
+    {
+        TunSendQueue(Ctx, &Ctx->Device.Queues[0], NetBufferLists);
+        ExReleaseSpinLockShared(&Ctx->TransitionLock, Irql);
+        return;
+    }
+
+    /* Split the chain by flow, keeping NBL order within each queue. */
+    NET_BUFFER_LIST *Heads[TUN_MAX_QUEUES], **Tails[TUN_MAX_QUEUES];
+    for (ULONG Index = 0; Index < QueueCount; ++Index)
+    {
+        Heads[Index] = NULL;
+        Tails[Index] = &Heads[Index];
+    }
+    for (NET_BUFFER_LIST *Nbl = NetBufferLists, *NextNbl; Nbl; Nbl = NextNbl)
+    {
+        NextNbl = NET_BUFFER_LIST_NEXT_NBL(Nbl);
+        NET_BUFFER_LIST_NEXT_NBL(Nbl) = NULL;
+        ULONG Index = TunFlowQueue(TunNblFlowHash(Ctx, Nbl), QueueCount);
+        *Tails[Index] = Nbl;
+        Tails[Index] = &NET_BUFFER_LIST_NEXT_NBL(Nbl);
+    }
+    for (ULONG Index = 0; Index < QueueCount; ++Index)
+    {
+        if (Heads[Index])
+            TunSendQueue(Ctx, &Ctx->Device.Queues[Index], Heads[Index]);
+    }
+    ExReleaseSpinLockShared(&Ctx->TransitionLock, Irql);
+    return;
+
+skipNbl:
+    for (NET_BUFFER_LIST *Nbl = NetBufferLists; Nbl; Nbl = NET_BUFFER_LIST_NEXT_NBL(Nbl))
+    {
+        for (NET_BUFFER *Nb = NET_BUFFER_LIST_FIRST_NB(Nbl); Nb; Nb = NET_BUFFER_NEXT_NB(Nb))
+            DiscardedPacketsCount++;
+        NET_BUFFER_LIST_STATUS(Nbl) = Status;
+        TunNblCompleteLso(Nbl);
+    }
+    ExReleaseSpinLockShared(&Ctx->TransitionLock, Irql);
+    NdisMSendNetBufferListsComplete(Ctx->MiniportAdapterHandle, NetBufferLists, 0);
+    InterlockedAddNoFence64((LONG64 *)&Ctx->Statistics.ifOutDiscards, DiscardedPacketsCount);
+}
+
 static MINIPORT_CANCEL_SEND TunCancelSend;
 _Use_decl_annotations_
 static VOID
@@ -387,7 +820,6 @@ static VOID
 TunReturnNetBufferLists(NDIS_HANDLE MiniportAdapterContext, PNET_BUFFER_LIST NetBufferLists, ULONG ReturnFlags)
 {
     TUN_CTX *Ctx = (TUN_CTX *)MiniportAdapterContext;
-    TUN_RING *Ring = Ctx->Device.Receive.Ring;
 
     LONG64 ReceivedPacketsCount = 0, ReceivedPacketsSize = 0, ErrorPacketsCount = 0;
     for (NET_BUFFER_LIST *Nbl = NetBufferLists, *NextNbl; Nbl; Nbl = NextNbl)
@@ -396,39 +828,36 @@ TunReturnNetBufferLists(NDIS_HANDLE MiniportAdapterContext, PNET_BUFFER_LIST Net
 
         if (NT_SUCCESS(NET_BUFFER_LIST_STATUS(Nbl)))
         {
-            ReceivedPacketsCount++;
+            ReceivedPacketsCount += TunNblPacketCount(Nbl);
             ReceivedPacketsSize += NET_BUFFER_LIST_FIRST_NB(Nbl)->DataLength;
         }
         else
-            ErrorPacketsCount++;
+            ErrorPacketsCount += TunNblPacketCount(Nbl);
 
+        TUN_QUEUE *Queue = TunNblGetQueue(Nbl);
         TunNblMarkCompleted(Nbl);
         for (;;)
         {
             KLOCK_QUEUE_HANDLE LockHandle;
-            KeAcquireInStackQueuedSpinLock(&Ctx->Device.Receive.Lock, &LockHandle);
-            NET_BUFFER_LIST *CompletedNbl = Ctx->Device.Receive.ActiveNbls.Head;
+            KeAcquireInStackQueuedSpinLock(&Queue->Receive.Lock, &LockHandle);
+            NET_BUFFER_LIST *CompletedNbl = Queue->Receive.ActiveNbls.Head;
             if (!CompletedNbl || !TunNblIsCompleted(CompletedNbl))
             {
                 KeReleaseInStackQueuedSpinLock(&LockHandle);
                 break;
             }
-            Ctx->Device.Receive.ActiveNbls.Head = NET_BUFFER_LIST_NEXT_NBL_EX(CompletedNbl);
-            if (!Ctx->Device.Receive.ActiveNbls.Head)
-                KeSetEvent(&Ctx->Device.Receive.ActiveNbls.Empty, IO_NO_INCREMENT, FALSE);
+            Queue->Receive.ActiveNbls.Head = NET_BUFFER_LIST_NEXT_NBL_EX(CompletedNbl);
+            ULONG RingHead = TunNblGetOffset(CompletedNbl);
+            /* Caching reuses NET_BUFFER_LIST_NEXT_NBL_EX, and must be done before the receive thread may see Empty and
+             * flush the cache. */
+            TunPutReceiveNblPayloadMdls(&Queue->Receive.MdlCache, CompletedNbl);
+            BOOLEAN Cached = !!TunCachePush(&Queue->Receive.NblCache, TunNblCacheEntry(CompletedNbl));
+            if (!Queue->Receive.ActiveNbls.Head)
+                KeSetEvent(&Queue->Receive.ActiveNbls.Empty, IO_NO_INCREMENT, FALSE);
             KeReleaseInStackQueuedSpinLock(&LockHandle);
-            WriteULongRelease(&Ring->Head, TunNblGetOffset(CompletedNbl));
-            const MDL *TargetMdl = Ctx->Device.Receive.Mdl;
-            for (MDL *Mdl = NET_BUFFER_FIRST_MDL(NET_BUFFER_LIST_FIRST_NB(CompletedNbl)); Mdl; Mdl = Mdl->Next)
-            {
-                if (MmGetMdlVirtualAddress(Mdl) < MmGetMdlVirtualAddress(TargetMdl) ||
-                    (UCHAR *)MmGetMdlVirtualAddress(Mdl) + MmGetMdlByteCount(Mdl) >
-                        (UCHAR *)MmGetMdlVirtualAddress(TargetMdl) + MmGetMdlByteCount(TargetMdl))
-                    continue;
-                IoFreeMdl(Mdl);
-                break;
-            }
-            NdisFreeNetBufferList(CompletedNbl);
+            WriteULongRelease(&Queue->Receive.Ring->Head, RingHead);
+            if (!Cached)
+                TunFreeReceiveNbl(CompletedNbl);
         }
     }
 
@@ -441,17 +870,24 @@ TunReturnNetBufferLists(NDIS_HANDLE MiniportAdapterContext, PNET_BUFFER_LIST Net
 _IRQL_requires_max_(PASSIVE_LEVEL)
 _Function_class_(KSTART_ROUTINE)
 static VOID
-TunProcessReceiveData(_Inout_ TUN_CTX *Ctx)
+TunProcessReceiveData(_Inout_ TUN_QUEUE *Queue)
 {
+    TUN_CTX *Ctx = Queue->Ctx;
+
     KeSetPriorityThread(KeGetCurrentThread(), 1);
 
-    TUN_RING *Ring = Ctx->Device.Receive.Ring;
-    ULONG RingCapacity = Ctx->Device.Receive.Capacity;
+    TUN_RING *Ring = Queue->Receive.Ring;
+    ULONG RingCapacity = Queue->Receive.Capacity;
     LARGE_INTEGER Frequency;
     KeQueryPerformanceCounter(&Frequency);
     ULONG64 SpinMax = Frequency.QuadPart / 1000 / 10; /* 1/10 ms */
-    VOID *Events[] = { &Ctx->Device.Disconnected, Ctx->Device.Receive.TailMoved };
+    VOID *Events[] = { &Ctx->Device.Disconnected, Queue->Receive.TailMoved };
     ASSERT(RTL_NUMBER_OF(Events) <= THREAD_WAIT_OBJECTS);
+    /* NBLs and payload MDLs taken from the queue caches a batch at a time, so building a batch does not need the
+     * lock. */
+    TUN_CACHE Stash, MdlStash;
+    TunCacheInit(&Stash, Ctx->ReceiveBatchSize);
+    TunCacheInit(&MdlStash, Ctx->ReceiveBatchSize);
 
     ULONG RingHead = ReadULongAcquire(&Ring->Head);
     if (RingHead >= RingCapacity)
@@ -476,228 +912,427 @@ TunProcessReceiveData(_Inout_ TUN_CTX *Ctx)
                     break;
                 ZwYieldExecution();
             }
-            if (RingHead == RingTail)
+            if (RingHead != RingTail)
+                TUN_STAT_ADD(Ctx, ReceiveSpins, 1);
+            else
             {
                 WriteRelease(&Ring->Alertable, TRUE);
                 RingTail = ReadULongAcquire(&Ring->Tail);
                 if (RingHead == RingTail)
                 {
+                    TUN_STAT_ADD(Ctx, ReceiveSleeps, 1);
                     KeWaitForMultipleObjects(
                         RTL_NUMBER_OF(Events), Events, WaitAny, Executive, KernelMode, FALSE, NULL, NULL);
                     WriteRelease(&Ring->Alertable, FALSE);
                     continue;
                 }
                 WriteRelease(&Ring->Alertable, FALSE);
-                KeClearEvent(Ctx->Device.Receive.TailMoved);
+                KeClearEvent(Queue->Receive.TailMoved);
             }
         }
-        if (RingTail >= RingCapacity)
-            break;
-
-        ULONG RingContent = TUN_RING_WRAP(RingTail - RingHead, RingCapacity);
-        if (RingContent < sizeof(TUN_PACKET))
-            break;
-
-        TUN_PACKET *Packet = (TUN_PACKET *)(Ring->Data + RingHead);
-        ULONG PacketSize = *(volatile ULONG *)&Packet->Size;
-        if (PacketSize > TUN_MAX_IP_PACKET_SIZE)
-            break;
-
-        ULONG AlignedPacketSize = TUN_ALIGN(sizeof(TUN_PACKET) + PacketSize);
-        if (AlignedPacketSize > RingContent)
-            break;
-
-        RingHead = TUN_RING_WRAP(RingHead + AlignedPacketSize, RingCapacity);
-
-        ULONG NblFlags;
-        USHORT NblProto;
-        if (PacketSize >= 20 && Packet->Data[0] >> 4 == 4)
+        /* Chain every packet we can see, up to a batch, and indicate them together. */
+        TUN_RECEIVE_BATCH Batch;
+        TunReceiveBatchBegin(
+            &Batch, RingHead, RingTail, Ctx->ReceiveBatchSize, Ctx->Offload.RscIPv4, Ctx->Offload.RscIPv6);
+        NET_BUFFER_LIST *BatchHead = NULL, *BatchTail = NULL;
+        /* Last MDL of the batch tail while receive segment coalescing grows it */
+        MDL *RscMdlTail = NULL;
+        TUN_RING_STATUS RingStatus;
+        TUN_PACKET *Packet;
+        ULONG PacketSize, Version;
+        while ((RingStatus = TunReceiveBatchNext(&Batch, Ring, RingCapacity, &Packet, &PacketSize, &Version)) ==
+               TUN_RING_OK)
         {
-            NblFlags = NDIS_NBL_FLAGS_IS_IPV4;
-            NblProto = HTONS(NDIS_ETH_TYPE_IPV4);
+            VOID *PacketAddr =
+                (UCHAR *)MmGetMdlVirtualAddress(Queue->Receive.Mdl) + (ULONG)(Packet->Data - (UCHAR *)Ring);
+            TUN_RSC_SEGMENT Segment;
+            if (TunReceiveBatchCoalesces(&Batch, Packet->Data, PacketSize, &Segment) &&
+                TunChainReceivePayload(
+                    Queue, &MdlStash, &RscMdlTail, (UCHAR *)PacketAddr + Batch.Rsc.HeaderSize, Segment.PayloadSize))
+            {
+                TunReceiveBatchAppend(&Batch, &Segment);
+                NET_BUFFER_DATA_LENGTH(NET_BUFFER_LIST_FIRST_NB(BatchTail)) = Batch.Rsc.Size;
+                TunNblSetOffsetAndMarkActive(BatchTail, Batch.Ring.Head);
+                continue;
+            }
+            if (Batch.Coalescing)
+                TunCompleteReceiveRsc(BatchTail, TunReceiveBatchEndRsc(&Batch));
+            NET_BUFFER_LIST *Nbl = TunGetReceiveNbl(Queue, &Stash, PacketAddr, PacketSize);
+            if (!Nbl)
+                continue;
+            if (Version == 4)
+            {
+                NdisSetNblFlag(Nbl, NDIS_NBL_FLAGS_IS_IPV4);
+                NET_BUFFER_LIST_INFO(Nbl, NetBufferListFrameType) = (PVOID)HTONS(NDIS_ETH_TYPE_IPV4);
+            }
+            else
+            {
+                NdisSetNblFlag(Nbl, NDIS_NBL_FLAGS_IS_IPV6);
+                NET_BUFFER_LIST_INFO(Nbl, NetBufferListFrameType) = (PVOID)HTONS(NDIS_ETH_TYPE_IPV6);
+            }
+            NET_BUFFER_LIST_STATUS(Nbl) = NDIS_STATUS_SUCCESS;
+            TunNblSetOffsetAndMarkActive(Nbl, Batch.Ring.Head);
+            if (BatchHead)
+            {
+                NET_BUFFER_LIST_NEXT_NBL(BatchTail) = Nbl;
+                NET_BUFFER_LIST_NEXT_NBL_EX(BatchTail) = Nbl;
+            }
+            else
+                BatchHead = Nbl;
+            BatchTail = Nbl;
+            RscMdlTail = NET_BUFFER_LIST_MDL(Nbl);
+            TunReceiveBatchAdd(&Batch, Packet->Data, PacketSize, Version);
         }
-        else if (PacketSize >= 40 && Packet->Data[0] >> 4 == 6)
+        if (Batch.Coalescing)
+            TunCompleteReceiveRsc(BatchTail, TunReceiveBatchEndRsc(&Batch));
+
+        /* Ring head past the last NBL indicated. Returning the NBLs moves the ring head up to here. */
+        ULONG IndicatedHead = RingHead, Indicated = 0;
+        if (Batch.Indicated)
         {
-            NblFlags = NDIS_NBL_FLAGS_IS_IPV6;
-            NblProto = HTONS(NDIS_ETH_TYPE_IPV6);
+            KIRQL Irql = ExAcquireSpinLockShared(&Ctx->TransitionLock);
+            if (ReadAcquire(&Ctx->Running))
+            {
+                KLOCK_QUEUE_HANDLE LockHandle;
+                KeAcquireInStackQueuedSpinLock(&Queue->Receive.Lock, &LockHandle);
+                if (Queue->Receive.ActiveNbls.Head)
+                    NET_BUFFER_LIST_NEXT_NBL_EX(Queue->Receive.ActiveNbls.Tail) = BatchHead;
+                else
+                {
+                    KeClearEvent(&Queue->Receive.ActiveNbls.Empty);
+                    Queue->Receive.ActiveNbls.Head = BatchHead;
+                }
+                Queue->Receive.ActiveNbls.Tail = BatchTail;
+                /* Refill the stash for the next batch while we hold the lock anyway. */
+                TunCacheMove(&Stash, &Queue->Receive.NblCache, Stash.MaxDepth);
+                TunCacheMove(&MdlStash, &Queue->Receive.MdlCache, MdlStash.MaxDepth);
+                KeReleaseInStackQueuedSpinLock(&LockHandle);
+
+                IndicatedHead = TunNblGetOffset(BatchTail);
+                ULONG ReceiveFlags = NDIS_RECEIVE_FLAGS_DISPATCH_LEVEL;
+                if (!Batch.Mixed)
+                    ReceiveFlags |= NDIS_RECEIVE_FLAGS_SINGLE_ETHER_TYPE;
+                NdisMIndicateReceiveNetBufferLists(
+                    Ctx->MiniportAdapterHandle, BatchHead, NDIS_DEFAULT_PORT_NUMBER, Batch.Indicated, ReceiveFlags);
+                TUN_STAT_ADD(Ctx, ReceiveIndications, 1);
+                if (Batch.Packets != Batch.Indicated)
+                    TUN_STAT_ADD(Ctx, ReceiveCoalesced, Batch.Packets - Batch.Indicated);
+                Indicated = Batch.Packets;
+            }
+            ExReleaseSpinLockShared(&Ctx->TransitionLock, Irql);
+            for (NET_BUFFER_LIST *Nbl = Indicated ? NULL : BatchHead, *NextNbl; Nbl; Nbl = NextNbl)
+            {
+                NextNbl = NET_BUFFER_LIST_NEXT_NBL(Nbl);
+                TunPutReceiveNbl(&Stash, &MdlStash, Nbl);
+            }
         }
-        else
-            goto skipNbl;
 
-        VOID *PacketAddr =
-            (UCHAR *)MmGetMdlVirtualAddress(Ctx->Device.Receive.Mdl) + (ULONG)(Packet->Data - (UCHAR *)Ring);
-        MDL *Mdl = IoAllocateMdl(PacketAddr, PacketSize, FALSE, FALSE, NULL);
-        if (!Mdl)
-            goto skipNbl;
-        IoBuildPartialMdl(Ctx->Device.Receive.Mdl, Mdl, PacketAddr, PacketSize);
-        NET_BUFFER_LIST *Nbl = NdisAllocateNetBufferAndNetBufferList(Ctx->NblPool, 0, 0, Mdl, 0, PacketSize);
-        if (!Nbl)
-            goto cleanupMdl;
-        Nbl->SourceHandle = Ctx->MiniportAdapterHandle;
-        NdisSetNblFlag(Nbl, NblFlags);
-        NET_BUFFER_LIST_INFO(Nbl, NetBufferListFrameType) = (PVOID)NblProto;
-        NET_BUFFER_LIST_STATUS(Nbl) = NDIS_STATUS_SUCCESS;
-        TunNblSetOffsetAndMarkActive(Nbl, RingHead);
-
-        KIRQL Irql = ExAcquireSpinLockShared(&Ctx->TransitionLock);
-        if (!ReadAcquire(&Ctx->Running))
-            goto cleanupNbl;
-
-        KLOCK_QUEUE_HANDLE LockHandle;
-        KeAcquireInStackQueuedSpinLock(&Ctx->Device.Receive.Lock, &LockHandle);
-        if (Ctx->Device.Receive.ActiveNbls.Head)
-            NET_BUFFER_LIST_NEXT_NBL_EX(Ctx->Device.Receive.ActiveNbls.Tail) = Nbl;
-        else
+        RingHead = Batch.Ring.Head;
+        if (Batch.Ring.Count != Indicated)
         {
-            KeClearEvent(&Ctx->Device.Receive.ActiveNbls.Empty);
-            Ctx->Device.Receive.ActiveNbls.Head = Nbl;
+            InterlockedAddNoFence64((LONG64 *)&Ctx->Statistics.ifInDiscards, Batch.Ring.Count - Indicated);
+            TUN_STAT_ADD(Ctx, ReceiveDiscards, Batch.Ring.Count - Indicated);
         }
-        Ctx->Device.Receive.ActiveNbls.Tail = Nbl;
-        KeReleaseInStackQueuedSpinLock(&LockHandle);
-
-        NdisMIndicateReceiveNetBufferLists(
-            Ctx->MiniportAdapterHandle,
-            Nbl,
-            NDIS_DEFAULT_PORT_NUMBER,
-            1,
-            NDIS_RECEIVE_FLAGS_DISPATCH_LEVEL | NDIS_RECEIVE_FLAGS_SINGLE_ETHER_TYPE);
-
-        ExReleaseSpinLockShared(&Ctx->TransitionLock, Irql);
-        continue;
-
-    cleanupNbl:
-        ExReleaseSpinLockShared(&Ctx->TransitionLock, Irql);
-        NdisFreeNetBufferList(Nbl);
-    cleanupMdl:
-        IoFreeMdl(Mdl);
-    skipNbl:
-        InterlockedIncrementNoFence64((LONG64 *)&Ctx->Statistics.ifInDiscards);
-        KeWaitForSingleObject(&Ctx->Device.Receive.ActiveNbls.Empty, Executive, KernelMode, FALSE, NULL);
-        WriteULongRelease(&Ring->Head, RingHead);
+        /* Nothing else will move the ring head past packets dropped after the last NBL indicated. */
+        if (RingHead != IndicatedHead)
+        {
+            KeWaitForSingleObject(&Queue->Receive.ActiveNbls.Empty, Executive, KernelMode, FALSE, NULL);
+            WriteULongRelease(&Ring->Head, RingHead);
+        }
+        if (RingStatus != TUN_RING_EMPTY)
+            break;
     }
 
     /* Wait for all NBLs to return: 1. To prevent race between proceeding and invalidating ring head. 2. To have
      * TunDispatchUnregisterBuffers() implicitly wait before releasing ring MDL used by NBL(s). */
-    KeWaitForSingleObject(&Ctx->Device.Receive.ActiveNbls.Empty, Executive, KernelMode, FALSE, NULL);
+    KeWaitForSingleObject(&Queue->Receive.ActiveNbls.Empty, Executive, KernelMode, FALSE, NULL);
+    TunFreeCachedNbls(TunCacheDetach(&Stash));
+    TunFreeCachedMdls(TunCacheDetach(&MdlStash));
 cleanup:
     WriteULongRelease(&Ring->Head, MAXULONG);
 }
 
-#define IS_POW2(x) ((x) && !((x) & ((x)-1)))
-
 _IRQL_requires_max_(PASSIVE_LEVEL)
 _Must_inspect_result_
 static NTSTATUS
-TunRegisterBuffers(_Inout_ TUN_CTX *Ctx, _Inout_ IRP *Irp)
+TunMapQueue(_Inout_ TUN_QUEUE *Queue, _In_ const TUN_REGISTER_RINGS *Rrb, _Inout_ IRP *Irp)
 {
-    NTSTATUS Status = STATUS_ALREADY_INITIALIZED;
-    IO_STACK_LOCATION *Stack = IoGetCurrentIrpStackLocation(Irp);
-
-    if (!ExAcquireResourceExclusiveLite(&Ctx->Device.RegistrationLock, FALSE))
-        return Status;
-
-    if (Ctx->Device.OwningFileObject)
-        goto cleanupMutex;
-    Ctx->Device.OwningFileObject = Stack->FileObject;
-
-    TUN_REGISTER_RINGS Rrb;
-    if (Stack->Parameters.DeviceIoControl.InputBufferLength == sizeof(Rrb))
-        NdisMoveMemory(&Rrb, Irp->AssociatedIrp.SystemBuffer, sizeof(Rrb));
-#ifdef _WIN64
-    else if (
-        IoIs32bitProcess(Irp) && Stack->Parameters.DeviceIoControl.InputBufferLength == sizeof(TUN_REGISTER_RINGS_32))
-    {
-        TUN_REGISTER_RINGS_32 *Rrb32 = Irp->AssociatedIrp.SystemBuffer;
-        Rrb.Send.RingSize = Rrb32->Send.RingSize;
-        Rrb.Send.Ring = (TUN_RING *)Rrb32->Send.Ring;
-        Rrb.Send.TailMoved = (HANDLE)Rrb32->Send.TailMoved;
-        Rrb.Receive.RingSize = Rrb32->Receive.RingSize;
-        Rrb.Receive.Ring = (TUN_RING *)Rrb32->Receive.Ring;
-        Rrb.Receive.TailMoved = (HANDLE)Rrb32->Receive.TailMoved;
-    }
-#endif
-    else
-    {
-        Status = STATUS_INVALID_PARAMETER;
-        goto cleanupResetOwner;
-    }
+    NTSTATUS Status;
 
-    Ctx->Device.Send.Capacity = TUN_RING_CAPACITY(Rrb.Send.RingSize);
+    Queue->Send.Capacity = TUN_RING_CAPACITY(Rrb->Send.RingSize);
     if (Status = STATUS_INVALID_PARAMETER,
-        (Ctx->Device.Send.Capacity < TUN_MIN_RING_CAPACITY || Ctx->Device.Send.Capacity > TUN_MAX_RING_CAPACITY ||
-         !IS_POW2(Ctx->Device.Send.Capacity) || !Rrb.Send.TailMoved || !Rrb.Send.Ring))
-        goto cleanupResetOwner;
+        (!TunRingIsValidCapacity(Queue->Send.Capacity) || !Rrb->Send.TailMoved || !Rrb->Send.Ring))
+        return Status;
 
     if (!NT_SUCCESS(
             Status = ObReferenceObjectByHandle(
-                Rrb.Send.TailMoved,
+                Rrb->Send.TailMoved,
                 /* We will not wait on send ring tail moved event. */
                 EVENT_MODIFY_STATE,
                 *ExEventObjectType,
                 Irp->RequestorMode,
-                &Ctx->Device.Send.TailMoved,
+                &Queue->Send.TailMoved,
                 NULL)))
-        goto cleanupResetOwner;
+        return Status;
 
-    Ctx->Device.Send.Mdl = IoAllocateMdl(Rrb.Send.Ring, Rrb.Send.RingSize, FALSE, FALSE, NULL);
-    if (Status = STATUS_INSUFFICIENT_RESOURCES, !Ctx->Device.Send.Mdl)
+    Queue->Send.Mdl = IoAllocateMdl(Rrb->Send.Ring, Rrb->Send.RingSize, FALSE, FALSE, NULL);
+    if (Status = STATUS_INSUFFICIENT_RESOURCES, !Queue->Send.Mdl)
         goto cleanupSendTailMoved;
     try
     {
         Status = STATUS_INVALID_USER_BUFFER;
-        MmProbeAndLockPages(Ctx->Device.Send.Mdl, Irp->RequestorMode, IoWriteAccess);
+        MmProbeAndLockPages(Queue->Send.Mdl, Irp->RequestorMode, IoWriteAccess);
     }
     except(EXCEPTION_EXECUTE_HANDLER) { goto cleanupSendMdl; }
 
-    Ctx->Device.Send.Ring =
-        MmGetSystemAddressForMdlSafe(Ctx->Device.Send.Mdl, NormalPagePriority | MdlMappingNoExecute);
-    if (Status = STATUS_INSUFFICIENT_RESOURCES, !Ctx->Device.Send.Ring)
+    Queue->Send.Ring = MmGetSystemAddressForMdlSafe(Queue->Send.Mdl, NormalPagePriority | MdlMappingNoExecute);
+    if (Status = STATUS_INSUFFICIENT_RESOURCES, !Queue->Send.Ring)
         goto cleanupSendUnlockPages;
 
-    Ctx->Device.Send.RingTail = ReadULongAcquire(&Ctx->Device.Send.Ring->Tail);
-    if (Status = STATUS_INVALID_PARAMETER, Ctx->Device.Send.RingTail >= Ctx->Device.Send.Capacity)
+    Queue->Send.ReservedTail = Queue->Send.PublishedTail = ReadULongAcquire(&Queue->Send.Ring->Tail);
+    if (Status = STATUS_INVALID_PARAMETER, Queue->Send.ReservedTail >= Queue->Send.Capacity)
         goto cleanupSendUnlockPages;
 
-    Ctx->Device.Receive.Capacity = TUN_RING_CAPACITY(Rrb.Receive.RingSize);
+    Queue->Receive.Capacity = TUN_RING_CAPACITY(Rrb->Receive.RingSize);
     if (Status = STATUS_INVALID_PARAMETER,
-        (Ctx->Device.Receive.Capacity < TUN_MIN_RING_CAPACITY || Ctx->Device.Receive.Capacity > TUN_MAX_RING_CAPACITY ||
-         !IS_POW2(Ctx->Device.Receive.Capacity) || !Rrb.Receive.TailMoved || !Rrb.Receive.Ring))
+        (!TunRingIsValidCapacity(Queue->Receive.Capacity) || !Rrb->Receive.TailMoved || !Rrb->Receive.Ring))
         goto cleanupSendUnlockPages;
 
     if (!NT_SUCCESS(
             Status = ObReferenceObjectByHandle(
-                Rrb.Receive.TailMoved,
+                Rrb->Receive.TailMoved,
                 /* We need to clear receive ring TailMoved event on transition to non-alertable state. */
                 SYNCHRONIZE | EVENT_MODIFY_STATE,
                 *ExEventObjectType,
                 Irp->RequestorMode,
-                &Ctx->Device.Receive.TailMoved,
+                &Queue->Receive.TailMoved,
                 NULL)))
         goto cleanupSendUnlockPages;
 
-    Ctx->Device.Receive.Mdl = IoAllocateMdl(Rrb.Receive.Ring, Rrb.Receive.RingSize, FALSE, FALSE, NULL);
-    if (Status = STATUS_INSUFFICIENT_RESOURCES, !Ctx->Device.Receive.Mdl)
+    Queue->Receive.Mdl = IoAllocateMdl(Rrb->Receive.Ring, Rrb->Receive.RingSize, FALSE, FALSE, NULL);
+    if (Status = STATUS_INSUFFICIENT_RESOURCES, !Queue->Receive.Mdl)
         goto cleanupReceiveTailMoved;
     try
     {
         Status = STATUS_INVALID_USER_BUFFER;
-        MmProbeAndLockPages(Ctx->Device.Receive.Mdl, Irp->RequestorMode, IoWriteAccess);
+        MmProbeAndLockPages(Queue->Receive.Mdl, Irp->RequestorMode, IoWriteAccess);
     }
     except(EXCEPTION_EXECUTE_HANDLER) { goto cleanupReceiveMdl; }
 
-    Ctx->Device.Receive.Ring =
-        MmGetSystemAddressForMdlSafe(Ctx->Device.Receive.Mdl, NormalPagePriority | MdlMappingNoExecute);
-    if (Status = STATUS_INSUFFICIENT_RESOURCES, !Ctx->Device.Receive.Ring)
+    Queue->Receive.Ring =
+        MmGetSystemAddressForMdlSafe(Queue->Receive.Mdl, NormalPagePriority | MdlMappingNoExecute);
+    if (Status = STATUS_INSUFFICIENT_RESOURCES, !Queue->Receive.Ring)
         goto cleanupReceiveUnlockPages;
 
+    TunCacheInit(&Queue->Receive.NblCache, TunCacheDepthForRing(Queue->Receive.Capacity));
+    TunCacheInit(&Queue->Receive.MdlCache, TunCacheDepthForRing(Queue->Receive.Capacity));
+    return STATUS_SUCCESS;
+
+cleanupReceiveUnlockPages:
+    MmUnlockPages(Queue->Receive.Mdl);
+cleanupReceiveMdl:
+    IoFreeMdl(Queue->Receive.Mdl);
+cleanupReceiveTailMoved:
+    ObDereferenceObject(Queue->Receive.TailMoved);
+cleanupSendUnlockPages:
+    MmUnlockPages(Queue->Send.Mdl);
+cleanupSendMdl:
+    IoFreeMdl(Queue->Send.Mdl);
+cleanupSendTailMoved:
+    ObDereferenceObject(Queue->Send.TailMoved);
+    return Status;
+}
+
+_IRQL_requires_max_(PASSIVE_LEVEL)
+static VOID
+TunUnmapQueue(_Inout_ TUN_QUEUE *Queue)
+{
+    /* All NBLs have returned by now, and TunReturnNetBufferLists caches them before signaling Empty. */
+    KLOCK_QUEUE_HANDLE LockHandle;
+    KeAcquireInStackQueuedSpinLock(&Queue->Receive.Lock, &LockHandle);
+    TUN_CACHE_ENTRY *Entries = TunCacheDetach(&Queue->Receive.NblCache);
+    TUN_CACHE_ENTRY *MdlEntries = TunCacheDetach(&Queue->Receive.MdlCache);
+    KeReleaseInStackQueuedSpinLock(&LockHandle);
+    TunFreeCachedNbls(Entries);
+    TunFreeCachedMdls(MdlEntries);
+    MmUnlockPages(Queue->Receive.Mdl);
+    IoFreeMdl(Queue->Receive.Mdl);
+    ObDereferenceObject(Queue->Receive.TailMoved);
+    MmUnlockPages(Queue->Send.Mdl);
+    IoFreeMdl(Queue->Send.Mdl);
+    ObDereferenceObject(Queue->Send.TailMoved);
+}
+
+_IRQL_requires_max_(PASSIVE_LEVEL)
+static VOID
+TunJoinReceiveThread(_Inout_ TUN_QUEUE *Queue)
+{
+    PKTHREAD ThreadObject;
+    if (NT_SUCCESS(
+            ObReferenceObjectByHandle(Queue->Receive.Thread, SYNCHRONIZE, NULL, KernelMode, &ThreadObject, NULL)))
+    {
+        KeWaitForSingleObject(ThreadObject, Executive, KernelMode, FALSE, NULL);
+        ObDereferenceObject(ThreadObject);
+    }
+    ZwClose(Queue->Receive.Thread);
+}
+
+_IRQL_requires_max_(PASSIVE_LEVEL)
+_Must_inspect_result_
+static NTSTATUS
+TunRegisterBuffers(_Inout_ TUN_CTX *Ctx, _Inout_ IRP *Irp)
+{
+    NTSTATUS Status = STATUS_ALREADY_INITIALIZED;
+    IO_STACK_LOCATION *Stack = IoGetCurrentIrpStackLocation(Irp);
+    ULONG QueuesMapped = 0, ThreadsStarted = 0;
+
+    if (!ExAcquireResourceExclusiveLite(&Ctx->Device.RegistrationLock, FALSE))
+        return Status;
+
+    if (Ctx->Device.OwningFileObject)
+        goto cleanupMutex;
+    Ctx->Device.OwningFileObject = Stack->FileObject;
+
+    ULONG QueueCount = 1;
+    TUN_REGISTER_RINGS *Rings = NULL;
+#ifdef _WIN64
+    TUN_REGISTER_RINGS_32 *Rings32 = NULL;
+#endif
+    ULONG StatisticsSize = 0, Flags = 0;
+    TUN_DRIVER_STATISTICS *Statistics = NULL;
+    ULONG InputBufferLength = Stack->Parameters.DeviceIoControl.InputBufferLength;
+    Status = STATUS_INVALID_PARAMETER;
+    if (Stack->Parameters.DeviceIoControl.IoControlCode == TUN_IOCTL_REGISTER_QUEUES)
+    {
+#ifdef _WIN64
+        if (IoIs32bitProcess(Irp))
+        {
+            TUN_REGISTER_QUEUES_32 *Rqb32 = Irp->AssociatedIrp.SystemBuffer;
+            if (InputBufferLength < FIELD_OFFSET(TUN_REGISTER_QUEUES_32, Queues))
+                goto cleanupResetOwner;
+            QueueCount = Rqb32->QueueCount;
+            if (!QueueCount || QueueCount > TUN_MAX_QUEUES ||
+                InputBufferLength !=
+                    FIELD_OFFSET(TUN_REGISTER_QUEUES_32, Queues) + QueueCount * sizeof(TUN_REGISTER_RINGS_32))
+                goto cleanupResetOwner;
+            StatisticsSize = Rqb32->StatisticsSize;
+            Statistics = (TUN_DRIVER_STATISTICS *)Rqb32->Statistics;
+            Flags = Rqb32->Flags;
+            Rings32 = Rqb32->Queues;
+        }
+        else
+#endif
+        {
+            TUN_REGISTER_QUEUES *Rqb = Irp->AssociatedIrp.SystemBuffer;
+            if (InputBufferLength < FIELD_OFFSET(TUN_REGISTER_QUEUES, Queues))
+                goto cleanupResetOwner;
+            QueueCount = Rqb->QueueCount;
+            if (!QueueCount || QueueCount > TUN_MAX_QUEUES ||
+                InputBufferLength !=
+                    FIELD_OFFSET(TUN_REGISTER_QUEUES, Queues) + QueueCount * sizeof(TUN_REGISTER_RINGS))
+                goto cleanupResetOwner;
+            StatisticsSize = Rqb->StatisticsSize;
+            Statistics = Rqb->Statistics;
+            Flags = Rqb->Flags;
+            Rings = Rqb->Queues;
+        }
+    }
+    else if (InputBufferLength == sizeof(TUN_REGISTER_RINGS) || InputBufferLength == sizeof(TUN_REGISTER_RINGS_EX))
+    {
+        TUN_REGISTER_RINGS_EX *RrbEx = Irp->AssociatedIrp.SystemBuffer;
+        Rings = &RrbEx->Rings;
+        if (InputBufferLength == sizeof(TUN_REGISTER_RINGS_EX))
+        {
+            StatisticsSize = RrbEx->StatisticsSize;
+            Statistics = RrbEx->Statistics;
+        }
+    }
+#ifdef _WIN64
+    else if (
+        IoIs32bitProcess(Irp) && (InputBufferLength == sizeof(TUN_REGISTER_RINGS_32) ||
+                                  InputBufferLength == sizeof(TUN_REGISTER_RINGS_EX_32)))
+    {
+        TUN_REGISTER_RINGS_EX_32 *RrbEx32 = Irp->AssociatedIrp.SystemBuffer;
+        Rings32 = &RrbEx32->Rings;
+        if (InputBufferLength == sizeof(TUN_REGISTER_RINGS_EX_32))
+        {
+            StatisticsSize = RrbEx32->StatisticsSize;
+            Statistics = (TUN_DRIVER_STATISTICS *)RrbEx32->Statistics;
+        }
+    }
+#endif
+    else
+        goto cleanupResetOwner;
+    if (Flags & ~TUN_REGISTER_FLAG_GSO)
+        goto cleanupResetOwner;
+
+    for (; QueuesMapped < QueueCount; ++QueuesMapped)
+    {
+        TUN_REGISTER_RINGS Rrb;
+#ifdef _WIN64
+        if (Rings32)
+        {
+            TUN_REGISTER_RINGS_32 *Rrb32 = &Rings32[QueuesMapped];
+            Rrb.Send.RingSize = Rrb32->Send.RingSize;
+            Rrb.Send.Ring = (TUN_RING *)Rrb32->Send.Ring;
+            Rrb.Send.TailMoved = (HANDLE)Rrb32->Send.TailMoved;
+            Rrb.Receive.RingSize = Rrb32->Receive.RingSize;
+            Rrb.Receive.Ring = (TUN_RING *)Rrb32->Receive.Ring;
+            Rrb.Receive.TailMoved = (HANDLE)Rrb32->Receive.TailMoved;
+        }
+        else
+#endif
+            NdisMoveMemory(&Rrb, &Rings[QueuesMapped], sizeof(Rrb));
+        if (!NT_SUCCESS(Status = TunMapQueue(&Ctx->Device.Queues[QueuesMapped], &Rrb, Irp)))
+            goto cleanupQueues;
+    }
+
+    /* A page too small for the counters we maintain is ignored rather than rejected, so it can never fail rings. */
+    Ctx->Device.Statistics.Mdl = NULL;
+    if (Statistics && StatisticsSize >= sizeof(TUN_DRIVER_STATISTICS))
+    {
+        if (Status = STATUS_INVALID_PARAMETER, (ULONG_PTR)Statistics & (TUN_STATS_ALIGNMENT - 1))
+            goto cleanupQueues;
+        Ctx->Device.Statistics.Mdl = IoAllocateMdl(Statistics, sizeof(TUN_DRIVER_STATISTICS), FALSE, FALSE, NULL);
+        if (Status = STATUS_INSUFFICIENT_RESOURCES, !Ctx->Device.Statistics.Mdl)
+            goto cleanupQueues;
+        try
+        {
+            Status = STATUS_INVALID_USER_BUFFER;
+            MmProbeAndLockPages(Ctx->Device.Statistics.Mdl, Irp->RequestorMode, IoWriteAccess);
+        }
+        except(EXCEPTION_EXECUTE_HANDLER) { goto cleanupStatisticsMdl; }
+
+        TUN_DRIVER_STATISTICS *Page =
+            MmGetSystemAddressForMdlSafe(Ctx->Device.Statistics.Mdl, NormalPagePriority | MdlMappingNoExecute);
+        if (Status = STATUS_INSUFFICIENT_RESOURCES, !Page)
+            goto cleanupStatisticsUnlockPages;
+        WriteULongRelease(&Page->Size, sizeof(TUN_DRIVER_STATISTICS));
+        WritePointerRelease((PVOID *)&Ctx->Device.Statistics.Page, Page);
+    }
+
+    Ctx->Device.QueueCount = QueueCount;
+    ULONG Seed = (ULONG)KeQueryPerformanceCounter(NULL).QuadPart;
+    Ctx->Device.FlowSeed = RtlRandomEx(&Seed);
+    Ctx->Device.Gso = !!(Flags & TUN_REGISTER_FLAG_GSO);
     KeClearEvent(&Ctx->Device.Disconnected);
 
     OBJECT_ATTRIBUTES ObjectAttributes;
     InitializeObjectAttributes(&ObjectAttributes, NULL, OBJ_KERNEL_HANDLE, NULL, NULL);
-    if (Status = NDIS_STATUS_FAILURE,
-        !NT_SUCCESS(PsCreateSystemThread(
-            &Ctx->Device.Receive.Thread, THREAD_ALL_ACCESS, &ObjectAttributes, NULL, NULL, TunProcessReceiveData, Ctx)))
-        goto cleanupFlagsConnected;
+    for (; ThreadsStarted < QueueCount; ++ThreadsStarted)
+    {
+        TUN_QUEUE *Queue = &Ctx->Device.Queues[ThreadsStarted];
+        if (Status = NDIS_STATUS_FAILURE,
+            !NT_SUCCESS(PsCreateSystemThread(
+                &Queue->Receive.Thread,
+                THREAD_ALL_ACCESS,
+                &ObjectAttributes,
+                NULL,
+                NULL,
+                TunProcessReceiveData,
+                Queue)))
+            goto cleanupFlagsConnected;
+    }
 
     Ctx->Device.OwningProcessId = PsGetCurrentProcessId();
     InitializeListHead(&Ctx->Device.Entry);
@@ -705,27 +1340,30 @@ TunRegisterBuffers(_Inout_ TUN_CTX *Ctx, _Inout_ IRP *Irp)
     InsertTailList(&TunDispatchDeviceList, &Ctx->Device.Entry);
     ExReleaseResourceLite(&TunDispatchDeviceListLock);
 
+    if (Ctx->Device.Gso)
+        TunIndicateOffloadConfig(Ctx);
     ExReleaseResourceLite(&Ctx->Device.RegistrationLock);
     TunIndicateStatus(Ctx->MiniportAdapterHandle, MediaConnectStateConnected);
     return STATUS_SUCCESS;
 
 cleanupFlagsConnected:
     KeSetEvent(&Ctx->Device.Disconnected, IO_NO_INCREMENT, FALSE);
+    WritePointerRelease((PVOID *)&Ctx->Device.Statistics.Page, &Ctx->Device.Statistics.Sink);
     ExReleaseSpinLockExclusive(
         &Ctx->TransitionLock,
         ExAcquireSpinLockExclusive(&Ctx->TransitionLock)); /* Ensure above change is visible to all readers. */
-cleanupReceiveUnlockPages:
-    MmUnlockPages(Ctx->Device.Receive.Mdl);
-cleanupReceiveMdl:
-    IoFreeMdl(Ctx->Device.Receive.Mdl);
-cleanupReceiveTailMoved:
-    ObDereferenceObject(Ctx->Device.Receive.TailMoved);
-cleanupSendUnlockPages:
-    MmUnlockPages(Ctx->Device.Send.Mdl);
-cleanupSendMdl:
-    IoFreeMdl(Ctx->Device.Send.Mdl);
-cleanupSendTailMoved:
-    ObDereferenceObject(Ctx->Device.Send.TailMoved);
+    Ctx->Device.Gso = FALSE;
+    for (ULONG Index = 0; Index < ThreadsStarted; ++Index)
+        TunJoinReceiveThread(&Ctx->Device.Queues[Index]);
+    if (!Ctx->Device.Statistics.Mdl)
+        goto cleanupQueues;
+cleanupStatisticsUnlockPages:
+    MmUnlockPages(Ctx->Device.Statistics.Mdl);
+cleanupStatisticsMdl:
+    IoFreeMdl(Ctx->Device.Statistics.Mdl);
+cleanupQueues:
+    for (ULONG Index = 0; Index < QueuesMapped; ++Index)
+        TunUnmapQueue(&Ctx->Device.Queues[Index]);
 cleanupResetOwner:
     Ctx->Device.OwningFileObject = NULL;
 cleanupMutex:
@@ -755,28 +1393,33 @@ TunUnregisterBuffers(_Inout_ TUN_CTX *Ctx, _In_ FILE_OBJECT *Owner)
     TunIndicateStatus(Ctx->MiniportAdapterHandle, MediaConnectStateDisconnected);
 
     KeSetEvent(&Ctx->Device.Disconnected, IO_NO_INCREMENT, FALSE);
+    WritePointerRelease((PVOID *)&Ctx->Device.Statistics.Page, &Ctx->Device.Statistics.Sink);
     ExReleaseSpinLockExclusive(
         &Ctx->TransitionLock,
         ExAcquireSpinLockExclusive(&Ctx->TransitionLock)); /* Ensure above change is visible to all readers. */
-
-    PKTHREAD ThreadObject;
-    if (NT_SUCCESS(
-            ObReferenceObjectByHandle(Ctx->Device.Receive.Thread, SYNCHRONIZE, NULL, KernelMode, &ThreadObject, NULL)))
+    if (Ctx->Device.Gso)
     {
-        KeWaitForSingleObject(ThreadObject, Executive, KernelMode, FALSE, NULL);
-        ObDereferenceObject(ThreadObject);
+        Ctx->Device.Gso = FALSE;
+        TunIndicateOffloadConfig(Ctx);
     }
-    ZwClose(Ctx->Device.Receive.Thread);
 
-    WriteULongRelease(&Ctx->Device.Send.Ring->Tail, MAXULONG);
-    KeSetEvent(Ctx->Device.Send.TailMoved, IO_NO_INCREMENT, FALSE);
+    for (ULONG Index = 0; Index < Ctx->Device.QueueCount; ++Index)
+        TunJoinReceiveThread(&Ctx->Device.Queues[Index]);
 
-    MmUnlockPages(Ctx->Device.Receive.Mdl);
-    IoFreeMdl(Ctx->Device.Receive.Mdl);
-    ObDereferenceObject(Ctx->Device.Receive.TailMoved);
-    MmUnlockPages(Ctx->Device.Send.Mdl);
-    IoFreeMdl(Ctx->Device.Send.Mdl);
-    ObDereferenceObject(Ctx->Device.Send.TailMoved);
+    for (ULONG Index = 0; Index < Ctx->Device.QueueCount; ++Index)
+    {
+        TUN_QUEUE *Queue = &Ctx->Device.Queues[Index];
+        WriteULongRelease(&Queue->Send.Ring->Tail, MAXULONG);
+        KeSetEvent(Queue->Send.TailMoved, IO_NO_INCREMENT, FALSE);
+    }
+
+    if (Ctx->Device.Statistics.Mdl)
+    {
+        MmUnlockPages(Ctx->Device.Statistics.Mdl);
+        IoFreeMdl(Ctx->Device.Statistics.Mdl);
+    }
+    for (ULONG Index = 0; Index < Ctx->Device.QueueCount; ++Index)
+        TunUnmapQueue(&Ctx->Device.Queues[Index]);
 
     ExReleaseResourceLite(&Ctx->Device.RegistrationLock);
 }
@@ -812,7 +1455,8 @@ static NTSTATUS
 TunDispatchDeviceControl(DEVICE_OBJECT *DeviceObject, IRP *Irp)
 {
     IO_STACK_LOCATION *Stack = IoGetCurrentIrpStackLocation(Irp);
-    if (Stack->Parameters.DeviceIoControl.IoControlCode != TUN_IOCTL_REGISTER_RINGS)
+    if (Stack->Parameters.DeviceIoControl.IoControlCode != TUN_IOCTL_REGISTER_RINGS &&
+        Stack->Parameters.DeviceIoControl.IoControlCode != TUN_IOCTL_REGISTER_QUEUES)
         return NdisDispatchDeviceControl(DeviceObject, Irp);
 
     SECURITY_SUBJECT_CONTEXT SubjectContext;
@@ -835,7 +1479,8 @@ TunDispatchDeviceControl(DEVICE_OBJECT *DeviceObject, IRP *Irp)
         goto cleanup;
     switch (Stack->Parameters.DeviceIoControl.IoControlCode)
     {
-    case TUN_IOCTL_REGISTER_RINGS: {
+    case TUN_IOCTL_REGISTER_RINGS:
+    case TUN_IOCTL_REGISTER_QUEUES: {
         KeEnterCriticalRegion();
         ExAcquireResourceSharedLite(&TunDispatchCtxGuard, TRUE);
 #pragma warning(suppress : 28175)
@@ -969,7 +1614,8 @@ TunPause(NDIS_HANDLE MiniportAdapterContext, PNDIS_MINIPORT_PAUSE_PARAMETERS Min
         &Ctx->TransitionLock,
         ExAcquireSpinLockExclusive(&Ctx->TransitionLock)); /* Ensure above change is visible to all readers. */
 
-    KeWaitForSingleObject(&Ctx->Device.Receive.ActiveNbls.Empty, Executive, KernelMode, FALSE, NULL);
+    for (ULONG Index = 0; Index < TUN_MAX_QUEUES; ++Index)
+        KeWaitForSingleObject(&Ctx->Device.Queues[Index].Receive.ActiveNbls.Empty, Executive, KernelMode, FALSE, NULL);
 
     return NDIS_STATUS_SUCCESS;
 }
@@ -981,6 +1627,55 @@ TunDevicePnPEventNotify(NDIS_HANDLE MiniportAdapterContext, PNET_DEVICE_PNP_EVEN
 {
 }
 
+/* Reads the integer adapter setting Keyword into Value if it lies within Min and Max. Otherwise, Value keeps the
+ * default it holds. */
+_IRQL_requires_max_(PASSIVE_LEVEL)
+static VOID
+TunReadConfigurationInteger(
+    _In_ NDIS_HANDLE ConfigHandle,
+    _In_ NDIS_STRING *Keyword,
+    _In_ ULONG Min,
+    _In_ ULONG Max,
+    _Inout_ ULONG *Value)
+{
+    NDIS_STATUS Status;
+    NDIS_CONFIGURATION_PARAMETER *Parameter;
+    NdisReadConfiguration(&Status, &Parameter, ConfigHandle, Keyword, NdisParameterInteger);
+    if (Status == NDIS_STATUS_SUCCESS && Parameter->ParameterData.IntegerData >= Min &&
+        Parameter->ParameterData.IntegerData <= Max)
+        *Value = Parameter->ParameterData.IntegerData;
+}
+
+/* Reads the adapter settings into Ctx, falling back to defaults for the ones missing or out of range. */
+_IRQL_requires_max_(PASSIVE_LEVEL)
+static VOID
+TunReadConfiguration(_In_ NDIS_HANDLE MiniportAdapterHandle, _Inout_ TUN_CTX *Ctx)
+{
+    ULONG BatchSize = 0, RscIPv4 = TRUE, RscIPv6 = TRUE;
+    NDIS_CONFIGURATION_OBJECT ConfigObject = { .Header = { .Type = NDIS_OBJECT_TYPE_CONFIGURATION_OBJECT,
+                                                           .Revision = NDIS_CONFIGURATION_OBJECT_REVISION_1,
+                                                           .Size = NDIS_SIZEOF_CONFIGURATION_OBJECT_REVISION_1 },
+                                               .NdisHandle = MiniportAdapterHandle };
+    NDIS_HANDLE ConfigHandle;
+    if (NdisOpenConfigurationEx(&ConfigObject, &ConfigHandle) == NDIS_STATUS_SUCCESS)
+    {
+        NDIS_STRING BatchSizeKeyword = NDIS_STRING_CONST("ReceiveBatchSize");
+        NDIS_STRING RscIPv4Keyword = NDIS_STRING_CONST("*RscIPv4");
+        NDIS_STRING RscIPv6Keyword = NDIS_STRING_CONST("*RscIPv6");
+        TunReadConfigurationInteger(ConfigHandle, &BatchSizeKeyword, 0, MAXULONG, &BatchSize);
+        TunReadConfigurationInteger(ConfigHandle, &RscIPv4Keyword, 0, 1, &RscIPv4);
+        TunReadConfigurationInteger(ConfigHandle, &RscIPv6Keyword, 0, 1, &RscIPv6);
+        NdisCloseConfiguration(ConfigHandle);
+    }
+    /* Before NDIS 6.30 there is no receive segment coalescing to report, nor a TcpRecvSegCoalesceInfo the protocol
+     * stack would look at, so coalesced packets would go up as plain oversized ones. */
+    if (NdisVersion < NDIS_RUNTIME_VERSION_630)
+        RscIPv4 = RscIPv6 = FALSE;
+    Ctx->ReceiveBatchSize = TunReceiveBatchSize(BatchSize);
+    Ctx->Offload.RscIPv4 = (BOOLEAN)RscIPv4;
+    Ctx->Offload.RscIPv6 = (BOOLEAN)RscIPv6;
+}
+
 static MINIPORT_INITIALIZE TunInitializeEx;
 _Use_decl_annotations_
 static NDIS_STATUS
@@ -1031,10 +1726,16 @@ TunInitializeEx(
         NDIS_STATISTICS_FLAGS_VALID_BROADCAST_BYTES_RCV | NDIS_STATISTICS_FLAGS_VALID_DIRECTED_BYTES_XMIT |
         NDIS_STATISTICS_FLAGS_VALID_MULTICAST_BYTES_XMIT | NDIS_STATISTICS_FLAGS_VALID_BROADCAST_BYTES_XMIT;
     KeInitializeEvent(&Ctx->Device.Disconnected, NotificationEvent, TRUE);
-    KeInitializeSpinLock(&Ctx->Device.Send.Lock);
-    KeInitializeSpinLock(&Ctx->Device.Receive.Lock);
-    KeInitializeEvent(&Ctx->Device.Receive.ActiveNbls.Empty, NotificationEvent, TRUE);
+    Ctx->Device.Statistics.Page = &Ctx->Device.Statistics.Sink;
+    for (ULONG Index = 0; Index < TUN_MAX_QUEUES; ++Index)
+    {
+        TUN_QUEUE *Queue = &Ctx->Device.Queues[Index];
+        Queue->Ctx = Ctx;
+        KeInitializeSpinLock(&Queue->Receive.Lock);
+        KeInitializeEvent(&Queue->Receive.ActiveNbls.Empty, NotificationEvent, TRUE);
+    }
     ExInitializeResourceLite(&Ctx->Device.RegistrationLock);
+    Ctx->Offload.LsoV2IPv4 = Ctx->Offload.LsoV2IPv6 = TRUE;
 
     NET_BUFFER_LIST_POOL_PARAMETERS NblPoolParameters = {
         .Header = { .Type = NDIS_OBJECT_TYPE_DEFAULT,
@@ -1050,6 +1751,8 @@ TunInitializeEx(
     if (Status = NDIS_STATUS_FAILURE, !Ctx->NblPool)
         goto cleanupFreeCtx;
 
+    TunReadConfiguration(MiniportAdapterHandle, Ctx);
+
     NDIS_MINIPORT_ADAPTER_REGISTRATION_ATTRIBUTES AdapterRegistrationAttributes = {
         .Header = { .Type = NDIS_OBJECT_TYPE_MINIPORT_ADAPTER_REGISTRATION_ATTRIBUTES,
                     .Revision = NdisVersion < NDIS_RUNTIME_VERSION_630
@@ -1093,7 +1796,9 @@ TunInitializeEx(
                                         OID_GEN_INTERRUPT_MODERATION,
                                         OID_GEN_LINK_PARAMETERS,
                                         OID_PNP_SET_POWER,
-                                        OID_PNP_QUERY_POWER };
+                                        OID_PNP_QUERY_POWER,
+                                        OID_TCP_OFFLOAD_PARAMETERS,
+                                        OID_OFFLOAD_ENCAPSULATION };
     NDIS_MINIPORT_ADAPTER_GENERAL_ATTRIBUTES AdapterGeneralAttributes = {
         .Header = { .Type = NDIS_OBJECT_TYPE_MINIPORT_ADAPTER_GENERAL_ATTRIBUTES,
                     .Revision = NDIS_MINIPORT_ADAPTER_GENERAL_ATTRIBUTES_REVISION_2,
@@ -1132,6 +1837,22 @@ TunInitializeEx(
             MiniportAdapterHandle, (PNDIS_MINIPORT_ADAPTER_ATTRIBUTES)&AdapterGeneralAttributes)))
         goto cleanupFreeNblPool;
 
+    /* Large send offload stays off until a client that segments super-packets registers. */
+    NDIS_OFFLOAD DefaultOffload, HardwareOffload;
+    TunInitOffload(&DefaultOffload, FALSE, FALSE, Ctx->Offload.RscIPv4, Ctx->Offload.RscIPv6);
+    TunInitOffload(&HardwareOffload, TRUE, TRUE, TRUE, TRUE);
+    NDIS_MINIPORT_ADAPTER_OFFLOAD_ATTRIBUTES AdapterOffloadAttributes = {
+        .Header = { .Type = NDIS_OBJECT_TYPE_MINIPORT_ADAPTER_OFFLOAD_ATTRIBUTES,
+                    .Revision = NDIS_MINIPORT_ADAPTER_OFFLOAD_ATTRIBUTES_REVISION_1,
+                    .Size = NDIS_SIZEOF_MINIPORT_ADAPTER_OFFLOAD_ATTRIBUTES_REVISION_1 },
+        .DefaultOffloadConfiguration = &DefaultOffload,
+        .HardwareOffloadCapabilities = &HardwareOffload
+    };
+    if (Status = NDIS_STATUS_FAILURE,
+        !NT_SUCCESS(NdisMSetMiniportAttributes(
+            MiniportAdapterHandle, (PNDIS_MINIPORT_ADAPTER_ATTRIBUTES)&AdapterOffloadAttributes)))
+        goto cleanupFreeNblPool;
+
     return NDIS_STATUS_SUCCESS;
 
 cleanupFreeNblPool:
@@ -1335,6 +2056,54 @@ TunOidSet(_Inout_ TUN_CTX *Ctx, _Inout_ NDIS_OID_REQUEST *OidRequest)
         }
         OidRequest->DATA.SET_INFORMATION.BytesRead = sizeof(NDIS_DEVICE_POWER_STATE);
         return NDIS_STATUS_SUCCESS;
+
+    case OID_TCP_OFFLOAD_PARAMETERS: {
+        if (OidRequest->DATA.SET_INFORMATION.InformationBufferLength < NDIS_SIZEOF_OFFLOAD_PARAMETERS_REVISION_1)
+        {
+            OidRequest->DATA.SET_INFORMATION.BytesNeeded = NDIS_SIZEOF_OFFLOAD_PARAMETERS_REVISION_1;
+            return NDIS_STATUS_INVALID_LENGTH;
+        }
+        const NDIS_OFFLOAD_PARAMETERS *Parameters = OidRequest->DATA.SET_INFORMATION.InformationBuffer;
+        if (Parameters->Header.Type != NDIS_OBJECT_TYPE_DEFAULT ||
+            Parameters->Header.Revision < NDIS_OFFLOAD_PARAMETERS_REVISION_1 ||
+            Parameters->Header.Size < NDIS_SIZEOF_OFFLOAD_PARAMETERS_REVISION_1)
+            return NDIS_STATUS_INVALID_PARAMETER;
+        /* Receive segment coalescing fields only exist from revision 3 on. */
+        BOOLEAN HasRsc = Parameters->Header.Revision >= NDIS_OFFLOAD_PARAMETERS_REVISION_3 &&
+                         Parameters->Header.Size >= NDIS_SIZEOF_OFFLOAD_PARAMETERS_REVISION_3 &&
+                         OidRequest->DATA.SET_INFORMATION.InformationBufferLength >=
+                             NDIS_SIZEOF_OFFLOAD_PARAMETERS_REVISION_3;
+        ExAcquireResourceExclusiveLite(&Ctx->Device.RegistrationLock, TRUE);
+        if (Parameters->LsoV2IPv4 != NDIS_OFFLOAD_PARAMETERS_NO_CHANGE)
+            Ctx->Offload.LsoV2IPv4 = Parameters->LsoV2IPv4 == NDIS_OFFLOAD_PARAMETERS_LSOV2_ENABLED;
+        if (Parameters->LsoV2IPv6 != NDIS_OFFLOAD_PARAMETERS_NO_CHANGE)
+            Ctx->Offload.LsoV2IPv6 = Parameters->LsoV2IPv6 == NDIS_OFFLOAD_PARAMETERS_LSOV2_ENABLED;
+        if (HasRsc && Parameters->RscIPv4 != NDIS_OFFLOAD_PARAMETERS_NO_CHANGE)
+            Ctx->Offload.RscIPv4 = Parameters->RscIPv4 == NDIS_OFFLOAD_PARAMETERS_RSC_ENABLED;
+        if (HasRsc && Parameters->RscIPv6 != NDIS_OFFLOAD_PARAMETERS_NO_CHANGE)
+            Ctx->Offload.RscIPv6 = Parameters->RscIPv6 == NDIS_OFFLOAD_PARAMETERS_RSC_ENABLED;
+        TunIndicateOffloadConfig(Ctx);
+        ExReleaseResourceLite(&Ctx->Device.RegistrationLock);
+        OidRequest->DATA.SET_INFORMATION.BytesRead = OidRequest->DATA.SET_INFORMATION.InformationBufferLength;
+        return NDIS_STATUS_SUCCESS;
+    }
+
+    case OID_OFFLOAD_ENCAPSULATION: {
+        if (OidRequest->DATA.SET_INFORMATION.InformationBufferLength < NDIS_SIZEOF_OFFLOAD_ENCAPSULATION_REVISION_1)
+        {
+            OidRequest->DATA.SET_INFORMATION.BytesNeeded = NDIS_SIZEOF_OFFLOAD_ENCAPSULATION_REVISION_1;
+            return NDIS_STATUS_INVALID_LENGTH;
+        }
+        /* Packets are bare IP, so that is the only framing offloads can work with. */
+        const NDIS_OFFLOAD_ENCAPSULATION *Encapsulation = OidRequest->DATA.SET_INFORMATION.InformationBuffer;
+        if ((Encapsulation->IPv4.Enabled == NDIS_OFFLOAD_SET_ON &&
+             !(Encapsulation->IPv4.EncapsulationType & NDIS_ENCAPSULATION_NULL)) ||
+            (Encapsulation->IPv6.Enabled == NDIS_OFFLOAD_SET_ON &&
+             !(Encapsulation->IPv6.EncapsulationType & NDIS_ENCAPSULATION_NULL)))
+            return NDIS_STATUS_NOT_SUPPORTED;
+        OidRequest->DATA.SET_INFORMATION.BytesRead = OidRequest->DATA.SET_INFORMATION.InformationBufferLength;
+        return NDIS_STATUS_SUCCESS;
+    }
     }
 
     return NDIS_STATUS_NOT_SUPPORTED;
@@ -29,6 +29,7 @@ static WINTUN_RECEIVE_PACKET_FUNC *WintunReceivePacket;
 static WINTUN_RELEASE_RECEIVE_PACKET_FUNC *WintunReleaseReceivePacket;
 static WINTUN_ALLOCATE_SEND_PACKET_FUNC *WintunAllocateSendPacket;
 static WINTUN_SEND_PACKET_FUNC *WintunSendPacket;
+static WINTUN_SET_PACKET_CHECKSUMS_FUNC *WintunSetPacketChecksums;
 
 static HMODULE
 InitializeWintun(void)
@@ -41,7 +42,7 @@ InitializeWintun(void)
     if (X(WintunCreateAdapter) || X(WintunCloseAdapter) || X(WintunOpenAdapter) || X(WintunGetAdapterLUID) ||
         X(WintunGetRunningDriverVersion) || X(WintunDeleteDriver) || X(WintunSetLogger) || X(WintunStartSession) ||
         X(WintunEndSession) || X(WintunGetReadWaitEvent) || X(WintunReceivePacket) || X(WintunReleaseReceivePacket) ||
-        X(WintunAllocateSendPacket) || X(WintunSendPacket))
+        X(WintunAllocateSendPacket) || X(WintunSendPacket) || X(WintunSetPacketChecksums))
 #undef X
     {
         DWORD LastError = GetLastError();
@@ -202,19 +203,6 @@ PrintPacket(_In_ const BYTE *Packet, _In_ DWORD PacketSize)
         Log(WINTUN_LOG_INFO, L"Received IPv%d proto 0x%x packet from %s to %s", IpVersion, Proto, Src, Dst);
 }
 
-static USHORT
-IPChecksum(_In_reads_bytes_(Len) BYTE *Buffer, _In_ DWORD Len)
-{
-    ULONG Sum = 0;
-    for (; Len > 1; Len -= 2, Buffer += 2)
-        Sum += *(USHORT *)Buffer;
-    if (Len)
-        Sum += *Buffer;
-    Sum = (Sum >> 16) + (Sum & 0xffff);
-    Sum += (Sum >> 16);
-    return (USHORT)(~Sum);
-}
-
 static void
 MakeICMP(_Out_writes_bytes_all_(28) BYTE Packet[28])
 {
@@ -225,9 +213,8 @@ MakeICMP(_Out_writes_bytes_all_(28) BYTE Packet[28])
     Packet[9] = 1;
     *(ULONG *)&Packet[12] = htonl((10 << 24) | (6 << 16) | (7 << 8) | (8 << 0)); /* 10.6.7.8 */
     *(ULONG *)&Packet[16] = htonl((10 << 24) | (6 << 16) | (7 << 8) | (7 << 0)); /* 10.6.7.7 */
-    *(USHORT *)&Packet[10] = IPChecksum(Packet, 20);
     Packet[20] = 8;
-    *(USHORT *)&Packet[22] = IPChecksum(&Packet[20], 8);
+    WintunSetPacketChecksums(Packet, 28);
     Log(WINTUN_LOG_INFO, L"Sending IPv4 ICMP echo request to 10.6.7.8 from 10.6.7.7");
 }
 
@@ -0,0 +1,74 @@
+/* SPDX-License-Identifier: GPL-2.0 OR MIT
+ *
+ * Copyright (C) 2018-2021 WireGuard LLC. All Rights Reserved.
+ */
+
+/* Object cache: LIFO order, the depth bound, and batch moves between a shared cache and a private stash. */
+
+#include "../common/cache.h"
+#include "test.h"
+
+static TUN_CACHE_ENTRY Entries[16];
+
+static void
+TestDepthForRing(void)
+{
+    CHECK(TunCacheDepthForRing(TUN_MIN_RING_CAPACITY) == TUN_MIN_RING_CAPACITY / TUN_CACHE_RING_BYTES_PER_ENTRY);
+    CHECK(TunCacheDepthForRing(TUN_MAX_RING_CAPACITY) == TUN_CACHE_MAX_DEPTH);
+    CHECK(TunCacheDepthForRing(0) == 0);
+}
+
+static void
+TestPushPop(void)
+{
+    TUN_CACHE Cache;
+    TunCacheInit(&Cache, 4);
+    CHECK(!TunCachePop(&Cache));
+
+    /* Most recently returned first, and nothing past the maximum depth. */
+    for (ULONG i = 0; i < 4; ++i)
+        CHECK(TunCachePush(&Cache, &Entries[i]));
+    CHECK(!TunCachePush(&Cache, &Entries[4]));
+    CHECK(Cache.Depth == 4);
+    for (ULONG i = 4; i-- > 0;)
+        CHECK(TunCachePop(&Cache) == &Entries[i]);
+    CHECK(!TunCachePop(&Cache) && Cache.Depth == 0);
+
+    TUN_CACHE Disabled;
+    TunCacheInit(&Disabled, 0);
+    CHECK(!TunCachePush(&Disabled, &Entries[0]));
+}
+
+static void
+TestMove(void)
+{
+    TUN_CACHE Shared, Stash;
+    TunCacheInit(&Shared, 16);
+    TunCacheInit(&Stash, 5);
+    for (ULONG i = 0; i < 8; ++i)
+        TunCachePush(&Shared, &Entries[i]);
+
+    /* Taking a batch stops at the count asked for, at a full destination, or at an empty source. */
+    CHECK(TunCacheMove(&Stash, &Shared, 3) == 3);
+    CHECK(Stash.Depth == 3 && Shared.Depth == 5);
+    CHECK(TunCacheMove(&Stash, &Shared, 8) == 2);
+    CHECK(Stash.Depth == 5 && Shared.Depth == 3);
+    CHECK(TunCacheMove(&Shared, &Stash, 16) == 5);
+    CHECK(TunCacheMove(&Shared, &Stash, 1) == 0);
+
+    /* Every object is still accounted for exactly once. */
+    ULONG Seen = 0, Count = 0;
+    for (TUN_CACHE_ENTRY *Entry = TunCacheDetach(&Shared); Entry; Entry = Entry->Next, ++Count)
+        Seen |= 1U << (Entry - Entries);
+    CHECK(Seen == 0xFF && Count == 8);
+    CHECK(!Shared.Head && Shared.Depth == 0);
+}
+
+int
+main(void)
+{
+    RUN(TestDepthForRing);
+    RUN(TestPushPop);
+    RUN(TestMove);
+    TEST_EXIT();
+}
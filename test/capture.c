@@ -0,0 +1,317 @@
+/* SPDX-License-Identifier: GPL-2.0 OR MIT
+ *
+ * Copyright (C) 2018-2021 WireGuard LLC. All Rights Reserved.
+ */
+
+/* Packet capture: the byte layout of every pcapng block, and the staging queue handing records from many producers to
+ * the writer, in reservation order, truncated to the snap length, and dropped rather than overwritten when full. */
+
+#include <pthread.h>
+#include <sched.h>
+#include "../common/capture.h"
+#include "test.h"
+
+#define CAPACITY TUN_MIN_RING_CAPACITY
+#define PRODUCERS 4
+#define PACKETS_PER_PRODUCER 50000
+
+/* The largest block, and a guard byte behind it to catch writes past the end. */
+static UCHAR Block[TUN_PCAPNG_ENHANCED_PACKET_SIZE(TUN_MAX_IP_PACKET_SIZE) + 1];
+
+static ULONG
+Get16(const UCHAR *Data)
+{
+    USHORT Value;
+    memcpy(&Value, Data, sizeof(Value));
+    return Value;
+}
+
+static ULONG
+Get32(const UCHAR *Data)
+{
+    ULONG Value;
+    memcpy(&Value, Data, sizeof(Value));
+    return Value;
+}
+
+static ULONG64
+Get64(const UCHAR *Data)
+{
+    ULONG64 Value;
+    memcpy(&Value, Data, sizeof(Value));
+    return Value;
+}
+
+/* Checks the framing every block shares: type, a total length that is a multiple of 4 and repeated at the end. */
+static void
+CheckFraming(const UCHAR *Data, ULONG Size, ULONG Type, ULONG ExpectedSize)
+{
+    CHECK(Size == ExpectedSize && Size % 4 == 0);
+    CHECK(Get32(Data) == Type);
+    CHECK(Get32(Data + 4) == Size);
+    CHECK(Get32(Data + Size - 4) == Size);
+}
+
+static void
+TestSectionHeader(void)
+{
+    memset(Block, 0xCC, sizeof(Block));
+    ULONG Size = TunPcapngSectionHeader(Block);
+    CheckFraming(Block, Size, 0x0A0D0D0A, TUN_PCAPNG_SECTION_HEADER_SIZE);
+    /* The byte-order magic reads back as written, and the type is a palindrome, so readers of either byte order find
+     * it. */
+    static const UCHAR Type[] = { 0x0A, 0x0D, 0x0D, 0x0A };
+    CHECK(!memcmp(Block, Type, 4));
+    CHECK(Get32(Block + 8) == 0x1A2B3C4D);
+    CHECK(Get16(Block + 12) == 1 && Get16(Block + 14) == 0);
+    CHECK(Get64(Block + 16) == ~(ULONG64)0);
+    CHECK(Block[Size] == 0xCC);
+}
+
+static void
+TestInterfaceDescription(void)
+{
+    memset(Block, 0xCC, sizeof(Block));
+    ULONG Size = TunPcapngInterfaceDescription(Block, 1500);
+    CheckFraming(Block, Size, 1, TUN_PCAPNG_INTERFACE_DESCRIPTION_SIZE);
+    CHECK(Get16(Block + 8) == TUN_PCAPNG_LINKTYPE_RAW && Get16(Block + 10) == 0);
+    CHECK(Get32(Block + 12) == 1500);
+    /* if_tsresol of 10^-7 s, padded to 32 bits, then the end of options. */
+    CHECK(Get16(Block + 16) == 9 && Get16(Block + 18) == 1);
+    CHECK(Block[20] == 7 && !Block[21] && !Block[22] && !Block[23]);
+    CHECK(Get32(Block + 24) == 0);
+    CHECK(Block[Size] == 0xCC);
+}
+
+static void
+TestEnhancedPacket(void)
+{
+    static UCHAR RecordBuffer[TUN_CAPTURE_MAX_RECORD_SIZE];
+    TUN_CAPTURE_RECORD *Record = (TUN_CAPTURE_RECORD *)RecordBuffer;
+    ULONG CapturedSizes[] = { 0, 1, 2, 3, 4, 5, 7, 20, 1499, 1500, TUN_MAX_IP_PACKET_SIZE };
+    for (ULONG i = 0; i < sizeof(CapturedSizes) / sizeof(*CapturedSizes); ++i)
+    {
+        ULONG Captured = CapturedSizes[i];
+        ULONG64 Timestamp = 0x0123456789ABCDEFULL + i;
+        Record->Size = (ULONG)sizeof(TUN_CAPTURE_RECORD) + Captured;
+        Record->Flags = i & 1 ? TUN_CAPTURE_INBOUND : TUN_CAPTURE_OUTBOUND;
+        Record->OriginalSize = Captured + i;
+        TestFill(Record->Data, Captured);
+        memset(Block, 0xCC, sizeof(Block));
+
+        ULONG Size = TunPcapngEnhancedPacket(Block, Record, Timestamp);
+        CheckFraming(Block, Size, 6, TUN_PCAPNG_ENHANCED_PACKET_SIZE(Captured));
+        CHECK(Get32(Block + 8) == 0);
+        CHECK(Get32(Block + 12) == (ULONG)(Timestamp >> 32) && Get32(Block + 16) == (ULONG)Timestamp);
+        CHECK(Get32(Block + 20) == Captured && Get32(Block + 24) == Captured + i);
+        CHECK(!memcmp(Block + 28, Record->Data, Captured));
+        /* Data padded to 32 bits with zeroes, then epb_flags, then the end of options. */
+        ULONG Padded = 28 + TUN_ALIGN(Captured);
+        for (ULONG Byte = 28 + Captured; Byte < Padded; ++Byte)
+            CHECK(!Block[Byte]);
+        CHECK(Get16(Block + Padded) == 2 && Get16(Block + Padded + 2) == 4);
+        CHECK(Get32(Block + Padded + 4) == Record->Flags);
+        CHECK(Get32(Block + Padded + 8) == 0);
+        CHECK(Padded + 16 == Size);
+        CHECK(Block[Size] == 0xCC);
+    }
+}
+
+static void
+TestInterfaceStatistics(void)
+{
+    memset(Block, 0xCC, sizeof(Block));
+    ULONG Size = TunPcapngInterfaceStatistics(Block, 0xFEDCBA9876543210ULL, 0x100000002ULL);
+    CheckFraming(Block, Size, 5, TUN_PCAPNG_INTERFACE_STATISTICS_SIZE);
+    CHECK(Get32(Block + 8) == 0);
+    CHECK(Get32(Block + 12) == 0xFEDCBA98 && Get32(Block + 16) == 0x76543210);
+    CHECK(Get16(Block + 20) == 5 && Get16(Block + 22) == 8);
+    CHECK(Get64(Block + 24) == 0x100000002ULL);
+    CHECK(Get32(Block + 32) == 0);
+    CHECK(Block[Size] == 0xCC);
+}
+
+static TUN_RING *
+AllocateQueue(TUN_CAPTURE_QUEUE *Queue)
+{
+    TUN_RING *Ring = calloc(1, TUN_CAPTURE_RING_SIZE(CAPACITY));
+    TunCaptureInit(Queue, Ring, CAPACITY);
+    return Ring;
+}
+
+static void
+TestQueue(void)
+{
+    TUN_CAPTURE_QUEUE Queue;
+    TUN_RING *Ring = AllocateQueue(&Queue);
+    static UCHAR Packet[TUN_MAX_IP_PACKET_SIZE];
+    TestFill(Packet, sizeof(Packet));
+    TUN_CAPTURE_RECORD *Record;
+    ULONG Head = 0, Content;
+    CHECK(!TunCaptureNext(&Queue, Head, &Record));
+
+    /* Snapped to the snap length, and to the largest packet; the original size is kept. */
+    CHECK(TunCapturePut(&Queue, 42, TUN_CAPTURE_INBOUND, Packet, 1500, 96, &Content));
+    CHECK(Content == TUN_ALIGN(sizeof(TUN_CAPTURE_RECORD) + 96));
+    CHECK(TunCapturePut(&Queue, 43, TUN_CAPTURE_OUTBOUND, Packet, 60, 96, &Content));
+    CHECK(TunCapturePut(&Queue, 44, TUN_CAPTURE_OUTBOUND, Packet, TUN_MAX_IP_PACKET_SIZE + 1, ~0U, &Content));
+
+    /* Timestamp, captured and original size */
+    ULONG Expected[][3] = { { 42, 96, 1500 },
+                            { 43, 60, 60 },
+                            { 44, TUN_MAX_IP_PACKET_SIZE, TUN_MAX_IP_PACKET_SIZE + 1 } };
+    for (ULONG i = 0; i < 3; ++i)
+    {
+        ULONG Aligned = TunCaptureNext(&Queue, Head, &Record);
+        CHECK(Aligned == TUN_ALIGN(sizeof(TUN_CAPTURE_RECORD) + Expected[i][1]));
+        CHECK(Record->TimestampLow == Expected[i][0] && !Record->TimestampHigh);
+        CHECK(Record->Size == sizeof(TUN_CAPTURE_RECORD) + Expected[i][1]);
+        CHECK(Record->OriginalSize == Expected[i][2]);
+        CHECK(Record->Flags == (i ? TUN_CAPTURE_OUTBOUND : TUN_CAPTURE_INBOUND));
+        CHECK(!memcmp(Record->Data, Packet, Expected[i][1]));
+        Head = TunCaptureRelease(&Queue, Head, Aligned);
+        CHECK(Ring->Head == Head);
+    }
+    CHECK(!TunCaptureNext(&Queue, Head, &Record));
+    /* Released space is zeroed, so the next record's commit word reads zero until written. */
+    for (ULONG i = 0; i < Head; ++i)
+        CHECK(!Ring->Data[i]);
+
+    /* A record still being written holds up the writer, even with later records committed. */
+    CHECK(TunCapturePut(&Queue, 1, 0, Packet, 100, ~0U, &Content));
+    CHECK(TunCapturePut(&Queue, 2, 0, Packet, 100, ~0U, &Content));
+    Record = (TUN_CAPTURE_RECORD *)(Ring->Data + Head);
+    ULONG Size = Record->Size;
+    Record->Size = 0;
+    CHECK(!TunCaptureNext(&Queue, Head, &Record));
+    Record->Size = Size;
+    CHECK(TunCaptureNext(&Queue, Head, &Record) && Record->TimestampLow == 1);
+    free(Ring);
+}
+
+static void
+TestFull(void)
+{
+    TUN_CAPTURE_QUEUE Queue;
+    TUN_RING *Ring = AllocateQueue(&Queue);
+    static UCHAR Packet[9000];
+    TestFill(Packet, sizeof(Packet));
+    TUN_CAPTURE_RECORD *Record;
+    ULONG Head = 0, Content = 0, Put = 0, Got = 0;
+
+    /* Fill up, which drops rather than overwrites, then drain, many times over so records run over the end. */
+    for (ULONG Round = 0; Round < 50; ++Round)
+    {
+        ULONG Size = 1 + TestRandom() % sizeof(Packet);
+        while (TunCapturePut(&Queue, Put, 0, Packet, Size, ~0U, &Content))
+            Put++;
+        CHECK(Content + TUN_ALIGN(sizeof(TUN_CAPTURE_RECORD) + Size) > CAPACITY - TUN_ALIGNMENT);
+        CHECK(Queue.Dropped == Round + 1);
+        ULONG Aligned;
+        while ((Aligned = TunCaptureNext(&Queue, Head, &Record)) != 0)
+        {
+            CHECK(Record->TimestampLow == Got++);
+            CHECK(Record->OriginalSize == Size && !memcmp(Record->Data, Packet, Size));
+            Head = TunCaptureRelease(&Queue, Head, Aligned);
+        }
+        CHECK(Got == Put);
+    }
+    /* Nothing is left behind in the slack past the capacity either. */
+    for (ULONG i = 0; i < CAPACITY + TUN_CAPTURE_MAX_RECORD_SIZE; ++i)
+    {
+        if (Ring->Data[i])
+        {
+            CHECK(!Ring->Data[i]);
+            break;
+        }
+    }
+    free(Ring);
+}
+
+static TUN_CAPTURE_QUEUE SharedQueue;
+
+static void *
+Producer(void *Context)
+{
+    ULONG Id = (ULONG)(size_t)Context, Content;
+    UCHAR Packet[1024];
+    for (ULONG Sequence = 0; Sequence < PACKETS_PER_PRODUCER;)
+    {
+        ULONG Size = 8 + (Sequence * 37 + Id) % (sizeof(Packet) - 8);
+        memcpy(Packet, &Id, 4);
+        memcpy(Packet + 4, &Sequence, 4);
+        memset(Packet + 8, (UCHAR)(Id + Sequence), Size - 8);
+        if (TunCapturePut(&SharedQueue, ((ULONG64)Id << 32) | Sequence, 0, Packet, Size, ~0U, &Content))
+            Sequence++;
+        else
+            sched_yield();
+    }
+    return NULL;
+}
+
+/* Concurrent producers, each waiting out a full queue, against one writer. Each producer's records arrive whole and in
+ * order. */
+static void
+TestConcurrent(void)
+{
+    TUN_RING *Ring = AllocateQueue(&SharedQueue);
+    pthread_t Threads[PRODUCERS];
+    for (size_t i = 0; i < PRODUCERS; ++i)
+        CHECK(!pthread_create(&Threads[i], NULL, Producer, (void *)i));
+
+    ULONG Expected[PRODUCERS] = { 0 }, Received = 0, Head = 0, Errors = 0;
+    while (Received < PRODUCERS * PACKETS_PER_PRODUCER && Errors < 10)
+    {
+        TUN_CAPTURE_RECORD *Record;
+        ULONG Aligned = TunCaptureNext(&SharedQueue, Head, &Record);
+        if (!Aligned)
+        {
+            sched_yield();
+            continue;
+        }
+        ULONG Id, Sequence, Size = Record->Size - (ULONG)sizeof(TUN_CAPTURE_RECORD);
+        memcpy(&Id, Record->Data, 4);
+        memcpy(&Sequence, Record->Data + 4, 4);
+        if (Id >= PRODUCERS || Sequence != Expected[Id] || Record->TimestampHigh != Id ||
+            Record->TimestampLow != Sequence || Size != Record->OriginalSize)
+        {
+            fprintf(stderr, "producer %u sequence %u out of order\n", Id, Sequence);
+            ++Errors;
+        }
+        else
+        {
+            for (ULONG Byte = 8; Byte < Size; ++Byte)
+            {
+                if (Record->Data[Byte] != (UCHAR)(Id + Sequence))
+                {
+                    fprintf(stderr, "producer %u sequence %u corrupt at byte %u\n", Id, Sequence, Byte);
+                    ++Errors;
+                    break;
+                }
+            }
+            Expected[Id]++;
+        }
+        Received++;
+        Head = TunCaptureRelease(&SharedQueue, Head, Aligned);
+    }
+    CHECK(!Errors);
+    for (size_t i = 0; i < PRODUCERS; ++i)
+        pthread_join(Threads[i], NULL);
+    for (ULONG i = 0; i < PRODUCERS; ++i)
+        CHECK(Expected[i] == PACKETS_PER_PRODUCER);
+    printf("%u records, %lld dropped\n", Received, (long long)SharedQueue.Dropped);
+    free(Ring);
+}
+
+int
+main(void)
+{
+    RUN(TestSectionHeader);
+    RUN(TestInterfaceDescription);
+    RUN(TestEnhancedPacket);
+    RUN(TestInterfaceStatistics);
+    RUN(TestQueue);
+    RUN(TestFull);
+    RUN(TestConcurrent);
+    TEST_EXIT();
+}
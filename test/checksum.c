@@ -0,0 +1,251 @@
+/* SPDX-License-Identifier: GPL-2.0 OR MIT
+ *
+ * Copyright (C) 2018-2021 WireGuard LLC. All Rights Reserved.
+ */
+
+/* Internet checksum: every kernel the CPU has must agree with a plain RFC 1071 sum of big-endian 16-bit words, for
+ * every length, odd ones included, at every alignment, and on data built to carry as much as possible. The incremental
+ * update and whole-packet helpers are checked against the same reference. */
+
+#include "../common/checksum.h"
+#include "test.h"
+
+#define MAX_SIZE 0x10000
+#define MAX_MISALIGNMENT 64
+
+typedef ULONG64 (*KERNEL)(ULONG64 Sum, const UCHAR *Data, ULONG Size);
+
+static ULONG64
+Add(ULONG64 Sum, const UCHAR *Data, ULONG Size)
+{
+    return TunChecksumAdd(Sum, Data, Size);
+}
+
+static const struct
+{
+    const char *Name;
+    KERNEL Kernel;
+} Kernels[] = {
+    { "scalar", TunChecksumAddScalar },
+#ifdef TUN_CHECKSUM_X86
+    { "sse2", TunChecksumAddSse2 },
+    { "avx2", TunChecksumAddAvx2 },
+#endif
+#ifdef TUN_CHECKSUM_NEON
+    { "neon", TunChecksumAddNeon },
+#endif
+    { "dispatch", Add },
+};
+
+static UCHAR Buffer[MAX_SIZE + MAX_MISALIGNMENT];
+
+/* RFC 1071, the slow way: a trailing odd byte is padded with a zero byte. */
+static ULONG
+NaiveSum(const UCHAR *Data, ULONG Size)
+{
+    ULONG64 Sum = 0;
+    for (ULONG i = 0; i < Size; i += 2)
+        Sum += (ULONG)Data[i] << 8 | (i + 1 < Size ? Data[i + 1] : 0);
+    while (Sum >> 16)
+        Sum = (Sum & 0xFFFF) + (Sum >> 16);
+    return (ULONG)Sum;
+}
+
+/* Reads a checksum as stored into a header, that is, in network byte order. */
+static ULONG
+Stored(USHORT Checksum)
+{
+    UCHAR Bytes[2];
+    memcpy(Bytes, &Checksum, sizeof(Bytes));
+    return (ULONG)Bytes[0] << 8 | Bytes[1];
+}
+
+static int
+KernelUsable(ULONG Index)
+{
+#ifdef TUN_CHECKSUM_X86
+    if (Kernels[Index].Kernel == TunChecksumAddAvx2)
+        return TunChecksumHaveAvx2();
+#endif
+    (void)Index;
+    return 1;
+}
+
+static int
+Agrees(KERNEL Kernel, const UCHAR *Data, ULONG Size)
+{
+    return Stored(TunChecksumFinish(Kernel(0, Data, Size))) == (~NaiveSum(Data, Size) & 0xFFFF);
+}
+
+static void
+CheckAllKernels(const UCHAR *Data, ULONG Size)
+{
+    for (ULONG i = 0; i < sizeof(Kernels) / sizeof(*Kernels); ++i)
+    {
+        if (KernelUsable(i) && !Agrees(Kernels[i].Kernel, Data, Size))
+        {
+            fprintf(stderr, "%s kernel disagrees: size %u, offset %u\n", Kernels[i].Name, Size, (ULONG)(Data - Buffer));
+            ++TestFailures;
+        }
+    }
+}
+
+/* Every length up to a few vector iterations past the vector threshold, each at every alignment within a cache line,
+ * so every kernel's head, loop and scalar tail meet every combination of odd and even bytes. */
+static void
+TestLengthsAndAlignment(void)
+{
+    TestFill(Buffer, sizeof(Buffer));
+    for (ULONG Size = 0; Size <= 4 * TUN_CHECKSUM_VECTOR_MIN_SIZE + 64; ++Size)
+        for (ULONG Offset = 0; Offset < MAX_MISALIGNMENT; ++Offset)
+            CheckAllKernels(Buffer + Offset, Size);
+    for (ULONG Size = 1000; Size <= MAX_SIZE; Size = Size * 3 / 2 + 1)
+        for (ULONG Offset = 0; Offset < 8; ++Offset)
+            CheckAllKernels(Buffer + Offset, Size);
+    CheckAllKernels(Buffer, MAX_SIZE);
+    CheckAllKernels(Buffer + 1, MAX_SIZE - 1);
+}
+
+/* All-ones data makes every word addition carry, and the largest packet piles up the most carries before the fold. */
+static void
+TestCarries(void)
+{
+    memset(Buffer, 0xFF, sizeof(Buffer));
+    for (ULONG Size = MAX_SIZE - 70; Size <= MAX_SIZE; ++Size)
+        CheckAllKernels(Buffer + (Size & 7), Size);
+    for (ULONG Size = 0; Size < 300; ++Size)
+        CheckAllKernels(Buffer + (Size & 7), Size);
+
+    /* Values near the top of each word size, so partial sums sit right on the carry boundary. */
+    for (ULONG Size = 2; Size <= 512; Size += 2)
+    {
+        for (ULONG i = 0; i < Size; i += 2)
+        {
+            Buffer[i] = 0xFF;
+            Buffer[i + 1] = (UCHAR)(0xFE + (TestRandom() & 1));
+        }
+        CheckAllKernels(Buffer, Size);
+    }
+
+    /* An incoming sum that is already all ones must carry into every kernel's result too. */
+    memset(Buffer, 0xFF, 256);
+    for (ULONG i = 0; i < sizeof(Kernels) / sizeof(*Kernels); ++i)
+    {
+        if (!KernelUsable(i))
+            continue;
+        CHECK(TunChecksumFold(Kernels[i].Kernel(~(ULONG64)0, Buffer, 256)) == 0xFFFF);
+        CHECK(TunChecksumFold(Kernels[i].Kernel(~(ULONG64)0, Buffer, 0)) == 0xFFFF);
+    }
+    CHECK(TunChecksumFold(0) == 0);
+    CHECK(TunChecksumAdd64(~(ULONG64)0, 1) == 1);
+}
+
+/* Sums of pieces of even size chain into the sum of the whole. */
+static void
+TestChaining(void)
+{
+    TestFill(Buffer, sizeof(Buffer));
+    for (ULONG Round = 0; Round < 2000; ++Round)
+    {
+        ULONG Size = TestRandom() % 9000, Split = (TestRandom() % (Size + 1)) & ~1U;
+        ULONG64 Sum = TunChecksumAdd(0, Buffer, Split);
+        Sum = TunChecksumAdd(Sum, Buffer + Split, Size - Split);
+        CHECK(Stored(TunChecksumFinish(Sum)) == (~NaiveSum(Buffer, Size) & 0xFFFF));
+    }
+}
+
+static void
+TestUpdate(void)
+{
+    UCHAR Data[64];
+    for (ULONG Round = 0; Round < 20000; ++Round)
+    {
+        TestFill(Data, sizeof(Data));
+        if (Round & 1)
+            memset(Data, 0xFF, sizeof(Data) / 2);
+        USHORT Checksum = TunChecksumFinish(TunChecksumAddScalar(0, Data, sizeof(Data)));
+        ULONG Offset = (TestRandom() % 30) * 2, Size = Round % 3 ? 2 : 4;
+        UCHAR Old[4];
+        memcpy(Old, Data + Offset, Size);
+        TestFill(Data + Offset, Size);
+        if (Round % 7 == 0)
+            memset(Data + Offset, 0, Size);
+        USHORT Updated = TunChecksumUpdate(Checksum, Old, Data + Offset, Size);
+        CHECK(Stored(Updated) == (~NaiveSum(Data, sizeof(Data)) & 0xFFFF));
+    }
+}
+
+/* Checks that the header and transport checksums of a packet verify: summed with the checksum, all ones. */
+static void
+CheckPacket(UCHAR *Packet, ULONG Size, ULONG Transport, ULONG PseudoSum)
+{
+    CHECK(TunChecksumPacket(Packet, Size));
+    if (Packet[0] >> 4 == 4)
+        CHECK(NaiveSum(Packet, Transport) == 0xFFFF);
+    ULONG Sum = NaiveSum(Packet + Transport, Size - Transport) + PseudoSum;
+    Sum = (Sum & 0xFFFF) + (Sum >> 16);
+    CHECK(Sum == 0xFFFF);
+}
+
+static void
+TestPacket(void)
+{
+    UCHAR Packet[1500];
+
+    /* IPv4 UDP with an odd payload size */
+    TestFill(Packet, sizeof(Packet));
+    ULONG Size = 20 + 8 + 333;
+    Packet[0] = 0x45, Packet[2] = (UCHAR)(Size >> 8), Packet[3] = (UCHAR)Size;
+    Packet[6] = Packet[7] = 0, Packet[9] = 17;
+    Packet[24] = (UCHAR)((Size - 20) >> 8), Packet[25] = (UCHAR)(Size - 20);
+    UCHAR Pseudo[12] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 17, (UCHAR)((Size - 20) >> 8), (UCHAR)(Size - 20) };
+    memcpy(Pseudo, Packet + 12, 8);
+    CheckPacket(Packet, Size, 20, NaiveSum(Pseudo, sizeof(Pseudo)));
+
+    /* IPv6 TCP */
+    TestFill(Packet, sizeof(Packet));
+    Size = 40 + 20 + 1001;
+    Packet[0] = 0x60, Packet[4] = (UCHAR)((Size - 40) >> 8), Packet[5] = (UCHAR)(Size - 40), Packet[6] = 6;
+    UCHAR Pseudo6[36] = { 0 };
+    memcpy(Pseudo6, Packet + 8, 32);
+    Pseudo6[33] = 6, Pseudo6[34] = (UCHAR)((Size - 40) >> 8), Pseudo6[35] = (UCHAR)(Size - 40);
+    CheckPacket(Packet, Size, 40, NaiveSum(Pseudo6, sizeof(Pseudo6)));
+
+    /* IPv4 ICMP has no pseudo-header. */
+    TestFill(Packet, sizeof(Packet));
+    Size = 20 + 64;
+    Packet[0] = 0x45, Packet[2] = 0, Packet[3] = (UCHAR)Size, Packet[6] = Packet[7] = 0, Packet[9] = 1;
+    CheckPacket(Packet, Size, 20, 0);
+
+    /* UDP never stores a zero checksum, as that means none. Find a payload whose checksum comes out zero. */
+    memset(Packet, 0, sizeof(Packet));
+    Size = 20 + 8 + 2;
+    Packet[0] = 0x45, Packet[3] = (UCHAR)Size, Packet[9] = 17, Packet[25] = (UCHAR)(Size - 20);
+    UCHAR PseudoZero[12] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 17, 0, (UCHAR)(Size - 20) };
+    ULONG Partial = NaiveSum(PseudoZero, sizeof(PseudoZero)) + NaiveSum(Packet + 20, 8);
+    Partial = (Partial & 0xFFFF) + (Partial >> 16);
+    ULONG Payload = 0xFFFF - Partial;
+    Packet[28] = (UCHAR)(Payload >> 8), Packet[29] = (UCHAR)Payload;
+    CHECK(TunChecksumPacket(Packet, Size));
+    CHECK(Packet[26] == 0xFF && Packet[27] == 0xFF);
+
+    /* Lengths beyond the buffer are refused. */
+    Packet[3] = (UCHAR)(Size + 1);
+    CHECK(!TunChecksumPacket(Packet, Size));
+    Packet[0] = 0x20;
+    CHECK(!TunChecksumPacket(Packet, Size));
+}
+
+int
+main(void)
+{
+#ifdef TUN_CHECKSUM_X86
+    printf("AVX2 %s\n", TunChecksumHaveAvx2() ? "available" : "not available, skipped");
+#endif
+    RUN(TestLengthsAndAlignment);
+    RUN(TestCarries);
+    RUN(TestChaining);
+    RUN(TestUpdate);
+    RUN(TestPacket);
+    TEST_EXIT();
+}
@@ -0,0 +1,268 @@
+/* SPDX-License-Identifier: GPL-2.0 OR MIT
+ *
+ * Copyright (C) 2018-2021 WireGuard LLC. All Rights Reserved.
+ */
+
+/* Receive filter: program validation, header parsing of IPv4 and IPv6 packets, and program evaluation. */
+
+#include "../common/filter.h"
+#include "test.h"
+
+#define INSN(Op, Field, JumpTrue, JumpFalse, Value) \
+    { \
+        TUN_FILTER_OP_##Op, TUN_FILTER_FIELD_##Field, JumpTrue, JumpFalse, Value, { 0 } \
+    }
+#define ACCEPT INSN(ACCEPT, VERSION, 0, 0, 0)
+#define REJECT INSN(REJECT, VERSION, 0, 0, 0)
+
+static union
+{
+    TUN_FILTER_PROGRAM Program;
+    UCHAR Storage[TUN_FILTER_PROGRAM_SIZE(TUN_FILTER_MAX_INSNS + 1)];
+} Compiled;
+
+static int
+Compile(const TUN_FILTER_INSN *Insns, ULONG Count)
+{
+    return TunFilterCompile(Insns, Count, &Compiled.Program);
+}
+
+/* Builds an IPv4 packet of Size bytes with a 20 byte header followed by the source and destination ports. */
+static ULONG
+Ipv4(UCHAR *Packet, ULONG Size, UCHAR Protocol, const UCHAR Source[4], USHORT SourcePort, USHORT DestinationPort)
+{
+    memset(Packet, 0, Size);
+    Packet[0] = 0x45;
+    Packet[2] = (UCHAR)(Size >> 8);
+    Packet[3] = (UCHAR)Size;
+    Packet[9] = Protocol;
+    memcpy(Packet + 12, Source, 4);
+    Packet[16] = 192, Packet[17] = 0, Packet[18] = 2, Packet[19] = 1;
+    Packet[20] = (UCHAR)(SourcePort >> 8), Packet[21] = (UCHAR)SourcePort;
+    Packet[22] = (UCHAR)(DestinationPort >> 8), Packet[23] = (UCHAR)DestinationPort;
+    return Size;
+}
+
+static void
+TestCompile(void)
+{
+    const TUN_FILTER_INSN Valid[] = { INSN(JEQ, VERSION, 0, 1, 4), ACCEPT, REJECT };
+    CHECK(Compile(Valid, 3));
+    CHECK(Compiled.Program.Count == 3);
+    CHECK(!Compile(Valid, 0));
+    CHECK(!Compile(Valid, TUN_FILTER_MAX_INSNS + 1));
+
+    /* The last instruction must end the program, and every jump must land inside it. */
+    const TUN_FILTER_INSN NoEnd[] = { ACCEPT, INSN(JEQ, VERSION, 0, 0, 4) };
+    CHECK(!Compile(NoEnd, 2));
+    const TUN_FILTER_INSN JumpOut[] = { INSN(JEQ, VERSION, 0, 2, 4), ACCEPT, REJECT };
+    CHECK(!Compile(JumpOut, 3));
+    const TUN_FILTER_INSN JumpToEnd[] = { INSN(JEQ, VERSION, 1, 0, 4), ACCEPT, REJECT };
+    CHECK(Compile(JumpToEnd, 3));
+
+    /* Comparisons are on scalar fields, prefixes on address fields with at most as many bits as the address. */
+    const TUN_FILTER_INSN BadOp[] = { { TUN_FILTER_OP_COUNT, 0, 0, 0, 0, { 0 } }, ACCEPT };
+    CHECK(!Compile(BadOp, 2));
+    const TUN_FILTER_INSN EqAddress[] = { INSN(JEQ, SOURCE_ADDRESS4, 0, 0, 0), ACCEPT };
+    CHECK(!Compile(EqAddress, 2));
+    const TUN_FILTER_INSN PrefixPort[] = { INSN(JPREFIX, SOURCE_PORT, 0, 0, 8), ACCEPT };
+    CHECK(!Compile(PrefixPort, 2));
+    const TUN_FILTER_INSN LongPrefix4[] = { INSN(JPREFIX, SOURCE_ADDRESS4, 0, 0, 33), ACCEPT };
+    CHECK(!Compile(LongPrefix4, 2));
+    const TUN_FILTER_INSN Prefix4[] = { INSN(JPREFIX, SOURCE_ADDRESS4, 0, 0, 32), ACCEPT };
+    CHECK(Compile(Prefix4, 2));
+    const TUN_FILTER_INSN LongPrefix6[] = { INSN(JPREFIX, DESTINATION_ADDRESS6, 0, 0, 129), ACCEPT };
+    CHECK(!Compile(LongPrefix6, 2));
+}
+
+static void
+TestMasks(void)
+{
+    static const UCHAR Expected12[16] = { 0xFF, 0xF0 };
+    TUN_FILTER_INSN Insns[] = { INSN(JPREFIX, SOURCE_ADDRESS6, 0, 0, 12), ACCEPT };
+    CHECK(Compile(Insns, 2));
+    CHECK(!memcmp(Compiled.Program.Insns[0].Mask, Expected12, 16));
+
+    Insns[0].Value = 0;
+    CHECK(Compile(Insns, 2));
+    for (ULONG Byte = 0; Byte < 16; ++Byte)
+        CHECK(Compiled.Program.Insns[0].Mask[Byte] == 0);
+
+    Insns[0].Value = 128;
+    CHECK(Compile(Insns, 2));
+    for (ULONG Byte = 0; Byte < 16; ++Byte)
+        CHECK(Compiled.Program.Insns[0].Mask[Byte] == 0xFF);
+
+    /* Instructions that are not prefix tests never look at their mask, which stays clear. */
+    CHECK(Compiled.Program.Insns[1].Mask[0] == 0);
+}
+
+static void
+TestParseIpv4(void)
+{
+    static const UCHAR Source[4] = { 10, 1, 2, 3 };
+    UCHAR Packet[64];
+    TUN_FILTER_HEADERS Headers;
+
+    TunFilterParse(Packet, Ipv4(Packet, 40, 6, Source, 1234, 443), &Headers);
+    CHECK(Headers.Fields[TUN_FILTER_FIELD_VERSION] == 4);
+    CHECK(Headers.Fields[TUN_FILTER_FIELD_PROTOCOL] == 6);
+    CHECK(Headers.Fields[TUN_FILTER_FIELD_LENGTH] == 40);
+    CHECK(Headers.Fields[TUN_FILTER_FIELD_SOURCE_PORT] == 1234);
+    CHECK(Headers.Fields[TUN_FILTER_FIELD_DESTINATION_PORT] == 443);
+    CHECK(Headers.Present & (1 << TUN_FILTER_FIELD_DESTINATION_ADDRESS4));
+    CHECK(!(Headers.Present & (1 << TUN_FILTER_FIELD_SOURCE_ADDRESS6)));
+    CHECK(Headers.Source == Packet + 12 && Headers.Destination == Packet + 16);
+
+    /* Ports are only read from first fragments of port-carrying protocols, and only when they are all there. */
+    Packet[7] = 1;
+    TunFilterParse(Packet, 40, &Headers);
+    CHECK(!(Headers.Present & (1 << TUN_FILTER_FIELD_SOURCE_PORT)));
+    TunFilterParse(Packet, Ipv4(Packet, 40, 1, Source, 1234, 443), &Headers);
+    CHECK(!(Headers.Present & (1 << TUN_FILTER_FIELD_SOURCE_PORT)));
+    CHECK(Headers.Present & (1 << TUN_FILTER_FIELD_PROTOCOL));
+    TunFilterParse(Packet, Ipv4(Packet, 23, 17, Source, 1234, 443), &Headers);
+    CHECK(!(Headers.Present & (1 << TUN_FILTER_FIELD_DESTINATION_PORT)));
+
+    /* Options push the transport header back. */
+    Ipv4(Packet, 64, 17, Source, 0, 0);
+    Packet[0] = 0x46;
+    Packet[24] = 0x12, Packet[25] = 0x34, Packet[26] = 0x00, Packet[27] = 0x35;
+    TunFilterParse(Packet, 64, &Headers);
+    CHECK(Headers.Fields[TUN_FILTER_FIELD_SOURCE_PORT] == 0x1234);
+    CHECK(Headers.Fields[TUN_FILTER_FIELD_DESTINATION_PORT] == 53);
+
+    /* Truncated headers leave only the version and the length. */
+    TunFilterParse(Packet, 19, &Headers);
+    CHECK(Headers.Present == ((1 << TUN_FILTER_FIELD_LENGTH) | (1 << TUN_FILTER_FIELD_VERSION)));
+    Packet[0] = 0x4F;
+    TunFilterParse(Packet, 40, &Headers);
+    CHECK(Headers.Present == ((1 << TUN_FILTER_FIELD_LENGTH) | (1 << TUN_FILTER_FIELD_VERSION)));
+    TunFilterParse(Packet, 0, &Headers);
+    CHECK(Headers.Present == 1 << TUN_FILTER_FIELD_LENGTH);
+}
+
+static void
+TestParseIpv6(void)
+{
+    UCHAR Packet[128] = { 0 };
+    TUN_FILTER_HEADERS Headers;
+
+    /* Hop-by-hop options, then a first fragment, then UDP. */
+    Packet[0] = 0x60;
+    Packet[6] = 0;
+    Packet[8] = 0x20, Packet[9] = 0x01, Packet[10] = 0x0d, Packet[11] = 0xb8;
+    Packet[40] = 44, Packet[41] = 1;
+    Packet[56] = 17;
+    Packet[64] = 0x04, Packet[65] = 0xD2, Packet[66] = 0x00, Packet[67] = 0x35;
+    TunFilterParse(Packet, 72, &Headers);
+    CHECK(Headers.Fields[TUN_FILTER_FIELD_VERSION] == 6);
+    CHECK(Headers.Fields[TUN_FILTER_FIELD_PROTOCOL] == 17);
+    CHECK(Headers.Fields[TUN_FILTER_FIELD_SOURCE_PORT] == 1234);
+    CHECK(Headers.Fields[TUN_FILTER_FIELD_DESTINATION_PORT] == 53);
+    CHECK(Headers.Source == Packet + 8 && Headers.Destination == Packet + 24);
+    CHECK(!(Headers.Present & (1 << TUN_FILTER_FIELD_SOURCE_ADDRESS4)));
+
+    /* A later fragment has the protocol but no ports. */
+    Packet[58] = 0x01;
+    TunFilterParse(Packet, 72, &Headers);
+    CHECK(Headers.Fields[TUN_FILTER_FIELD_PROTOCOL] == 17);
+    CHECK(!(Headers.Present & (1 << TUN_FILTER_FIELD_SOURCE_PORT)));
+    Packet[58] = 0;
+
+    /* An extension header running past the packet stops parsing before the protocol. */
+    TunFilterParse(Packet, 50, &Headers);
+    CHECK(!(Headers.Present & (1 << TUN_FILTER_FIELD_PROTOCOL)));
+    CHECK(Headers.Present & (1 << TUN_FILTER_FIELD_SOURCE_ADDRESS6));
+    TunFilterParse(Packet, 39, &Headers);
+    CHECK(!(Headers.Present & (1 << TUN_FILTER_FIELD_SOURCE_ADDRESS6)));
+
+    Packet[0] = 0x50;
+    TunFilterParse(Packet, 72, &Headers);
+    CHECK(Headers.Present == ((1 << TUN_FILTER_FIELD_LENGTH) | (1 << TUN_FILTER_FIELD_VERSION)));
+}
+
+static void
+TestRun(void)
+{
+    static const UCHAR Inside[4] = { 10, 1, 2, 3 }, Outside[4] = { 11, 1, 2, 3 };
+    UCHAR Packet[64];
+
+    /* Accept HTTPS from 10.0.0.0/8 and anything longer than 1000 bytes, reject the rest. */
+    TUN_FILTER_INSN Insns[] = {
+        INSN(JGT, LENGTH, 4, 0, 1000),
+        INSN(JPREFIX, SOURCE_ADDRESS4, 0, 2, 8),
+        INSN(JEQ, PROTOCOL, 0, 1, 6),
+        INSN(JEQ, DESTINATION_PORT, 1, 0, 443),
+        REJECT,
+        ACCEPT,
+    };
+    Insns[1].Address[0] = 10;
+    CHECK(Compile(Insns, sizeof(Insns) / sizeof(*Insns)));
+    CHECK(TunFilterRun(&Compiled.Program, Packet, Ipv4(Packet, 40, 6, Inside, 1234, 443)));
+    CHECK(!TunFilterRun(&Compiled.Program, Packet, Ipv4(Packet, 40, 6, Outside, 1234, 443)));
+    CHECK(!TunFilterRun(&Compiled.Program, Packet, Ipv4(Packet, 40, 6, Inside, 1234, 80)));
+    CHECK(!TunFilterRun(&Compiled.Program, Packet, Ipv4(Packet, 40, 17, Inside, 1234, 443)));
+
+    /* A test on a field the packet lacks is false: ICMP has no destination port, IPv4 no IPv6 address. */
+    const TUN_FILTER_INSN NoPort[] = { INSN(JEQ, DESTINATION_PORT, 0, 1, 0), ACCEPT, REJECT };
+    CHECK(Compile(NoPort, 3));
+    CHECK(!TunFilterRun(&Compiled.Program, Packet, Ipv4(Packet, 40, 1, Inside, 0, 0)));
+    CHECK(TunFilterRun(&Compiled.Program, Packet, Ipv4(Packet, 40, 6, Inside, 0, 0)));
+    const TUN_FILTER_INSN AnySource6[] = { INSN(JPREFIX, SOURCE_ADDRESS6, 0, 1, 0), ACCEPT, REJECT };
+    CHECK(Compile(AnySource6, 3));
+    CHECK(!TunFilterRun(&Compiled.Program, Packet, Ipv4(Packet, 40, 6, Inside, 0, 0)));
+
+    /* IPv6 prefixes compare whole bytes first, then the masked bits of the last one. */
+    UCHAR Packet6[60] = { 0x60 };
+    Packet6[6] = 59;
+    Packet6[24] = 0xfd, Packet6[25] = 0x12, Packet6[26] = 0x34;
+    TUN_FILTER_INSN Ula[] = { INSN(JPREFIX, DESTINATION_ADDRESS6, 0, 1, 20), ACCEPT, REJECT };
+    Ula[0].Address[0] = 0xfd, Ula[0].Address[1] = 0x12, Ula[0].Address[2] = 0x3f;
+    CHECK(Compile(Ula, 3));
+    CHECK(TunFilterRun(&Compiled.Program, Packet6, sizeof(Packet6)));
+    Packet6[26] = 0x44;
+    CHECK(!TunFilterRun(&Compiled.Program, Packet6, sizeof(Packet6)));
+}
+
+/* Programs are untrusted input: any instruction mix that compiles must terminate, which it does by only jumping
+ * forward. Random programs run over random packets must hit an accept or reject without faulting. */
+static void
+TestRandomPrograms(void)
+{
+    TUN_FILTER_INSN Insns[32];
+    UCHAR Packet[80];
+    ULONG Compiles = 0;
+    for (ULONG Round = 0; Round < 20000; ++Round)
+    {
+        ULONG Count = 1 + TestRandom() % 32;
+        for (ULONG i = 0; i < Count; ++i)
+        {
+            Insns[i].Op = (UCHAR)(TestRandom() % TUN_FILTER_OP_COUNT);
+            Insns[i].Field = (UCHAR)(TestRandom() % TUN_FILTER_FIELD_COUNT);
+            Insns[i].JumpTrue = (UCHAR)(TestRandom() % 4);
+            Insns[i].JumpFalse = (UCHAR)(TestRandom() % 4);
+            Insns[i].Value = TestRandom() % 160;
+            TestFill(Insns[i].Address, sizeof(Insns[i].Address));
+        }
+        if (!Compile(Insns, Count))
+            continue;
+        ++Compiles;
+        TestFill(Packet, sizeof(Packet));
+        Packet[0] = (UCHAR)((TestRandom() & 1 ? 0x40 : 0x60) | (Packet[0] & 0xF));
+        TunFilterRun(&Compiled.Program, Packet, TestRandom() % sizeof(Packet));
+    }
+    CHECK(Compiles > 100);
+}
+
+int
+main(void)
+{
+    RUN(TestCompile);
+    RUN(TestMasks);
+    RUN(TestParseIpv4);
+    RUN(TestParseIpv6);
+    RUN(TestRun);
+    RUN(TestRandomPrograms);
+    TEST_EXIT();
+}
@@ -0,0 +1,149 @@
+/* SPDX-License-Identifier: GPL-2.0 OR MIT
+ *
+ * Copyright (C) 2018-2021 WireGuard LLC. All Rights Reserved.
+ */
+
+/* Flow steering: every packet of a flow, fragments included, must land on the same queue, and flows must spread over
+ * the queues evenly. */
+
+#include "../common/flow.h"
+#include "test.h"
+
+#define SEED 0x5EED1234
+
+static void
+Ipv4(UCHAR *Packet, UCHAR Protocol, ULONG Source, USHORT SourcePort, USHORT DestinationPort)
+{
+    memset(Packet, 0, 28);
+    Packet[0] = 0x45;
+    Packet[8] = 64;
+    Packet[9] = Protocol;
+    Packet[12] = (UCHAR)(Source >> 24), Packet[13] = (UCHAR)(Source >> 16);
+    Packet[14] = (UCHAR)(Source >> 8), Packet[15] = (UCHAR)Source;
+    Packet[16] = 192, Packet[17] = 0, Packet[18] = 2, Packet[19] = 1;
+    Packet[20] = (UCHAR)(SourcePort >> 8), Packet[21] = (UCHAR)SourcePort;
+    Packet[22] = (UCHAR)(DestinationPort >> 8), Packet[23] = (UCHAR)DestinationPort;
+}
+
+static void
+TestIpv4(void)
+{
+    UCHAR Packet[64], Other[64];
+
+    /* Only addresses, protocol and ports count, not the rest of the header nor the payload. */
+    Ipv4(Packet, 6, 0x0A000001, 40000, 443);
+    ULONG Hash = TunFlowHash(SEED, Packet, 28);
+    memcpy(Other, Packet, 28);
+    Other[1] = 0x10, Other[3] = 0x99, Other[5] = 7, Other[8] = 3, Other[10] = 0xAB, Other[27] = 0xFF;
+    CHECK(TunFlowHash(SEED, Other, 28) == Hash);
+    CHECK(TunFlowHash(SEED, Packet, 64) == Hash);
+
+    Ipv4(Other, 6, 0x0A000001, 40001, 443);
+    CHECK(TunFlowHash(SEED, Other, 28) != Hash);
+    Ipv4(Other, 17, 0x0A000001, 40000, 443);
+    CHECK(TunFlowHash(SEED, Other, 28) != Hash);
+    Ipv4(Other, 6, 0x0A000002, 40000, 443);
+    CHECK(TunFlowHash(SEED, Other, 28) != Hash);
+    CHECK(TunFlowHash(SEED + 1, Packet, 28) != Hash);
+
+    /* Fragments lack ports past the first one, so no fragment hashes them. */
+    Ipv4(Packet, 17, 0x0A000001, 40000, 53);
+    Packet[6] = 0x20;
+    ULONG First = TunFlowHash(SEED, Packet, 28);
+    Packet[6] = 0x00, Packet[7] = 0xB9;
+    memset(Packet + 20, 0x5A, 8);
+    CHECK(TunFlowHash(SEED, Packet, 28) == First);
+    Packet[7] = 0;
+    Ipv4(Packet, 17, 0x0A000001, 40000, 53);
+    CHECK(TunFlowHash(SEED, Packet, 28) != First);
+
+    /* Protocols without ports, and headers cut short of the ports, hash without them. */
+    Ipv4(Packet, 1, 0x0A000001, 1, 2);
+    Ipv4(Other, 1, 0x0A000001, 3, 4);
+    CHECK(TunFlowHash(SEED, Packet, 28) == TunFlowHash(SEED, Other, 28));
+    Ipv4(Packet, 6, 0x0A000001, 1, 2);
+    Ipv4(Other, 6, 0x0A000001, 3, 4);
+    CHECK(TunFlowHash(SEED, Packet, 23) == TunFlowHash(SEED, Other, 23));
+
+    /* Options push the ports back. */
+    Ipv4(Packet, 6, 0x0A000001, 0, 0);
+    Packet[0] = 0x46;
+    memcpy(Other, Packet, 28);
+    Other[20] = 0xEE;
+    CHECK(TunFlowHash(SEED, Packet, 28) == TunFlowHash(SEED, Other, 28));
+    Other[25] = 0xEE;
+    CHECK(TunFlowHash(SEED, Packet, 28) != TunFlowHash(SEED, Other, 28));
+}
+
+static void
+TestIpv6(void)
+{
+    UCHAR Packet[64] = { 0x60 }, Other[64];
+    Packet[6] = 6;
+    Packet[8] = 0x20, Packet[9] = 0x01, Packet[10] = 0x0d, Packet[11] = 0xb8, Packet[23] = 1;
+    Packet[24] = 0x20, Packet[25] = 0x01, Packet[26] = 0x0d, Packet[27] = 0xb8, Packet[39] = 2;
+    Packet[40] = 0x9C, Packet[41] = 0x40, Packet[42] = 0x01, Packet[43] = 0xBB;
+    ULONG Hash = TunFlowHash(SEED, Packet, 44);
+
+    memcpy(Other, Packet, 44);
+    Other[1] = 0xFF, Other[5] = 0x10, Other[7] = 1;
+    CHECK(TunFlowHash(SEED, Other, 44) == Hash);
+    Other[23] = 3;
+    CHECK(TunFlowHash(SEED, Other, 44) != Hash);
+    Other[23] = 1, Other[43] = 0x50;
+    CHECK(TunFlowHash(SEED, Other, 44) != Hash);
+
+    /* Behind a fragment header, whatever follows the fixed header is left out. */
+    Packet[6] = 44;
+    memcpy(Other, Packet, 44);
+    Other[40] = 0x11, Other[43] = 0x08;
+    CHECK(TunFlowHash(SEED, Packet, 44) == TunFlowHash(SEED, Other, 44));
+}
+
+static void
+TestNotIp(void)
+{
+    UCHAR Packet[64] = { 0 };
+    CHECK(TunFlowHash(SEED, Packet, 0) == SEED);
+    CHECK(TunFlowHash(SEED, Packet, 64) == SEED);
+    Packet[0] = 0x45;
+    CHECK(TunFlowHash(SEED, Packet, 19) == SEED);
+    Packet[0] = 0x44;
+    CHECK(TunFlowHash(SEED, Packet, 64) == SEED);
+    Packet[0] = 0x60;
+    CHECK(TunFlowHash(SEED, Packet, 39) == SEED);
+}
+
+static void
+TestQueues(void)
+{
+    CHECK(TunFlowQueue(0xFFFFFFFF, 1) == 0);
+    CHECK(TunFlowQueue(0, TUN_MAX_QUEUES) == 0);
+    CHECK(TunFlowQueue(0xFFFFFFFF, TUN_MAX_QUEUES) == TUN_MAX_QUEUES - 1);
+
+    /* Flows differing only in source port spread evenly, within 10% of the mean for every queue count. */
+    UCHAR Packet[64];
+    for (ULONG Count = 2; Count <= TUN_MAX_QUEUES; ++Count)
+    {
+        ULONG Queues[TUN_MAX_QUEUES] = { 0 }, Flows = 8000 * Count;
+        for (ULONG Flow = 0; Flow < Flows; ++Flow)
+        {
+            Ipv4(Packet, 6, 0x0A000001, (USHORT)Flow, 443);
+            ULONG Queue = TunFlowQueue(TunFlowHash(SEED, Packet, 28), Count);
+            CHECK(Queue < Count);
+            Queues[Queue % TUN_MAX_QUEUES]++;
+        }
+        for (ULONG Queue = 0; Queue < Count; ++Queue)
+            CHECK(Queues[Queue] > 7200 && Queues[Queue] < 8800);
+    }
+}
+
+int
+main(void)
+{
+    RUN(TestIpv4);
+    RUN(TestIpv6);
+    RUN(TestNotIp);
+    RUN(TestQueues);
+    TEST_EXIT();
+}
@@ -0,0 +1,173 @@
+/* SPDX-License-Identifier: GPL-2.0 OR MIT
+ *
+ * Copyright (C) 2018-2021 WireGuard LLC. All Rights Reserved.
+ */
+
+/* Segmentation of TCP super-packets: which packets are accepted, and that every segment is a valid TCP/IP packet
+ * carrying its share of the payload with the right headers. Checksums are verified with a plain byte-wise sum. */
+
+#include "../common/gso.h"
+#include "test.h"
+
+/* One's complement sum of big-endian 16-bit words, folded. */
+static ULONG
+NaiveSum(ULONG Sum, const UCHAR *Data, ULONG Size)
+{
+    for (ULONG i = 0; i < Size; i += 2)
+        Sum += (ULONG)Data[i] << 8 | (i + 1 < Size ? Data[i + 1] : 0);
+    while (Sum >> 16)
+        Sum = (Sum & 0xFFFF) + (Sum >> 16);
+    return Sum;
+}
+
+static ULONG
+Load32(const UCHAR *Data)
+{
+    return (ULONG)Data[0] << 24 | (ULONG)Data[1] << 16 | (ULONG)Data[2] << 8 | Data[3];
+}
+
+/* Builds a super-packet with IpOptions and TcpOptions bytes of options and Payload bytes of data. Returns its size. */
+static ULONG
+SuperPacket(UCHAR *Packet, UCHAR Version, ULONG IpOptions, ULONG TcpOptions, ULONG Payload, UCHAR Flags)
+{
+    ULONG IpHeaderSize = Version == 4 ? 20 + IpOptions : 40, Size = IpHeaderSize + 20 + TcpOptions + Payload;
+    memset(Packet, 0, IpHeaderSize + 20 + TcpOptions);
+    if (Version == 4)
+    {
+        Packet[0] = (UCHAR)(0x40 | IpHeaderSize / 4);
+        Packet[4] = 0x12, Packet[5] = 0xFF; /* Identification, about to carry over into the high byte */
+        Packet[6] = 0x40;                   /* Don't fragment */
+        Packet[8] = 64;
+        Packet[9] = 6;
+        Packet[12] = 10, Packet[15] = 1, Packet[16] = 10, Packet[19] = 2;
+    }
+    else
+    {
+        Packet[0] = 0x60;
+        Packet[6] = 6;
+        Packet[7] = 64;
+        Packet[8] = 0xfd, Packet[23] = 1, Packet[24] = 0xfd, Packet[39] = 2;
+    }
+    UCHAR *Tcp = Packet + IpHeaderSize;
+    Tcp[0] = 0xC0, Tcp[1] = 0x00, Tcp[2] = 0x01, Tcp[3] = 0xBB;
+    Tcp[4] = 0xFF, Tcp[5] = 0xFF, Tcp[6] = 0xF0, Tcp[7] = 0x00; /* Sequence number, about to wrap */
+    Tcp[12] = (UCHAR)((20 + TcpOptions) / 4 << 4);
+    Tcp[13] = Flags;
+    for (ULONG i = 0; i < TcpOptions; ++i)
+        Tcp[20 + i] = 1; /* No-operation */
+    TestFill(Tcp + 20 + TcpOptions, Payload);
+    return Size;
+}
+
+/* Segments the super-packet and checks every segment against it. */
+static void
+CheckSegments(const UCHAR *Packet, ULONG Size, ULONG Mss, ULONG ExpectedSegments)
+{
+    static UCHAR Segment[TUN_GSO_MAX_HEADER_SIZE + TUN_MAX_IP_PACKET_SIZE];
+    TUN_GSO Gso;
+    CHECK(TunGsoParse(Packet, Size, Mss, &Gso));
+    CHECK(Gso.Segments == ExpectedSegments);
+
+    ULONG Payload = 0;
+    for (ULONG Index = 0; Index < Gso.Segments; ++Index)
+    {
+        ULONG SegmentSize = TunGsoSegment(Packet, &Gso, Index, Segment);
+        ULONG PayloadSize = SegmentSize - Gso.HeaderSize;
+        CHECK(PayloadSize <= Mss && (PayloadSize == Mss || Index == Gso.Segments - 1));
+        CHECK(!memcmp(Segment + Gso.HeaderSize, Packet + Gso.HeaderSize + Payload, PayloadSize));
+
+        const UCHAR *Tcp = Segment + Gso.IpHeaderSize;
+        ULONG TcpSize = SegmentSize - Gso.IpHeaderSize, Pseudo;
+        if (Gso.Version == 4)
+        {
+            CHECK(TunGsoLoad16(Segment + 2) == SegmentSize);
+            CHECK(TunGsoLoad16(Segment + 4) == ((TunGsoLoad16(Packet + 4) + Index) & 0xFFFF));
+            CHECK(NaiveSum(0, Segment, Gso.IpHeaderSize) == 0xFFFF);
+            CHECK(!memcmp(Segment + 6, Packet + 6, 4) && !memcmp(Segment + 12, Packet + 12, Gso.IpHeaderSize - 12));
+            Pseudo = NaiveSum(6 + TcpSize, Segment + 12, 8);
+        }
+        else
+        {
+            CHECK(TunGsoLoad16(Segment + 4) == TcpSize);
+            CHECK(!memcmp(Segment + 6, Packet + 6, 34));
+            Pseudo = NaiveSum(6 + TcpSize, Segment + 8, 32);
+        }
+        CHECK(NaiveSum(Pseudo, Tcp, TcpSize) == 0xFFFF);
+        CHECK(Load32(Tcp + 4) == Load32(Packet + Gso.IpHeaderSize + 4) + Payload);
+        UCHAR Flags = Packet[Gso.IpHeaderSize + 13];
+        if (Index != Gso.Segments - 1)
+            Flags &= ~0x09;
+        if (Index)
+            Flags &= ~0x80;
+        CHECK(Tcp[13] == Flags);
+        CHECK(!memcmp(Tcp + 20, Packet + Gso.IpHeaderSize + 20, Gso.HeaderSize - Gso.IpHeaderSize - 20));
+        Payload += PayloadSize;
+    }
+    CHECK(Payload == Gso.PayloadSize);
+    CHECK(!TunGsoSegment(Packet, &Gso, Gso.Segments, Segment));
+}
+
+static void
+TestSegmentIpv4(void)
+{
+    static UCHAR Packet[TUN_MAX_IP_PACKET_SIZE];
+    CheckSegments(Packet, SuperPacket(Packet, 4, 0, 12, 4000, 0x18 /* PSH ACK */), 1448, 3);
+    CheckSegments(Packet, SuperPacket(Packet, 4, 40, 40, 2896, 0x99 /* CWR PSH FIN */), 1448, 2);
+    CheckSegments(Packet, SuperPacket(Packet, 4, 0, 0, 65535 - 40, 0x10), 536, 123);
+    /* Payload shorter than one segment, and no payload at all, still yield one segment with fixed checksums. */
+    CheckSegments(Packet, SuperPacket(Packet, 4, 0, 0, 100, 0x19), 1448, 1);
+    CheckSegments(Packet, SuperPacket(Packet, 4, 0, 0, 0, 0x11), 1448, 1);
+}
+
+static void
+TestSegmentIpv6(void)
+{
+    static UCHAR Packet[TUN_MAX_IP_PACKET_SIZE];
+    CheckSegments(Packet, SuperPacket(Packet, 6, 0, 12, 4000, 0x18), 1428, 3);
+    CheckSegments(Packet, SuperPacket(Packet, 6, 0, 0, 65535 - 60, 0x99), 8000, 9);
+    CheckSegments(Packet, SuperPacket(Packet, 6, 0, 0, 1, 0x10), 1, 1);
+}
+
+static void
+TestReject(void)
+{
+    UCHAR Packet[256];
+    TUN_GSO Gso;
+    ULONG Size = SuperPacket(Packet, 4, 0, 0, 100, 0x10);
+    CHECK(TunGsoParse(Packet, Size, 1448, &Gso));
+    CHECK(!TunGsoParse(Packet, Size, 0, &Gso));
+    CHECK(!TunGsoParse(Packet, 0, 1448, &Gso));
+    CHECK(!TunGsoParse(Packet, 39, 1448, &Gso));
+
+    /* Only unfragmented TCP. */
+    Packet[9] = 17;
+    CHECK(!TunGsoParse(Packet, Size, 1448, &Gso));
+    Packet[9] = 6, Packet[6] = 0x20;
+    CHECK(!TunGsoParse(Packet, Size, 1448, &Gso));
+    Packet[6] = 0x00, Packet[7] = 0x08;
+    CHECK(!TunGsoParse(Packet, Size, 1448, &Gso));
+    Packet[7] = 0x00;
+
+    /* Header lengths below the minimum, or past the packet. */
+    Packet[0] = 0x44;
+    CHECK(!TunGsoParse(Packet, Size, 1448, &Gso));
+    Packet[0] = 0x45, Packet[32] = 0x40;
+    CHECK(!TunGsoParse(Packet, Size, 1448, &Gso));
+    Packet[32] = 0xF0;
+    CHECK(!TunGsoParse(Packet, 50, 1448, &Gso));
+
+    Size = SuperPacket(Packet, 6, 0, 0, 100, 0x10);
+    Packet[6] = 44;
+    CHECK(!TunGsoParse(Packet, Size, 1448, &Gso));
+    Packet[0] = 0x50;
+    CHECK(!TunGsoParse(Packet, Size, 1448, &Gso));
+}
+
+int
+main(void)
+{
+    RUN(TestSegmentIpv4);
+    RUN(TestSegmentIpv6);
+    RUN(TestReject);
+    TEST_EXIT();
+}
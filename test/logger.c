@@ -0,0 +1,252 @@
+/* SPDX-License-Identifier: GPL-2.0 OR MIT
+ *
+ * Copyright (C) 2018-2021 WireGuard LLC. All Rights Reserved.
+ */
+
+/* Log message queue and rate limiting behind the logger of the API: messages come out whole and in the order they were
+ * claimed, a full queue drops and counts rather than waits, and each rate limiting slot lets a burst per interval
+ * through, shared by the call sites colliding on it without one restarting the interval of another. */
+
+#include "../common/log.h"
+#include "test.h"
+#include <pthread.h>
+#include <sched.h>
+
+#define QUEUE_SIZE 8
+#define SITES 61
+#define BURST 20
+#define INTERVAL 1000
+#define PRODUCERS 4
+#define MESSAGES_PER_PRODUCER 50000
+
+typedef struct _MESSAGE
+{
+    ULONG Producer, Sequence, Check;
+} MESSAGE;
+
+static volatile LONG64 Sequences[QUEUE_SIZE];
+static MESSAGE Messages[QUEUE_SIZE];
+
+static int
+Put(TUN_LOG_QUEUE *Queue, ULONG Producer, ULONG Sequence)
+{
+    LONG64 Position;
+    if (!TunLogClaim(Queue, &Position))
+        return 0;
+    MESSAGE *Message = &Messages[TunLogIndex(Queue, Position)];
+    Message->Producer = Producer;
+    Message->Sequence = Sequence;
+    Message->Check = ~(Producer ^ Sequence);
+    TunLogPublish(Queue, Position);
+    return 1;
+}
+
+static void
+TestOrder(void)
+{
+    TUN_LOG_QUEUE Queue;
+    memset((void *)Sequences, 0, sizeof(Sequences));
+    TunLogInit(&Queue, Sequences, QUEUE_SIZE);
+    CHECK(!TunLogPeek(&Queue));
+
+    /* Around the queue many times, with anywhere from one message to a full queue in it at once. */
+    ULONG Queued = 0, Taken = 0;
+    for (ULONG Round = 0; Round < 1000; ++Round)
+    {
+        for (ULONG i = TestRandom() % QUEUE_SIZE + 1; i; --i)
+        {
+            if (Queued - Taken < QUEUE_SIZE)
+                CHECK(Put(&Queue, 0, Queued++));
+        }
+        for (ULONG i = TestRandom() % (Queued - Taken + 1); i; --i)
+        {
+            CHECK(TunLogPeek(&Queue));
+            CHECK(Messages[TunLogIndex(&Queue, Queue.Head)].Sequence == Taken++);
+            TunLogRelease(&Queue);
+        }
+    }
+    while (TunLogPeek(&Queue))
+    {
+        CHECK(Messages[TunLogIndex(&Queue, Queue.Head)].Sequence == Taken++);
+        TunLogRelease(&Queue);
+    }
+    CHECK(Taken == Queued && !Queue.Dropped);
+
+    /* A message claimed but not yet published holds up the ones claimed after it. */
+    LONG64 First, Second;
+    CHECK(TunLogClaim(&Queue, &First) && TunLogClaim(&Queue, &Second) && Second == First + 1);
+    TunLogPublish(&Queue, Second);
+    CHECK(!TunLogPeek(&Queue));
+    TunLogPublish(&Queue, First);
+    CHECK(TunLogPeek(&Queue));
+    TunLogRelease(&Queue);
+    CHECK(TunLogPeek(&Queue));
+    TunLogRelease(&Queue);
+    CHECK(!TunLogPeek(&Queue));
+}
+
+static void
+TestFull(void)
+{
+    TUN_LOG_QUEUE Queue;
+    memset((void *)Sequences, 0, sizeof(Sequences));
+    TunLogInit(&Queue, Sequences, QUEUE_SIZE);
+
+    for (ULONG i = 0; i < QUEUE_SIZE; ++i)
+        CHECK(Put(&Queue, 0, i));
+    /* Every message that does not fit is counted, and none of them overwrites a queued one. */
+    for (ULONG i = 0; i < 5; ++i)
+        CHECK(!Put(&Queue, 1, i));
+    CHECK(Queue.Dropped == 5 && Queue.Tail == QUEUE_SIZE);
+
+    /* Draining one message frees exactly one entry. */
+    CHECK(TunLogPeek(&Queue) && Messages[TunLogIndex(&Queue, Queue.Head)].Sequence == 0);
+    TunLogRelease(&Queue);
+    CHECK(Put(&Queue, 0, QUEUE_SIZE));
+    CHECK(!Put(&Queue, 1, 5));
+    CHECK(Queue.Dropped == 6);
+    for (ULONG i = 1; i <= QUEUE_SIZE; ++i)
+    {
+        CHECK(TunLogPeek(&Queue));
+        const MESSAGE *Message = &Messages[TunLogIndex(&Queue, Queue.Head)];
+        CHECK(Message->Producer == 0 && Message->Sequence == i);
+        TunLogRelease(&Queue);
+    }
+    CHECK(!TunLogPeek(&Queue));
+}
+
+static TUN_LOG_QUEUE SharedQueue;
+static volatile ULONG ProducersDone;
+static volatile LONG64 Retried; /* Counted as dropped, but then queued after all */
+
+static void *
+Producer(void *Context)
+{
+    ULONG Id = (ULONG)(size_t)Context;
+    for (ULONG Sequence = 0; Sequence < MESSAGES_PER_PRODUCER; ++Sequence)
+    {
+        /* Every few messages, wait out a full queue, so the consumer gets to see long runs from every producer. */
+        while (!Put(&SharedQueue, Id, Sequence) && !(Sequence % 16))
+        {
+            __atomic_add_fetch(&Retried, 1, __ATOMIC_RELAXED);
+            sched_yield();
+        }
+    }
+    __atomic_add_fetch(&ProducersDone, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+/* Concurrent producers against one consumer: the messages of each producer come out whole and in order, and every
+ * message is either delivered or counted as dropped. */
+static void
+TestConcurrent(void)
+{
+    memset((void *)Sequences, 0, sizeof(Sequences));
+    TunLogInit(&SharedQueue, Sequences, QUEUE_SIZE);
+    pthread_t Threads[PRODUCERS];
+    for (size_t i = 0; i < PRODUCERS; ++i)
+        CHECK(!pthread_create(&Threads[i], NULL, Producer, (void *)i));
+
+    ULONG Next[PRODUCERS] = { 0 }, Delivered = 0, Errors = 0;
+    while (Errors < 10)
+    {
+        if (!TunLogPeek(&SharedQueue))
+        {
+            /* Producers publish their last message before they count themselves done. */
+            if (__atomic_load_n(&ProducersDone, __ATOMIC_ACQUIRE) == PRODUCERS && !TunLogPeek(&SharedQueue))
+                break;
+            sched_yield();
+            continue;
+        }
+        const MESSAGE *Message = &Messages[TunLogIndex(&SharedQueue, SharedQueue.Head)];
+        if (Message->Producer >= PRODUCERS || Message->Check != ~(Message->Producer ^ Message->Sequence) ||
+            Message->Sequence < Next[Message->Producer])
+        {
+            fprintf(stderr, "producer %u sequence %u out of order or torn\n", Message->Producer, Message->Sequence);
+            ++Errors;
+        }
+        else
+            Next[Message->Producer] = Message->Sequence + 1;
+        ++Delivered;
+        TunLogRelease(&SharedQueue);
+    }
+    for (size_t i = 0; i < PRODUCERS; ++i)
+        pthread_join(Threads[i], NULL);
+    CHECK(!Errors);
+    CHECK(Delivered + SharedQueue.Dropped - Retried == PRODUCERS * MESSAGES_PER_PRODUCER);
+    printf("%u delivered, %lld dropped\n", Delivered, (long long)(SharedQueue.Dropped - Retried));
+}
+
+/* Call sites, like the format strings the logger limits by. Slots go by the address in two byte steps, so SiteB is in
+ * the slot after SiteA, and SiteC, a slot count of steps further, collides with SiteA. */
+static const char Strings[2 * SITES + 2];
+#define SiteA ((const void *)&Strings[0])
+#define SiteB ((const void *)&Strings[2])
+#define SiteC ((const void *)&Strings[2 * SITES])
+
+static void
+TestBurst(void)
+{
+    TUN_LOG_RATE Rates[SITES] = { 0 };
+    TUN_LOG_LIMIT Limit;
+    TunLogLimitInit(&Limit, Rates, SITES, BURST, INTERVAL);
+
+    /* The first message starts the interval. The burst gets through, the rest of the interval is suppressed. */
+    LONG64 Start = 5 * INTERVAL;
+    for (ULONG i = 0; i < BURST; ++i)
+        CHECK(TunLogRateAllow(&Limit, SiteA, Start + i));
+    for (ULONG i = 0; i < 30; ++i)
+        CHECK(!TunLogRateAllow(&Limit, SiteA, Start + INTERVAL - 1));
+    CHECK(Limit.Suppressed == 30);
+
+    /* Once the interval is over, the next message starts a new one with a whole burst. */
+    Start += INTERVAL;
+    for (ULONG i = 0; i < BURST; ++i)
+        CHECK(TunLogRateAllow(&Limit, SiteA, Start));
+    CHECK(!TunLogRateAllow(&Limit, SiteA, Start + 1));
+    CHECK(Limit.Suppressed == 31);
+
+    /* A quiet site is not held up by a noisy one in another slot. */
+    CHECK(TunLogRateAllow(&Limit, SiteB, Start + 1));
+
+    /* A message timestamped before the interval it lands in started neither starts a new one nor gets through. */
+    CHECK(!TunLogRateAllow(&Limit, SiteA, Start - 1));
+    CHECK(Limit.Suppressed == 32);
+}
+
+static void
+TestColliding(void)
+{
+    TUN_LOG_RATE Rates[SITES] = { 0 };
+    TUN_LOG_LIMIT Limit;
+    TunLogLimitInit(&Limit, Rates, SITES, BURST, INTERVAL);
+
+    /* Sites sharing a slot share the burst. */
+    LONG64 Start = 5 * INTERVAL;
+    for (ULONG i = 0; i < BURST; ++i)
+        CHECK(TunLogRateAllow(&Limit, i & 1 ? SiteC : SiteA, Start + i));
+    CHECK(!TunLogRateAllow(&Limit, SiteA, Start + BURST));
+    CHECK(!TunLogRateAllow(&Limit, SiteC, Start + BURST));
+
+    /* Taking turns throughout the interval, neither site restarts it for the other. */
+    for (LONG64 Now = Start + BURST; Now < Start + INTERVAL; Now += 10)
+        CHECK(!TunLogRateAllow(&Limit, (Now / 10) & 1 ? SiteC : SiteA, Now));
+    CHECK(Limit.Suppressed == 2 + (INTERVAL - BURST) / 10);
+
+    /* Whichever site logs first once the interval is over starts the next one for both. */
+    CHECK(TunLogRateAllow(&Limit, SiteC, Start + INTERVAL));
+    for (ULONG i = 1; i < BURST; ++i)
+        CHECK(TunLogRateAllow(&Limit, SiteA, Start + INTERVAL + i));
+    CHECK(!TunLogRateAllow(&Limit, SiteC, Start + INTERVAL + BURST));
+}
+
+int
+main(void)
+{
+    RUN(TestOrder);
+    RUN(TestFull);
+    RUN(TestConcurrent);
+    RUN(TestBurst);
+    RUN(TestColliding);
+    TEST_EXIT();
+}
@@ -0,0 +1,194 @@
+# SPDX-License-Identifier: GPL-2.0 OR MIT
+#
+# Copyright (C) 2018-2021 WireGuard LLC. All Rights Reserved.
+
+# Benchmarks of the packet I/O of the Python binding, api/pysession.h, against the fake session of pyfake.c, where a
+# native peer thread keeps the ring full. They measure what the binding costs and whether its threads get in each
+# other's way, not the ring: the fake session hands out malloc'd packets under a mutex. Run with "make bench"; set
+# PYBENCH_DURATION to the seconds each measurement takes, 1 by default.
+#
+# Batching: packets per second of read() and write(), one packet per call, against read_many() and write_many(), up to
+# MAX_BATCH packets per call and ring lock round-trip, with the ring filled or emptied between timed rounds.
+#
+# Threads: a reader thread reading packets, waiting on the read-wait event whenever the ring is empty, and a writer
+# thread writing them, alone and together, and the writer again while another thread blocks in wait_read_event() with
+# no packets coming. Every tenth of a second the counts are sampled; both threads must progress in every sample they
+# run together, which they do only because reads, writes and waits release the GIL around copies and waits.
+
+import os
+import threading
+import time
+
+import pyfake
+import pytest
+
+DURATION = float(os.environ.get("PYBENCH_DURATION", "1"))
+SAMPLE = 0.1
+
+
+class Worker(threading.Thread):
+    def __init__(self, loop):
+        super().__init__(daemon=True)
+        self.loop = loop
+        self.count = 0
+        self.stopping = False
+
+    def run(self):
+        self.loop(self)
+
+
+def reader(device):
+    def loop(worker):
+        while not worker.stopping:
+            if device.read() is None:
+                device.wait_read_event(timeout=SAMPLE)
+            else:
+                worker.count += 1
+
+    return Worker(loop)
+
+
+def writer(device, size):
+    packet = bytes(size)
+
+    def loop(worker):
+        while not worker.stopping:
+            for _ in range(16):
+                device.write(packet)
+            worker.count += 16
+
+    return Worker(loop)
+
+
+def waiter(device):
+    def loop(worker):
+        # Nothing arrives: this blocks until stop().
+        worker.result = device.wait_read_event()
+
+    return Worker(loop)
+
+
+def measure(workers):
+    """Runs workers for DURATION, returning their rates and the fraction of samples each made progress in."""
+    for worker in workers:
+        worker.start()
+    samples = []
+    last = [0] * len(workers)
+    start = time.perf_counter()
+    while time.perf_counter() - start < DURATION:
+        time.sleep(SAMPLE)
+        counts = [worker.count for worker in workers]
+        samples.append([now > before for now, before in zip(counts, last)])
+        last = counts
+    elapsed = time.perf_counter() - start
+    for worker in workers:
+        worker.stopping = True
+    for worker in workers:
+        worker.join()
+    rates = [worker.count / elapsed for worker in workers]
+    progress = [sum(sample[i] for sample in samples) / len(samples) for i in range(len(workers))]
+    return rates, progress
+
+
+def report(size, case, read_pps, write_pps, progress=None):
+    def rate(pps):
+        return "%10.0f" % pps if pps is not None else "%10s" % "-"
+
+    share = "%9.0f%%" % (100 * progress) if progress is not None else "%10s" % "-"
+    print("%6d %-18s %s %s %s" % (size, case, rate(read_pps), rate(write_pps), share))
+
+
+def timed(prepare, run):
+    """Repeats prepare() untimed and run() timed for DURATION, returning the packets run() moved per second."""
+    count = 0
+    elapsed = 0.0
+    while elapsed < DURATION:
+        prepare()
+        start = time.perf_counter()
+        count += run()
+        elapsed += time.perf_counter() - start
+    return count / elapsed
+
+
+@pytest.mark.parametrize("size", [64, 1400])
+def test_batching(size):
+    device = pyfake.FakeDevice()
+    ring = [b"%06d" % i + bytes(size - 6) for i in range(pyfake.RING_SIZE)]
+
+    def read():
+        for count in range(pyfake.RING_SIZE + 1):
+            if device.read() is None:
+                return count
+
+    def read_many():
+        count = 0
+        while True:
+            got = len(device.read_many(pyfake.MAX_BATCH))
+            if not got:
+                return count
+            count += got
+
+    def write():
+        for packet in ring:
+            device.write(packet)
+        return len(ring)
+
+    def write_many():
+        count = 0
+        for i in range(0, len(ring), pyfake.MAX_BATCH):
+            count += device.write_many(ring[i : i + pyfake.MAX_BATCH])
+        return count
+
+    # Both read the same packets, and write_many() sends them whole.
+    device.push(ring[: pyfake.MAX_BATCH + 1])
+    assert [device.read() for _ in range(pyfake.MAX_BATCH + 1)] == ring[: pyfake.MAX_BATCH + 1]
+    device.push(ring[: pyfake.MAX_BATCH + 1])
+    assert device.read_many(pyfake.MAX_BATCH) + device.read_many(pyfake.MAX_BATCH) == ring[: pyfake.MAX_BATCH + 1]
+    assert device.write_many(ring) == len(ring) and device.stats()["last_sent"] == ring[-1]
+
+    read_pps = timed(lambda: device.push(ring), read)
+    read_many_pps = timed(lambda: device.push(ring), read_many)
+    write_pps = timed(lambda: None, write)
+    write_many_pps = timed(lambda: None, write_many)
+    report(size, "per packet", read_pps, write_pps)
+    report(size, "batched", read_many_pps, write_many_pps)
+    print("%6d %-18s %9.1fx %9.1fx" % (size, "speedup", read_many_pps / read_pps, write_many_pps / write_pps))
+    stats = device.stats()
+    assert stats["released"] == stats["received"] and stats["pending"] == 0
+
+
+@pytest.fixture(scope="module", autouse=True)
+def header():
+    print("\n%6s %-18s %10s %10s %10s" % ("size", "case", "read pps", "write pps", "progress"))
+
+
+@pytest.mark.parametrize("size", [64, 1400])
+def test_threads(size):
+    device = pyfake.FakeDevice()
+    (write_alone,), (progress,) = measure([writer(device, size)])
+    report(size, "write", None, write_alone, progress)
+
+    device.start_peer(size)
+    (read_alone,), (progress,) = measure([reader(device)])
+    report(size, "read", read_alone, None, progress)
+
+    (read_pps, write_pps), progress = measure([reader(device), writer(device, size)])
+    device.stop_peer()
+    report(size, "read + write", read_pps, write_pps, min(progress))
+    assert min(progress) == 1, "a thread stalled while the other ran"
+
+    # A blocked wait must not hold up the writer. Drain the ring and the signal the peer left behind first.
+    while device.read() is not None:
+        pass
+    device.wait_read_event(timeout=0)
+    assert device.wait_read_event(timeout=0) == pyfake.WAIT_TIMEOUT
+    blocked = waiter(device)
+    blocked.start()
+    (write_pps,), (progress,) = measure([writer(device, size)])
+    report(size, "write + wait", None, write_pps, progress)
+    assert blocked.is_alive()
+    assert progress == 1, "the writer stalled behind wait_read_event()"
+    device.stop()
+    blocked.join(5)
+    assert not blocked.is_alive() and blocked.result == pyfake.WAIT_OBJECT_0 + 1
+    assert device.stats()["sent"] > 0
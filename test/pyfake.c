@@ -0,0 +1,648 @@
+/* SPDX-License-Identifier: GPL-2.0 OR MIT
+ *
+ * Copyright (C) 2018-2021 WireGuard LLC. All Rights Reserved.
+ */
+
+/* Python extension running the code of the Python binding in api/py*.h against a fake session and logger instead of
+ * wintun.dll, for the host tests and benchmarks in py*.py. A FakeDevice hands out the packets pushed into it like a
+ * ring would, or those a native peer thread keeps producing, takes the packets written to it, and counts what the
+ * binding does with its session. log() passes lines to the logger set_logger() registered, from a thread without the
+ * GIL like the drain thread of the logger does. */
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#include "win32.h"
+#include <stddef.h>
+#include <string.h>
+
+#define PyErr_SetFromWindowsErr(Error) PyErr_SetFromErrno(PyExc_OSError)
+
+static PyObject* fake_error = NULL;
+
+static void raise_error_from_errno(void) {
+    PyErr_Format(fake_error, "Wintun error %u", GetLastError());
+}
+
+static void raise_error(const char* errmsg) {
+    PyErr_SetString(fake_error, errmsg);
+}
+
+#include "../api/pysession.h"
+#include "../api/pyreader.h"
+
+// Log lines copied for delivery, so tests tell lines filtered out before the copy.
+static Py_ssize_t fake_log_copies;
+
+static void* fake_log_copy(size_t size) {
+    __atomic_add_fetch(&fake_log_copies, 1, __ATOMIC_RELAXED);
+    return PyMem_RawMalloc(size);
+}
+
+#define PyMem_RawMalloc fake_log_copy
+#include "../api/pylogger.h"
+#undef PyMem_RawMalloc
+
+#define FAKE_RING_SIZE 4096
+// Receive calls whose batch sizes are recorded, enough for the tests without growing through a benchmark.
+#define FAKE_BATCHES_RECORDED 4096
+
+typedef struct fake_t {
+    PyObject_HEAD
+    // Packets pushed and not yet received, in a ring. Receiving hands out the copies themselves, until released.
+    pthread_mutex_t lock;
+    BYTE* ring[FAKE_RING_SIZE];
+    DWORD sizes[FAKE_RING_SIZE];
+    size_t head, tail;
+    DWORD error; // Reported once the ring is empty, like ERROR_HANDLE_EOF when the adapter goes away
+    HANDLE read_event;
+    HANDLE stop_event;
+    // Produces packets of peer_size whenever the ring has room, until peer_stop.
+    pthread_t peer;
+    int peer_running;
+    int peer_stop;
+    DWORD peer_size;
+    // What the binding did with the session.
+    LONG users;
+    Py_ssize_t receive_calls;
+    Py_ssize_t received;
+    Py_ssize_t released;
+    PyObject* batches; // Packets returned by each receive call that returned any
+    Py_ssize_t sent;
+    Py_ssize_t sent_bytes;
+    BYTE* last_sent;
+    reader_t reader;
+} fake_t;
+
+// Sent packets carry their size in front, for the counters.
+typedef struct fake_packet_t {
+    DWORD size;
+    DWORD reserved;
+    BYTE data[];
+} fake_packet_t;
+
+static WINTUN_SESSION_HANDLE fake_session(fake_t* fake) {
+    return (WINTUN_SESSION_HANDLE)fake;
+}
+
+static DWORD WINAPI fake_receive_packets(WINTUN_SESSION_HANDLE session, BYTE** packets, DWORD* sizes, DWORD max_count) {
+    fake_t* fake = (fake_t*)session;
+    DWORD count = 0;
+    pthread_mutex_lock(&fake->lock);
+    fake->receive_calls++;
+    for (; count < max_count && fake->head != fake->tail; ++count)
+    {
+        packets[count] = fake->ring[fake->head % FAKE_RING_SIZE];
+        sizes[count] = fake->sizes[fake->head % FAKE_RING_SIZE];
+        fake->head++;
+    }
+    fake->received += count;
+    pthread_mutex_unlock(&fake->lock);
+    if (count && fake->receive_calls <= FAKE_BATCHES_RECORDED)
+    {
+        // Called with the GIL held.
+        PyObject* batch = PyLong_FromUnsignedLong(count);
+        if (batch)
+        {
+            PyList_Append(fake->batches, batch);
+            Py_DECREF(batch);
+        }
+    }
+    else
+    {
+        SetLastError(fake->error ? fake->error : ERROR_NO_MORE_ITEMS);
+    }
+    return count;
+}
+
+static void WINAPI fake_release_receive_packets(WINTUN_SESSION_HANDLE session, const BYTE** packets, DWORD count) {
+    fake_t* fake = (fake_t*)session;
+    for (DWORD i = 0; i < count; ++i)
+    {
+        free((void*)packets[i]);
+    }
+    pthread_mutex_lock(&fake->lock);
+    fake->released += count;
+    pthread_mutex_unlock(&fake->lock);
+}
+
+static BYTE* WINAPI fake_receive_packet(WINTUN_SESSION_HANDLE session, DWORD* size) {
+    fake_t* fake = (fake_t*)session;
+    BYTE* packet = NULL;
+    pthread_mutex_lock(&fake->lock);
+    fake->receive_calls++;
+    if (fake->head != fake->tail)
+    {
+        packet = fake->ring[fake->head % FAKE_RING_SIZE];
+        *size = fake->sizes[fake->head % FAKE_RING_SIZE];
+        fake->head++;
+        fake->received++;
+    }
+    pthread_mutex_unlock(&fake->lock);
+    if (!packet)
+    {
+        SetLastError(fake->error ? fake->error : ERROR_NO_MORE_ITEMS);
+    }
+    return packet;
+}
+
+static void WINAPI fake_release_receive_packet(WINTUN_SESSION_HANDLE session, const BYTE* packet) {
+    fake_release_receive_packets(session, &packet, 1);
+}
+
+static BYTE* WINAPI fake_allocate_send_packet(WINTUN_SESSION_HANDLE session, DWORD size) {
+    fake_t* fake = (fake_t*)session;
+    if (fake->error)
+    {
+        SetLastError(fake->error);
+        return NULL;
+    }
+    fake_packet_t* packet = malloc(sizeof(fake_packet_t) + size);
+    if (!packet)
+    {
+        SetLastError(ERROR_BUFFER_OVERFLOW);
+        return NULL;
+    }
+    packet->size = size;
+    return packet->data;
+}
+
+static void WINAPI fake_send_packet(WINTUN_SESSION_HANDLE session, const BYTE* data) {
+    fake_t* fake = (fake_t*)session;
+    BYTE* packet = (BYTE*)data - offsetof(fake_packet_t, data);
+    pthread_mutex_lock(&fake->lock);
+    fake->sent++;
+    fake->sent_bytes += ((fake_packet_t*)packet)->size;
+    BYTE* last = fake->last_sent;
+    fake->last_sent = packet;
+    pthread_mutex_unlock(&fake->lock);
+    free(last);
+}
+
+static DWORD WINAPI fake_allocate_send_packets(WINTUN_SESSION_HANDLE session, const DWORD* sizes, BYTE** packets,
+                                               DWORD count) {
+    DWORD allocated = 0;
+    while (allocated < count && (packets[allocated] = fake_allocate_send_packet(session, sizes[allocated])))
+    {
+        allocated++;
+    }
+    return allocated;
+}
+
+static void WINAPI fake_send_packets(WINTUN_SESSION_HANDLE session, const BYTE** packets, DWORD count) {
+    for (DWORD i = 0; i < count; ++i)
+    {
+        fake_send_packet(session, packets[i]);
+    }
+}
+
+static HANDLE WINAPI fake_get_read_wait_event(WINTUN_SESSION_HANDLE session) {
+    return ((fake_t*)session)->read_event;
+}
+
+static void fake_session_release(PyObject* owner) {
+    ((fake_t*)owner)->users--;
+}
+
+static const session_backend_t fake_session_backend = {
+    fake_receive_packet,
+    fake_release_receive_packet,
+    fake_receive_packets,
+    fake_release_receive_packets,
+    fake_allocate_send_packet,
+    fake_send_packet,
+    fake_allocate_send_packets,
+    fake_send_packets,
+    fake_get_read_wait_event,
+    fake_session_release,
+};
+
+static reader_t* reader_of(PyObject* owner) {
+    return &((fake_t*)owner)->reader;
+}
+
+static PyObject* fake_new(PyTypeObject* type, PyObject* args, PyObject* kwds) {
+    fake_t* fake = (fake_t*)type->tp_alloc(type, 0);
+    if (!fake)
+    {
+        return NULL;
+    }
+    pthread_mutex_init(&fake->lock, NULL);
+    fake->read_event = CreateEventW(NULL, FALSE, FALSE, NULL);
+    fake->stop_event = CreateEventW(NULL, TRUE, FALSE, NULL);
+    fake->batches = PyList_New(0);
+    if (!fake->read_event || !fake->stop_event || !fake->batches)
+    {
+        Py_DECREF(fake);
+        return NULL;
+    }
+    return (PyObject*)fake;
+}
+
+static void fake_peer_end(fake_t* fake);
+
+static void fake_dealloc(fake_t* fake) {
+    reader_end(&fake->reader);
+    fake_peer_end(fake);
+    while (fake->head != fake->tail)
+    {
+        free(fake->ring[fake->head++ % FAKE_RING_SIZE]);
+    }
+    if (fake->read_event)
+    {
+        CloseHandle(fake->read_event);
+    }
+    if (fake->stop_event)
+    {
+        CloseHandle(fake->stop_event);
+    }
+    free(fake->last_sent);
+    Py_XDECREF(fake->batches);
+    pthread_mutex_destroy(&fake->lock);
+    Py_TYPE(fake)->tp_free((PyObject*)fake);
+}
+
+static PyObject* fake_push(PyObject* self, PyObject* args) {
+    fake_t* fake = (fake_t*)self;
+    PyObject* iterable;
+    if (!PyArg_ParseTuple(args, "O:push", &iterable))
+    {
+        return NULL;
+    }
+    PyObject* seq = PySequence_Fast(iterable, "push() takes a sequence of bytes");
+    if (!seq)
+    {
+        return NULL;
+    }
+    Py_ssize_t total = PySequence_Fast_GET_SIZE(seq);
+    if (fake->tail - fake->head + total > FAKE_RING_SIZE)
+    {
+        Py_DECREF(seq);
+        raise_error("Ring full");
+        return NULL;
+    }
+    for (Py_ssize_t i = 0; i < total; ++i)
+    {
+        char* data;
+        Py_ssize_t size;
+        if (PyBytes_AsStringAndSize(PySequence_Fast_GET_ITEM(seq, i), &data, &size) < 0)
+        {
+            Py_DECREF(seq);
+            return NULL;
+        }
+        BYTE* packet = malloc(size ? size : 1);
+        if (!packet)
+        {
+            Py_DECREF(seq);
+            return PyErr_NoMemory();
+        }
+        memcpy(packet, data, size);
+        pthread_mutex_lock(&fake->lock);
+        fake->ring[fake->tail % FAKE_RING_SIZE] = packet;
+        fake->sizes[fake->tail % FAKE_RING_SIZE] = (DWORD)size;
+        fake->tail++;
+        pthread_mutex_unlock(&fake->lock);
+    }
+    Py_DECREF(seq);
+    // Like the driver moving the tail.
+    SetEvent(fake->read_event);
+    Py_RETURN_NONE;
+}
+
+static PyObject* fake_fail(PyObject* self, PyObject* args) {
+    fake_t* fake = (fake_t*)self;
+    unsigned int error = ERROR_HANDLE_EOF;
+    if (!PyArg_ParseTuple(args, "|I:fail", &error))
+    {
+        return NULL;
+    }
+    fake->error = error;
+    SetEvent(fake->read_event);
+    Py_RETURN_NONE;
+}
+
+static PyObject* fake_stats(PyObject* self, PyObject* args) {
+    fake_t* fake = (fake_t*)self;
+    pthread_mutex_lock(&fake->lock);
+    fake_packet_t* last = (fake_packet_t*)fake->last_sent;
+    PyObject* stats = Py_BuildValue(
+        "{s:i,s:n,s:n,s:n,s:n,s:O,s:n,s:n,s:y#}",
+        "users",
+        (int)fake->users,
+        "pending",
+        (Py_ssize_t)(fake->tail - fake->head),
+        "receive_calls",
+        fake->receive_calls,
+        "received",
+        fake->received,
+        "released",
+        fake->released,
+        "batches",
+        fake->batches,
+        "sent",
+        fake->sent,
+        "sent_bytes",
+        fake->sent_bytes,
+        "last_sent",
+        last ? (const char*)last->data : NULL,
+        last ? (Py_ssize_t)last->size : 0);
+    pthread_mutex_unlock(&fake->lock);
+    return stats;
+}
+
+static PyObject* fake_read(PyObject* self, PyObject* args) {
+    return session_read(&fake_session_backend, fake_session((fake_t*)self));
+}
+
+static PyObject* fake_write(PyObject* self, PyObject* args) {
+    char* buf = NULL;
+    Py_ssize_t len = 0;
+    if (!PyArg_ParseTuple(args, "s#:write", &buf, &len))
+    {
+        return NULL;
+    }
+    return session_write(&fake_session_backend, fake_session((fake_t*)self), buf, len);
+}
+
+static PyObject* fake_write_many(PyObject* self, PyObject* args) {
+    PyObject* iterable = NULL;
+    if (!PyArg_ParseTuple(args, "O:write_many", &iterable))
+    {
+        return NULL;
+    }
+    PyObject* seq = PySequence_Fast(iterable, "write_many() argument must be iterable");
+    if (!seq)
+    {
+        return NULL;
+    }
+    PyObject* ret = session_write_many(&fake_session_backend, fake_session((fake_t*)self), seq);
+    Py_DECREF(seq);
+    return ret;
+}
+
+static PyObject* fake_wait_read_event(PyObject* self, PyObject* args, PyObject* kwds) {
+    fake_t* fake = (fake_t*)self;
+    PyObject* timeout = Py_None;
+    char* kwlist[] = { "timeout", NULL };
+    DWORD ms;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|O:wait_read_event", kwlist, &timeout) || wait_timeout(timeout, &ms))
+    {
+        return NULL;
+    }
+    return session_wait_read(&fake_session_backend, fake_session(fake), fake->stop_event, ms);
+}
+
+static PyObject* fake_stop(PyObject* self, PyObject* args) {
+    SetEvent(((fake_t*)self)->stop_event);
+    Py_RETURN_NONE;
+}
+
+static void* fake_peer(void* param) {
+    fake_t* fake = param;
+    BYTE* packets[64];
+    DWORD count = 0;
+    while (!__atomic_load_n(&fake->peer_stop, __ATOMIC_RELAXED))
+    {
+        for (; count < _countof(packets); ++count)
+        {
+            if (!(packets[count] = malloc(fake->peer_size ? fake->peer_size : 1)))
+            {
+                break;
+            }
+            memset(packets[count], (BYTE)count, fake->peer_size);
+        }
+        pthread_mutex_lock(&fake->lock);
+        DWORD pushed = 0;
+        for (; pushed < count && fake->tail - fake->head < FAKE_RING_SIZE; ++pushed)
+        {
+            fake->ring[fake->tail % FAKE_RING_SIZE] = packets[pushed];
+            fake->sizes[fake->tail % FAKE_RING_SIZE] = fake->peer_size;
+            fake->tail++;
+        }
+        pthread_mutex_unlock(&fake->lock);
+        memmove(packets, packets + pushed, (count - pushed) * sizeof(packets[0]));
+        count -= pushed;
+        if (pushed)
+        {
+            SetEvent(fake->read_event);
+        }
+        else
+        {
+            // The ring is full: leave the CPU to the reader.
+            struct timespec pause = { 0, 100000 };
+            nanosleep(&pause, NULL);
+        }
+    }
+    for (DWORD i = 0; i < count; ++i)
+    {
+        free(packets[i]);
+    }
+    return NULL;
+}
+
+static void fake_peer_end(fake_t* fake) {
+    if (!fake->peer_running)
+    {
+        return;
+    }
+    __atomic_store_n(&fake->peer_stop, 1, __ATOMIC_RELAXED);
+    Py_BEGIN_ALLOW_THREADS
+    pthread_join(fake->peer, NULL);
+    Py_END_ALLOW_THREADS
+    fake->peer_running = 0;
+}
+
+static PyObject* fake_start_peer(PyObject* self, PyObject* args) {
+    fake_t* fake = (fake_t*)self;
+    unsigned int size;
+    if (!PyArg_ParseTuple(args, "I:start_peer", &size))
+    {
+        return NULL;
+    }
+    fake_peer_end(fake);
+    fake->peer_size = size;
+    fake->peer_stop = 0;
+    if (pthread_create(&fake->peer, NULL, fake_peer, fake))
+    {
+        raise_error("Cannot start peer");
+        return NULL;
+    }
+    fake->peer_running = 1;
+    Py_RETURN_NONE;
+}
+
+static PyObject* fake_stop_peer(PyObject* self, PyObject* args) {
+    fake_peer_end((fake_t*)self);
+    Py_RETURN_NONE;
+}
+
+static PyObject* fake_read_many(PyObject* self, PyObject* args) {
+    fake_t* fake = (fake_t*)self;
+    unsigned int max_count = 64;
+    if (!PyArg_ParseTuple(args, "|I:read_many", &max_count))
+    {
+        return NULL;
+    }
+    DWORD received;
+    return max_count ? receive_batch(&fake_session_backend, fake_session(fake), max_count, &received) : PyList_New(0);
+}
+
+static PyObject* fake_start_reading(PyObject* self, PyObject* args) {
+    fake_t* fake = (fake_t*)self;
+    PyObject *loop, *protocol;
+    if (!PyArg_ParseTuple(args, "OO:start_reading", &loop, &protocol))
+    {
+        return NULL;
+    }
+    fake->users++;
+    if (reader_start(&fake->reader, &fake_session_backend, self, fake_session(fake), loop, protocol))
+    {
+        fake->users--;
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+static PyObject* fake_stop_reading(PyObject* self, PyObject* args) {
+    reader_end(&((fake_t*)self)->reader);
+    Py_RETURN_NONE;
+}
+
+static WINTUN_LOGGER_CALLBACK fake_logger = NULL;
+
+static VOID WINAPI fake_set_logger(WINTUN_LOGGER_CALLBACK logger) {
+    fake_logger = logger;
+}
+
+static PyObject* fake_py_set_logger(PyObject* self, PyObject* args, PyObject* kwds) {
+    return log_set_logger(fake_set_logger, args, kwds);
+}
+
+static PyObject* fake_log(PyObject* self, PyObject* args) {
+    PyObject* iterable;
+    if (!PyArg_ParseTuple(args, "O:log", &iterable))
+    {
+        return NULL;
+    }
+    PyObject* seq = PySequence_Fast(iterable, "log() takes a sequence of (level, timestamp, message)");
+    if (!seq)
+    {
+        return NULL;
+    }
+    Py_ssize_t count = PySequence_Fast_GET_SIZE(seq);
+    int* levels = PyMem_Calloc(count + 1, sizeof(int));
+    unsigned long long* timestamps = PyMem_Calloc(count + 1, sizeof(unsigned long long));
+    wchar_t** messages = PyMem_Calloc(count + 1, sizeof(wchar_t*));
+    PyObject* result = NULL;
+    if (!levels || !timestamps || !messages)
+    {
+        PyErr_NoMemory();
+        goto cleanup;
+    }
+    for (Py_ssize_t i = 0; i < count; ++i)
+    {
+        PyObject* message;
+        if (!PyArg_ParseTuple(PySequence_Fast_GET_ITEM(seq, i), "iKU", &levels[i], &timestamps[i], &message) ||
+            !(messages[i] = PyUnicode_AsWideCharString(message, NULL)))
+        {
+            goto cleanup;
+        }
+    }
+    WINTUN_LOGGER_CALLBACK logger = fake_logger;
+    if (logger)
+    {
+        Py_BEGIN_ALLOW_THREADS
+        for (Py_ssize_t i = 0; i < count; ++i)
+        {
+            logger((WINTUN_LOGGER_LEVEL)levels[i], timestamps[i], messages[i]);
+        }
+        Py_END_ALLOW_THREADS
+    }
+    result = Py_None;
+    Py_INCREF(result);
+cleanup:
+    for (Py_ssize_t i = 0; messages && i < count; ++i)
+    {
+        PyMem_Free(messages[i]);
+    }
+    PyMem_Free(messages);
+    PyMem_Free(timestamps);
+    PyMem_Free(levels);
+    Py_DECREF(seq);
+    return result;
+}
+
+static PyObject* fake_log_copies_get(PyObject* self, PyObject* args) {
+    return PyLong_FromSsize_t(__atomic_load_n(&fake_log_copies, __ATOMIC_RELAXED));
+}
+
+static PyMethodDef fake_module_meth[] = {
+    { "set_logger", (PyCFunction)(void (*)(void))fake_py_set_logger, METH_VARARGS | METH_KEYWORDS, NULL },
+    { "log", fake_log, METH_VARARGS, "log(lines) -> None. Pass (level, timestamp, message) lines to the logger." },
+    { "log_copies", fake_log_copies_get, METH_NOARGS, "log_copies() -> number of log lines copied so far." },
+    { NULL, NULL, 0, NULL }
+};
+
+static PyMethodDef fake_meth[] = {
+    { "push", fake_push, METH_VARARGS, "push(packets) -> None. Queue packets and signal the read-wait event." },
+    { "fail", fake_fail, METH_VARARGS, "fail(error=ERROR_HANDLE_EOF) -> None. Fail receiving once drained." },
+    { "stats", fake_stats, METH_NOARGS, "stats() -> dict of what the binding did with the session." },
+    { "start_peer", fake_start_peer, METH_VARARGS, "start_peer(size) -> None. Keep producing packets of size." },
+    { "stop_peer", fake_stop_peer, METH_NOARGS, "stop_peer() -> None." },
+    { "stop", fake_stop, METH_NOARGS, "stop() -> None. Signal the stop event, like bringing the session down." },
+    { "read", fake_read, METH_NOARGS, NULL },
+    { "write", fake_write, METH_VARARGS, NULL },
+    { "write_many", fake_write_many, METH_VARARGS, NULL },
+    { "wait_read_event", (PyCFunction)(void (*)(void))fake_wait_read_event, METH_VARARGS | METH_KEYWORDS, NULL },
+    { "read_many", fake_read_many, METH_VARARGS, NULL },
+    { "start_reading", fake_start_reading, METH_VARARGS, NULL },
+    { "stop_reading", fake_stop_reading, METH_NOARGS, NULL },
+    { NULL, NULL, 0, NULL }
+};
+
+static PyTypeObject fake_type = {
+    PyVarObject_HEAD_INIT(NULL, 0).tp_name = "pyfake.FakeDevice",
+    .tp_basicsize = sizeof(fake_t),
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_doc = "Session of a Wintun adapter, faked.",
+    .tp_new = fake_new,
+    .tp_dealloc = (destructor)fake_dealloc,
+    .tp_methods = fake_meth,
+};
+
+static struct PyModuleDef fake_module = { .m_base = PyModuleDef_HEAD_INIT,
+                                         .m_name = "pyfake",
+                                         .m_size = -1,
+                                         .m_methods = fake_module_meth };
+
+PyMODINIT_FUNC PyInit_pyfake(void) {
+    if (PyType_Ready(&fake_type) < 0)
+    {
+        return NULL;
+    }
+    PyObject* m = PyModule_Create(&fake_module);
+    if (!m)
+    {
+        return NULL;
+    }
+    fake_error = PyErr_NewException("pyfake.Error", NULL, NULL);
+    Py_XINCREF(fake_error);
+    if (PyModule_AddObject(m, "Error", fake_error) < 0 ||
+        PyModule_AddObject(m, "FakeDevice", (PyObject*)&fake_type) < 0)
+    {
+        Py_XDECREF(fake_error);
+        Py_DECREF(m);
+        return NULL;
+    }
+    Py_INCREF(&fake_type);
+    PyModule_AddIntConstant(m, "ERROR_HANDLE_EOF", ERROR_HANDLE_EOF);
+    PyModule_AddIntConstant(m, "ERROR_INVALID_DATA", ERROR_INVALID_DATA);
+    PyModule_AddIntConstant(m, "WAIT_OBJECT_0", WAIT_OBJECT_0);
+    PyModule_AddIntConstant(m, "WAIT_TIMEOUT", WAIT_TIMEOUT);
+    PyModule_AddIntConstant(m, "MAX_BATCH", MAX_BATCH);
+    PyModule_AddIntConstant(m, "RING_SIZE", FAKE_RING_SIZE);
+    PyModule_AddIntConstant(m, "DRAIN_ROUNDS", DRAIN_ROUNDS);
+    PyModule_AddIntConstant(m, "LOG_INFO", WINTUN_LOG_INFO);
+    PyModule_AddIntConstant(m, "LOG_WARN", WINTUN_LOG_WARN);
+    PyModule_AddIntConstant(m, "LOG_ERR", WINTUN_LOG_ERR);
+    return m;
+}
@@ -0,0 +1,106 @@
+# SPDX-License-Identifier: GPL-2.0 OR MIT
+#
+# Copyright (C) 2018-2021 WireGuard LLC. All Rights Reserved.
+
+# set_logger() of the Python binding, api/pylogger.h, against the fake log source of pyfake.c: lines below the minimum
+# level are dropped before they are copied, and the rest reach the callback in order, in batches handed over once
+# max_batch lines are waiting, once the oldest has waited max_delay milliseconds, or when set_logger(None) stops
+# logging.
+
+import time
+
+import pyfake
+import pytest
+
+EPOCH = 132000000000000000  # 100 ns units since 1601, like the timestamps of the driver
+
+
+def lines(count, level=pyfake.LOG_INFO, start=0):
+    return [(level, EPOCH + i, "line %d" % i) for i in range(start, start + count)]
+
+
+class Batches(list):
+    def __call__(self, batch):
+        self.append(batch)
+
+    def lines(self):
+        return [line for batch in self for line in batch]
+
+
+def until(predicate, timeout=5):
+    deadline = time.monotonic() + timeout
+    while not predicate():
+        assert time.monotonic() < deadline, "timed out"
+        time.sleep(0.002)
+
+
+@pytest.fixture
+def batches():
+    batches = Batches()
+    yield batches
+    pyfake.set_logger(None)
+
+
+def test_level_filtered_before_copy(batches):
+    pyfake.set_logger(batches, min_level=pyfake.LOG_WARN, max_batch=1)
+    copies = pyfake.log_copies()
+    logged = lines(5) + lines(2, pyfake.LOG_WARN, 5) + lines(5, pyfake.LOG_INFO, 7) + lines(1, pyfake.LOG_ERR, 12)
+    pyfake.log(logged)
+    assert pyfake.log_copies() - copies == 3
+    assert batches == [[line] for line in logged if line[0] >= pyfake.LOG_WARN]
+
+
+def test_size_flush(batches):
+    pyfake.set_logger(batches, max_batch=4, max_delay=60000)
+    pyfake.log(lines(10))
+    # Full batches go out from the logging thread, before log() returns; the rest waits.
+    assert [len(batch) for batch in batches] == [4, 4]
+    pyfake.set_logger(None)
+    assert [len(batch) for batch in batches] == [4, 4, 2]
+    assert batches.lines() == lines(10)
+
+
+def test_timer_flush(batches):
+    pyfake.set_logger(batches, max_batch=1000, max_delay=50)
+    start = time.monotonic()
+    pyfake.log(lines(3))
+    until(lambda: batches)
+    assert time.monotonic() - start >= 0.045
+    assert batches == [lines(3)]
+    # The next line starts another wait.
+    time.sleep(0.1)
+    pyfake.log(lines(2, pyfake.LOG_INFO, 3))
+    until(lambda: len(batches) == 2)
+    assert batches == [lines(3), lines(2, pyfake.LOG_INFO, 3)]
+
+
+def test_size_and_timer(batches):
+    pyfake.set_logger(batches, max_batch=8, max_delay=50)
+    pyfake.log(lines(20))
+    until(lambda: len(batches.lines()) == 20)
+    # Whichever of the timer and a full batch delivers first, no line is lost, repeated or out of order.
+    assert batches.lines() == lines(20)
+    assert all(len(batch) <= 8 for batch in batches)
+
+
+def test_set_logger_none_flushes(batches):
+    pyfake.set_logger(batches, max_batch=1000, max_delay=60000)
+    pyfake.log(lines(3))
+    assert not batches
+    pyfake.set_logger(None)
+    assert batches == [lines(3)]
+    # Logging is off: lines are neither copied nor delivered.
+    copies = pyfake.log_copies()
+    pyfake.log(lines(3, pyfake.LOG_ERR))
+    time.sleep(0.05)
+    assert pyfake.log_copies() == copies
+    assert batches == [lines(3)]
+
+
+def test_arguments():
+    with pytest.raises(TypeError):
+        pyfake.set_logger(42)
+    with pytest.raises(ValueError):
+        pyfake.set_logger(print, min_level=pyfake.LOG_ERR + 1)
+    with pytest.raises(ValueError):
+        pyfake.set_logger(print, max_batch=0)
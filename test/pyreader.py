@@ -0,0 +1,326 @@
+# SPDX-License-Identifier: GPL-2.0 OR MIT
+#
+# Copyright (C) 2018-2021 WireGuard LLC. All Rights Reserved.
+
+# Packet I/O of the Python binding, api/pysession.h and api/pyreader.h, against the fake session of pyfake.c: read(),
+# write() and wait_read_event() do what the ring says, read_many() takes what the ring has in one receive call,
+# write_many() sends what it is given in batches, and start_reading() hands packets to the protocol in batches, one
+# call_soon_threadsafe() per batch, until the protocol stops reading, even from data_received(), or the session fails.
+
+import asyncio
+
+import pyfake
+import pytest
+
+
+def packets(count, start=0):
+    return [b"%06d" % i + bytes(i % 64) for i in range(start, start + count)]
+
+
+class CountingLoop:
+    """Passes the callbacks the reader schedules on to the loop, counting them."""
+
+    def __init__(self, loop):
+        self.loop = loop
+        self.threadsafe = 0
+        self.soon = 0
+
+    def call_soon_threadsafe(self, callback, *args):
+        self.threadsafe += 1
+        return self.loop.call_soon_threadsafe(callback, *args)
+
+    def call_soon(self, callback, *args):
+        self.soon += 1
+        return self.loop.call_soon(callback, *args)
+
+
+class Protocol:
+    def __init__(self, on_packet=None):
+        self.packets = []
+        self.lost = []
+        self.on_packet = on_packet
+
+    def data_received(self, data):
+        self.packets.append(data)
+        if self.on_packet:
+            self.on_packet(self, data)
+
+    def connection_lost(self, exc):
+        self.lost.append(exc)
+
+
+async def until(predicate, timeout=5):
+    for _ in range(int(timeout * 1000)):
+        if predicate():
+            return
+        await asyncio.sleep(0.001)
+    raise AssertionError("timed out")
+
+
+async def settle():
+    # Long enough for a stray wakeup of the reader thread to reach the loop.
+    await asyncio.sleep(0.05)
+
+
+def run(coroutine, errors=None):
+    loop = asyncio.new_event_loop()
+    reported = errors if errors is not None else []
+    loop.set_exception_handler(lambda loop, context: reported.append(context))
+    try:
+        loop.run_until_complete(coroutine(loop))
+    finally:
+        loop.close()
+    if errors is None:
+        assert not reported
+
+
+def test_read_write_wait():
+    device = pyfake.FakeDevice()
+    assert device.read() is None
+    assert device.wait_read_event(timeout=0.01) == pyfake.WAIT_TIMEOUT
+    device.push(packets(2))
+    assert device.wait_read_event(timeout=0) == pyfake.WAIT_OBJECT_0
+    assert [device.read(), device.read(), device.read()] == packets(2) + [None]
+    assert device.stats()["released"] == 2
+
+    assert device.write(b"\x45" + bytes(19)) == 20
+    # The loopback header pymobiledevice3 puts in front is not sent.
+    assert device.write(b"\x00\x00\x86\xdd\x60" + bytes(39)) == 40
+    stats = device.stats()
+    assert stats["sent"] == 2 and stats["sent_bytes"] == 60 and stats["last_sent"] == b"\x60" + bytes(39)
+
+    device.stop()
+    assert device.wait_read_event() == pyfake.WAIT_OBJECT_0 + 1
+    device.fail()
+    with pytest.raises(pyfake.Error):
+        device.read()
+    with pytest.raises(pyfake.Error):
+        device.write(bytes(20))
+
+
+def test_read_many():
+    device = pyfake.FakeDevice()
+    assert device.read_many() == []
+    device.push(packets(300))
+    assert device.read_many(4) == packets(4)
+    assert device.read_many(0) == []
+    # One receive call of at most MAX_BATCH packets, however many are asked for.
+    assert device.read_many(1000) == packets(pyfake.MAX_BATCH, 4)
+    assert device.read_many(1000) == packets(300 - 4 - pyfake.MAX_BATCH, 4 + pyfake.MAX_BATCH)
+    stats = device.stats()
+    assert stats["batches"] == [4, pyfake.MAX_BATCH, 300 - 4 - pyfake.MAX_BATCH]
+    assert stats["released"] == 300
+    device.fail()
+    with pytest.raises(pyfake.Error):
+        device.read_many()
+
+
+def test_write_many():
+    device = pyfake.FakeDevice()
+    assert device.write_many([]) == 0
+    sent = packets(300)
+    # Any iterable of buffers; the loopback header is stripped as by write().
+    assert device.write_many(iter(sent[:-1] + [b"\x00\x00\x86\xdd" + sent[-1]])) == 300
+    stats = device.stats()
+    assert stats["sent"] == 300 and stats["sent_bytes"] == sum(map(len, sent)) and stats["last_sent"] == sent[-1]
+
+    with pytest.raises(ValueError):
+        device.write_many([bytes(20), bytes(0x10000)])
+    with pytest.raises(TypeError):
+        device.write_many([bytes(20), 42])
+    assert device.stats()["sent"] == 300
+    device.fail()
+    with pytest.raises(pyfake.Error):
+        device.write_many([bytes(20)])
+
+
+def test_batches():
+    async def main(loop):
+        device = pyfake.FakeDevice()
+        counting = CountingLoop(loop)
+        protocol = Protocol()
+        device.push(packets(600))
+        device.start_reading(counting, protocol)
+        await until(lambda: len(protocol.packets) == 600)
+        await settle()
+        device.stop_reading()
+        assert protocol.packets == packets(600)
+        # A batch short of MAX_BATCH tells the ring is drained, so one drain takes all three.
+        stats = device.stats()
+        assert stats["batches"] == [256, 256, 88]
+        assert counting.threadsafe == 1 and counting.soon == 0
+        assert stats["released"] == 600 and stats["users"] == 0
+        assert not protocol.lost
+
+    run(main)
+
+
+def test_yields_between_rounds():
+    async def main(loop):
+        device = pyfake.FakeDevice()
+        counting = CountingLoop(loop)
+        protocol = Protocol()
+        total = pyfake.DRAIN_ROUNDS * pyfake.MAX_BATCH + 76
+        device.push(packets(total))
+        device.start_reading(counting, protocol)
+        await until(lambda: len(protocol.packets) == total)
+        await settle()
+        device.stop_reading()
+        assert protocol.packets == packets(total)
+        # After DRAIN_ROUNDS full batches the drain yields to the loop and carries on from there, not the thread.
+        assert device.stats()["batches"] == [pyfake.MAX_BATCH] * pyfake.DRAIN_ROUNDS + [76]
+        assert counting.threadsafe == 1 and counting.soon == 1
+
+    run(main)
+
+
+def test_threadsafe_call_per_batch():
+    async def main(loop):
+        device = pyfake.FakeDevice()
+        counting = CountingLoop(loop)
+        protocol = Protocol()
+        device.start_reading(counting, protocol)
+        await settle()
+        assert counting.threadsafe == 0
+        for burst in range(1, 6):
+            device.push(packets(10, 10 * (burst - 1)))
+            await until(lambda: len(protocol.packets) == 10 * burst)
+            await settle()
+            assert counting.threadsafe == burst
+        device.stop_reading()
+        assert protocol.packets == packets(50)
+        assert device.stats()["users"] == 0
+
+    run(main)
+
+
+def test_arriving_during_delivery():
+    async def main(loop):
+        device = pyfake.FakeDevice()
+        counting = CountingLoop(loop)
+
+        def on_packet(protocol, data):
+            if len(protocol.packets) == 1:
+                device.push(packets(5, 1))
+
+        protocol = Protocol(on_packet)
+        device.push(packets(1))
+        device.start_reading(counting, protocol)
+        # The read-wait event is signaled again while the drain runs, so the reader comes back for them.
+        await until(lambda: len(protocol.packets) == 6)
+        await settle()
+        device.stop_reading()
+        assert protocol.packets == packets(6)
+        assert counting.threadsafe == 2
+
+    run(main)
+
+
+def test_stop_from_data_received():
+    async def main(loop):
+        device = pyfake.FakeDevice()
+        counting = CountingLoop(loop)
+
+        def on_packet(protocol, data):
+            if len(protocol.packets) == 10:
+                device.stop_reading()
+                assert device.stats()["users"] == 0
+
+        protocol = Protocol(on_packet)
+        device.push(packets(300))
+        device.start_reading(counting, protocol)
+        await until(lambda: len(protocol.packets) == 10)
+        await settle()
+        # The rest of the batch was already off the ring, and is dropped rather than delivered to a protocol that quit.
+        stats = device.stats()
+        assert protocol.packets == packets(10)
+        assert stats["received"] == stats["released"] == pyfake.MAX_BATCH
+        assert stats["pending"] == 300 - pyfake.MAX_BATCH
+        assert stats["users"] == 0
+        assert counting.threadsafe == 1 and counting.soon == 0
+        device.stop_reading()
+
+        # Reading again picks up where the ring is.
+        restarted = Protocol()
+        device.start_reading(counting, restarted)
+        device.push(packets(1, 300))
+        await until(lambda: len(restarted.packets) == 300 - pyfake.MAX_BATCH + 1)
+        device.stop_reading()
+        assert restarted.packets == packets(300 - pyfake.MAX_BATCH + 1, pyfake.MAX_BATCH)
+        assert protocol.packets == packets(10)
+
+    run(main)
+
+
+def test_restart_from_data_received():
+    async def main(loop):
+        device = pyfake.FakeDevice()
+        counting = CountingLoop(loop)
+        second = Protocol()
+
+        def on_packet(protocol, data):
+            if len(protocol.packets) == 3:
+                device.stop_reading()
+                device.start_reading(counting, second)
+
+        first = Protocol(on_packet)
+        device.push(packets(20))
+        device.start_reading(counting, first)
+        await until(lambda: len(first.packets) == 3)
+        device.push(packets(5, 20))
+        await until(lambda: len(second.packets) == 5)
+        await settle()
+        device.stop_reading()
+        # The old drain must not hand the new protocol what is left of its batch.
+        assert first.packets == packets(3)
+        assert second.packets == packets(5, 20)
+        assert device.stats()["users"] == 0
+
+    run(main)
+
+
+def test_data_received_raises():
+    async def main(loop):
+        device = pyfake.FakeDevice()
+
+        def on_packet(protocol, data):
+            if len(protocol.packets) == 1:
+                raise ValueError("bad packet")
+
+        protocol = Protocol(on_packet)
+        device.push(packets(300))
+        device.start_reading(CountingLoop(loop), protocol)
+        # The loop reports the error, the rest of that batch is gone, and reading carries on with the ring.
+        await until(lambda: len(protocol.packets) == 1 + 300 - pyfake.MAX_BATCH)
+        await settle()
+        device.stop_reading()
+        assert protocol.packets == packets(1) + packets(300 - pyfake.MAX_BATCH, pyfake.MAX_BATCH)
+
+    errors = []
+    run(main, errors)
+    assert len(errors) == 1 and isinstance(errors[0]["exception"], ValueError)
+
+
+def test_connection_lost():
+    async def main(loop):
+        device = pyfake.FakeDevice()
+        counting = CountingLoop(loop)
+        protocol = Protocol()
+        device.push(packets(5))
+        device.start_reading(counting, protocol)
+        await until(lambda: len(protocol.packets) == 5)
+        device.fail(pyfake.ERROR_HANDLE_EOF)
+        await until(lambda: protocol.lost)
+        await settle()
+        assert len(protocol.lost) == 1 and isinstance(protocol.lost[0], pyfake.Error)
+        assert protocol.packets == packets(5)
+        # Reading stopped by itself, and the session reference went with it.
+        stats = device.stats()
+        assert stats["users"] == 0 and stats["released"] == 5
+        threadsafe = counting.threadsafe
+        device.push(packets(1))
+        await settle()
+        assert counting.threadsafe == threadsafe and len(protocol.packets) == 5
+        device.stop_reading()
+
+    run(main)
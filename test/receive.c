@@ -0,0 +1,377 @@
+/* SPDX-License-Identifier: GPL-2.0 OR MIT
+ *
+ * Copyright (C) 2018-2021 WireGuard LLC. All Rights Reserved.
+ */
+
+/* Receive batch policy of the driver, against a ring the test plays the client of: the batch size the adapter setting
+ * gives, a batch going up as soon as the ring runs dry, ends or turns out corrupt, packets that cannot go up counting
+ * against the batch all the same, and receive segment coalescing staying within a batch, per IP version, with every
+ * coalesced segment counting against the batch like the packet it came in as. */
+
+#include "../common/receive.h"
+#include "test.h"
+
+#define CAPACITY TUN_MIN_RING_CAPACITY
+#define MSS 100
+#define MAX_NBLS TUN_RECEIVE_BATCH_MAX
+
+static TUN_RING *Ring;
+static ULONG RingTail;
+
+/* Ring packets each NBL of the last batch carries */
+static ULONG NblPackets[MAX_NBLS];
+/* Ring offset of the packet whose NBL, or payload MDL, TunProcessReceiveData fails to allocate, if any */
+static ULONG FailNbl = CAPACITY, FailChain = CAPACITY;
+
+static void
+ResetRing(void)
+{
+    memset(Ring, 0, TUN_RING_SIZE(CAPACITY));
+    RingTail = 0;
+}
+
+/* Produces a packet of Size bytes at the ring tail. Returns its offset, for ReceiveBatch to find it by. */
+static ULONG
+Produce(const UCHAR *Data, ULONG Size)
+{
+    ULONG Offset = RingTail;
+    TUN_PACKET *Packet = TunRingPacketAt(Ring, Offset);
+    Packet->Size = Size;
+    memcpy(Packet->Data, Data, Size);
+    RingTail = TUN_RING_WRAP(Offset + TUN_ALIGN(sizeof(TUN_PACKET) + Size), CAPACITY);
+    Ring->Tail = RingTail;
+    return Offset;
+}
+
+/* Produces a UDP packet, which goes up on its own. */
+static ULONG
+ProduceUdp(UCHAR Version)
+{
+    UCHAR Packet[80] = { 0 };
+    ULONG Size = Version == 4 ? 48 : 68;
+    Packet[0] = Version == 4 ? 0x45 : 0x60;
+    if (Version == 4)
+    {
+        Packet[2] = (UCHAR)Size;
+        Packet[8] = 64;
+        Packet[9] = 17;
+    }
+    else
+    {
+        Packet[5] = (UCHAR)(Size - 40);
+        Packet[6] = 17;
+        Packet[7] = 64;
+    }
+    return Produce(Packet, Size);
+}
+
+/* Produces segment Index of a TCP flow over IP Version, with MSS bytes of payload, or Payload bytes and PSH set if it
+ * is the last. */
+static ULONG
+ProduceSegment(UCHAR Version, ULONG Index, int Last, ULONG Payload)
+{
+    UCHAR Packet[40 + 20 + MSS] = { 0 };
+    ULONG IpSize = Version == 4 ? 20 : 40, Size = IpSize + 20 + (Last ? Payload : MSS);
+    if (Version == 4)
+    {
+        Packet[0] = 0x45;
+        Packet[2] = (UCHAR)(Size >> 8), Packet[3] = (UCHAR)Size;
+        Packet[6] = 0x40; /* Don't fragment */
+        Packet[8] = 64;
+        Packet[9] = 6;
+        Packet[12] = 10, Packet[15] = 1, Packet[16] = 10, Packet[19] = 2;
+    }
+    else
+    {
+        Packet[0] = 0x60;
+        Packet[4] = (UCHAR)((Size - 40) >> 8), Packet[5] = (UCHAR)(Size - 40);
+        Packet[6] = 6;
+        Packet[7] = 64;
+        Packet[8] = 0xfd, Packet[23] = 1, Packet[24] = 0xfd, Packet[39] = 2;
+    }
+    UCHAR *Tcp = Packet + IpSize;
+    ULONG Sequence = Index * MSS;
+    Tcp[0] = 0x01, Tcp[1] = 0xBB, Tcp[2] = 0xC0, Tcp[3] = 0x00;
+    Tcp[4] = (UCHAR)(Sequence >> 24), Tcp[5] = (UCHAR)(Sequence >> 16);
+    Tcp[6] = (UCHAR)(Sequence >> 8), Tcp[7] = (UCHAR)Sequence;
+    Tcp[12] = 5 << 4;
+    Tcp[13] = TUN_RSC_TCP_ACK | (Last ? TUN_RSC_TCP_PSH : 0);
+    Tcp[14] = 0x01;
+    TestFill(Tcp + 20, Size - IpSize - 20);
+    CHECK(TunChecksumPacket(Packet, Size));
+    return Produce(Packet, Size);
+}
+
+/* Produces a flow of Count segments, the last carrying LastPayload bytes. Returns the offset of the first. */
+static ULONG
+ProduceFlow(UCHAR Version, ULONG First, ULONG Count, ULONG LastPayload)
+{
+    ULONG Offset = RingTail;
+    for (ULONG i = First; i < First + Count; ++i)
+        ProduceSegment(Version, i, i == First + Count - 1, LastPayload);
+    return Offset;
+}
+
+/* IP total length, or payload length plus the IPv6 header, as the packet at Offset says */
+static ULONG
+IpLength(ULONG Offset)
+{
+    const UCHAR *Data = TunRingPacketAt(Ring, Offset)->Data;
+    if (Data[0] >> 4 == 4)
+        return (ULONG)Data[2] << 8 | Data[3];
+    return 40 + ((ULONG)Data[4] << 8 | Data[5]);
+}
+
+/* Builds and indicates one batch the way TunProcessReceiveData does, with NBLs reduced to their packet counts, and
+ * returns the NBLs to move the ring head past it. Returns the status the batch ended on. */
+static TUN_RING_STATUS
+ReceiveBatch(TUN_RECEIVE_BATCH *Batch, ULONG Max, int RscIPv4, int RscIPv6)
+{
+    TunReceiveBatchBegin(Batch, Ring->Head, Ring->Tail, Max, RscIPv4, RscIPv6);
+    memset(NblPackets, 0, sizeof(NblPackets));
+    TUN_RING_STATUS Status;
+    TUN_PACKET *Packet;
+    ULONG PacketSize, Version;
+    while ((Status = TunReceiveBatchNext(Batch, Ring, CAPACITY, &Packet, &PacketSize, &Version)) == TUN_RING_OK)
+    {
+        ULONG PacketOffset = (ULONG)((UCHAR *)Packet - Ring->Data);
+        TUN_RSC_SEGMENT Segment;
+        if (TunReceiveBatchCoalesces(Batch, Packet->Data, PacketSize, &Segment) && PacketOffset != FailChain)
+        {
+            TunReceiveBatchAppend(Batch, &Segment);
+            NblPackets[Batch->Indicated - 1]++;
+            continue;
+        }
+        if (Batch->Coalescing)
+        {
+            ULONG Segments = TunReceiveBatchEndRsc(Batch);
+            CHECK(Segments == (NblPackets[Batch->Indicated - 1] > 1 ? NblPackets[Batch->Indicated - 1] : 0));
+        }
+        if (PacketOffset == FailNbl)
+            continue;
+        CHECK(Batch->Indicated < MAX_NBLS);
+        NblPackets[Batch->Indicated] = 1;
+        TunReceiveBatchAdd(Batch, Packet->Data, PacketSize, Version);
+    }
+    if (Batch->Coalescing)
+    {
+        ULONG Segments = TunReceiveBatchEndRsc(Batch);
+        CHECK(Segments == (NblPackets[Batch->Indicated - 1] > 1 ? NblPackets[Batch->Indicated - 1] : 0));
+    }
+    CHECK(!Batch->Coalescing);
+    ULONG Packets = 0;
+    for (ULONG i = 0; i < Batch->Indicated; ++i)
+        Packets += NblPackets[i];
+    CHECK(Packets == Batch->Packets && Batch->Packets <= Batch->Ring.Count && Batch->Ring.Count <= Max);
+    Ring->Head = Batch->Ring.Head;
+    return Status;
+}
+
+static void
+TestBatchSize(void)
+{
+    CHECK(TunReceiveBatchSize(0) == TUN_RECEIVE_BATCH_DEFAULT);
+    CHECK(TunReceiveBatchSize(1) == 1);
+    CHECK(TunReceiveBatchSize(TUN_RECEIVE_BATCH_DEFAULT + 1) == TUN_RECEIVE_BATCH_DEFAULT + 1);
+    CHECK(TunReceiveBatchSize(TUN_RECEIVE_BATCH_MAX) == TUN_RECEIVE_BATCH_MAX);
+    CHECK(TunReceiveBatchSize(TUN_RECEIVE_BATCH_MAX + 1) == TUN_RECEIVE_BATCH_DEFAULT);
+    CHECK(TunReceiveBatchSize(0xFFFFFFFF) == TUN_RECEIVE_BATCH_DEFAULT);
+}
+
+static void
+TestFlush(void)
+{
+    TUN_RECEIVE_BATCH Batch;
+
+    /* Nothing to indicate on an empty ring. */
+    ResetRing();
+    CHECK(ReceiveBatch(&Batch, TUN_RECEIVE_BATCH_DEFAULT, 0, 0) == TUN_RING_EMPTY);
+    CHECK(Batch.Indicated == 0 && Batch.Ring.Count == 0);
+
+    /* A full batch goes up, and so does what is left once the ring runs dry, whatever the batch size. */
+    static const ULONG Sizes[] = { 1, 4, TUN_RECEIVE_BATCH_DEFAULT, TUN_RECEIVE_BATCH_MAX };
+    for (ULONG s = 0; s < sizeof(Sizes) / sizeof(*Sizes); ++s)
+    {
+        ULONG Max = TunReceiveBatchSize(Sizes[s]), Total = 2 * Max + Max / 2 + 1, Received = 0, Batches = 0;
+        ResetRing();
+        for (ULONG i = 0; i < Total; ++i)
+            ProduceUdp(4);
+        while (Received < Total)
+        {
+            CHECK(ReceiveBatch(&Batch, Max, 0, 0) == TUN_RING_EMPTY);
+            CHECK(Batch.Indicated == (Total - Received < Max ? Total - Received : Max));
+            CHECK(Batch.Indicated == Batch.Packets && Batch.Packets == Batch.Ring.Count);
+            Received += Batch.Indicated;
+            if (++Batches > 3)
+                break;
+        }
+        CHECK(Batches == 3 && Received == Total && Ring->Head == RingTail);
+    }
+
+    /* Packets produced while the batch is being built join it, up to the batch size. */
+    ResetRing();
+    ProduceUdp(4);
+    TunReceiveBatchBegin(&Batch, Ring->Head, Ring->Tail, 3, 0, 0);
+    TUN_PACKET *Packet;
+    ULONG PacketSize, Version;
+    CHECK(TunReceiveBatchNext(&Batch, Ring, CAPACITY, &Packet, &PacketSize, &Version) == TUN_RING_OK);
+    TunReceiveBatchAdd(&Batch, Packet->Data, PacketSize, Version);
+    for (ULONG i = 0; i < 3; ++i)
+        ProduceUdp(4);
+    for (ULONG i = 0; i < 2; ++i)
+    {
+        CHECK(TunReceiveBatchNext(&Batch, Ring, CAPACITY, &Packet, &PacketSize, &Version) == TUN_RING_OK);
+        TunReceiveBatchAdd(&Batch, Packet->Data, PacketSize, Version);
+    }
+    CHECK(TunReceiveBatchNext(&Batch, Ring, CAPACITY, &Packet, &PacketSize, &Version) == TUN_RING_EMPTY);
+    CHECK(Batch.Indicated == 3 && Batch.Ring.Head != RingTail);
+
+    /* Packets that are not IP take up room in the batch, and are discarded. */
+    ResetRing();
+    ProduceUdp(4);
+    UCHAR Junk[16] = { 0x45 };
+    Produce(Junk, sizeof(Junk));
+    ProduceUdp(4);
+    CHECK(ReceiveBatch(&Batch, 2, 0, 0) == TUN_RING_EMPTY);
+    CHECK(Batch.Ring.Count == 2 && Batch.Indicated == 1 && Batch.Packets == 1);
+    CHECK(ReceiveBatch(&Batch, 2, 0, 0) == TUN_RING_EMPTY);
+    CHECK(Batch.Ring.Count == 1 && Batch.Indicated == 1 && Ring->Head == RingTail);
+
+    /* A batch of one IP version goes up as such, and a batch of both as mixed. */
+    ResetRing();
+    ProduceUdp(6);
+    ProduceUdp(6);
+    CHECK(ReceiveBatch(&Batch, 8, 0, 0) == TUN_RING_EMPTY);
+    CHECK(Batch.Indicated == 2 && Batch.Version == 6 && !Batch.Mixed);
+    ProduceUdp(6);
+    ProduceUdp(4);
+    CHECK(ReceiveBatch(&Batch, 8, 0, 0) == TUN_RING_EMPTY);
+    CHECK(Batch.Indicated == 2 && Batch.Version == 6 && Batch.Mixed);
+
+    /* The client tearing the ring down mid-batch: what came before goes up, and the thread gives up on the ring. */
+    ResetRing();
+    for (ULONG i = 0; i < 3; ++i)
+        ProduceUdp(4);
+    TunReceiveBatchBegin(&Batch, Ring->Head, Ring->Tail, 8, 0, 0);
+    Ring->Tail = CAPACITY;
+    for (ULONG i = 0; i < 3; ++i)
+    {
+        CHECK(TunReceiveBatchNext(&Batch, Ring, CAPACITY, &Packet, &PacketSize, &Version) == TUN_RING_OK);
+        TunReceiveBatchAdd(&Batch, Packet->Data, PacketSize, Version);
+    }
+    CHECK(TunReceiveBatchNext(&Batch, Ring, CAPACITY, &Packet, &PacketSize, &Version) == TUN_RING_EOF);
+    CHECK(Batch.Indicated == 3 && Batch.Ring.Head == RingTail);
+    ResetRing();
+    Ring->Tail = CAPACITY;
+    CHECK(ReceiveBatch(&Batch, 8, 0, 0) == TUN_RING_EOF && Batch.Indicated == 0);
+
+    /* A corrupt packet mid-batch: what came before goes up, and the head stays on it. */
+    ResetRing();
+    ProduceUdp(4);
+    ProduceUdp(4);
+    ULONG Bad = ProduceUdp(4);
+    ProduceUdp(4);
+    TunRingPacketAt(Ring, Bad)->Size = TUN_MAX_IP_PACKET_SIZE + 1;
+    CHECK(ReceiveBatch(&Batch, 8, 0, 0) == TUN_RING_CORRUPT);
+    CHECK(Batch.Indicated == 2 && Batch.Ring.Count == 2 && Ring->Head == Bad);
+}
+
+static void
+TestRsc(void)
+{
+    TUN_RECEIVE_BATCH Batch;
+
+    /* A flow within one batch goes up as one coalesced packet, each segment counting against the batch. */
+    for (UCHAR Version = 4; Version <= 6; Version += 2)
+    {
+        ULONG HeaderSize = (Version == 4 ? 20 : 40) + 20;
+        ResetRing();
+        ULONG First = ProduceFlow(Version, 0, 5, 30);
+        CHECK(ReceiveBatch(&Batch, 8, 1, 1) == TUN_RING_EMPTY);
+        CHECK(Batch.Indicated == 1 && Batch.Packets == 5 && Batch.Ring.Count == 5 && NblPackets[0] == 5);
+        CHECK(IpLength(First) == HeaderSize + 4 * MSS + 30);
+
+        /* Coalescing off for the IP version of the flow, or altogether: every segment goes up on its own. */
+        for (int OtherVersion = 1; OtherVersion >= 0; --OtherVersion)
+        {
+            ResetRing();
+            First = ProduceFlow(Version, 0, 5, 30);
+            int RscIPv4 = OtherVersion && Version == 6, RscIPv6 = OtherVersion && Version == 4;
+            CHECK(ReceiveBatch(&Batch, 8, RscIPv4, RscIPv6) == TUN_RING_EMPTY);
+            CHECK(Batch.Indicated == 5 && Batch.Packets == 5);
+            CHECK(IpLength(First) == HeaderSize + MSS);
+        }
+    }
+
+    /* A flow longer than the batch: the batch ends the coalesced packet, and the next batch starts another with the
+     * segment after it. */
+    ResetRing();
+    ULONG First = ProduceFlow(4, 0, 5, MSS);
+    ULONG Fourth = TUN_RING_WRAP(First + 3 * TUN_ALIGN(sizeof(TUN_PACKET) + 40 + MSS), CAPACITY);
+    CHECK(ReceiveBatch(&Batch, 3, 1, 1) == TUN_RING_EMPTY);
+    CHECK(Batch.Indicated == 1 && Batch.Packets == 3 && NblPackets[0] == 3 && Ring->Head == Fourth);
+    CHECK(IpLength(First) == 40 + 3 * MSS && IpLength(Fourth) == 40 + MSS);
+    CHECK(ReceiveBatch(&Batch, 3, 1, 1) == TUN_RING_EMPTY);
+    CHECK(Batch.Indicated == 1 && Batch.Packets == 2 && NblPackets[0] == 2 && Ring->Head == RingTail);
+    CHECK(IpLength(Fourth) == 40 + 2 * MSS);
+
+    /* A batch of one never coalesces. */
+    ResetRing();
+    First = ProduceFlow(4, 0, 3, MSS);
+    for (ULONG i = 0; i < 3; ++i)
+    {
+        CHECK(ReceiveBatch(&Batch, 1, 1, 1) == TUN_RING_EMPTY);
+        CHECK(Batch.Indicated == 1 && Batch.Packets == 1);
+    }
+    CHECK(IpLength(First) == 40 + MSS);
+
+    /* A packet that does not continue the flow ends the coalesced packet and goes up on its own. */
+    ResetRing();
+    First = ProduceFlow(4, 0, 2, MSS);
+    ProduceUdp(4);
+    ProduceSegment(4, 2, 0, MSS);
+    ProduceUdp(6);
+    CHECK(ReceiveBatch(&Batch, 8, 1, 1) == TUN_RING_EMPTY);
+    CHECK(Batch.Indicated == 4 && Batch.Packets == 5 && Batch.Mixed);
+    CHECK(NblPackets[0] == 2 && NblPackets[1] == 1 && NblPackets[2] == 1 && NblPackets[3] == 1);
+    CHECK(IpLength(First) == 40 + 2 * MSS);
+
+    /* Failing to chain a payload ends the coalesced packet, and the segment starts the next. */
+    ResetRing();
+    First = ProduceFlow(4, 0, 2, MSS);
+    FailChain = ProduceFlow(4, 2, 3, MSS);
+    CHECK(ReceiveBatch(&Batch, 8, 1, 1) == TUN_RING_EMPTY);
+    CHECK(Batch.Indicated == 2 && Batch.Packets == 5 && NblPackets[0] == 2 && NblPackets[1] == 3);
+    CHECK(IpLength(First) == 40 + 2 * MSS && IpLength(FailChain) == 40 + 3 * MSS);
+    FailChain = CAPACITY;
+
+    /* Failing to get an NBL for a packet that does not continue the flow still ends the coalesced packet, and the
+     * packet is discarded. */
+    ResetRing();
+    First = ProduceFlow(4, 0, 2, MSS);
+    FailNbl = ProduceUdp(4);
+    ProduceSegment(4, 2, 0, MSS);
+    CHECK(ReceiveBatch(&Batch, 8, 1, 1) == TUN_RING_EMPTY);
+    CHECK(Batch.Indicated == 2 && Batch.Packets == 3 && Batch.Ring.Count == 4);
+    CHECK(NblPackets[0] == 2 && NblPackets[1] == 1 && IpLength(First) == 40 + 2 * MSS);
+    FailNbl = CAPACITY;
+
+    /* A corrupt packet ends the batch, and the coalesced packet before it goes up. */
+    ResetRing();
+    First = ProduceFlow(4, 0, 3, MSS);
+    ULONG Bad = ProduceSegment(4, 3, 0, MSS);
+    TunRingPacketAt(Ring, Bad)->Size = TUN_MAX_IP_PACKET_SIZE + 1;
+    CHECK(ReceiveBatch(&Batch, 8, 1, 1) == TUN_RING_CORRUPT);
+    CHECK(Batch.Indicated == 1 && Batch.Packets == 3 && Ring->Head == Bad && IpLength(First) == 40 + 3 * MSS);
+}
+
+int
+main(void)
+{
+    Ring = calloc(1, TUN_RING_SIZE(CAPACITY));
+    RUN(TestBatchSize);
+    RUN(TestFlush);
+    RUN(TestRsc);
+    free(Ring);
+    TEST_EXIT();
+}
@@ -0,0 +1,326 @@
+/* SPDX-License-Identifier: GPL-2.0 OR MIT
+ *
+ * Copyright (C) 2018-2021 WireGuard LLC. All Rights Reserved.
+ */
+
+/* Multi-producer stress test of TunRingReserve and TunRingPublish, the way concurrent TunSendQueue calls use them.
+ * Producers write chains of variable-sized packets tagged with their producer and sequence number, into a ring small
+ * enough to wrap constantly and fill up now and then. The consumer checks that it never sees a tail past unwritten
+ * space, that each producer's packets arrive in order with none missing, and that every byte of every packet is
+ * intact. A second consumer does what a WINTUN_SESSION_SINGLE_CONSUMER client does without the ring lock: it takes
+ * batches with TunRingBatchTake, filtering some packets out, holds on to the packets for a while and releases them in
+ * random order, so the head only ever moves past packets that are released, never past ones still in use. */
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+
+static void Preempt(void);
+
+/* Producers waiting in TunRingPublish for a preempted predecessor give the CPU up instead of spinning it away, so the
+ * test stays quick on machines with fewer CPUs than threads. Producers also get preempted at random around the loads
+ * and the compare-and-swap in TunRingReserve, where a stale head would hand out space still in use. */
+#define TUN_RING_CPU_RELAX() sched_yield()
+#define TUN_RING_READ_ACQUIRE(Ptr) (Preempt(), __atomic_load_n((Ptr), __ATOMIC_ACQUIRE))
+#define TUN_RING_COMPARE_EXCHANGE(Ptr, Exchange, Comparand) \
+    (Preempt(), __sync_val_compare_and_swap((Ptr), (Comparand), (Exchange)))
+#include "../common/ring.h"
+#include "test.h"
+
+#define CAPACITY TUN_MIN_RING_CAPACITY
+#define PRODUCERS 4
+#define PACKETS_PER_PRODUCER 200000
+#define MAX_CHAIN 8
+#define HEADER_SIZE 8
+
+static TUN_RING *Ring;
+static volatile ULONG ReservedTail, PublishedTail;
+static volatile LONG Overflows, Stop;
+
+static UCHAR
+Pattern(ULONG Producer, ULONG Sequence, ULONG Offset)
+{
+    return (UCHAR)(Producer * 131 + Sequence * 7 + Offset);
+}
+
+static ULONG
+Random(ULONG *State)
+{
+    *State ^= *State << 13;
+    *State ^= *State >> 17;
+    *State ^= *State << 5;
+    return *State;
+}
+
+/* Yields now and then, so threads interleave at the points that matter even on a single CPU. Once in a while the
+ * producer stays away long enough for the others to go a lap around the ring. */
+static __thread ULONG PreemptState;
+
+static void
+Preempt(void)
+{
+    if (!PreemptState)
+        return;
+    ULONG Dice = Random(&PreemptState) % 512;
+    if (!Dice)
+        nanosleep(&(struct timespec){ .tv_nsec = 500000 }, NULL);
+    else if (Dice < 2)
+        sched_yield();
+}
+
+static void *
+Producer(void *Context)
+{
+    ULONG Id = (ULONG)(size_t)Context, State = 0x9E3779B9 * (Id + 1), Sequence = 0;
+    PreemptState = State ^ 0x5A5A5A5A;
+    while (Sequence < PACKETS_PER_PRODUCER)
+    {
+        ULONG Sizes[MAX_CHAIN], Count = 1 + Random(&State) % MAX_CHAIN, Required = 0;
+        if (Count > PACKETS_PER_PRODUCER - Sequence)
+            Count = PACKETS_PER_PRODUCER - Sequence;
+        for (ULONG i = 0; i < Count; ++i)
+        {
+            /* Mostly small packets, now and then a large one to make the reservation straddle the wrap point. */
+            Sizes[i] = HEADER_SIZE + (Random(&State) % 16 ? Random(&State) % 200 : Random(&State) % 9000);
+            Required += TUN_ALIGN(sizeof(TUN_PACKET) + Sizes[i]);
+        }
+        ULONG Start;
+        if (!TunRingReserve(&ReservedTail, &Ring->Head, CAPACITY, Required, &Start))
+        {
+            __atomic_fetch_add(&Overflows, 1, __ATOMIC_RELAXED);
+            if (TUN_RING_READ_ACQUIRE_LONG(&Stop))
+                break;
+            sched_yield();
+            continue;
+        }
+        ULONG Offset = TUN_RING_WRAP(Start, CAPACITY);
+        for (ULONG i = 0; i < Count; ++i, ++Sequence)
+        {
+            Preempt();
+            TUN_PACKET *Packet = TunRingPacketAt(Ring, Offset);
+            Packet->Size = Sizes[i];
+            memcpy(Packet->Data, &Id, sizeof(Id));
+            memcpy(Packet->Data + sizeof(Id), &Sequence, sizeof(Sequence));
+            for (ULONG Byte = HEADER_SIZE; Byte < Sizes[i]; ++Byte)
+                Packet->Data[Byte] = Pattern(Id, Sequence, Byte);
+            Offset = TUN_RING_WRAP(Offset + TUN_ALIGN(sizeof(TUN_PACKET) + Sizes[i]), CAPACITY);
+        }
+        TunRingPublish(Ring, CAPACITY, &PublishedTail, Start, Start + Required);
+    }
+    return NULL;
+}
+
+static void
+TestStress(void)
+{
+    Ring = calloc(1, TUN_RING_SIZE(CAPACITY));
+    /* Start just short of the wrap point, and with the free-running tails a few laps in. */
+    Ring->Head = Ring->Tail = CAPACITY - 256;
+    ReservedTail = PublishedTail = 3 * CAPACITY + Ring->Tail;
+
+    pthread_t Threads[PRODUCERS];
+    for (size_t i = 0; i < PRODUCERS; ++i)
+        CHECK(!pthread_create(&Threads[i], NULL, Producer, (void *)i));
+
+    ULONG Expected[PRODUCERS] = { 0 }, Received = 0, Head = Ring->Head, Errors = 0;
+    while (Received < PRODUCERS * PACKETS_PER_PRODUCER && Errors < 10)
+    {
+        ULONG Tail = TUN_RING_READ_ACQUIRE(&Ring->Tail);
+        if (Head == Tail)
+        {
+            sched_yield();
+            continue;
+        }
+        while (Head != Tail && Errors < 10)
+        {
+            TUN_PACKET *Packet;
+            ULONG Size, Aligned, Id, Sequence;
+            if (TunRingPeekPacket(Ring, CAPACITY, Head, Tail, &Packet, &Size, &Aligned) != TUN_RING_OK)
+            {
+                fprintf(stderr, "bad packet at %u, tail %u\n", Head, Tail);
+                ++Errors;
+                break;
+            }
+            memcpy(&Id, Packet->Data, sizeof(Id));
+            memcpy(&Sequence, Packet->Data + sizeof(Id), sizeof(Sequence));
+            if (Id >= PRODUCERS || Sequence != Expected[Id])
+            {
+                fprintf(stderr, "producer %u sequence %u out of order\n", Id, Sequence);
+                ++Errors;
+                break;
+            }
+            for (ULONG Byte = HEADER_SIZE; Byte < Size; ++Byte)
+            {
+                if (Packet->Data[Byte] != Pattern(Id, Sequence, Byte))
+                {
+                    fprintf(stderr, "producer %u sequence %u corrupt at byte %u\n", Id, Sequence, Byte);
+                    ++Errors;
+                    break;
+                }
+            }
+            /* Poison the packet before handing its space back, so a producer that skipped writing it shows up. */
+            memset(Packet, 0xEE, Aligned);
+            Expected[Id]++;
+            Received++;
+            Head = TUN_RING_WRAP(Head + Aligned, CAPACITY);
+        }
+        TUN_RING_WRITE_RELEASE(&Ring->Head, Head);
+        /* Let the producers catch up, so they keep running into a full ring. */
+        sched_yield();
+    }
+    CHECK(!Errors);
+    TUN_RING_WRITE_RELEASE_LONG(&Stop, 1);
+    for (size_t i = 0; i < PRODUCERS; ++i)
+        pthread_join(Threads[i], NULL);
+    for (ULONG i = 0; i < PRODUCERS; ++i)
+        CHECK(Expected[i] == PACKETS_PER_PRODUCER);
+    CHECK(PublishedTail == ReservedTail);
+    CHECK(TUN_RING_WRAP(PublishedTail, CAPACITY) == Ring->Tail);
+    printf("%u packets, %d overflows\n", Received, Overflows);
+    free(Ring);
+}
+
+/* The receive filter of the single consumer: every fifth packet of each producer is rejected. */
+static int
+AcceptPacket(const void *Context, const UCHAR *Data, ULONG Size)
+{
+    ULONG Sequence;
+    (void)Context;
+    (void)Size;
+    memcpy(&Sequence, Data + sizeof(ULONG), sizeof(Sequence));
+    return Sequence % 5 != 0;
+}
+
+static int
+CheckPacket(const UCHAR *Data, ULONG Size, ULONG Id, ULONG Sequence)
+{
+    for (ULONG Byte = HEADER_SIZE; Byte < Size; ++Byte)
+    {
+        if (Data[Byte] != Pattern(Id, Sequence, Byte))
+        {
+            fprintf(stderr, "producer %u sequence %u corrupt at byte %u\n", Id, Sequence, Byte);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* WintunReceivePackets, WintunReleaseReceivePacket and the receive filter, as the single consumer runs them. */
+static void
+TestSingleConsumer(void)
+{
+    Ring = calloc(1, TUN_RING_SIZE(CAPACITY));
+    Ring->Head = Ring->Tail = CAPACITY - 256;
+    ReservedTail = PublishedTail = Ring->Tail;
+    Overflows = Stop = 0;
+
+    pthread_t Threads[PRODUCERS];
+    for (size_t i = 0; i < PRODUCERS; ++i)
+        CHECK(!pthread_create(&Threads[i], NULL, Producer, (void *)i));
+
+    /* Held packets cannot outnumber what fits between head and tail. */
+    static UCHAR *Held[CAPACITY / TUN_ALIGN(sizeof(TUN_PACKET) + HEADER_SIZE)];
+    ULONG Expected[PRODUCERS] = { 0 }, Received = 0, Errors = 0, HeldCount = 0, State = 0x1234567;
+    ULONG Head = Ring->Head, HeadRelease = Head, PacketsToRelease = 0;
+    ULONG64 Filtered = 0, Publishes = 0;
+    PreemptState = 0xC0FFEE;
+    while ((Received < PRODUCERS * PACKETS_PER_PRODUCER || HeldCount) && Errors < 10)
+    {
+        UCHAR *Packets[32];
+        ULONG Sizes[32], Skipped = 0;
+        TUN_RING_BATCH Batch;
+        TunRingBatchBegin(&Batch, Head, TUN_RING_READ_ACQUIRE(&Ring->Tail), 1 + Random(&State) % 32);
+        TUN_RING_STATUS Status =
+            TunRingBatchTake(&Batch, Ring, CAPACITY, 0, AcceptPacket, NULL, Packets, Sizes, &Skipped);
+        if (Status != TUN_RING_EMPTY)
+        {
+            fprintf(stderr, "bad packet at %u\n", Batch.Head);
+            ++Errors;
+            break;
+        }
+        Head = Batch.Head;
+        PacketsToRelease += Batch.Count + Skipped;
+        Filtered += Skipped;
+        for (ULONG i = 0; i < Batch.Count; ++i)
+        {
+            ULONG Id, Sequence;
+            memcpy(&Id, Packets[i], sizeof(Id));
+            memcpy(&Sequence, Packets[i] + sizeof(Id), sizeof(Sequence));
+            if (Id < PRODUCERS && Expected[Id] % 5 == 0 && Sequence == Expected[Id] + 1)
+                Expected[Id]++;
+            if (Id >= PRODUCERS || Sequence != Expected[Id])
+            {
+                fprintf(stderr, "producer %u sequence %u out of order\n", Id, Sequence);
+                ++Errors;
+                break;
+            }
+            Expected[Id]++;
+            Held[HeldCount++] = Packets[i];
+        }
+        Received += Batch.Count + Skipped;
+
+        /* Filtered packets are released on the way, and moving the head over them is up to the consumer. */
+        ULONG Release = HeldCount ? Random(&State) % (HeldCount + 1) : 0;
+        if (Skipped || Release)
+        {
+            for (; Release; --Release)
+            {
+                ULONG Index = Random(&State) % HeldCount;
+                UCHAR *Data = Held[Index];
+                Held[Index] = Held[--HeldCount];
+                TUN_PACKET *Packet = (TUN_PACKET *)(Data - offsetof(TUN_PACKET, Data));
+                ULONG Id, Sequence;
+                memcpy(&Id, Data, sizeof(Id));
+                memcpy(&Sequence, Data + sizeof(Id), sizeof(Sequence));
+                if (!CheckPacket(Data, Packet->Size, Id, Sequence))
+                {
+                    ++Errors;
+                    break;
+                }
+                Packet->Size |= TUN_PACKET_RELEASE;
+            }
+            ULONG NewHeadRelease = TunRingAdvanceReleased(Ring, CAPACITY, HeadRelease, &PacketsToRelease);
+            if (NewHeadRelease != HeadRelease)
+            {
+                /* Poison what the head moves over, so a packet still held that the head passed shows up. */
+                for (ULONG Offset = HeadRelease; Offset != NewHeadRelease;)
+                {
+                    TUN_PACKET *Packet = TunRingPacketAt(Ring, Offset);
+                    ULONG Aligned = TUN_ALIGN(sizeof(TUN_PACKET) + (Packet->Size & TUN_PACKET_SIZE_MASK));
+                    memset(Packet, 0xEE, Aligned);
+                    Offset = TUN_RING_WRAP(Offset + Aligned, CAPACITY);
+                }
+                HeadRelease = NewHeadRelease;
+                TUN_RING_WRITE_RELEASE(&Ring->Head, HeadRelease);
+                ++Publishes;
+            }
+        }
+        if (!Batch.Count)
+            sched_yield();
+    }
+    PreemptState = 0;
+    CHECK(!Errors);
+    CHECK(!PacketsToRelease && HeadRelease == Head && Head == Ring->Tail);
+    TUN_RING_WRITE_RELEASE_LONG(&Stop, 1);
+    for (size_t i = 0; i < PRODUCERS; ++i)
+        pthread_join(Threads[i], NULL);
+    for (ULONG i = 0; i < PRODUCERS; ++i)
+        CHECK(Expected[i] == PACKETS_PER_PRODUCER);
+    CHECK(Filtered == PRODUCERS * (PACKETS_PER_PRODUCER / 5));
+    printf(
+        "%u packets, %llu filtered, %llu head moves, %d overflows\n",
+        Received,
+        (unsigned long long)Filtered,
+        (unsigned long long)Publishes,
+        Overflows);
+    free(Ring);
+}
+
+int
+main(void)
+{
+    RUN(TestStress);
+    RUN(TestSingleConsumer);
+    TEST_EXIT();
+}
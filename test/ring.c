@@ -0,0 +1,313 @@
+/* SPDX-License-Identifier: GPL-2.0 OR MIT
+ *
+ * Copyright (C) 2018-2021 WireGuard LLC. All Rights Reserved.
+ */
+
+/* Ring layout shared by the driver and the API, and the single-threaded behavior of the ring helpers: wrapping, packet
+ * validation, batches, release and commit runs, and reservation. */
+
+#include "../common/ring.h"
+#include "test.h"
+
+#define CAPACITY TUN_MIN_RING_CAPACITY
+
+static TUN_RING *
+NewRing(void)
+{
+    return calloc(1, TUN_RING_SIZE(CAPACITY));
+}
+
+/* Writes a packet of Size bytes, filled with Fill, at Offset. Returns the offset of the next packet. */
+static ULONG
+PutPacket(TUN_RING *Ring, ULONG Offset, ULONG Size, UCHAR Fill)
+{
+    TUN_PACKET *Packet = TunRingPacketAt(Ring, Offset);
+    Packet->Size = Size;
+    memset(Packet->Data, Fill, Size);
+    return TUN_RING_WRAP(Offset + TUN_ALIGN(sizeof(TUN_PACKET) + Size), CAPACITY);
+}
+
+/* The driver and every client built against an older wintun.h must agree on these. */
+static void
+TestLayout(void)
+{
+    CHECK(sizeof(TUN_PACKET) == 4);
+    CHECK(offsetof(TUN_PACKET, Data) == 4);
+    CHECK(sizeof(TUN_RING) == 12);
+    CHECK(offsetof(TUN_RING, Head) == 0);
+    CHECK(offsetof(TUN_RING, Tail) == 4);
+    CHECK(offsetof(TUN_RING, Alertable) == 8);
+    CHECK(offsetof(TUN_RING, Data) == 12);
+    CHECK(TUN_MAX_PACKET_SIZE == 0x10004);
+    CHECK(TUN_RING_SIZE(CAPACITY) == 12 + CAPACITY + 0x10000);
+    CHECK(TUN_RING_CAPACITY(TUN_RING_SIZE(CAPACITY)) == CAPACITY);
+    CHECK(TUN_RING_CAPACITY(TUN_RING_SIZE(TUN_MAX_RING_CAPACITY)) == TUN_MAX_RING_CAPACITY);
+    CHECK(TUN_ALIGN(0) == 0 && TUN_ALIGN(1) == 4 && TUN_ALIGN(4) == 4 && TUN_ALIGN(5) == 8);
+    CHECK(TUN_IS_ALIGNED(8) && !TUN_IS_ALIGNED(6));
+    CHECK(TUN_PACKET_GSO_MSS((1460 << TUN_PACKET_GSO_SHIFT) | 1500) == 1460);
+}
+
+static void
+TestCapacity(void)
+{
+    CHECK(TunRingIsValidCapacity(TUN_MIN_RING_CAPACITY));
+    CHECK(TunRingIsValidCapacity(TUN_MAX_RING_CAPACITY));
+    CHECK(!TunRingIsValidCapacity(TUN_MIN_RING_CAPACITY / 2));
+    CHECK(!TunRingIsValidCapacity(TUN_MAX_RING_CAPACITY * 2));
+    CHECK(!TunRingIsValidCapacity(TUN_MIN_RING_CAPACITY + TUN_ALIGNMENT));
+}
+
+static void
+TestSpaceAndContent(void)
+{
+    /* One slot always stays free, so a full ring is told apart from an empty one. */
+    CHECK(TunRingSpace(0, 0, CAPACITY) == CAPACITY - TUN_ALIGNMENT);
+    CHECK(TunRingContent(0, 0, CAPACITY) == 0);
+    CHECK(TunRingSpace(0, CAPACITY - TUN_ALIGNMENT, CAPACITY) == 0);
+    CHECK(TunRingContent(0, CAPACITY - TUN_ALIGNMENT, CAPACITY) == CAPACITY - TUN_ALIGNMENT);
+    /* Tail wrapped past the end while the head has not. */
+    CHECK(TunRingContent(CAPACITY - 16, 8, CAPACITY) == 24);
+    CHECK(TunRingSpace(CAPACITY - 16, 8, CAPACITY) == CAPACITY - 24 - TUN_ALIGNMENT);
+    /* Free-running offsets give the same answers as wrapped ones. */
+    CHECK(TunRingSpace(CAPACITY - 16, 5 * CAPACITY + 8, CAPACITY) == TunRingSpace(CAPACITY - 16, 8, CAPACITY));
+    CHECK(TUN_RING_WRAP(CAPACITY + 12, CAPACITY) == 12);
+}
+
+static void
+TestPeek(void)
+{
+    TUN_RING *Ring = NewRing();
+    TUN_PACKET *Packet;
+    ULONG Size, Aligned, Mss = 0;
+
+    CHECK(TunRingPeekPacket(Ring, CAPACITY, 0, 0, &Packet, &Size, &Aligned) == TUN_RING_EMPTY);
+    CHECK(TunRingPeekPacket(Ring, CAPACITY, CAPACITY, 0, &Packet, &Size, &Aligned) == TUN_RING_EOF);
+    CHECK(TunRingPeekPacket(Ring, CAPACITY, 0, CAPACITY, &Packet, &Size, &Aligned) == TUN_RING_EOF);
+
+    ULONG Tail = PutPacket(Ring, 0, 61, 0xAA);
+    CHECK(Tail == 68);
+    CHECK(TunRingPeekPacket(Ring, CAPACITY, 0, Tail, &Packet, &Size, &Aligned) == TUN_RING_OK);
+    CHECK(Packet == TunRingPacketAt(Ring, 0) && Size == 61 && Aligned == 68);
+    /* A tail short of the whole packet, or of its size field, means the ring is inconsistent. */
+    CHECK(TunRingPeekPacket(Ring, CAPACITY, 0, 64, &Packet, &Size, &Aligned) == TUN_RING_CORRUPT);
+    CHECK(TunRingPeekPacket(Ring, CAPACITY, 0, 2, &Packet, &Size, &Aligned) == TUN_RING_CORRUPT);
+    TunRingPacketAt(Ring, 0)->Size = TUN_MAX_IP_PACKET_SIZE + 1;
+    CHECK(TunRingPeekPacket(Ring, CAPACITY, 0, Tail, &Packet, &Size, &Aligned) == TUN_RING_CORRUPT);
+
+    /* A packet starting near the end runs on into the slack after capacity instead of wrapping. */
+    ULONG Head = CAPACITY - 8;
+    Tail = PutPacket(Ring, Head, 1500, 0x55);
+    CHECK(Tail == TUN_ALIGN(sizeof(TUN_PACKET) + 1500) - 8);
+    CHECK(TunRingPeekPacket(Ring, CAPACITY, Head, Tail, &Packet, &Size, &Aligned) == TUN_RING_OK);
+    CHECK(Size == 1500 && Packet->Data[1499] == 0x55);
+    CHECK(TUN_RING_WRAP(Head + Aligned, CAPACITY) == Tail);
+
+    /* GSO sizes are only accepted by the GSO-aware peek. */
+    TunRingPacketAt(Ring, 0)->Size = (1400 << TUN_PACKET_GSO_SHIFT) | 3000;
+    Tail = TUN_ALIGN(sizeof(TUN_PACKET) + 3000);
+    CHECK(TunRingPeekPacket(Ring, CAPACITY, 0, Tail, &Packet, &Size, &Aligned) == TUN_RING_CORRUPT);
+    CHECK(TunRingPeekPacketGso(Ring, CAPACITY, 0, Tail, &Packet, &Size, &Aligned, &Mss) == TUN_RING_OK);
+    CHECK(Size == 3000 && Mss == 1400);
+    free(Ring);
+}
+
+static void
+TestBatch(void)
+{
+    TUN_RING *Ring = NewRing();
+    TUN_RING_BATCH Batch;
+    TUN_PACKET *Packet;
+    ULONG Size, Tail = CAPACITY - 256;
+
+    /* Five packets across the wrap point, taken three at a time. */
+    ULONG Head = Tail;
+    for (ULONG i = 0; i < 5; ++i)
+        Tail = PutPacket(Ring, Tail, 60 + i, (UCHAR)i);
+    Ring->Tail = Tail;
+    TunRingBatchBegin(&Batch, Head, Head, 3);
+    for (ULONG i = 0; i < 3; ++i)
+    {
+        CHECK(TunRingBatchNext(&Batch, Ring, CAPACITY, &Packet, &Size) == TUN_RING_OK);
+        CHECK(Size == 60 + i && Packet->Data[0] == i);
+    }
+    CHECK(TunRingBatchNext(&Batch, Ring, CAPACITY, &Packet, &Size) == TUN_RING_EMPTY);
+    CHECK(Batch.Count == 3);
+
+    /* The next batch rereads the tail once it runs out, picking up a packet produced meanwhile. */
+    TunRingBatchBegin(&Batch, Batch.Head, Batch.Tail, 16);
+    CHECK(TunRingBatchNext(&Batch, Ring, CAPACITY, &Packet, &Size) == TUN_RING_OK && Size == 63);
+    Tail = PutPacket(Ring, Tail, 100, 9);
+    Ring->Tail = Tail;
+    CHECK(TunRingBatchNext(&Batch, Ring, CAPACITY, &Packet, &Size) == TUN_RING_OK && Size == 64);
+    CHECK(TunRingBatchNext(&Batch, Ring, CAPACITY, &Packet, &Size) == TUN_RING_OK && Size == 100);
+    CHECK(TunRingBatchNext(&Batch, Ring, CAPACITY, &Packet, &Size) == TUN_RING_EMPTY);
+    CHECK(Batch.Head == Tail && Batch.Count == 3);
+
+    /* A corrupt packet stops the batch on it. */
+    ULONG Bad = Batch.Head;
+    TunRingPacketAt(Ring, Bad)->Size = 0x20000;
+    Ring->Tail = TUN_RING_WRAP(Bad + 64, CAPACITY);
+    TunRingBatchBegin(&Batch, Bad, Bad, 16);
+    CHECK(TunRingBatchNext(&Batch, Ring, CAPACITY, &Packet, &Size) == TUN_RING_CORRUPT);
+    CHECK(Batch.Head == Bad && Batch.Count == 0);
+    free(Ring);
+}
+
+static int
+AcceptOdd(const void *Context, const UCHAR *Data, ULONG Size)
+{
+    (void)Context;
+    (void)Data;
+    return Size & 1;
+}
+
+/* WintunReceivePackets: a batch ends early at the observed tail or on a bad packet, returning what it took so far. */
+static void
+TestBatchTake(void)
+{
+    TUN_RING *Ring = NewRing();
+    TUN_RING_BATCH Batch;
+    UCHAR *Packets[8];
+    ULONG Sizes[8], Skipped = 0, Offsets[6], Tail = CAPACITY - 200;
+
+    for (ULONG i = 0; i < 6; ++i)
+    {
+        Offsets[i] = Tail;
+        Tail = PutPacket(Ring, Tail, 41 + i, (UCHAR)i);
+    }
+    Ring->Tail = Tail;
+
+    /* Full batch: stops at Max with packets left. */
+    TunRingBatchBegin(&Batch, Offsets[0], Tail, 4);
+    CHECK(TunRingBatchTake(&Batch, Ring, CAPACITY, 0, NULL, NULL, Packets, Sizes, &Skipped) == TUN_RING_EMPTY);
+    CHECK(Batch.Count == 4 && Batch.Head == Offsets[4] && !Skipped);
+    CHECK(Batch.Bytes == 41 + 42 + 43 + 44 && Batch.Mixed);
+    for (ULONG i = 0; i < 4; ++i)
+        CHECK(Sizes[i] == 41 + i && Packets[i] == TunRingPacketAt(Ring, Offsets[i])->Data && Packets[i][0] == i);
+
+    /* Partial batch: the tail observed before the batch bounds it, even though the producer has moved on. */
+    TunRingBatchBegin(&Batch, Batch.Head, Tail, 8);
+    Ring->Tail = PutPacket(Ring, Tail, 100, 0);
+    CHECK(TunRingBatchTake(&Batch, Ring, CAPACITY, 0, NULL, NULL, Packets, Sizes, &Skipped) == TUN_RING_EMPTY);
+    CHECK(Batch.Count == 2 && Batch.Head == Tail && Sizes[0] == 45 && Sizes[1] == 46);
+
+    /* Rejected packets are marked released and skipped, without counting against the batch. */
+    TunRingBatchBegin(&Batch, Offsets[0], Tail, 2);
+    CHECK(TunRingBatchTake(&Batch, Ring, CAPACITY, 0, AcceptOdd, NULL, Packets, Sizes, &Skipped) == TUN_RING_EMPTY);
+    CHECK(Batch.Count == 2 && Sizes[0] == 41 && Sizes[1] == 43 && Skipped == 1 && Batch.Head == Offsets[3]);
+    CHECK(Batch.Bytes == 41 + 43);
+    CHECK(TunRingPacketAt(Ring, Offsets[1])->Size == (42 | TUN_PACKET_RELEASE));
+    CHECK(!(TunRingPacketAt(Ring, Offsets[2])->Size & TUN_PACKET_RELEASE));
+    TunRingPacketAt(Ring, Offsets[1])->Size = 42;
+
+    /* Invalid data mid-batch: the packets before it are returned, and the head stays on it for the next batch. */
+    TunRingPacketAt(Ring, Offsets[3])->Size = 0x20000;
+    Skipped = 0;
+    TunRingBatchBegin(&Batch, Offsets[0], Tail, 8);
+    CHECK(TunRingBatchTake(&Batch, Ring, CAPACITY, 0, NULL, NULL, Packets, Sizes, &Skipped) == TUN_RING_CORRUPT);
+    CHECK(Batch.Count == 3 && Batch.Head == Offsets[3]);
+    TunRingBatchBegin(&Batch, Batch.Head, Tail, 8);
+    CHECK(TunRingBatchTake(&Batch, Ring, CAPACITY, 0, NULL, NULL, Packets, Sizes, &Skipped) == TUN_RING_CORRUPT);
+    CHECK(Batch.Count == 0 && Batch.Head == Offsets[3]);
+
+    /* Super-packets are invalid data unless the client asked for them. */
+    TunRingPacketAt(Ring, Offsets[3])->Size = (1000 << TUN_PACKET_GSO_SHIFT) | 44;
+    TunRingBatchBegin(&Batch, Offsets[2], Tail, 8);
+    CHECK(TunRingBatchTake(&Batch, Ring, CAPACITY, 0, NULL, NULL, Packets, Sizes, &Skipped) == TUN_RING_CORRUPT);
+    CHECK(Batch.Count == 1 && Batch.Head == Offsets[3]);
+    TunRingBatchBegin(&Batch, Offsets[2], Tail, 8);
+    CHECK(TunRingBatchTake(&Batch, Ring, CAPACITY, 1, NULL, NULL, Packets, Sizes, &Skipped) == TUN_RING_EMPTY);
+    CHECK(Batch.Count == 4 && Sizes[1] == 44 && Batch.Head == Tail);
+
+    /* A tail the driver invalidated on teardown ends the batch before any packet. */
+    TunRingBatchBegin(&Batch, Offsets[0], CAPACITY, 8);
+    CHECK(TunRingBatchTake(&Batch, Ring, CAPACITY, 0, NULL, NULL, Packets, Sizes, &Skipped) == TUN_RING_EOF);
+    CHECK(Batch.Count == 0 && Batch.Head == Offsets[0]);
+
+    /* An empty batch takes nothing, which is why WintunReceivePackets refuses a zero MaxCount up front. */
+    TunRingBatchBegin(&Batch, Offsets[0], Tail, 0);
+    CHECK(TunRingBatchTake(&Batch, Ring, CAPACITY, 0, NULL, NULL, Packets, Sizes, &Skipped) == TUN_RING_EMPTY);
+    CHECK(Batch.Count == 0 && Batch.Head == Offsets[0]);
+    free(Ring);
+}
+
+static void
+TestReleaseAndCommit(void)
+{
+    TUN_RING *Ring = NewRing();
+    ULONG Offsets[5], Tail = CAPACITY - 128;
+
+    for (ULONG i = 0; i < 5; ++i)
+    {
+        Offsets[i] = Tail;
+        Tail = PutPacket(Ring, Tail, 40 + i, 0);
+    }
+    /* Released out of order: the head only moves over the leading run. */
+    TunRingPacketAt(Ring, Offsets[0])->Size |= TUN_PACKET_RELEASE;
+    TunRingPacketAt(Ring, Offsets[1])->Size |= TUN_PACKET_RELEASE;
+    TunRingPacketAt(Ring, Offsets[3])->Size |= TUN_PACKET_RELEASE;
+    ULONG Pending = 5;
+    ULONG Cursor = TunRingAdvanceReleased(Ring, CAPACITY, Offsets[0], &Pending);
+    CHECK(Cursor == Offsets[2] && Pending == 3);
+    TunRingPacketAt(Ring, Offsets[2])->Size |= TUN_PACKET_RELEASE;
+    TunRingPacketAt(Ring, Offsets[4])->Size |= TUN_PACKET_RELEASE;
+    Cursor = TunRingAdvanceReleased(Ring, CAPACITY, Cursor, &Pending);
+    CHECK(Cursor == Tail && Pending == 0);
+
+    /* Allocated send packets carry the bit until they are sent; the tail only moves over the leading sent run. */
+    for (ULONG i = 0; i < 5; ++i)
+        TunRingPacketAt(Ring, Offsets[i])->Size = (40 + i) | TUN_PACKET_RELEASE;
+    TunRingPacketAt(Ring, Offsets[0])->Size &= ~TUN_PACKET_RELEASE;
+    TunRingPacketAt(Ring, Offsets[2])->Size &= ~TUN_PACKET_RELEASE;
+    Pending = 5;
+    Cursor = TunRingAdvanceCommitted(Ring, CAPACITY, Offsets[0], &Pending);
+    CHECK(Cursor == Offsets[1] && Pending == 4);
+    for (ULONG i = 1; i < 5; ++i)
+        TunRingPacketAt(Ring, Offsets[i])->Size &= ~TUN_PACKET_RELEASE;
+    Cursor = TunRingAdvanceCommitted(Ring, CAPACITY, Cursor, &Pending);
+    CHECK(Cursor == Tail && Pending == 0);
+    free(Ring);
+}
+
+static void
+TestReserveAndPublish(void)
+{
+    TUN_RING *Ring = NewRing();
+    ULONG Start, Start2;
+
+    /* Private tails run free from the ring tail; publishing stores the wrapped value into the ring. */
+    Ring->Head = Ring->Tail = CAPACITY - 64;
+    volatile ULONG Reserved = 7 * CAPACITY + Ring->Tail, Published = Reserved;
+    CHECK(TunRingReserve(&Reserved, &Ring->Head, CAPACITY, 128, &Start));
+    CHECK(Start == 7 * CAPACITY + CAPACITY - 64 && Reserved == Start + 128);
+    CHECK(TunRingReserve(&Reserved, &Ring->Head, CAPACITY, 256, &Start2));
+    CHECK(Start2 == Start + 128);
+    TunRingPublish(Ring, CAPACITY, &Published, Start, Start + 128);
+    CHECK(Ring->Tail == 64 && Published == Start + 128);
+    TunRingPublish(Ring, CAPACITY, &Published, Start2, Start2 + 256);
+    CHECK(Ring->Tail == 64 + 256);
+
+    /* Space runs out one slot short of the head, and comes back as the head moves. */
+    ULONG Space = TunRingSpace(Ring->Head, Reserved, CAPACITY);
+    CHECK(Space == CAPACITY - 384 - TUN_ALIGNMENT);
+    CHECK(!TunRingReserve(&Reserved, &Ring->Head, CAPACITY, Space + TUN_ALIGNMENT, &Start));
+    CHECK(TunRingReserve(&Reserved, &Ring->Head, CAPACITY, Space, &Start));
+    CHECK(!TunRingReserve(&Reserved, &Ring->Head, CAPACITY, TUN_ALIGNMENT, &Start2));
+    Ring->Head = 0;
+    CHECK(TunRingReserve(&Reserved, &Ring->Head, CAPACITY, 64 - TUN_ALIGNMENT, &Start2));
+    free(Ring);
+}
+
+int
+main(void)
+{
+    RUN(TestLayout);
+    RUN(TestCapacity);
+    RUN(TestSpaceAndContent);
+    RUN(TestPeek);
+    RUN(TestBatch);
+    RUN(TestBatchTake);
+    RUN(TestReleaseAndCommit);
+    RUN(TestReserveAndPublish);
+    TEST_EXIT();
+}
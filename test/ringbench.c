@@ -0,0 +1,798 @@
+/* SPDX-License-Identifier: GPL-2.0 OR MIT
+ *
+ * Copyright (C) 2018-2021 WireGuard LLC. All Rights Reserved.
+ */
+
+/* Ring throughput benchmark, in both directions. In the receive mode, a driver thread emulates TunSendQueue on the send
+ * ring: it reserves ring space for a chain of packets, copies them in, publishes the tail and signals the tail-moved
+ * event. The client consumes them the way WintunWaitForPackets, WintunReceivePackets and WintunReleaseReceivePackets
+ * do, releasing each batch with one call. The release mode releases each packet on its own instead, in random order,
+ * the way WintunReleaseReceivePacket is used by clients that finish packets out of order. In the send modes, the client
+ * produces bursts of packets on the receive ring, with WintunAllocateSendPackets and WintunSendPackets on the whole
+ * burst in the send mode, or WintunAllocateSendPacket and WintunSendPacket on each packet in the send1 mode, and a
+ * driver thread consumes them the way TunProcessReceiveData does. The ring lives in shared memory and the auto-reset
+ * event is an eventfd, so this runs on Linux without the driver. The sweep covers packet sizes, ring capacities and
+ * batch sizes, and reports packet and bit rates, the time the client spends in ring calls per packet, ring latency
+ * percentiles, events signaled and wake-ups per packet, and how often per packet the client publishes the ring head or
+ * tail. A release that leaves the oldest outstanding packet held does not publish, so in the release mode this stays
+ * well below the one store per packet releasing would take otherwise. Each configuration runs on a ring of regular
+ * pages and on one of huge pages, the Linux counterpart of WINTUN_SESSION_LARGE_PAGES, when the system has huge pages
+ * reserved. The client keeps the counters WintunGetSessionStatistics reports on every other call only, so calls with
+ * and without counting see the same ring and scheduling, and the count column gives what counting adds to its time
+ * per packet, which should stay under 2%.
+ *
+ * Usage: ringbench [-d milliseconds] [-s packet size] [-c ring capacity] [-b batch size] [-p regular|huge]
+ *                  [-m receive|release|send|send1] [-w spin microseconds]
+ * Each of -s, -c, -b, -p and -m pins that dimension of the sweep to one value. */
+
+#define _GNU_SOURCE
+#include "../common/ring.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+static const ULONG PacketSizes[] = { 64, 512, 1500, 9000, TUN_MAX_IP_PACKET_SIZE };
+static const ULONG Capacities[] = { TUN_MIN_RING_CAPACITY, 0x100000, 0x800000, TUN_MAX_RING_CAPACITY };
+static const ULONG BatchSizes[] = { 1, 16, 256 };
+static const char *const PageKinds[] = { "regular", "huge" };
+static const char *const Modes[] = { "receive", "release", "send", "send1" };
+
+enum
+{
+    MODE_RECEIVE,
+    MODE_RELEASE,
+    MODE_SEND,
+    MODE_SEND_ONE
+};
+
+/* Packets the driver takes off the receive ring per indication, its default ReceiveBatchSize */
+#define DRIVER_BATCH 64
+
+/* Buckets of the session statistics histograms, WINTUN_HISTOGRAM_BUCKETS */
+#define HISTOGRAM_BUCKETS 17
+
+/* Latencies go into a histogram with 16 linear buckets per power of two, so percentiles are within 1/16. */
+#define LATENCY_SUB_BITS 4
+#define LATENCY_SUB_BUCKETS (1 << LATENCY_SUB_BITS)
+#define LATENCY_BUCKETS (LATENCY_SUB_BUCKETS + (64 - LATENCY_SUB_BITS) * LATENCY_SUB_BUCKETS)
+
+/* The ring counters of a session, TUN_RING_STATISTICS, which the client keeps when counting */
+typedef struct _RING_STATISTICS
+{
+    ULONG64 Packets;
+    ULONG64 Bytes;
+    ULONG64 Failures;
+    ULONG HighWater;
+    ULONG64 PacketSizes[HISTOGRAM_BUCKETS];
+    ULONG64 BatchSizes[HISTOGRAM_BUCKETS];
+} RING_STATISTICS;
+
+typedef struct _BENCH
+{
+    TUN_RING *Ring;
+    size_t RingSize;
+    ULONG Capacity;
+    ULONG PacketSize;
+    ULONG Batch;
+    int HugePages;
+    int Mode;
+    ULONG64 SpinNs;
+    int TailMoved;
+
+    /* Producer side: the driver on the send ring, the client on the receive ring */
+    volatile ULONG ReservedTail;
+    volatile ULONG PublishedTail;
+    ULONG Tail;
+    ULONG TailRelease;
+    volatile LONG Stop;
+    volatile ULONG64 Produced;
+    ULONG64 Signals;
+    ULONG64 Overflows;
+
+    /* Consumer side: the client on the send ring, the driver on the receive ring */
+    ULONG Head;
+    ULONG HeadRelease;
+    ULONG64 Consumed;
+    ULONG64 Wakeups;
+    int Corrupt;
+    ULONG64 Latency[LATENCY_BUCKETS];
+
+    /* Packets the client holds between allocating or receiving them and sending or releasing them, and the time it
+     * spends in ring calls */
+    ULONG PacketsToRelease;
+    ULONG64 Publishes;
+    ULONG64 ClientNs[2];      /* Without and with counting */
+    ULONG64 ClientPackets[2]; /* Without and with counting */
+    ULONG Shuffle;
+    int Counting; /* Flips from one call to the next */
+    RING_STATISTICS Stats;
+    ULONG *Sizes; /* Sizes of the packets of a batch, the PacketSizes of the session calls */
+} BENCH;
+
+static ULONG64
+Now(void)
+{
+    struct timespec Time;
+    clock_gettime(CLOCK_MONOTONIC, &Time);
+    return (ULONG64)Time.tv_sec * 1000000000 + (ULONG64)Time.tv_nsec;
+}
+
+static ULONG
+LatencyBucket(ULONG64 Value)
+{
+    if (Value < LATENCY_SUB_BUCKETS)
+        return (ULONG)Value;
+    ULONG Exponent = 63 - (ULONG)__builtin_clzll(Value);
+    ULONG Mantissa = (ULONG)(Value >> (Exponent - LATENCY_SUB_BITS)) & (LATENCY_SUB_BUCKETS - 1);
+    return LATENCY_SUB_BUCKETS + (Exponent - LATENCY_SUB_BITS) * LATENCY_SUB_BUCKETS + Mantissa;
+}
+
+/* Returns the lower bound of the bucket. */
+static ULONG64
+LatencyValue(ULONG Bucket)
+{
+    if (Bucket < LATENCY_SUB_BUCKETS)
+        return Bucket;
+    Bucket -= LATENCY_SUB_BUCKETS;
+    ULONG Exponent = Bucket / LATENCY_SUB_BUCKETS;
+    return (ULONG64)(LATENCY_SUB_BUCKETS + Bucket % LATENCY_SUB_BUCKETS) << Exponent;
+}
+
+static ULONG64
+LatencyPercentile(const BENCH *Bench, ULONG Percent)
+{
+    ULONG64 Rank = (Bench->Consumed * Percent + 99) / 100, Seen = 0;
+    for (ULONG Bucket = 0; Bucket < LATENCY_BUCKETS; ++Bucket)
+    {
+        Seen += Bench->Latency[Bucket];
+        if (Seen >= Rank && Seen)
+            return LatencyValue(Bucket);
+    }
+    return 0;
+}
+
+/* HistogramBucket, CountAdd, CountPackets and CountBatch of the session, with the same relaxed loads and stores, and
+ * the counting of ERROR_NO_MORE_ITEMS and ERROR_BUFFER_OVERFLOW failures. Like the session, the client tallies the
+ * bytes of a batch, and whether its sizes are mixed, while taking the packets. */
+static ULONG
+HistogramBucket(ULONG Value)
+{
+    if (!Value)
+        return 0;
+    ULONG Index = 31 - (ULONG)__builtin_clz(Value) + 1;
+    return Index < HISTOGRAM_BUCKETS - 1 ? Index : HISTOGRAM_BUCKETS - 1;
+}
+
+static inline void
+CountAdd(ULONG64 *Counter, ULONG64 Value)
+{
+    __atomic_store_n(Counter, __atomic_load_n(Counter, __ATOMIC_RELAXED) + Value, __ATOMIC_RELAXED);
+}
+
+static inline void
+CountPackets(BENCH *Bench, const ULONG *Sizes, ULONG Count, ULONG Bytes, ULONG Mixed)
+{
+    if (!Bench->Counting || !Count)
+        return;
+    if (!Mixed)
+        CountAdd(&Bench->Stats.PacketSizes[HistogramBucket(Sizes[0])], Count);
+    else
+    {
+        for (ULONG i = 0, Run = 1; i < Count; ++i, ++Run)
+        {
+            if (i + 1 == Count || Sizes[i + 1] != Sizes[i])
+            {
+                CountAdd(&Bench->Stats.PacketSizes[HistogramBucket(Sizes[i])], Run);
+                Run = 0;
+            }
+        }
+    }
+    CountAdd(&Bench->Stats.Packets, Count);
+    CountAdd(&Bench->Stats.Bytes, Bytes);
+}
+
+static inline void
+CountBatch(BENCH *Bench, ULONG Count, ULONG Occupancy)
+{
+    if (!Bench->Counting)
+        return;
+    if (Count)
+        CountAdd(&Bench->Stats.BatchSizes[HistogramBucket(Count)], 1);
+    if (Occupancy > Bench->Stats.HighWater)
+        __atomic_store_n(&Bench->Stats.HighWater, Occupancy, __ATOMIC_RELAXED);
+}
+
+static inline void
+CountFailure(BENCH *Bench)
+{
+    if (Bench->Counting)
+        CountAdd(&Bench->Stats.Failures, 1);
+}
+
+static void
+SignalEvent(int Event)
+{
+    ULONG64 One = 1;
+    while (write(Event, &One, sizeof(One)) < 0 && errno == EINTR)
+        ;
+}
+
+static void
+WaitEvent(int Event)
+{
+    ULONG64 Value;
+    while (read(Event, &Value, sizeof(Value)) < 0 && errno == EINTR)
+        ;
+}
+
+/* The driver's TunSendQueue, with each batch standing in for an NBL chain. The payload starts with the time the
+ * packet was written, for the client to measure latency against. When the ring is full the driver would drop the
+ * chain; here it counts an overflow and retries, so the client always sees a saturated producer. */
+static void *
+DriverThread(void *Context)
+{
+    BENCH *Bench = Context;
+    ULONG Aligned = TUN_ALIGN(sizeof(TUN_PACKET) + Bench->PacketSize);
+    ULONG Required = Aligned * Bench->Batch;
+
+    while (!TUN_RING_READ_ACQUIRE_LONG(&Bench->Stop))
+    {
+        ULONG ReservedTail;
+        if (!TunRingReserve(&Bench->ReservedTail, &Bench->Ring->Head, Bench->Capacity, Required, &ReservedTail))
+        {
+            ++Bench->Overflows;
+            sched_yield();
+            continue;
+        }
+        ULONG RingTail = TUN_RING_WRAP(ReservedTail, Bench->Capacity);
+        ULONG64 Stamp = Now();
+        for (ULONG i = 0; i < Bench->Batch; ++i)
+        {
+            TUN_PACKET *Packet = TunRingPacketAt(Bench->Ring, RingTail);
+            Packet->Size = Bench->PacketSize;
+            memcpy(Packet->Data, &Stamp, sizeof(Stamp));
+            memset(Packet->Data + sizeof(Stamp), (UCHAR)RingTail, Bench->PacketSize - sizeof(Stamp));
+            RingTail = TUN_RING_WRAP(RingTail + Aligned, Bench->Capacity);
+        }
+        TunRingPublish(Bench->Ring, Bench->Capacity, &Bench->PublishedTail, ReservedTail, ReservedTail + Required);
+        __atomic_store_n(&Bench->Produced, Bench->Produced + Bench->Batch, __ATOMIC_RELEASE);
+        SignalEvent(Bench->TailMoved);
+        ++Bench->Signals;
+    }
+    SignalEvent(Bench->TailMoved);
+    return NULL;
+}
+
+/* WintunWaitForPackets: spins for a while, then blocks on the tail-moved event. Returns zero once the driver has
+ * stopped and every packet it produced has been consumed. */
+static int
+WaitForPackets(BENCH *Bench)
+{
+    ULONG64 Start = Now();
+    for (;;)
+    {
+        if (TUN_RING_READ_ACQUIRE(&Bench->Ring->Tail) != Bench->Head)
+            return 1;
+        if (TUN_RING_READ_ACQUIRE_LONG(&Bench->Stop) &&
+            __atomic_load_n(&Bench->Produced, __ATOMIC_ACQUIRE) == Bench->Consumed)
+            return 0;
+        if (Now() - Start >= Bench->SpinNs)
+            break;
+        TUN_RING_CPU_RELAX();
+    }
+    for (;;)
+    {
+        WaitEvent(Bench->TailMoved);
+        ++Bench->Wakeups;
+        if (TUN_RING_READ_ACQUIRE(&Bench->Ring->Tail) != Bench->Head)
+            return 1;
+        if (TUN_RING_READ_ACQUIRE_LONG(&Bench->Stop) &&
+            __atomic_load_n(&Bench->Produced, __ATOMIC_ACQUIRE) == Bench->Consumed)
+            return 0;
+    }
+}
+
+/* Walks the release cursor over released packets and stores the ring head if it moved. */
+static void
+PublishHead(BENCH *Bench)
+{
+    ULONG HeadRelease =
+        TunRingAdvanceReleased(Bench->Ring, Bench->Capacity, Bench->HeadRelease, &Bench->PacketsToRelease);
+    if (HeadRelease == Bench->HeadRelease)
+        return;
+    Bench->HeadRelease = HeadRelease;
+    TUN_RING_WRITE_RELEASE(&Bench->Ring->Head, HeadRelease);
+    ++Bench->Publishes;
+}
+
+static ULONG
+ShuffleRandom(BENCH *Bench)
+{
+    Bench->Shuffle ^= Bench->Shuffle << 13;
+    Bench->Shuffle ^= Bench->Shuffle >> 17;
+    Bench->Shuffle ^= Bench->Shuffle << 5;
+    return Bench->Shuffle;
+}
+
+/* WintunReceivePackets followed by WintunReleaseReceivePackets on everything received, or in the release mode by
+ * WintunReleaseReceivePacket on each packet received, in random order. */
+static int
+ClientReceive(BENCH *Bench, TUN_PACKET **Packets)
+{
+    ULONG64 Start = Now();
+    ULONG Tail = TUN_RING_READ_ACQUIRE(&Bench->Ring->Tail);
+    ULONG Occupancy = TunRingContent(Bench->HeadRelease, Tail, Bench->Capacity);
+    ULONG Count = 0, Bytes = 0, Mixed = 0;
+    for (; Count < Bench->Batch; ++Count)
+    {
+        ULONG Size, Aligned;
+        TUN_RING_STATUS Status =
+            TunRingPeekPacket(Bench->Ring, Bench->Capacity, Bench->Head, Tail, &Packets[Count], &Size, &Aligned);
+        if (Status == TUN_RING_EMPTY)
+            break;
+        if (Status != TUN_RING_OK || Size != Bench->PacketSize)
+        {
+            fprintf(stderr, "ringbench: ring corrupt at offset %u\n", Bench->Head);
+            return 0;
+        }
+        Bench->Head = TUN_RING_WRAP(Bench->Head + Aligned, Bench->Capacity);
+        Bench->PacketsToRelease++;
+        Bench->Sizes[Count] = Size;
+        if (Bench->Counting)
+        {
+            Bytes += Size;
+            Mixed |= Size ^ Bench->Sizes[0];
+        }
+    }
+    CountPackets(Bench, Bench->Sizes, Count, Bytes, Mixed);
+    if (!Count)
+        CountFailure(Bench);
+    CountBatch(Bench, Count, Occupancy);
+    ULONG64 Received = Now();
+    for (ULONG i = 0; i < Count; ++i)
+    {
+        ULONG64 Stamp;
+        memcpy(&Stamp, Packets[i]->Data, sizeof(Stamp));
+        Bench->Latency[LatencyBucket(Received - Stamp)]++;
+    }
+    Bench->Consumed += Count;
+    if (Bench->Mode == MODE_RELEASE)
+    {
+        for (ULONG i = Count; i > 1; --i)
+        {
+            ULONG j = ShuffleRandom(Bench) % i;
+            TUN_PACKET *Packet = Packets[i - 1];
+            Packets[i - 1] = Packets[j];
+            Packets[j] = Packet;
+        }
+        for (ULONG i = 0; i < Count; ++i)
+        {
+            Packets[i]->Size |= TUN_PACKET_RELEASE;
+            if (Packets[i] == TunRingPacketAt(Bench->Ring, Bench->HeadRelease))
+                PublishHead(Bench);
+        }
+    }
+    else
+    {
+        for (ULONG i = 0; i < Count; ++i)
+            Packets[i]->Size |= TUN_PACKET_RELEASE;
+        PublishHead(Bench);
+    }
+    Bench->ClientNs[Bench->Counting] += Now() - Start;
+    Bench->ClientPackets[Bench->Counting] += Count;
+    Bench->Counting ^= 1;
+    return 1;
+}
+
+/* WintunAllocateSendPackets on Count packets, stamping each with the time the burst started, and WintunSendPackets on
+ * all of them. Only the stamp is written, so the time measured is that of the ring calls. Returns zero if the ring
+ * lacked the space. */
+static int
+ClientSend(BENCH *Bench, ULONG Count, ULONG64 Stamp)
+{
+    ULONG Aligned = TUN_ALIGN(sizeof(TUN_PACKET) + Bench->PacketSize);
+    ULONG Head = TUN_RING_READ_ACQUIRE(&Bench->Ring->Head);
+    if (TunRingSpace(Head, Bench->Tail, Bench->Capacity) < Aligned * Count)
+    {
+        CountFailure(Bench);
+        return 0;
+    }
+    ULONG First = Bench->Tail, Bytes = 0, Mixed = 0;
+    for (ULONG i = 0; i < Count; ++i)
+    {
+        TunRingPacketAt(Bench->Ring, Bench->Tail)->Size = Bench->PacketSize | TUN_PACKET_RELEASE;
+        Bench->Tail = TUN_RING_WRAP(Bench->Tail + Aligned, Bench->Capacity);
+        Bench->PacketsToRelease++;
+        if (Bench->Counting)
+        {
+            Bytes += Bench->Sizes[i];
+            Mixed |= Bench->Sizes[i] ^ Bench->Sizes[0];
+        }
+    }
+    CountPackets(Bench, Bench->Sizes, Count, Bytes, Mixed);
+    CountBatch(Bench, Count, TunRingContent(Head, Bench->Tail, Bench->Capacity));
+    for (ULONG i = 0, Offset = First; i < Count; ++i, Offset = TUN_RING_WRAP(Offset + Aligned, Bench->Capacity))
+    {
+        TUN_PACKET *Packet = TunRingPacketAt(Bench->Ring, Offset);
+        memcpy(Packet->Data, &Stamp, sizeof(Stamp));
+        Packet->Size &= ~TUN_PACKET_RELEASE;
+    }
+    ULONG TailRelease =
+        TunRingAdvanceCommitted(Bench->Ring, Bench->Capacity, Bench->TailRelease, &Bench->PacketsToRelease);
+    if (TailRelease != Bench->TailRelease)
+    {
+        Bench->TailRelease = TailRelease;
+        TUN_RING_WRITE_RELEASE(&Bench->Ring->Tail, TailRelease);
+        ++Bench->Publishes;
+        /* The driver sets Alertable before rechecking the tail, and the client checks it after storing the tail. Both
+         * need a full barrier in between, or each may miss the other's store and the driver sleeps on a full ring. */
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (TUN_RING_READ_ACQUIRE_LONG(&Bench->Ring->Alertable))
+        {
+            SignalEvent(Bench->TailMoved);
+            ++Bench->Signals;
+        }
+    }
+    __atomic_store_n(&Bench->Produced, Bench->Produced + Count, __ATOMIC_RELEASE);
+    return 1;
+}
+
+/* One burst of the batch size, in one pair of calls in the send mode, or a pair of calls per packet in the send1
+ * mode. Returns zero if the ring lacked the space. */
+static int
+ClientSendBurst(BENCH *Bench)
+{
+    ULONG64 Start = Now();
+    ULONG PerCall = Bench->Mode == MODE_SEND_ONE ? 1 : Bench->Batch;
+    for (ULONG Sent = 0; Sent < Bench->Batch; Sent += PerCall)
+    {
+        if (!ClientSend(Bench, PerCall, Start))
+            return 0;
+    }
+    Bench->ClientNs[Bench->Counting] += Now() - Start;
+    Bench->ClientPackets[Bench->Counting] += Bench->Batch;
+    Bench->Counting ^= 1;
+    return 1;
+}
+
+/* TunProcessReceiveData: spins for a while on an empty ring, then sets Alertable and sleeps on the tail-moved event.
+ * Takes up to DRIVER_BATCH packets at a time and moves the head past them. Returns once the client has stopped and
+ * every packet it sent has been consumed. */
+static void *
+DriverReceiveThread(void *Context)
+{
+    BENCH *Bench = Context;
+    TUN_RING *Ring = Bench->Ring;
+    for (;;)
+    {
+        int Stopping = TUN_RING_READ_ACQUIRE_LONG(&Bench->Stop);
+        ULONG Tail = TUN_RING_READ_ACQUIRE(&Ring->Tail);
+        if (Tail == Bench->Head)
+        {
+            if (Stopping)
+                break;
+            ULONG64 SpinStart = Now();
+            while ((Tail = TUN_RING_READ_ACQUIRE(&Ring->Tail)) == Bench->Head &&
+                   !TUN_RING_READ_ACQUIRE_LONG(&Bench->Stop) && Now() - SpinStart < Bench->SpinNs)
+                TUN_RING_CPU_RELAX();
+            if (Tail == Bench->Head)
+            {
+                __atomic_store_n(&Ring->Alertable, 1, __ATOMIC_SEQ_CST);
+                Tail = TUN_RING_READ_ACQUIRE(&Ring->Tail);
+                if (Tail == Bench->Head && !TUN_RING_READ_ACQUIRE_LONG(&Bench->Stop))
+                {
+                    WaitEvent(Bench->TailMoved);
+                    ++Bench->Wakeups;
+                }
+                TUN_RING_WRITE_RELEASE_LONG(&Ring->Alertable, 0);
+                continue;
+            }
+        }
+        TUN_RING_BATCH Batch;
+        TUN_RING_STATUS Status;
+        TUN_PACKET *Packet;
+        ULONG PacketSize;
+        TunRingBatchBegin(&Batch, Bench->Head, Tail, DRIVER_BATCH);
+        ULONG64 Received = Now();
+        while ((Status = TunRingBatchNext(&Batch, Ring, Bench->Capacity, &Packet, &PacketSize)) == TUN_RING_OK)
+        {
+            ULONG64 Stamp;
+            memcpy(&Stamp, Packet->Data, sizeof(Stamp));
+            Bench->Latency[LatencyBucket(Received - Stamp)]++;
+        }
+        if (Status != TUN_RING_EMPTY)
+        {
+            fprintf(stderr, "ringbench: ring corrupt at offset %u\n", Batch.Head);
+            Bench->Corrupt = 1;
+            break;
+        }
+        Bench->Head = Batch.Head;
+        TUN_RING_WRITE_RELEASE(&Ring->Head, Bench->Head);
+        Bench->Consumed += Batch.Count;
+    }
+    return NULL;
+}
+
+/* Returns the default huge page size, or zero if the kernel has no huge page support. */
+static size_t
+HugePageSize(void)
+{
+    FILE *MemInfo = fopen("/proc/meminfo", "r");
+    if (!MemInfo)
+        return 0;
+    char Line[128];
+    unsigned long long Kilobytes = 0;
+    while (fgets(Line, sizeof(Line), MemInfo))
+    {
+        if (sscanf(Line, "Hugepagesize: %llu kB", &Kilobytes) == 1)
+            break;
+    }
+    fclose(MemInfo);
+    return (size_t)Kilobytes * 1024;
+}
+
+/* Allocates the ring in memory that could as well be shared with another process, as the driver maps it. With
+ * HugePages, the memory comes from the huge pages reserved in /proc/sys/vm/nr_hugepages, and *Size is rounded up to
+ * the huge page size, like WINTUN_SESSION_LARGE_PAGES rounds up to the large page minimum. Returns NULL with errno set
+ * on failure. */
+static TUN_RING *
+AllocateRing(size_t *Size, int HugePages)
+{
+    int Flags = MAP_SHARED | MAP_ANONYMOUS | MAP_POPULATE;
+    if (HugePages)
+    {
+        size_t PageSize = HugePageSize();
+        if (!PageSize)
+        {
+            errno = ENOTSUP;
+            return NULL;
+        }
+        *Size = (*Size + PageSize - 1) / PageSize * PageSize;
+        Flags |= MAP_HUGETLB;
+    }
+    void *Memory = mmap(NULL, *Size, PROT_READ | PROT_WRITE, Flags, -1, 0);
+    return Memory == MAP_FAILED ? NULL : Memory;
+}
+
+static int
+RunBench(BENCH *Bench, ULONG64 DurationNs)
+{
+    int Ok = 0;
+    TUN_PACKET **Packets = calloc(Bench->Batch, sizeof(*Packets));
+    Bench->Sizes = calloc(Bench->Batch, sizeof(*Bench->Sizes));
+    Bench->TailMoved = eventfd(0, EFD_CLOEXEC);
+    if (!Packets || !Bench->Sizes || Bench->TailMoved < 0)
+    {
+        perror("ringbench");
+        goto cleanup;
+    }
+    for (ULONG i = 0; i < Bench->Batch; ++i)
+        Bench->Sizes[i] = Bench->PacketSize;
+    Bench->RingSize = TUN_RING_SIZE(Bench->Capacity);
+    Bench->Ring = AllocateRing(&Bench->RingSize, Bench->HugePages);
+    if (!Bench->Ring)
+    {
+        /* Too few huge pages reserved for this ring is not a failure of the ring, so the sweep goes on. */
+        Ok = Bench->HugePages;
+        fprintf(
+            stderr,
+            "ringbench: cannot allocate %zu bytes of %s pages for capacity %u: %s\n",
+            Bench->RingSize,
+            PageKinds[Bench->HugePages],
+            Bench->Capacity,
+            strerror(errno));
+        goto cleanup;
+    }
+
+    pthread_t Driver;
+    if ((errno = pthread_create(
+             &Driver, NULL, Bench->Mode <= MODE_RELEASE ? DriverThread : DriverReceiveThread, Bench)) != 0)
+    {
+        perror("ringbench: pthread_create");
+        goto cleanup;
+    }
+    ULONG64 Start = Now();
+    Ok = 1;
+    if (Bench->Mode <= MODE_RELEASE)
+    {
+        int Running = 1;
+        while (WaitForPackets(Bench))
+        {
+            if (!ClientReceive(Bench, Packets))
+            {
+                Ok = 0;
+                break;
+            }
+            if (Running && Now() - Start >= DurationNs)
+            {
+                TUN_RING_WRITE_RELEASE_LONG(&Bench->Stop, 1);
+                Running = 0;
+            }
+        }
+    }
+    else
+    {
+        /* A full ring fails the allocation, and the client retries once the driver had a chance to catch up. */
+        while (Now() - Start < DurationNs)
+        {
+            if (!ClientSendBurst(Bench))
+            {
+                ++Bench->Overflows;
+                sched_yield();
+            }
+        }
+    }
+    TUN_RING_WRITE_RELEASE_LONG(&Bench->Stop, 1);
+    SignalEvent(Bench->TailMoved);
+    pthread_join(Driver, NULL);
+    double Seconds = (double)(Now() - Start) / 1e9;
+    Ok &= !Bench->Corrupt && Bench->Consumed;
+
+    if (Ok)
+    {
+        double ClientNs = (double)Bench->ClientNs[0] / (double)Bench->ClientPackets[0];
+        double CountingNs = (double)Bench->ClientNs[1] / (double)Bench->ClientPackets[1];
+        printf(
+            "%6u %9u %6u %7s %7s %12.0f %9.3f %8.1f %+7.1f%% %10llu %10llu %9.4f %9.4f %9.4f %10llu\n",
+            Bench->PacketSize,
+            Bench->Capacity,
+            Bench->Batch,
+            PageKinds[Bench->HugePages],
+            Modes[Bench->Mode],
+            (double)Bench->Consumed / Seconds,
+            (double)Bench->Consumed * Bench->PacketSize * 8 / Seconds / 1e9,
+            ClientNs,
+            (CountingNs / ClientNs - 1) * 100,
+            (unsigned long long)LatencyPercentile(Bench, 50),
+            (unsigned long long)LatencyPercentile(Bench, 99),
+            (double)Bench->Signals / (double)Bench->Consumed,
+            (double)Bench->Wakeups / (double)Bench->Consumed,
+            (double)Bench->Publishes / (double)Bench->Consumed,
+            (unsigned long long)Bench->Overflows);
+    }
+cleanup:
+    if (Bench->TailMoved >= 0)
+        close(Bench->TailMoved);
+    if (Bench->Ring)
+        munmap(Bench->Ring, Bench->RingSize);
+    free(Bench->Sizes);
+    free(Packets);
+    return Ok;
+}
+
+int
+main(int argc, char *argv[])
+{
+    ULONG64 DurationNs = 200000000, SpinNs = 50000;
+    ULONG Size = 0, Capacity = 0, Batch = 0;
+    int Option, Pages = -1, Mode = -1;
+    while ((Option = getopt(argc, argv, "d:s:c:b:p:m:w:")) != -1)
+    {
+        switch (Option)
+        {
+        case 'd':
+            DurationNs = strtoull(optarg, NULL, 0) * 1000000;
+            break;
+        case 's':
+            Size = (ULONG)strtoul(optarg, NULL, 0);
+            break;
+        case 'c':
+            Capacity = (ULONG)strtoul(optarg, NULL, 0);
+            break;
+        case 'b':
+            Batch = (ULONG)strtoul(optarg, NULL, 0);
+            break;
+        case 'p':
+            Pages = !strcmp(optarg, "regular") ? 0 : !strcmp(optarg, "huge") ? 1 : -2;
+            break;
+        case 'm':
+            Mode = -2;
+            for (int m = 0; m < (int)(sizeof(Modes) / sizeof(*Modes)); ++m)
+            {
+                if (!strcmp(optarg, Modes[m]))
+                    Mode = m;
+            }
+            break;
+        case 'w':
+            SpinNs = strtoull(optarg, NULL, 0) * 1000;
+            break;
+        default:
+            fprintf(
+                stderr,
+                "Usage: %s [-d milliseconds] [-s packet size] [-c ring capacity] [-b batch size] "
+                "[-p regular|huge] [-m receive|release|send|send1] [-w spin microseconds]\n",
+                argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if ((Size && (Size < sizeof(ULONG64) || Size > TUN_MAX_IP_PACKET_SIZE)) ||
+        (Capacity && !TunRingIsValidCapacity(Capacity)) || (Batch && (Batch > 4096)) || Pages == -2 ||
+        Mode == -2)
+    {
+        fprintf(stderr, "%s: parameter out of range\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    /* Most systems reserve no huge pages. Unless asked for explicitly, the sweep then sticks to regular pages. */
+    size_t Probe = 1;
+    TUN_RING *ProbeRing = Pages ? AllocateRing(&Probe, 1) : NULL;
+    if (ProbeRing)
+        munmap(ProbeRing, Probe);
+    else if (Pages == 1)
+    {
+        fprintf(stderr, "%s: no huge pages: %s; reserve some in /proc/sys/vm/nr_hugepages\n", argv[0], strerror(errno));
+        return EXIT_FAILURE;
+    }
+    else if (Pages)
+    {
+        fprintf(stderr, "%s: no huge pages, comparing against regular pages skipped: %s\n", argv[0], strerror(errno));
+        Pages = 0;
+    }
+
+    printf(
+        "%6s %9s %6s %7s %7s %12s %9s %8s %8s %10s %10s %9s %9s %9s %10s\n",
+        "size",
+        "capacity",
+        "batch",
+        "pages",
+        "mode",
+        "pps",
+        "Gbit/s",
+        "ns/pkt",
+        "count",
+        "p50 ns",
+        "p99 ns",
+        "sig/pkt",
+        "wake/pkt",
+        "pub/pkt",
+        "overflows");
+    int Ok = 1;
+    for (size_t s = 0; s < sizeof(PacketSizes) / sizeof(*PacketSizes); ++s)
+    {
+        if (Size && s)
+            break;
+        for (size_t c = 0; c < sizeof(Capacities) / sizeof(*Capacities); ++c)
+        {
+            if (Capacity && c)
+                break;
+            for (size_t b = 0; b < sizeof(BatchSizes) / sizeof(*BatchSizes); ++b)
+            {
+                if (Batch && b)
+                    break;
+                for (int p = 0; p < 2; ++p)
+                {
+                    if (Pages >= 0 && p != Pages)
+                        continue;
+                    for (int m = 0; m < (int)(sizeof(Modes) / sizeof(*Modes)); ++m)
+                    {
+                        if (Mode >= 0 && m != Mode)
+                            continue;
+                        BENCH *Bench = calloc(1, sizeof(*Bench));
+                        if (!Bench)
+                            return EXIT_FAILURE;
+                        Bench->PacketSize = Size ? Size : PacketSizes[s];
+                        Bench->Capacity = Capacity ? Capacity : Capacities[c];
+                        Bench->Batch = Batch ? Batch : BatchSizes[b];
+                        Bench->HugePages = p;
+                        Bench->Mode = m;
+                        Bench->SpinNs = SpinNs;
+                        Bench->Shuffle = 0x2545F491;
+                        /* A chain that can never fit is what the driver drops outright, and a burst that can never fit
+                         * what WintunAllocateSendPackets cannot allocate whole. */
+                        if (TUN_ALIGN(sizeof(TUN_PACKET) + Bench->PacketSize) * (ULONG64)Bench->Batch <
+                            Bench->Capacity)
+                            Ok &= RunBench(Bench, DurationNs);
+                        free(Bench);
+                    }
+                }
+            }
+        }
+    }
+    return Ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
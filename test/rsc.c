@@ -0,0 +1,357 @@
+/* SPDX-License-Identifier: GPL-2.0 OR MIT
+ *
+ * Copyright (C) 2018-2021 WireGuard LLC. All Rights Reserved.
+ */
+
+/* Receive segment coalescing: which segments merge, and that a coalesced packet is a valid TCP/IP packet carrying the
+ * payloads of all its segments in order. Checksums are verified with a plain byte-wise sum.
+ *
+ * Not covered here: the driver only coalesces on NDIS 6.30 and later. TunReadConfiguration turns *RscIPv4 and *RscIPv6
+ * off on older versions, whatever the adapter settings say, since those versions have no TcpRecvSegCoalesceInfo to
+ * tell the protocol stack a packet was coalesced, and OID_TCP_OFFLOAD_PARAMETERS cannot turn them back on there, as
+ * the receive segment coalescing fields only exist from revision 3 on. */
+
+#include "../common/rsc.h"
+#include "test.h"
+
+#define MAX_SEGMENTS 64
+#define MAX_SEGMENT_SIZE 2048
+#define OPTIONS_SIZE 12
+#define FIRST_SEQUENCE 0xFFFFF000 /* About to wrap */
+
+static UCHAR Segments[MAX_SEGMENTS][MAX_SEGMENT_SIZE];
+static ULONG Sizes[MAX_SEGMENTS];
+static UCHAR Coalesced[TUN_MAX_IP_PACKET_SIZE];
+
+/* One's complement sum of big-endian 16-bit words, folded. */
+static ULONG
+NaiveSum(ULONG Sum, const UCHAR *Data, ULONG Size)
+{
+    for (ULONG i = 0; i < Size; i += 2)
+        Sum += (ULONG)Data[i] << 8 | (i + 1 < Size ? Data[i + 1] : 0);
+    while (Sum >> 16)
+        Sum = (Sum & 0xFFFF) + (Sum >> 16);
+    return Sum;
+}
+
+/* Payload byte at Offset into the stream, so concatenated payloads can be checked anywhere. */
+static UCHAR
+Pattern(ULONG Offset)
+{
+    return (UCHAR)(Offset * 7 + (Offset >> 8));
+}
+
+static ULONG
+IpHeaderSize(const UCHAR *Packet)
+{
+    return Packet[0] >> 4 == 4 ? 20 : 40;
+}
+
+/* Computes the IPv4 header and TCP checksums of a packet. */
+static void
+FixChecksums(UCHAR *Packet, ULONG Size)
+{
+    ULONG IpSize = IpHeaderSize(Packet), Pseudo, Sum;
+    UCHAR *Tcp = Packet + IpSize;
+    if (IpSize == 20)
+    {
+        Packet[10] = Packet[11] = 0;
+        Sum = ~NaiveSum(0, Packet, 20);
+        Packet[10] = (UCHAR)(Sum >> 8), Packet[11] = (UCHAR)Sum;
+        Pseudo = NaiveSum(6 + Size - IpSize, Packet + 12, 8);
+    }
+    else
+        Pseudo = NaiveSum(6 + Size - IpSize, Packet + 8, 32);
+    Tcp[16] = Tcp[17] = 0;
+    Sum = ~NaiveSum(Pseudo, Tcp, Size - IpSize);
+    Tcp[16] = (UCHAR)(Sum >> 8), Tcp[17] = (UCHAR)Sum;
+}
+
+/* Builds segment Index of a flow, carrying Payload bytes starting at stream offset Offset. */
+static void
+MakeSegment(ULONG Index, UCHAR Version, ULONG Offset, ULONG Payload, UCHAR Flags)
+{
+    UCHAR *Packet = Segments[Index];
+    ULONG IpSize = Version == 4 ? 20 : 40, Size = IpSize + 20 + OPTIONS_SIZE + Payload;
+    memset(Packet, 0, IpSize + 20 + OPTIONS_SIZE);
+    if (Version == 4)
+    {
+        Packet[0] = 0x45;
+        Packet[1] = 0x02; /* ECT(0) */
+        Packet[2] = (UCHAR)(Size >> 8), Packet[3] = (UCHAR)Size;
+        Packet[4] = (UCHAR)(Index >> 8), Packet[5] = (UCHAR)Index;
+        Packet[6] = 0x40; /* Don't fragment */
+        Packet[8] = 64;
+        Packet[9] = 6;
+        Packet[12] = 10, Packet[15] = 1, Packet[16] = 10, Packet[19] = 2;
+    }
+    else
+    {
+        Packet[0] = 0x60, Packet[1] = 0x20, Packet[3] = 0x42; /* ECT(0), flow label */
+        Packet[4] = (UCHAR)((Size - 40) >> 8), Packet[5] = (UCHAR)(Size - 40);
+        Packet[6] = 6;
+        Packet[7] = 64;
+        Packet[8] = 0xfd, Packet[23] = 1, Packet[24] = 0xfd, Packet[39] = 2;
+    }
+    UCHAR *Tcp = Packet + IpSize;
+    ULONG Sequence = FIRST_SEQUENCE + Offset;
+    Tcp[0] = 0x01, Tcp[1] = 0xBB, Tcp[2] = 0xC0, Tcp[3] = 0x00;
+    Tcp[4] = (UCHAR)(Sequence >> 24), Tcp[5] = (UCHAR)(Sequence >> 16);
+    Tcp[6] = (UCHAR)(Sequence >> 8), Tcp[7] = (UCHAR)Sequence;
+    Tcp[8] = 0x11, Tcp[9] = 0x22, Tcp[10] = 0x33, Tcp[11] = 0x44;
+    Tcp[12] = (20 + OPTIONS_SIZE) / 4 << 4;
+    Tcp[13] = Flags;
+    Tcp[14] = 0x01, Tcp[15] = 0x00;
+    Tcp[20] = Tcp[21] = 1, Tcp[22] = 8, Tcp[23] = 10; /* No-operations, then timestamps */
+    Tcp[24] = 0xAB, Tcp[31] = 0xCD;
+    for (ULONG i = 0; i < Payload; ++i)
+        Tcp[20 + OPTIONS_SIZE + i] = Pattern(Offset + i);
+    Sizes[Index] = Size;
+    FixChecksums(Packet, Size);
+}
+
+/* Builds a flow of Count segments of Mss bytes of payload, the last one carrying LastPayload bytes and LastFlags. */
+static void
+MakeFlow(UCHAR Version, ULONG Count, ULONG Mss, ULONG LastPayload, UCHAR LastFlags)
+{
+    for (ULONG i = 0; i < Count; ++i)
+        MakeSegment(
+            i, Version, i * Mss, i == Count - 1 ? LastPayload : Mss, i == Count - 1 ? LastFlags : TUN_RSC_TCP_ACK);
+}
+
+/* Feeds segments to coalescing the way the receive thread does, except that accepted payloads are copied behind the
+ * first segment rather than chained. Returns the number of segments in the coalesced packet, zero if the first one
+ * could not start one. */
+static ULONG
+Coalesce(TUN_RSC *Rsc, ULONG Count)
+{
+    memcpy(Coalesced, Segments[0], Sizes[0]);
+    if (!TunRscStart(Rsc, Coalesced, Sizes[0]))
+        return 0;
+    CHECK(!memcmp(Coalesced, Segments[0], Sizes[0]));
+    for (ULONG i = 1; i < Count; ++i)
+    {
+        TUN_RSC_SEGMENT Segment;
+        if (!TunRscCheck(Rsc, Segments[i], Sizes[i], &Segment))
+            break;
+        CHECK(Segment.PayloadSize == Sizes[i] - Rsc->HeaderSize);
+        memcpy(Coalesced + Rsc->Size, Segments[i] + Rsc->HeaderSize, Segment.PayloadSize);
+        TunRscAppend(Rsc, &Segment);
+    }
+    /* Nothing is rewritten until the coalesced packet is finished. */
+    CHECK(!memcmp(Coalesced, Segments[0], Rsc->HeaderSize));
+    if (Rsc->Segments > 1)
+        TunRscFinish(Rsc);
+    return Rsc->Segments;
+}
+
+/* Checks that the coalesced packet is the first segment's headers followed by the payload of Count segments, with
+ * lengths, PSH and checksums fixed up. */
+static void
+CheckCoalesced(const TUN_RSC *Rsc, ULONG Count, UCHAR Push)
+{
+    ULONG IpSize = IpHeaderSize(Coalesced), Size = Rsc->Size, Payload = Size - Rsc->HeaderSize, Expected = 0;
+    for (ULONG i = 0; i < Count; ++i)
+        Expected += Sizes[i] - Rsc->HeaderSize;
+    CHECK(Rsc->Segments == Count && Payload == Expected);
+    const UCHAR *Tcp = Coalesced + IpSize;
+    ULONG Pseudo;
+    if (IpSize == 20)
+    {
+        CHECK(((ULONG)Coalesced[2] << 8 | Coalesced[3]) == Size);
+        CHECK(NaiveSum(0, Coalesced, 20) == 0xFFFF);
+        CHECK(!memcmp(Coalesced + 4, Segments[0] + 4, 6) && !memcmp(Coalesced + 12, Segments[0] + 12, 8));
+        Pseudo = NaiveSum(6 + Size - IpSize, Coalesced + 12, 8);
+    }
+    else
+    {
+        CHECK(((ULONG)Coalesced[4] << 8 | Coalesced[5]) == Size - IpSize);
+        CHECK(!memcmp(Coalesced + 6, Segments[0] + 6, 34));
+        Pseudo = NaiveSum(6 + Size - IpSize, Coalesced + 8, 32);
+    }
+    CHECK(NaiveSum(Pseudo, Tcp, Size - IpSize) == 0xFFFF);
+    CHECK(Tcp[13] == (TUN_RSC_TCP_ACK | (Push ? TUN_RSC_TCP_PSH : 0)));
+    CHECK(!memcmp(Tcp, Segments[0] + IpSize, 13));
+    CHECK(!memcmp(Tcp + 14, Segments[0] + IpSize + 14, 2));
+    CHECK(!memcmp(Tcp + 18, Segments[0] + IpSize + 18, Rsc->HeaderSize - IpSize - 18));
+    for (ULONG i = 0; i < Payload; ++i)
+    {
+        if (Coalesced[Rsc->HeaderSize + i] != Pattern(i))
+        {
+            CHECK(Coalesced[Rsc->HeaderSize + i] == Pattern(i));
+            break;
+        }
+    }
+}
+
+static void
+TestMerge(void)
+{
+    TUN_RSC Rsc;
+    for (UCHAR Version = 4; Version <= 6; Version += 2)
+    {
+        /* A run of full segments closed by a short one carrying PSH. */
+        MakeFlow(Version, 8, 1448, 100, TUN_RSC_TCP_ACK | TUN_RSC_TCP_PSH);
+        CHECK(Coalesce(&Rsc, 8) == 8);
+        CheckCoalesced(&Rsc, 8, 1);
+
+        /* Odd segment sizes put every other payload at an odd offset, where its sum goes in byte-swapped. */
+        MakeFlow(Version, 9, 1001, 1, TUN_RSC_TCP_ACK);
+        CHECK(Coalesce(&Rsc, 9) == 9);
+        CheckCoalesced(&Rsc, 9, 0);
+
+        /* Full segments with no end in sight stay open for more. */
+        MakeFlow(Version, 4, 1200, 1200, TUN_RSC_TCP_ACK);
+        CHECK(Coalesce(&Rsc, 4) == 4 && !Rsc.Closed);
+        CheckCoalesced(&Rsc, 4, 0);
+
+        /* Random sizes, each no larger than the first. */
+        ULONG Offset = 0, Count = 20;
+        MakeSegment(0, (UCHAR)Version, 0, 1400, TUN_RSC_TCP_ACK);
+        Offset = 1400;
+        for (ULONG i = 1; i < Count; ++i)
+        {
+            ULONG Payload = i == Count - 1 ? 1 + TestRandom() % 1400 : 1400;
+            MakeSegment(i, (UCHAR)Version, Offset, Payload, TUN_RSC_TCP_ACK);
+            Offset += Payload;
+        }
+        CHECK(Coalesce(&Rsc, Count) == Count);
+        CheckCoalesced(&Rsc, Count, 0);
+    }
+}
+
+static void
+TestClose(void)
+{
+    TUN_RSC Rsc;
+    TUN_RSC_SEGMENT Segment;
+
+    /* Nothing follows a short segment, nor a push. */
+    MakeFlow(4, 3, 1448, 1448, TUN_RSC_TCP_ACK);
+    MakeSegment(1, 4, 1448, 1000, TUN_RSC_TCP_ACK);
+    MakeSegment(2, 4, 2448, 1000, TUN_RSC_TCP_ACK);
+    CHECK(Coalesce(&Rsc, 3) == 2 && Rsc.Closed);
+    CHECK(!TunRscCheck(&Rsc, Segments[2], Sizes[2], &Segment));
+    CheckCoalesced(&Rsc, 2, 0);
+
+    MakeFlow(4, 3, 1448, 1448, TUN_RSC_TCP_ACK);
+    MakeSegment(1, 4, 1448, 1448, TUN_RSC_TCP_ACK | TUN_RSC_TCP_PSH);
+    CHECK(Coalesce(&Rsc, 3) == 2 && Rsc.Closed);
+    CheckCoalesced(&Rsc, 2, 1);
+
+    /* A larger segment than the first would mean the first was short. */
+    MakeFlow(4, 2, 1000, 1001, TUN_RSC_TCP_ACK);
+    CHECK(Coalesce(&Rsc, 2) == 1);
+
+    /* The coalesced packet stops short of the largest IP packet. */
+    MakeFlow(4, MAX_SEGMENTS, 1448, 1448, TUN_RSC_TCP_ACK);
+    ULONG Fit = (TUN_MAX_IP_PACKET_SIZE - (Sizes[0] - 1448)) / 1448;
+    CHECK(Coalesce(&Rsc, MAX_SEGMENTS) == Fit);
+    CHECK(Rsc.Size <= TUN_MAX_IP_PACKET_SIZE && Rsc.Size + 1448 > TUN_MAX_IP_PACKET_SIZE);
+    CheckCoalesced(&Rsc, Fit, 0);
+}
+
+/* Makes a two-segment IPv4 or IPv6 flow, applies a change to the second segment at Offset, and returns whether the
+ * segments still merge. */
+static int
+MergesWith(UCHAR Version, ULONG Offset, UCHAR Value, int FixUp)
+{
+    TUN_RSC Rsc;
+    MakeFlow(Version, 2, 1000, 1000, TUN_RSC_TCP_ACK);
+    Segments[1][Offset] = Value;
+    if (FixUp)
+        FixChecksums(Segments[1], Sizes[1]);
+    return Coalesce(&Rsc, 2) == 2;
+}
+
+static void
+TestNoMerge(void)
+{
+    CHECK(MergesWith(4, 4, 0x77, 1));   /* Identification may differ. */
+    CHECK(!MergesWith(4, 1, 0x03, 1));  /* Congestion experienced */
+    CHECK(!MergesWith(4, 1, 0x12, 1));  /* DSCP */
+    CHECK(!MergesWith(4, 8, 63, 1));    /* TTL */
+    CHECK(!MergesWith(4, 6, 0x00, 1));  /* Don't fragment */
+    CHECK(!MergesWith(4, 6, 0x20, 1));  /* More fragments */
+    CHECK(!MergesWith(4, 15, 9, 1));    /* Source address */
+    CHECK(!MergesWith(4, 19, 9, 1));    /* Destination address */
+    CHECK(!MergesWith(4, 21, 0xBC, 1)); /* Source port */
+    CHECK(!MergesWith(4, 23, 0x01, 1)); /* Destination port */
+    CHECK(!MergesWith(4, 27, 0x00, 1)); /* Sequence number */
+    CHECK(!MergesWith(4, 31, 0x45, 1)); /* ACK number */
+    CHECK(!MergesWith(4, 34, 0x02, 1)); /* Window */
+    CHECK(!MergesWith(4, 33, 0x11, 1)); /* FIN */
+    CHECK(!MergesWith(4, 33, 0x12, 1)); /* SYN */
+    CHECK(!MergesWith(4, 33, 0x14, 1)); /* RST */
+    CHECK(!MergesWith(4, 33, 0x30, 1)); /* URG */
+    CHECK(!MergesWith(4, 33, 0x50, 1)); /* ECE */
+    CHECK(!MergesWith(4, 38, 0x01, 1)); /* Urgent pointer */
+    CHECK(!MergesWith(4, 51, 0xCE, 1)); /* Timestamp */
+    CHECK(!MergesWith(4, 60, 0x00, 0)); /* Payload checksum */
+    CHECK(!MergesWith(4, 10, 0x00, 0)); /* IP header checksum */
+
+    CHECK(!MergesWith(6, 1, 0x30, 1));  /* Congestion experienced */
+    CHECK(!MergesWith(6, 3, 0x43, 1));  /* Flow label */
+    CHECK(!MergesWith(6, 7, 63, 1));    /* Hop limit */
+    CHECK(!MergesWith(6, 23, 9, 1));    /* Source address */
+    CHECK(!MergesWith(6, 39, 9, 1));    /* Destination address */
+    CHECK(!MergesWith(6, 47, 0x00, 1)); /* Sequence number */
+    CHECK(!MergesWith(6, 71, 0xCE, 1)); /* Timestamp */
+    CHECK(!MergesWith(6, 80, 0x00, 0)); /* Payload checksum */
+    CHECK(MergesWith(6, 80, 0x00, 1));  /* Payload, with its checksum */
+
+    /* A first segment failing its checksum does not start anything, and keeps what follows from merging into it. */
+    TUN_RSC Rsc;
+    TUN_RSC_SEGMENT Segment;
+    MakeFlow(4, 3, 1000, 1000, TUN_RSC_TCP_ACK);
+    Segments[0][100] ^= 1;
+    CHECK(Coalesce(&Rsc, 3) == 1 && Rsc.Closed);
+    CHECK(!TunRscCheck(&Rsc, Segments[2], Sizes[2], &Segment));
+}
+
+static void
+TestStart(void)
+{
+    TUN_RSC Rsc;
+    /* A push ends a run, so it does not start one. */
+    MakeSegment(0, 4, 0, 1000, TUN_RSC_TCP_ACK | TUN_RSC_TCP_PSH);
+    CHECK(!TunRscStart(&Rsc, Segments[0], Sizes[0]));
+    /* Pure ACKs carry nothing to coalesce. */
+    MakeSegment(0, 4, 0, 0, TUN_RSC_TCP_ACK);
+    CHECK(!TunRscStart(&Rsc, Segments[0], Sizes[0]));
+    MakeSegment(0, 6, 0, 0, TUN_RSC_TCP_ACK);
+    CHECK(!TunRscStart(&Rsc, Segments[0], Sizes[0]));
+
+    /* IPv4 options, IPv6 extension headers, and lengths that disagree with the packet. */
+    MakeSegment(0, 4, 0, 1000, TUN_RSC_TCP_ACK);
+    CHECK(TunRscStart(&Rsc, Segments[0], Sizes[0]));
+    CHECK(!TunRscStart(&Rsc, Segments[0], Sizes[0] - 1));
+    Segments[0][0] = 0x46;
+    CHECK(!TunRscStart(&Rsc, Segments[0], Sizes[0]));
+    MakeSegment(0, 6, 0, 1000, TUN_RSC_TCP_ACK);
+    CHECK(TunRscStart(&Rsc, Segments[0], Sizes[0]));
+    CHECK(!TunRscStart(&Rsc, Segments[0], Sizes[0] + 1));
+    Segments[0][6] = 0;
+    CHECK(!TunRscStart(&Rsc, Segments[0], Sizes[0]));
+
+    /* Not TCP, and TCP headers reaching past the packet. */
+    MakeSegment(0, 4, 0, 1000, TUN_RSC_TCP_ACK);
+    Segments[0][9] = 17;
+    CHECK(!TunRscStart(&Rsc, Segments[0], Sizes[0]));
+    MakeSegment(0, 4, 0, 4, TUN_RSC_TCP_ACK);
+    Segments[0][32] = 0xF0;
+    CHECK(!TunRscStart(&Rsc, Segments[0], Sizes[0]));
+    Segments[0][32] = 0x40;
+    CHECK(!TunRscStart(&Rsc, Segments[0], Sizes[0]));
+    CHECK(!TunRscStart(&Rsc, Segments[0], 39));
+}
+
+int
+main(void)
+{
+    RUN(TestMerge);
+    RUN(TestClose);
+    RUN(TestNoMerge);
+    RUN(TestStart);
+    TEST_EXIT();
+}
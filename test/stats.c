@@ -0,0 +1,130 @@
+/* SPDX-License-Identifier: GPL-2.0 OR MIT
+ *
+ * Copyright (C) 2018-2021 WireGuard LLC. All Rights Reserved.
+ */
+
+/* Reading the driver statistics page: only the counters the driver says it maintains are copied, and each comes out
+ * whole while the driver keeps adding to it. There is no retry: the driver never writes the page but for Size, once,
+ * and its relaxed adds, so each counter is read on its own, and the counters of a snapshot may be a few events apart
+ * from each other but never torn. */
+
+#include "../common/stats.h"
+#include "test.h"
+#include <pthread.h>
+#include <stddef.h>
+
+#define ROUNDS 200000
+/* Added to every counter at once, so a torn read shows up as halves that differ */
+#define WHOLE 0x100000001LL
+
+static TUN_DRIVER_STATISTICS Page __attribute__((aligned(TUN_STATS_ALIGNMENT)));
+
+static volatile LONG64 *
+Counter(ULONG i)
+{
+    return &(&Page.SendOverflowNbls)[i];
+}
+
+static void
+TestLayout(void)
+{
+    CHECK(offsetof(TUN_DRIVER_STATISTICS, SendOverflowNbls) == TUN_STATS_HEADER_SIZE);
+    CHECK(offsetof(TUN_DRIVER_STATISTICS, ReceiveCoalesced) == TUN_STATS_HEADER_SIZE + (TUN_STATS_COUNTERS - 1) * 8);
+}
+
+static void
+TestSize(void)
+{
+    LONG64 Counters[TUN_STATS_COUNTERS];
+    memset(&Page, 0, sizeof(Page));
+    for (ULONG i = 0; i < TUN_STATS_COUNTERS; ++i)
+        *Counter(i) = i + 1;
+
+    /* A driver that did not take the page leaves Size zero: nothing is maintained. */
+    memset(Counters, 0xAA, sizeof(Counters));
+    CHECK(TunStatsRead(&Page, Counters) == 0);
+    for (ULONG i = 0; i < TUN_STATS_COUNTERS; ++i)
+        CHECK(Counters[i] == 0);
+
+    /* An older driver maintains a prefix of the counters. The rest read zero, whatever the page holds, and so does a
+     * counter the size only partly covers. */
+    for (ULONG Maintained = 0; Maintained <= TUN_STATS_COUNTERS; ++Maintained)
+    {
+        for (ULONG Partial = 0; Partial < (Maintained < TUN_STATS_COUNTERS ? 8 : 1); Partial += 4)
+        {
+            Page.Size = TUN_STATS_HEADER_SIZE + Maintained * sizeof(LONG64) + Partial;
+            memset(Counters, 0xAA, sizeof(Counters));
+            CHECK(TunStatsRead(&Page, Counters) == Maintained);
+            for (ULONG i = 0; i < TUN_STATS_COUNTERS; ++i)
+                CHECK(Counters[i] == (i < Maintained ? (LONG64)i + 1 : 0));
+        }
+    }
+
+    /* A newer driver maintains more counters than this reader knows of. */
+    Page.Size = sizeof(TUN_DRIVER_STATISTICS) + 64;
+    CHECK(TunStatsRead(&Page, Counters) == TUN_STATS_COUNTERS);
+    CHECK(Counters[TUN_STATS_COUNTERS - 1] == TUN_STATS_COUNTERS);
+}
+
+static volatile int Stop;
+
+/* Counts like the driver: relaxed adds, never reading a counter back. */
+static void *
+Driver(void *Context)
+{
+    (void)Context;
+    __atomic_store_n(&Page.Size, sizeof(TUN_DRIVER_STATISTICS), __ATOMIC_RELEASE);
+    while (!__atomic_load_n(&Stop, __ATOMIC_RELAXED))
+    {
+        for (ULONG i = 0; i < TUN_STATS_COUNTERS; ++i)
+            __atomic_add_fetch(Counter(i), WHOLE, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+/* Reads racing the driver taking the page and counting: until it has, nothing is maintained; after, every counter is
+ * whole and none goes backwards. */
+static void
+TestConcurrent(void)
+{
+    memset(&Page, 0, sizeof(Page));
+    pthread_t Thread;
+    CHECK(!pthread_create(&Thread, NULL, Driver, NULL));
+
+    LONG64 Counters[TUN_STATS_COUNTERS], Last[TUN_STATS_COUNTERS] = { 0 };
+    ULONG Errors = 0, Snapshots = 0;
+    for (ULONG Round = 0; Round < ROUNDS && Errors < 10; ++Round)
+    {
+        ULONG Maintained = TunStatsRead(&Page, Counters);
+        if (!Maintained)
+        {
+            for (ULONG i = 0; i < TUN_STATS_COUNTERS; ++i)
+                Errors += Counters[i] != 0;
+            continue;
+        }
+        Errors += Maintained != TUN_STATS_COUNTERS;
+        for (ULONG i = 0; i < TUN_STATS_COUNTERS; ++i)
+        {
+            if ((Counters[i] >> 32) != (Counters[i] & 0xFFFFFFFF) || Counters[i] < Last[i])
+            {
+                fprintf(stderr, "counter %u read 0x%llx after 0x%llx\n", i, (long long)Counters[i], (long long)Last[i]);
+                ++Errors;
+            }
+            Last[i] = Counters[i];
+        }
+        ++Snapshots;
+    }
+    __atomic_store_n(&Stop, 1, __ATOMIC_RELAXED);
+    pthread_join(Thread, NULL);
+    CHECK(!Errors);
+    printf("%u snapshots, first counter at %lld\n", Snapshots, (long long)(Last[0] & 0xFFFFFFFF));
+}
+
+int
+main(void)
+{
+    RUN(TestLayout);
+    RUN(TestSize);
+    RUN(TestConcurrent);
+    TEST_EXIT();
+}
@@ -0,0 +1,55 @@
+/* SPDX-License-Identifier: GPL-2.0 OR MIT
+ *
+ * Copyright (C) 2018-2021 WireGuard LLC. All Rights Reserved.
+ */
+
+#pragma once
+
+/* Minimal harness for the host tests of the portable headers in common/. Every test program runs its checks in order
+ * and exits non-zero if any failed. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int TestFailures;
+
+#define CHECK(Condition) \
+    do \
+    { \
+        if (!(Condition)) \
+        { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #Condition); \
+            ++TestFailures; \
+        } \
+    } while (0)
+
+#define RUN(Test) \
+    do \
+    { \
+        int Failures = TestFailures; \
+        Test(); \
+        printf("%-40s %s\n", #Test, TestFailures == Failures ? "ok" : "FAILED"); \
+    } while (0)
+
+#define TEST_EXIT() return TestFailures ? EXIT_FAILURE : EXIT_SUCCESS
+
+/* Deterministic pseudo-random numbers (xorshift32), so failures reproduce. */
+static unsigned int TestRandomState = 0x2545F491;
+
+static inline unsigned int
+TestRandom(void)
+{
+    unsigned int X = TestRandomState;
+    X ^= X << 13;
+    X ^= X >> 17;
+    X ^= X << 5;
+    return TestRandomState = X;
+}
+
+static inline void
+TestFill(unsigned char *Data, size_t Size)
+{
+    for (size_t i = 0; i < Size; ++i)
+        Data[i] = (unsigned char)TestRandom();
+}
@@ -0,0 +1,146 @@
+/* SPDX-License-Identifier: GPL-2.0 OR MIT
+ *
+ * Copyright (C) 2018-2021 WireGuard LLC. All Rights Reserved.
+ */
+
+/* Spin-then-block timing of WintunWaitForPackets: the spin time picked from the budget and the average arrival gap,
+ * the backoff between ring checks, counting a spin only when a check came up empty first, and the block time left of
+ * the timeout, which must never come out short, zero included, nor more than a millisecond long. */
+
+static unsigned long Relaxed;
+
+#define TUN_RING_CPU_RELAX() (++Relaxed)
+#include "../common/wait.h"
+#include "test.h"
+
+/* A performance counter ticking every 100 ns, the usual frequency on Windows */
+#define FREQUENCY 10000000
+
+static void
+TestSpinTime(void)
+{
+    TUN_WAIT Wait;
+
+    /* 50 us of budget is 500 ticks. Packets arriving later than that are only probed for. */
+    TunWaitBegin(&Wait, FREQUENCY, 1000, 100, 50, 10000);
+    CHECK(Wait.SpinTicks == 500 / TUN_WAIT_PROBE_DIVISOR && Wait.TimeoutTicks == 1000000);
+    /* Packets arriving within the budget are spun for twice the average gap, capped by the budget. */
+    TunWaitBegin(&Wait, FREQUENCY, 1000, 100, 50, 100);
+    CHECK(Wait.SpinTicks == 200);
+    TunWaitBegin(&Wait, FREQUENCY, 1000, 100, 50, 400);
+    CHECK(Wait.SpinTicks == 500);
+    TunWaitBegin(&Wait, FREQUENCY, 1000, 100, 50, 500);
+    CHECK(Wait.SpinTicks == 500);
+    /* Back-to-back arrivals still get the probe. */
+    TunWaitBegin(&Wait, FREQUENCY, 1000, 100, 50, 0);
+    CHECK(Wait.SpinTicks == 500 / TUN_WAIT_PROBE_DIVISOR);
+    /* The timeout caps the budget, down to not spinning at all. */
+    TunWaitBegin(&Wait, FREQUENCY, 1000, 1, 5000, 100);
+    CHECK(Wait.TimeoutTicks == 10000 && Wait.SpinTicks == 10000 / TUN_WAIT_PROBE_DIVISOR);
+    TunWaitBegin(&Wait, FREQUENCY, 1000, 1, 5000, 9000);
+    CHECK(Wait.SpinTicks == 10000);
+    TunWaitBegin(&Wait, FREQUENCY, 1000, 0, 5000, 0);
+    CHECK(Wait.TimeoutTicks == 0 && Wait.SpinTicks == 0);
+    TunWaitBegin(&Wait, FREQUENCY, 1000, TUN_WAIT_INFINITE, 0xFFFFFFFF, 0);
+    CHECK(Wait.TimeoutTicks == TUN_WAIT_NEVER && Wait.SpinTicks == 0xFFFFFFFFLL * 10 / TUN_WAIT_PROBE_DIVISOR);
+}
+
+static void
+TestSpin(void)
+{
+    TUN_WAIT Wait;
+
+    /* A packet found on the first check: TunWaitSpin never ran, so the wait does not count as a spin. */
+    TunWaitBegin(&Wait, FREQUENCY, 1000, 100, 50, 100);
+    CHECK(!Wait.Spun);
+
+    /* Each empty check relaxes twice as long as the one before, up to the cap, until the spin time is up. */
+    Relaxed = 0;
+    unsigned long Expected = 0;
+    for (ULONG i = 0; i < 10; ++i)
+    {
+        CHECK(TunWaitSpin(&Wait, 1000 + i * 10));
+        Expected += i < 6 ? 1UL << i : TUN_WAIT_MAX_BACKOFF;
+        CHECK(Relaxed == Expected && Wait.Spun);
+    }
+    CHECK(TunWaitSpin(&Wait, 1000 + 199));
+    Relaxed = 0;
+    CHECK(!TunWaitSpin(&Wait, 1000 + 200));
+    CHECK(!Relaxed);
+
+    /* Without spin time, the first empty check goes straight to blocking, and there was no spin to count. */
+    TunWaitBegin(&Wait, FREQUENCY, 1000, 0, 50, 100);
+    CHECK(!TunWaitSpin(&Wait, 1000) && !Wait.Spun && !Relaxed);
+}
+
+static void
+TestRemaining(void)
+{
+    TUN_WAIT Wait;
+
+    TunWaitBegin(&Wait, FREQUENCY, 1000, 5, 0, 0);
+    CHECK(TunWaitRemaining(&Wait, 1000) == 5);
+    CHECK(TunWaitRemaining(&Wait, 1000 + 40000) == 1);
+    CHECK(TunWaitRemaining(&Wait, 1000 + 39999) == 2);
+    /* The last tick of the timeout still blocks for a millisecond rather than returning a zero wait. */
+    CHECK(TunWaitRemaining(&Wait, 1000 + 49999) == 1);
+    CHECK(TunWaitRemaining(&Wait, 1000 + 50000) == 0);
+    CHECK(TunWaitRemaining(&Wait, 1000 + 90000) == 0);
+
+    TunWaitBegin(&Wait, FREQUENCY, 1000, TUN_WAIT_INFINITE, 0, 0);
+    CHECK(TunWaitRemaining(&Wait, 1000) == TUN_WAIT_INFINITE);
+    CHECK(TunWaitRemaining(&Wait, TUN_WAIT_NEVER) == TUN_WAIT_INFINITE);
+    /* The longest finite timeout neither overflows nor turns into an infinite one. */
+    TunWaitBegin(&Wait, FREQUENCY, 1000, TUN_WAIT_INFINITE - 1, 0, 0);
+    CHECK(TunWaitRemaining(&Wait, 1000) == TUN_WAIT_INFINITE - 1);
+    CHECK(TunWaitRemaining(&Wait, 1000 + 1) == TUN_WAIT_INFINITE - 1);
+
+    /* Whatever the counter frequency and however far in, the block time covers what is left of the timeout, and by
+     * less than a millisecond more. */
+    static const LONG64 Frequencies[] = { 1000, 3579545, FREQUENCY, 2400000000LL };
+    for (ULONG f = 0; f < sizeof(Frequencies) / sizeof(*Frequencies); ++f)
+    {
+        for (ULONG Round = 0; Round < 20000; ++Round)
+        {
+            ULONG Timeout = TestRandom() % 3000;
+            LONG64 Start = (LONG64)TestRandom() << 8;
+            TunWaitBegin(&Wait, Frequencies[f], Start, Timeout, 0, 0);
+            ULONG64 Random = (ULONG64)TestRandom() << 32 | TestRandom();
+            LONG64 Elapsed = Wait.TimeoutTicks ? (LONG64)(Random % (ULONG64)Wait.TimeoutTicks) : 0;
+            LONG64 Left = Wait.TimeoutTicks - Elapsed;
+            ULONG Remaining = TunWaitRemaining(&Wait, Start + Elapsed);
+            if (!Left)
+                CHECK(Remaining == 0);
+            else
+            {
+                CHECK((LONG64)Remaining * Frequencies[f] >= Left * 1000);
+                CHECK((LONG64)(Remaining - 1) * Frequencies[f] < Left * 1000);
+            }
+        }
+    }
+}
+
+static void
+TestAverageGap(void)
+{
+    /* Each sample moves the average an eighth of the way, up or down, and a steady gap is converged on. */
+    CHECK(TunWaitAverageGap(0, 800) == 100);
+    CHECK(TunWaitAverageGap(800, 0) == 700);
+    LONG64 AverageGap = 0;
+    for (ULONG i = 0; i < 200; ++i)
+        AverageGap = TunWaitAverageGap(AverageGap, 5000);
+    CHECK(AverageGap > 4990 && AverageGap <= 5000);
+    for (ULONG i = 0; i < 200; ++i)
+        AverageGap = TunWaitAverageGap(AverageGap, 40);
+    CHECK(AverageGap >= 40 && AverageGap < 50);
+}
+
+int
+main(void)
+{
+    RUN(TestSpinTime);
+    RUN(TestSpin);
+    RUN(TestRemaining);
+    RUN(TestAverageGap);
+    TEST_EXIT();
+}
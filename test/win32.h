@@ -0,0 +1,370 @@
+/* SPDX-License-Identifier: GPL-2.0 OR MIT
+ *
+ * Copyright (C) 2018-2021 WireGuard LLC. All Rights Reserved.
+ */
+
+#pragma once
+
+/* The few Win32 calls the Python binding code in api/py*.h makes, over pthreads, so the host tests run it on Linux:
+ * events, threads, slim locks, a threadpool timer, the last error, and the Wintun types its backends are made of.
+ * Events and threads are handles waited on under one lock, which is plenty for a test. */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+#include <wchar.h>
+
+typedef void VOID;
+typedef void *PVOID;
+typedef int BOOL;
+typedef unsigned char BYTE;
+typedef uint32_t DWORD;
+typedef int32_t LONG;
+typedef int64_t LONGLONG;
+typedef uint64_t ULONGLONG;
+typedef uint64_t DWORD64;
+typedef wchar_t WCHAR;
+typedef const wchar_t *LPCWSTR;
+typedef void *HANDLE;
+typedef void *LPVOID;
+typedef struct _TUN_SESSION *WINTUN_SESSION_HANDLE;
+
+#define WINAPI
+#define CALLBACK
+#define TRUE 1
+#define FALSE 0
+#define MAXDWORD 0xFFFFFFFF
+#define INFINITE 0xFFFFFFFF
+#define WAIT_OBJECT_0 0
+#define WAIT_TIMEOUT 258
+#define WAIT_FAILED 0xFFFFFFFF
+#define ERROR_SUCCESS 0
+#define ERROR_INVALID_DATA 13
+#define ERROR_HANDLE_EOF 38
+#define ERROR_BUFFER_OVERFLOW 111
+#define ERROR_NO_MORE_ITEMS 259
+#define WINTUN_MAX_IP_PACKET_SIZE 0xFFFF
+
+#ifndef _countof
+#    define _countof(Array) (sizeof(Array) / sizeof((Array)[0]))
+#endif
+#ifndef min
+#    define min(A, B) ((A) < (B) ? (A) : (B))
+#endif
+
+typedef BYTE *(WINAPI WINTUN_RECEIVE_PACKET_FUNC)(WINTUN_SESSION_HANDLE Session, DWORD *PacketSize);
+typedef void(WINAPI WINTUN_RELEASE_RECEIVE_PACKET_FUNC)(WINTUN_SESSION_HANDLE Session, const BYTE *Packet);
+typedef DWORD(WINAPI WINTUN_RECEIVE_PACKETS_FUNC)(
+    WINTUN_SESSION_HANDLE Session,
+    BYTE **Packets,
+    DWORD *PacketSizes,
+    DWORD MaxCount);
+typedef void(WINAPI WINTUN_RELEASE_RECEIVE_PACKETS_FUNC)(
+    WINTUN_SESSION_HANDLE Session,
+    const BYTE **Packets,
+    DWORD Count);
+typedef BYTE *(WINAPI WINTUN_ALLOCATE_SEND_PACKET_FUNC)(WINTUN_SESSION_HANDLE Session, DWORD PacketSize);
+typedef void(WINAPI WINTUN_SEND_PACKET_FUNC)(WINTUN_SESSION_HANDLE Session, const BYTE *Packet);
+typedef DWORD(WINAPI WINTUN_ALLOCATE_SEND_PACKETS_FUNC)(
+    WINTUN_SESSION_HANDLE Session,
+    const DWORD *PacketSizes,
+    BYTE **Packets,
+    DWORD Count);
+typedef void(WINAPI WINTUN_SEND_PACKETS_FUNC)(WINTUN_SESSION_HANDLE Session, const BYTE **Packets, DWORD Count);
+typedef HANDLE(WINAPI WINTUN_GET_READ_WAIT_EVENT_FUNC)(WINTUN_SESSION_HANDLE Session);
+
+typedef enum
+{
+    WINTUN_LOG_INFO,
+    WINTUN_LOG_WARN,
+    WINTUN_LOG_ERR
+} WINTUN_LOGGER_LEVEL;
+typedef VOID(CALLBACK *WINTUN_LOGGER_CALLBACK)(WINTUN_LOGGER_LEVEL Level, DWORD64 Timestamp, LPCWSTR Message);
+typedef VOID(WINAPI WINTUN_SET_LOGGER_FUNC)(WINTUN_LOGGER_CALLBACK NewLogger);
+
+#define ReadNoFence(Address) __atomic_load_n((Address), __ATOMIC_RELAXED)
+#define WriteNoFence(Address, Value) __atomic_store_n((Address), (Value), __ATOMIC_RELAXED)
+
+static __thread DWORD Win32LastError;
+
+static inline DWORD
+GetLastError(void)
+{
+    return Win32LastError;
+}
+
+static inline void
+SetLastError(DWORD Error)
+{
+    Win32LastError = Error;
+}
+
+typedef struct _WIN32_HANDLE
+{
+    int ManualReset;
+    int Signaled;
+    int IsThread;
+    pthread_t Thread;
+    DWORD(WINAPI *Start)(LPVOID);
+    LPVOID Parameter;
+} WIN32_HANDLE;
+
+static pthread_mutex_t Win32Lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t Win32Signaled = PTHREAD_COND_INITIALIZER;
+
+static inline HANDLE
+CreateEventW(void *Attributes, BOOL ManualReset, BOOL InitialState, const void *Name)
+{
+    (void)Attributes;
+    (void)Name;
+    WIN32_HANDLE *Event = calloc(1, sizeof(*Event));
+    if (!Event)
+        return NULL;
+    Event->ManualReset = ManualReset;
+    Event->Signaled = InitialState;
+    return Event;
+}
+
+static inline BOOL
+SetEvent(HANDLE Handle)
+{
+    pthread_mutex_lock(&Win32Lock);
+    ((WIN32_HANDLE *)Handle)->Signaled = 1;
+    pthread_cond_broadcast(&Win32Signaled);
+    pthread_mutex_unlock(&Win32Lock);
+    return TRUE;
+}
+
+static inline BOOL
+ResetEvent(HANDLE Handle)
+{
+    pthread_mutex_lock(&Win32Lock);
+    ((WIN32_HANDLE *)Handle)->Signaled = 0;
+    pthread_mutex_unlock(&Win32Lock);
+    return TRUE;
+}
+
+/* Waits for any of the handles, consuming the signal of an auto-reset event like Windows does. */
+static inline DWORD
+WaitForMultipleObjects(DWORD Count, const HANDLE *Handles, BOOL WaitAll, DWORD Milliseconds)
+{
+    (void)WaitAll;
+    struct timespec Deadline;
+    clock_gettime(CLOCK_REALTIME, &Deadline);
+    Deadline.tv_sec += Milliseconds / 1000;
+    Deadline.tv_nsec += (long)(Milliseconds % 1000) * 1000000;
+    if (Deadline.tv_nsec >= 1000000000)
+    {
+        Deadline.tv_sec++;
+        Deadline.tv_nsec -= 1000000000;
+    }
+    DWORD Result = WAIT_TIMEOUT;
+    pthread_mutex_lock(&Win32Lock);
+    for (;;)
+    {
+        for (DWORD i = 0; i < Count; ++i)
+        {
+            WIN32_HANDLE *Handle = Handles[i];
+            if (Handle->Signaled)
+            {
+                if (!Handle->ManualReset)
+                    Handle->Signaled = 0;
+                Result = WAIT_OBJECT_0 + i;
+                goto out;
+            }
+        }
+        if (Milliseconds == INFINITE)
+            pthread_cond_wait(&Win32Signaled, &Win32Lock);
+        else if (pthread_cond_timedwait(&Win32Signaled, &Win32Lock, &Deadline))
+            break;
+    }
+out:
+    pthread_mutex_unlock(&Win32Lock);
+    return Result;
+}
+
+static inline DWORD
+WaitForSingleObject(HANDLE Handle, DWORD Milliseconds)
+{
+    return WaitForMultipleObjects(1, &Handle, FALSE, Milliseconds);
+}
+
+static void *
+Win32ThreadStart(void *Parameter)
+{
+    WIN32_HANDLE *Thread = Parameter;
+    Thread->Start(Thread->Parameter);
+    SetEvent(Thread);
+    return NULL;
+}
+
+/* The thread handle is signaled once the thread returns, and stays so. */
+static inline HANDLE
+CreateThread(
+    void *Attributes,
+    size_t StackSize,
+    DWORD(WINAPI *Start)(LPVOID),
+    LPVOID Parameter,
+    DWORD Flags,
+    DWORD *ThreadId)
+{
+    (void)Attributes;
+    (void)StackSize;
+    (void)Flags;
+    (void)ThreadId;
+    WIN32_HANDLE *Thread = calloc(1, sizeof(*Thread));
+    if (!Thread)
+        return NULL;
+    Thread->ManualReset = 1;
+    Thread->IsThread = 1;
+    Thread->Start = Start;
+    Thread->Parameter = Parameter;
+    if (pthread_create(&Thread->Thread, NULL, Win32ThreadStart, Thread))
+    {
+        free(Thread);
+        return NULL;
+    }
+    return Thread;
+}
+
+static inline BOOL
+CloseHandle(HANDLE Handle)
+{
+    WIN32_HANDLE *Object = Handle;
+    if (Object->IsThread)
+        pthread_join(Object->Thread, NULL);
+    free(Object);
+    return TRUE;
+}
+
+typedef pthread_mutex_t SRWLOCK;
+#define SRWLOCK_INIT PTHREAD_MUTEX_INITIALIZER
+#define AcquireSRWLockExclusive(Lock) pthread_mutex_lock(Lock)
+#define ReleaseSRWLockExclusive(Lock) pthread_mutex_unlock(Lock)
+
+typedef struct _FILETIME
+{
+    DWORD dwLowDateTime;
+    DWORD dwHighDateTime;
+} FILETIME;
+
+typedef union _ULARGE_INTEGER
+{
+    struct
+    {
+        DWORD LowPart;
+        DWORD HighPart;
+    };
+    ULONGLONG QuadPart;
+} ULARGE_INTEGER;
+
+typedef struct _TP_CALLBACK_INSTANCE *PTP_CALLBACK_INSTANCE;
+typedef struct _TP_TIMER *PTP_TIMER;
+typedef VOID(CALLBACK *PTP_TIMER_CALLBACK)(PTP_CALLBACK_INSTANCE Instance, PVOID Context, PTP_TIMER Timer);
+
+/* A thread of its own per timer, which lives as long as the process. Only one-shot timers due relative to now. */
+struct _TP_TIMER
+{
+    pthread_mutex_t Lock;
+    pthread_cond_t Changed;
+    PTP_TIMER_CALLBACK Callback;
+    PVOID Context;
+    int Armed;
+    int Running;
+    struct timespec Due;
+    pthread_t Thread;
+};
+
+static inline int
+Win32Before(const struct timespec *A, const struct timespec *B)
+{
+    return A->tv_sec < B->tv_sec || (A->tv_sec == B->tv_sec && A->tv_nsec < B->tv_nsec);
+}
+
+static void *
+Win32TimerThread(void *Parameter)
+{
+    PTP_TIMER Timer = Parameter;
+    pthread_mutex_lock(&Timer->Lock);
+    for (;;)
+    {
+        struct timespec Now;
+        clock_gettime(CLOCK_MONOTONIC, &Now);
+        if (!Timer->Armed)
+            pthread_cond_wait(&Timer->Changed, &Timer->Lock);
+        else if (Win32Before(&Now, &Timer->Due))
+            pthread_cond_timedwait(&Timer->Changed, &Timer->Lock, &Timer->Due);
+        else
+        {
+            Timer->Armed = 0;
+            Timer->Running = 1;
+            pthread_mutex_unlock(&Timer->Lock);
+            Timer->Callback(NULL, Timer->Context, Timer);
+            pthread_mutex_lock(&Timer->Lock);
+            Timer->Running = 0;
+            pthread_cond_broadcast(&Timer->Changed);
+        }
+    }
+    return NULL;
+}
+
+static inline PTP_TIMER
+CreateThreadpoolTimer(PTP_TIMER_CALLBACK Callback, PVOID Context, void *Environment)
+{
+    (void)Environment;
+    PTP_TIMER Timer = calloc(1, sizeof(*Timer));
+    if (!Timer)
+        return NULL;
+    pthread_condattr_t Attributes;
+    pthread_condattr_init(&Attributes);
+    pthread_condattr_setclock(&Attributes, CLOCK_MONOTONIC);
+    pthread_mutex_init(&Timer->Lock, NULL);
+    pthread_cond_init(&Timer->Changed, &Attributes);
+    pthread_condattr_destroy(&Attributes);
+    Timer->Callback = Callback;
+    Timer->Context = Context;
+    if (pthread_create(&Timer->Thread, NULL, Win32TimerThread, Timer))
+    {
+        free(Timer);
+        return NULL;
+    }
+    pthread_detach(Timer->Thread);
+    return Timer;
+}
+
+/* Arms the timer to fire once, DueTime being negative 100 ns units from now, or disarms it for a DueTime of NULL. */
+static inline VOID
+SetThreadpoolTimer(PTP_TIMER Timer, FILETIME *DueTime, DWORD Period, DWORD WindowLength)
+{
+    (void)Period;
+    (void)WindowLength;
+    pthread_mutex_lock(&Timer->Lock);
+    Timer->Armed = !!DueTime;
+    if (DueTime)
+    {
+        ULARGE_INTEGER Due = { .LowPart = DueTime->dwLowDateTime, .HighPart = DueTime->dwHighDateTime };
+        LONGLONG Nanoseconds = -(LONGLONG)Due.QuadPart * 100;
+        clock_gettime(CLOCK_MONOTONIC, &Timer->Due);
+        Timer->Due.tv_sec += Nanoseconds / 1000000000;
+        Timer->Due.tv_nsec += Nanoseconds % 1000000000;
+        if (Timer->Due.tv_nsec >= 1000000000)
+        {
+            Timer->Due.tv_sec++;
+            Timer->Due.tv_nsec -= 1000000000;
+        }
+    }
+    pthread_cond_broadcast(&Timer->Changed);
+    pthread_mutex_unlock(&Timer->Lock);
+}
+
+static inline VOID
+WaitForThreadpoolTimerCallbacks(PTP_TIMER Timer, BOOL CancelPendingCallbacks)
+{
+    pthread_mutex_lock(&Timer->Lock);
+    if (CancelPendingCallbacks)
+        Timer->Armed = 0;
+    while (Timer->Running)
+        pthread_cond_wait(&Timer->Changed, &Timer->Lock);
+    pthread_mutex_unlock(&Timer->Lock);
+}
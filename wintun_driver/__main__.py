@@ -4,8 +4,9 @@ import pywintunx_pmd3
 from pyuac import main_requires_admin
 
 
-def log(level: int, timestamp: int, message: str) -> None:
-    print(message)
+def log(records: list) -> None:
+    for level, timestamp, message in records:
+        print(message)
 
 
 @click.group()